@@ -0,0 +1,32 @@
+# Compares two JSON result files written by <tt>bench/run.rb --json</tt>
+# and prints the change in ops/sec and allocations for every case they share.
+#
+#   ruby bench/compare.rb before.json after.json
+require 'rubygems'
+require 'json'
+
+if ARGV.length != 2
+  warn "Usage: ruby bench/compare.rb BEFORE.json AFTER.json"
+  exit 1
+end
+
+before, after = ARGV.map do |path|
+  report = JSON.parse(File.read(path))
+  results = {}
+  report['results'].each {|r| results["#{r['name']}/#{r['op']}/#{r['impl']}"] = r}
+  [report, results]
+end
+
+puts "before: #{before[0]['revision'] || '?'} (#{before[0]['time']}), after: #{after[0]['revision'] || '?'} (#{after[0]['time']})"
+puts "%-50s %12s %12s %8s %12s" % ['case', 'before ops/s', 'after ops/s', 'change', 'allocs/op']
+(before[1].keys & after[1].keys).each do |key|
+  b = before[1][key]
+  a = after[1][key]
+  change = (a['ops_per_sec'] / b['ops_per_sec'] - 1) * 100
+  allocs = if b['allocations_per_op'] && a['allocations_per_op']
+    "#{b['allocations_per_op']}->#{a['allocations_per_op']}"
+  else
+    '-'
+  end
+  puts "%-50s %12.1f %12.1f %+7.1f%% %12s" % [key, b['ops_per_sec'], a['ops_per_sec'], change, allocs]
+end
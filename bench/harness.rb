@@ -0,0 +1,120 @@
+module RocketAMF
+  module Bench
+    # A single measured operation. The block is run repeatedly until the
+    # configured time has elapsed, and the result records throughput along
+    # with the allocations and garbage collections it caused.
+    class Case
+      attr_reader :name, :impl, :op, :bytes
+
+      def initialize name, impl, op, bytes, &block
+        @name = name
+        @impl = impl
+        @op = op
+        @bytes = bytes
+        @block = block
+      end
+
+      def key
+        "#{@name}/#{@op}/#{@impl}"
+      end
+
+      def run min_time
+        @block.call # Warm up caches and check that the case works at all
+
+        GC.start
+        gc_before = GC.count
+        alloc_before = Harness.allocated_objects
+        iterations = 0
+        start = Harness.now
+        elapsed = 0.0
+        begin
+          @block.call
+          iterations += 1
+          elapsed = Harness.now - start
+        end while elapsed < min_time
+        alloc_after = Harness.allocated_objects
+        gc_after = GC.count
+
+        result = {
+          'name' => @name,
+          'impl' => @impl,
+          'op' => @op,
+          'iterations' => iterations,
+          'seconds' => elapsed,
+          'ops_per_sec' => iterations / elapsed,
+          'bytes' => @bytes,
+          'bytes_per_sec' => @bytes * iterations / elapsed,
+          'gc_count' => gc_after - gc_before
+        }
+        if alloc_before && alloc_after
+          result['allocations_per_op'] = (alloc_after - alloc_before) / iterations
+        end
+        result
+      end
+    end
+
+    # Runs a list of cases and reports them both as a table and as JSON
+    class Harness
+      def self.now
+        if defined?(Process::CLOCK_MONOTONIC)
+          Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        else
+          Time.now.to_f
+        end
+      end
+
+      # Total number of objects allocated so far, or nil if the VM doesn't
+      # keep track of it
+      def self.allocated_objects
+        return nil unless GC.respond_to?(:stat)
+        stat = GC.stat
+        stat[:total_allocated_objects] || stat[:total_allocated_object]
+      end
+
+      attr_reader :results
+
+      def initialize options={}
+        @min_time = options[:time] || 1.0
+        @filter = options[:filter]
+        @out = options[:out] || $stdout
+        @results = []
+      end
+
+      def run cases
+        cases = cases.select {|c| c.key =~ @filter} if @filter
+        @out.puts "%-40s %-6s %12s %12s %12s %6s" % ['case', 'impl', 'ops/sec', 'MB/sec', 'allocs/op', 'GCs']
+        cases.each do |c|
+          r = c.run(@min_time)
+          @results << r
+          @out.puts "%-40s %-6s %12.1f %12.2f %12s %6d" % [
+            "#{r['name']}/#{r['op']}", r['impl'], r['ops_per_sec'],
+            r['bytes_per_sec'] / (1024.0 * 1024.0),
+            r['allocations_per_op'] || '-', r['gc_count']
+          ]
+          @out.flush
+        end
+        @results
+      end
+
+      # Results with enough environment information to tell runs apart
+      def report
+        {
+          'ruby' => "#{RUBY_VERSION}p#{RUBY_PATCHLEVEL rescue '?'}",
+          'platform' => RUBY_PLATFORM,
+          'revision' => revision,
+          'time' => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+          'min_time' => @min_time,
+          'results' => @results
+        }
+      end
+
+      private
+      def revision
+        rev = `git rev-parse --short HEAD 2>/dev/null`.strip
+        rev.empty? ? nil : rev
+      rescue
+        nil
+      end
+    end
+  end
+end
@@ -0,0 +1,94 @@
+module RocketAMF
+  module Bench
+    # Typed row used for the wide row payloads
+    class Row
+      FIELDS = (1..20).map {|i| :"field_#{i}"}
+      attr_accessor *FIELDS
+      attr_accessor :id, :name, :created_at
+    end
+
+    # Generated payloads. Everything is derived from a fixed seed so that
+    # results are comparable between runs and commits.
+    module Payloads
+      SEED = 1234
+
+      module_function
+
+      def map_classes
+        RocketAMF::ClassMapper.define do |m|
+          m.map :as => 'bench.Row', :ruby => 'RocketAMF::Bench::Row'
+        end
+      end
+
+      def all
+        rand = Random.new(SEED)
+        {
+          'wide-rows' => wide_rows(rand, 2000),
+          'deep-graph' => deep_graph(rand, 12),
+          'byte-array' => byte_array(rand, 1024*1024),
+          'strings' => strings(rand, 10000),
+          'vectors' => vectors(rand, 50000)
+        }
+      end
+
+      # Array of typed objects with a mix of numeric, string and date columns
+      def wide_rows rand, count
+        time = Time.at(1300000000)
+        (1..count).map do |i|
+          row = Row.new
+          row.id = i
+          row.name = "row #{i}"
+          row.created_at = time + i
+          Row::FIELDS.each_with_index do |f, j|
+            value = case j % 4
+                    when 0 then rand.rand(1 << 20)
+                    when 1 then rand.rand * 1000
+                    when 2 then "value #{rand.rand(100)}"
+                    else j.even?
+                    end
+            row.send(:"#{f}=", value)
+          end
+          row
+        end
+      end
+
+      # Binary tree of hashes where every node also points at a shared
+      # sibling, so that references are exercised as well as nesting
+      def deep_graph rand, depth
+        shared = {:label => 'shared', :weight => rand.rand}
+        build = lambda do |d|
+          node = {:depth => d, :weight => rand.rand, :shared => shared}
+          node[:children] = d == 0 ? [] : [build.call(d-1), build.call(d-1)]
+          node
+        end
+        build.call(depth)
+      end
+
+      def byte_array rand, size
+        StringIO.new(rand.bytes(size))
+      end
+
+      # Mostly unique strings, with some repeats and some multibyte text
+      def strings rand, count
+        words = %w(alpha beta gamma delta epsilon zeta eta theta iota kappa) +
+                ["café", "naïve", "日本語", "über"]
+        (1..count).map do |i|
+          if i % 5 == 0
+            words[rand.rand(words.length)]
+          else
+            Array.new(1 + rand.rand(8)) { words[rand.rand(words.length)] }.join(' ') + " #{i}"
+          end
+        end
+      end
+
+      def vectors rand, count
+        {
+          :ints => RocketAMF::Values::Vector.new(:int, Array.new(count) { rand.rand(1 << 30) - (1 << 29) }),
+          :uints => RocketAMF::Values::Vector.new(:uint, Array.new(count) { rand.rand(1 << 31) }),
+          :doubles => RocketAMF::Values::Vector.new(:double, Array.new(count) { rand.rand * 1e6 }),
+          :objects => RocketAMF::Values::Vector.new(:object, Array.new(count / 10) {|i| {:i => i}})
+        }
+      end
+    end
+  end
+end
@@ -0,0 +1,167 @@
+# Runs the benchmark suite against the C extension and the pure Ruby
+# implementation. Usually run through <tt>rake bench</tt>.
+#
+#   ruby bench/run.rb [--time SECONDS] [--filter REGEX] [--json FILE]
+#
+# <tt>--json</tt> writes the results as JSON so that runs from different
+# commits can be compared with <tt>bench/compare.rb</tt>.
+root = File.expand_path('..', File.dirname(__FILE__))
+$:.unshift(File.join(root, 'ext'))
+$:.unshift(File.join(root, 'lib'))
+require 'rubygems'
+require 'optparse'
+require 'json'
+require 'rocketamf'
+require 'rocketamf/pure/deserializer' # Only ext gets included by default if available
+require 'rocketamf/pure/serializer'
+require 'rocketamf/pure/remoting'
+require 'rocketamf/rack'
+require File.join(root, 'bench', 'harness')
+require File.join(root, 'bench', 'payloads')
+
+options = {}
+OptionParser.new do |opts|
+  opts.banner = "Usage: ruby bench/run.rb [options]"
+  opts.on('--time SECONDS', Float, 'Minimum time to spend on each case') {|v| options[:time] = v}
+  opts.on('--filter REGEX', 'Only run cases whose name/op/impl matches') {|v| options[:filter] = Regexp.new(v)}
+  opts.on('--json FILE', 'Write results as JSON to FILE') {|v| options[:json] = v}
+end.parse!
+
+module RocketAMF
+  module Bench
+    # The implementations under test. Envelopes get their own subclasses so
+    # that both can be loaded at the same time.
+    IMPLS = {}
+    if defined?(RocketAMF::Ext)
+      IMPLS['ext'] = {
+        :deserializer => RocketAMF::Ext::Deserializer,
+        :serializer => RocketAMF::Ext::Serializer,
+        :envelope => Class.new(RocketAMF::Envelope) { include RocketAMF::Ext::Envelope }
+      }
+    else
+      warn "C extension not available, only benchmarking the pure implementation"
+    end
+    IMPLS['pure'] = {
+      :deserializer => RocketAMF::Pure::Deserializer,
+      :serializer => RocketAMF::Pure::Serializer,
+      :envelope => Class.new(RocketAMF::Envelope) { include RocketAMF::Pure::Envelope }
+    }
+
+    module_function
+
+    # Returns [name, version, object] for every object fixture that the
+    # default class mapper can round-trip
+    def fixture_objects root
+      Dir[File.join(root, 'spec', 'fixtures', 'objects', '*.bin')].sort.map do |path|
+        name = File.basename(path, '.bin')
+        version = name =~ /^amf3/ ? 3 : 0
+        data = File.open(path, 'rb') {|f| f.read}
+        begin
+          obj = RocketAMF::Pure::Deserializer.new(RocketAMF::ClassMapper.new).deserialize(version, data)
+          RocketAMF::Pure::Serializer.new(RocketAMF::ClassMapper.new).serialize(version, obj)
+          [name, version, obj]
+        rescue StandardError
+          nil # Needs custom mappings, e.g. externalizable classes
+        end
+      end.compact
+    end
+
+    def fixture_envelopes root
+      Dir[File.join(root, 'spec', 'fixtures', 'request', '*.bin')].sort.map do |path|
+        data = File.open(path, 'rb') {|f| f.read}
+        begin
+          IMPLS['pure'][:envelope].new.populate_from_stream(data).serialize
+          [File.basename(path, '.bin'), data]
+        rescue StandardError
+          nil
+        end
+      end.compact
+    end
+
+    def codec_cases name, version, obj
+      bytes = RocketAMF::Pure::Serializer.new(RocketAMF::ClassMapper.new).serialize(version, obj)
+      IMPLS.map do |impl, classes|
+        des = classes[:deserializer]
+        ser = classes[:serializer]
+        [
+          Case.new(name, impl, 'deserialize', bytes.bytesize) { des.new(RocketAMF::ClassMapper.new).deserialize(version, bytes) },
+          Case.new(name, impl, 'serialize', bytes.bytesize) { ser.new(RocketAMF::ClassMapper.new).serialize(version, obj) }
+        ]
+      end.flatten
+    end
+
+    def envelope_cases name, data
+      IMPLS.map do |impl, classes|
+        env_class = classes[:envelope]
+        env = env_class.new.populate_from_stream(data)
+        [
+          Case.new(name, impl, 'populate', data.bytesize) { env_class.new.populate_from_stream(data) },
+          Case.new(name, impl, 'serialize', data.bytesize) { env.serialize }
+        ]
+      end.flatten
+    end
+
+    def cases root
+      Payloads.map_classes
+      cases = []
+
+      # Existing fixtures, grouped so that each op decodes or encodes all of them
+      fixtures = fixture_objects(root)
+      [0, 3].each do |version|
+        group = fixtures.select {|f| f[1] == version}
+        group_bytes = group.map {|f| RocketAMF::Pure::Serializer.new(RocketAMF::ClassMapper.new).serialize(version, f[2])}
+        size = group_bytes.inject(0) {|s, b| s + b.bytesize}
+        IMPLS.each do |impl, classes|
+          des = classes[:deserializer]
+          ser = classes[:serializer]
+          cases << Case.new("fixtures-amf#{version}", impl, 'deserialize', size) do
+            group_bytes.each {|b| des.new(RocketAMF::ClassMapper.new).deserialize(version, b)}
+          end
+          cases << Case.new("fixtures-amf#{version}", impl, 'serialize', size) do
+            group.each {|f| ser.new(RocketAMF::ClassMapper.new).serialize(version, f[2])}
+          end
+        end
+      end
+
+      # Generated payloads in both AMF versions. ByteArrays and vectors only exist in AMF3.
+      Payloads.all.each do |name, obj|
+        versions = %w(vectors byte-array).include?(name) ? [3] : [0, 3]
+        versions.each {|v| cases.concat(codec_cases("#{name}-amf#{v}", v, obj))}
+      end
+
+      # Envelopes: the request fixtures and a large flex call
+      fixture_envelopes(root).each {|name, data| cases.concat(envelope_cases("envelope-#{name}", data))}
+      env = IMPLS['pure'][:envelope].new(:amf_version => 3)
+      env.call_flex 'Bench.rows', Payloads.wide_rows(Random.new(Payloads::SEED), 500)
+      cases.concat(envelope_cases('envelope-flex-rows', env.serialize))
+
+      # A full in-process gateway round trip for the same call, with the
+      # shipped Rack endpoint and with the usual hand-rolled read/to_s glue
+      cases.concat(rack_cases('rack-flex-rows', env.serialize))
+
+      cases
+    end
+
+    def rack_cases name, data
+      handler = lambda {|method, args| args[0].length}
+      endpoint = RocketAMF::Rack::Endpoint.new(&handler)
+      env = lambda { {'REQUEST_METHOD' => 'POST', 'CONTENT_LENGTH' => data.bytesize.to_s, 'rack.input' => StringIO.new(data)} }
+      [
+        Case.new(name, 'default', 'endpoint', data.bytesize) { endpoint.call(env.call)[2].each {|chunk| chunk} },
+        Case.new(name, 'default', 'handrolled', data.bytesize) do
+          request = RocketAMF::Envelope.new.populate_from_stream(env.call['rack.input'].read)
+          response = RocketAMF::Envelope.new
+          response.each_method_call(request, &handler)
+          [response.to_s].each {|chunk| chunk}
+        end
+      ]
+    end
+  end
+end
+
+harness = RocketAMF::Bench::Harness.new(options)
+harness.run(RocketAMF::Bench.cases(root))
+if options[:json]
+  File.open(options[:json], 'w') {|f| f.write(JSON.pretty_generate(harness.report))}
+  puts "Results written to #{options[:json]}"
+end
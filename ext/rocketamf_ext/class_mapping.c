@@ -5,28 +5,48 @@
 #include <st.h>
 #endif
 #include "utility.h"
+#include "class_mapping.h"
+
+// Most classes only ever have a handful of instance variable lists
+#define MAX_IVAR_SHAPES 256
 
 extern VALUE mRocketAMF;
 extern VALUE mRocketAMFExt;
+extern VALUE sym_class_name;
+extern VALUE sym_members;
+extern VALUE sym_externalizable;
+extern VALUE sym_dynamic;
 VALUE cFastMappingSet;
+VALUE cFastClassMapping;
 VALUE cTypedHash;
 ID id_use_ac;
 ID id_use_ac_ivar;
 ID id_mappings;
 ID id_mappings_ivar;
 ID id_hashset;
+static VALUE sym_as;
+static VALUE sym_ruby;
+static VALUE sym_ivars;
 
 typedef struct {
     VALUE mapset;
     st_table* setter_cache;
     st_table* prop_cache;
+    VALUE ivar_shapes; // Instance variable list to its sorted [ivar, key] pairs
 } CLASS_MAPPING;
 
 typedef struct {
     st_table* as_mappings;
     st_table* rb_mappings;
+    st_table* rb_traits;
+    st_table* rb_classes;
+    st_table* prop_cache;
+    st_table* setter_cache;
 } MAPSET;
 
+static VALUE mapping_class_props(VALUE klass);
+static ID mapping_setter_id(ID key_id);
+
 /*
  * Mark the as_mappings and rb_mappings hashes
  */
@@ -34,6 +54,9 @@ static void mapset_mark(MAPSET *set) {
     if(!set) return;
     rb_mark_tbl(set->as_mappings);
     rb_mark_tbl(set->rb_mappings);
+    rb_mark_tbl(set->rb_traits);
+    rb_mark_tbl(set->rb_classes);
+    rb_mark_tbl(set->prop_cache);
 }
 
 /*
@@ -50,6 +73,12 @@ static void mapset_free(MAPSET *set) {
     st_foreach(set->rb_mappings, mapset_free_strtable_key, 0);
     st_free_table(set->rb_mappings);
     set->rb_mappings = NULL;
+    st_foreach(set->rb_traits, mapset_free_strtable_key, 0);
+    st_free_table(set->rb_traits);
+    set->rb_traits = NULL;
+    st_free_table(set->rb_classes);
+    st_free_table(set->prop_cache);
+    st_free_table(set->setter_cache);
     xfree(set);
 }
 
@@ -64,6 +93,10 @@ static VALUE mapset_alloc(VALUE klass) {
     // Initialize internal data
     set->as_mappings = st_init_strtable();
     set->rb_mappings = st_init_strtable();
+    set->rb_traits = st_init_strtable();
+    set->rb_classes = st_init_numtable();
+    set->prop_cache = st_init_numtable();
+    set->setter_cache = st_init_numtable();
 
     return self;
 }
@@ -113,35 +146,210 @@ static VALUE mapset_map_defaults(VALUE self) {
     int i;
     ID map_id = rb_intern("map");
     VALUE params = rb_hash_new();
-    VALUE as_sym = ID2SYM(rb_intern("as"));
-    VALUE ruby_sym = ID2SYM(rb_intern("ruby"));
     for(i = 0; i < NUM_MAPPINGS; i++) {
-        rb_hash_aset(params, as_sym, rb_str_new2(as_classes[i]));
-        rb_hash_aset(params, ruby_sym, rb_str_new2(ruby_classes[i]));
+        rb_hash_aset(params, sym_as, rb_str_new2(as_classes[i]));
+        rb_hash_aset(params, sym_ruby, rb_str_new2(ruby_classes[i]));
         rb_funcall(self, map_id, 1, params);
     }
 
     return self;
 }
 
+/*
+ * Builds the frozen list of [ivar, key] symbol pairs for the given names, which
+ * can have a leading @ or not
+ */
+static VALUE mapset_ivar_pairs(VALUE names) {
+    long i, len = RARRAY_LEN(names);
+    VALUE pairs = rb_ary_new2(len);
+    for(i = 0; i < len; i++) {
+        VALUE name = rb_obj_as_string(RARRAY_PTR(names)[i]);
+        VALUE key = RSTRING_PTR(name)[0] == '@' ? rb_str_substr(name, 1, RSTRING_LEN(name) - 1) : name;
+        VALUE ivar = rb_str_plus(rb_str_new2("@"), key);
+        VALUE pair = rb_ary_new3(2, rb_str_intern(ivar), rb_str_intern(key));
+        rb_ary_push(pairs, rb_obj_freeze(pair));
+    }
+    return rb_obj_freeze(pairs);
+}
+
 /*
  * call-seq:
  *   m.map :as => 'com.example.Date', :ruby => "Example::Date'
+ *   m.map :as => 'com.example.Row', :ruby => 'Example::Row', :members => [:id, :name]
+ *   m.map :as => 'com.example.Row', :ruby => 'Example::Row', :ivars => true
  *
  * Map a given AS class to a ruby class. Use fully qualified names for both.
+ * If given a list of members, the class is serialized with sealed traits
+ * containing just those properties, in that order, rather than as a dynamic
+ * object.
+ *
+ * Properties are normally found by calling every public method that takes no
+ * arguments. With <tt>:ivars => true</tt> they're read straight from instance
+ * variables instead: the members if given, or else each instance's own
+ * instance variables, in sorted order. An array of names for <tt>:ivars</tt>
+ * limits it to just those, in that order.
  */
 static VALUE mapset_map(VALUE self, VALUE mapping) {
     MAPSET *set;
     Data_Get_Struct(self, MAPSET, set);
+    rb_check_frozen(self);
 
-    VALUE as_class = rb_hash_aref(mapping, ID2SYM(rb_intern("as")));
-    VALUE rb_class = rb_hash_aref(mapping, ID2SYM(rb_intern("ruby")));
+    VALUE as_class = rb_hash_aref(mapping, sym_as);
+    VALUE rb_class = rb_hash_aref(mapping, sym_ruby);
     st_insert(set->as_mappings, (st_data_t)strdup(RSTRING_PTR(as_class)), rb_class);
     st_insert(set->rb_mappings, (st_data_t)strdup(RSTRING_PTR(rb_class)), as_class);
 
+    // Build the traits once, so the serializer can use them for every instance
+    VALUE members = rb_ary_new();
+    VALUE member_list = rb_hash_aref(mapping, sym_members);
+    long i;
+    if(member_list != Qnil) {
+        Check_Type(member_list, T_ARRAY);
+        for(i = 0; i < RARRAY_LEN(member_list); i++) {
+            VALUE member = RARRAY_PTR(member_list)[i];
+            rb_ary_push(members, TYPE(member) == T_SYMBOL ? member : rb_str_intern(member));
+        }
+    }
+    rb_obj_freeze(members);
+    VALUE traits = rb_hash_new();
+    rb_hash_aset(traits, sym_class_name, rb_str_new_frozen(as_class));
+    rb_hash_aset(traits, sym_members, members);
+    rb_hash_aset(traits, sym_dynamic, RARRAY_LEN(members) == 0 ? Qtrue : Qfalse);
+    rb_hash_aset(traits, sym_externalizable, Qfalse);
+    VALUE ivars = rb_hash_aref(mapping, sym_ivars);
+    if(RARRAY_LEN(members) > 0 && RTEST(ivars)) {
+        rb_hash_aset(traits, sym_ivars, mapset_ivar_pairs(members));
+    } else if(TYPE(ivars) == T_ARRAY) {
+        rb_hash_aset(traits, sym_ivars, mapset_ivar_pairs(ivars));
+    } else if(RTEST(ivars)) {
+        rb_hash_aset(traits, sym_ivars, Qtrue);
+    }
+    rb_obj_freeze(traits);
+    if(st_lookup(set->rb_traits, (st_data_t)RSTRING_PTR(rb_class), NULL)) {
+        st_insert(set->rb_traits, (st_data_t)RSTRING_PTR(rb_class), traits);
+    } else {
+        st_add_direct(set->rb_traits, (st_data_t)strdup(RSTRING_PTR(rb_class)), traits);
+    }
+
     return Qnil;
 }
 
+static VALUE mapset_path2class(VALUE name) {
+    return rb_path2class(RSTRING_PTR(name));
+}
+
+/*
+ * st_table iterator that resolves a mapped ruby class, and caches its
+ * properties and their setters if it was mapped with members
+ */
+static int mapset_precompile_iter(st_data_t key, st_data_t value, st_data_t arg) {
+    MAPSET *set = (MAPSET *)arg;
+    VALUE rb_name = (VALUE)value;
+    if(st_lookup(set->rb_classes, rb_name, NULL)) return ST_CONTINUE;
+
+    // Skip classes that aren't loaded
+    int state = 0;
+    VALUE klass = rb_protect(mapset_path2class, rb_name, &state);
+    if(state) {
+        rb_set_errinfo(Qnil);
+        return ST_CONTINUE;
+    }
+    st_add_direct(set->rb_classes, rb_name, klass);
+
+    // Instance variable mapped classes don't use the property list, and only
+    // classes mapped with members have declared their shape. The rest are left
+    // to each mapper's lazy cache, so methods defined after boot still show up.
+    VALUE traits;
+    if(!st_lookup(set->rb_traits, (st_data_t)RSTRING_PTR(rb_name), &traits)) return ST_CONTINUE;
+    if(rb_hash_aref(traits, sym_ivars) != Qnil) return ST_CONTINUE;
+    if(RARRAY_LEN(rb_hash_aref(traits, sym_members)) == 0) return ST_CONTINUE;
+    if(st_lookup(set->prop_cache, klass, NULL)) return ST_CONTINUE;
+
+    VALUE props = rb_obj_freeze(mapping_class_props(klass));
+    st_add_direct(set->prop_cache, klass, props);
+    long i;
+    for(i = 0; i < RARRAY_LEN(props); i++) {
+        ID key_id = rb_to_id(RARRAY_PTR(props)[i]);
+        if(!st_lookup(set->setter_cache, key_id, NULL)) {
+            st_add_direct(set->setter_cache, key_id, mapping_setter_id(key_id));
+        }
+    }
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *   m.precompile! => m
+ *
+ * Resolves every mapped ruby class that's currently loaded and freezes the
+ * mapping set. Classes mapped with <tt>:members</tt> also have their property
+ * list and setters built. Every mapper using the set shares the result rather
+ * than building its own caches lazily, so calling this at boot in a preforking
+ * server leaves workers less to warm up. Mapped classes can't be redefined or
+ * reloaded afterwards.
+ *
+ * The property list of a class mapped with <tt>:members</tt> is taken from its
+ * public methods at the time of the call, and methods defined on it later are
+ * never picked up, so require everything that adds to those classes first.
+ * Classes mapped without <tt>:members</tt> are looked up lazily as usual.
+ */
+static VALUE mapset_precompile(VALUE self) {
+    MAPSET *set;
+    Data_Get_Struct(self, MAPSET, set);
+    if(OBJ_FROZEN(self)) return self;
+
+    st_foreach(set->as_mappings, mapset_precompile_iter, (st_data_t)set);
+    rb_obj_freeze(self);
+    return self;
+}
+
+/*
+ * Internal method for looking up a precompiled ruby class by ruby class name
+ * string from the mappings, or Qnil if not found
+ */
+static VALUE mapset_class_lookup(VALUE self, VALUE rb_name) {
+    MAPSET *set;
+    Data_Get_Struct(self, MAPSET, set);
+
+    VALUE klass;
+    if(st_lookup(set->rb_classes, rb_name, &klass)) {
+        return klass;
+    } else {
+        return Qnil;
+    }
+}
+
+/*
+ * Internal method for looking up a ruby class's precompiled property list, or
+ * Qnil if not found
+ */
+static VALUE mapset_props_lookup(VALUE self, VALUE klass) {
+    MAPSET *set;
+    Data_Get_Struct(self, MAPSET, set);
+
+    VALUE props;
+    if(st_lookup(set->prop_cache, klass, &props)) {
+        return props;
+    } else {
+        return Qnil;
+    }
+}
+
+/*
+ * Internal method for looking up a precompiled setter, or 0 if not found
+ */
+static ID mapset_setter_lookup(VALUE self, ID key_id) {
+    MAPSET *set;
+    Data_Get_Struct(self, MAPSET, set);
+
+    st_data_t setter_id;
+    if(st_lookup(set->setter_cache, key_id, &setter_id)) {
+        return (ID)setter_id;
+    } else {
+        return 0;
+    }
+}
+
 /*
  * Internal method for looking up a given ruby class's AS class name or Qnil if
  * not found
@@ -158,6 +366,22 @@ static VALUE mapset_as_lookup(VALUE self, const char* class_name) {
     }
 }
 
+/*
+ * Internal method for looking up the traits for a given ruby class name or Qnil
+ * if not found
+ */
+static VALUE mapset_traits_lookup(VALUE self, const char* class_name) {
+    MAPSET *set;
+    Data_Get_Struct(self, MAPSET, set);
+
+    VALUE traits;
+    if(st_lookup(set->rb_traits, (st_data_t)class_name, &traits)) {
+        return traits;
+    } else {
+        return Qnil;
+    }
+}
+
 /*
  * Internal method for looking up a given AS class names ruby class name mapping
  * or Qnil if not found
@@ -181,6 +405,7 @@ static void mapping_mark(CLASS_MAPPING *map) {
     if(!map) return;
     rb_gc_mark(map->mapset);
     rb_mark_tbl(map->prop_cache);
+    rb_gc_mark(map->ivar_shapes);
 }
 
 /*
@@ -201,6 +426,7 @@ static VALUE mapping_alloc(VALUE klass) {
     VALUE self = Data_Wrap_Struct(klass, mapping_mark, mapping_free, map);
     map->setter_cache = st_init_numtable();
     map->prop_cache = st_init_numtable();
+    map->ivar_shapes = rb_hash_new();
     return self;
 }
 
@@ -250,6 +476,17 @@ static VALUE mapping_s_define(VALUE klass) {
     return Qnil;
 }
 
+/*
+ * call-seq:
+ *   mapper.precompile! => mapper
+ *
+ * Precompiles the class mappings at boot. See FastMappingSet#precompile!.
+ */
+static VALUE mapping_s_precompile(VALUE klass) {
+    rb_funcall(rb_funcall(klass, id_mappings, 0), rb_intern("precompile!"), 0);
+    return klass;
+}
+
 /*
  * Reset class mappings
  */
@@ -271,6 +508,29 @@ static VALUE mapping_init(VALUE self) {
     return self;
 }
 
+/*
+ * Returns the ruby class name to look up mappings with for the given object,
+ * or NULL for plain hashes
+ */
+static const char* mapping_ruby_class_name(VALUE obj) {
+    int type = TYPE(obj);
+    if(type == T_STRING) {
+        // Use strings as the class name
+        return RSTRING_PTR(obj);
+    }
+
+    // Look up the class name and use that
+    VALUE klass = CLASS_OF(obj);
+    if(klass == cTypedHash) {
+        VALUE orig_name = rb_funcall(obj, rb_intern("type"), 0);
+        return RSTRING_PTR(orig_name);
+    } else if(type == T_HASH) {
+        // Don't bother looking up hash mapping, but need to check class name first in case it's a typed hash
+        return NULL;
+    }
+    return rb_class2name(klass);
+}
+
 /*
  * call-seq:
  *   mapper.get_as_class_name => str
@@ -282,25 +542,24 @@ static VALUE mapping_as_class_name(VALUE self, VALUE obj) {
     CLASS_MAPPING *map;
     Data_Get_Struct(self, CLASS_MAPPING, map);
 
-    int type = TYPE(obj);
-    const char* class_name;
-    if(type == T_STRING) {
-        // Use strings as the class name
-        class_name = RSTRING_PTR(obj);
-    } else {
-        // Look up the class name and use that
-        VALUE klass = CLASS_OF(obj);
-        class_name = rb_class2name(klass);
-        if(klass == cTypedHash) {
-            VALUE orig_name = rb_funcall(obj, rb_intern("type"), 0);
-            class_name = RSTRING_PTR(orig_name);
-        } else if(type == T_HASH) {
-            // Don't bother looking up hash mapping, but need to check class name first in case it's a typed hash
-            return Qnil;
-        }
-    }
+    const char* class_name = mapping_ruby_class_name(obj);
+    return class_name ? mapset_as_lookup(map->mapset, class_name) : Qnil;
+}
 
-    return mapset_as_lookup(map->mapset, class_name);
+/*
+ * call-seq:
+ *   mapper.get_as_traits(obj) => hash
+ *
+ * Returns the frozen AMF3 traits hash for the given ruby object, or nil if its
+ * class isn't mapped. Classes mapped with <tt>:members</tt> get sealed traits.
+ * Will also take a string containing the ruby class name.
+ */
+static VALUE mapping_as_traits(VALUE self, VALUE obj) {
+    CLASS_MAPPING *map;
+    Data_Get_Struct(self, CLASS_MAPPING, map);
+
+    const char* class_name = mapping_ruby_class_name(obj);
+    return class_name ? mapset_traits_lookup(map->mapset, class_name) : Qnil;
 }
 
 /*
@@ -320,6 +579,11 @@ static VALUE mapping_get_ruby_obj(VALUE self, VALUE name) {
     if(ruby_class_name == Qnil) {
         argv[0] = name;
         return rb_class_new_instance(1, argv, cTypedHash);
+    }
+
+    VALUE klass = mapset_class_lookup(map->mapset, ruby_class_name);
+    if(klass != Qnil) {
+        return rb_class_new_instance(0, NULL, klass);
     } else {
         VALUE base_const = rb_mKernel;
         char* endptr;
@@ -334,6 +598,21 @@ static VALUE mapping_get_ruby_obj(VALUE self, VALUE name) {
     }
 }
 
+/*
+ * Returns the setter ID for the given property ID
+ */
+static ID mapping_setter_id(ID key_id) {
+    const char* key_str = rb_id2name(key_id);
+    long len = strlen(key_str);
+    char* setter = ALLOC_N(char, len+2);
+    memcpy(setter, key_str, len);
+    setter[len] = '=';
+    setter[len+1] = '\0';
+    ID setter_id = rb_intern(setter);
+    xfree(setter);
+    return setter_id;
+}
+
 /*
  * st_table iterator for populating a given object from a property hash
  */
@@ -351,19 +630,9 @@ static int mapping_populate_iter(VALUE key, VALUE val, const VALUE args[2]) {
 
     // Calculate symbol for setter function
     ID key_id = SYM2ID(key);
-    ID setter_id;
-    if(!st_lookup(map->setter_cache, key_id, &setter_id)) {
-        // Calculate symbol
-        const char* key_str = rb_id2name(key_id);
-        long len = strlen(key_str);
-        char* setter = ALLOC_N(char, len+2);
-        memcpy(setter, key_str, len);
-        setter[len] = '=';
-        setter[len+1] = '\0';
-        setter_id = rb_intern(setter);
-        xfree(setter);
-
-        // Store it
+    ID setter_id = mapset_setter_lookup(map->mapset, key_id);
+    if(!setter_id && !st_lookup(map->setter_cache, key_id, &setter_id)) {
+        setter_id = mapping_setter_id(key_id);
         st_add_direct(map->setter_cache, key_id, setter_id);
     }
 
@@ -397,6 +666,67 @@ static VALUE mapping_populate(int argc, VALUE *argv, VALUE self) {
     return obj;
 }
 
+/*
+ * Returns the [ivar, key] pairs to read properties from for objects mapped with
+ * <tt>:ivars</tt>, given the <tt>:ivars</tt> entry from their traits. Used
+ * directly by the serializer so values can be written without building a
+ * props hash.
+ */
+VALUE mapping_ivars(VALUE self, VALUE obj, VALUE ivars) {
+    CLASS_MAPPING *map;
+    Data_Get_Struct(self, CLASS_MAPPING, map);
+
+    if(ivars != Qtrue) return ivars;
+
+    // Instances of a class needn't share a set of instance variables, so the
+    // pairs are cached by the list the object has rather than by class
+    VALUE names = rb_obj_instance_variables(obj);
+    VALUE pairs = rb_hash_lookup2(map->ivar_shapes, names, Qundef);
+    if(pairs == Qundef) {
+        VALUE sorted = rb_ary_sort_bang(rb_ary_dup(names));
+        pairs = mapset_ivar_pairs(sorted);
+        if(RHASH_SIZE(map->ivar_shapes) < MAX_IVAR_SHAPES) rb_hash_aset(map->ivar_shapes, rb_obj_freeze(names), pairs);
+    }
+    return pairs;
+}
+
+/*
+ * Returns true if the mapper is a FastClassMapping whose implementation of the
+ * given method hasn't been overridden, so the serializers can skip calling it
+ * and work from the mappings directly
+ */
+int mapping_native(VALUE mapper, ID mid) {
+    if(!RTEST(rb_obj_is_kind_of(mapper, cFastClassMapping))) return 0;
+    if(CLASS_OF(mapper) == cFastClassMapping) return 1;
+    VALUE method = rb_obj_method(mapper, ID2SYM(mid));
+    return rb_funcall(method, rb_intern("owner"), 0) == cFastClassMapping;
+}
+
+/*
+ * Returns the sorted names of the public methods that take no arguments on
+ * instances of the class, excluding those every Object has
+ */
+static VALUE mapping_class_props(VALUE klass) {
+    VALUE props_ary = rb_ary_new();
+    VALUE all_methods = rb_class_public_instance_methods(0, NULL, klass);
+    VALUE object_methods = rb_class_public_instance_methods(0, NULL, rb_cObject);
+    VALUE possible_methods = rb_funcall(all_methods, rb_intern("-"), 1, object_methods);
+    long i, len = RARRAY_LEN(possible_methods);
+    for(i = 0; i < len; i++) {
+        VALUE meth = rb_funcall(klass, rb_intern("instance_method"), 1, RARRAY_PTR(possible_methods)[i]);
+        VALUE arity = rb_funcall(meth, rb_intern("arity"), 0);
+        if(FIX2INT(arity) == 0) {
+            rb_ary_push(props_ary, RARRAY_PTR(possible_methods)[i]);
+        }
+    }
+
+    // Method table order shifts as symbols are interned, so sort to keep
+    // output stable. This also matches the pure ruby serializer, which sorts
+    // property keys, so both codecs write objects the same way.
+    rb_ary_sort_bang(props_ary);
+    return props_ary;
+}
+
 /*
  * call-seq:
  *   mapper.props_for_serialization(obj) => hash
@@ -415,27 +745,26 @@ static VALUE mapping_props(VALUE self, VALUE obj) {
         return obj;
     }
 
-    // Get "properties"
-    VALUE props_ary;
+    // Read instance variables if mapped that way
     VALUE klass = CLASS_OF(obj);
     long i, len;
-    if(!st_lookup(map->prop_cache, klass, &props_ary)) {
-        props_ary = rb_ary_new();
-
-        // Build props array
-        VALUE all_methods = rb_class_public_instance_methods(0, NULL, klass);
-        VALUE object_methods = rb_class_public_instance_methods(0, NULL, rb_cObject);
-        VALUE possible_methods = rb_funcall(all_methods, rb_intern("-"), 1, object_methods);
-        len = RARRAY_LEN(possible_methods);
+    VALUE traits = mapset_traits_lookup(map->mapset, rb_class2name(klass));
+    VALUE ivars = traits == Qnil ? Qnil : rb_hash_aref(traits, sym_ivars);
+    if(ivars != Qnil) {
+        VALUE pairs = mapping_ivars(self, obj, ivars);
+        VALUE props = rb_hash_new();
+        len = RARRAY_LEN(pairs);
         for(i = 0; i < len; i++) {
-            VALUE meth = rb_obj_method(obj, RARRAY_PTR(possible_methods)[i]);
-            VALUE arity = rb_funcall(meth, rb_intern("arity"), 0);
-            if(FIX2INT(arity) == 0) {
-                rb_ary_push(props_ary, RARRAY_PTR(possible_methods)[i]);
-            }
+            VALUE pair = RARRAY_PTR(pairs)[i];
+            rb_hash_aset(props, RARRAY_PTR(pair)[1], rb_attr_get(obj, SYM2ID(RARRAY_PTR(pair)[0])));
         }
+        return props;
+    }
 
-        // Store it
+    // Get "properties"
+    VALUE props_ary = mapset_props_lookup(map->mapset, klass);
+    if(props_ary == Qnil && !st_lookup(map->prop_cache, klass, &props_ary)) {
+        props_ary = mapping_class_props(klass);
         st_add_direct(map->prop_cache, klass, props_ary);
     }
 
@@ -458,18 +787,21 @@ void Init_rocket_amf_fast_class_mapping() {
     rb_define_method(cFastMappingSet, "initialize", mapset_init, 0);
     rb_define_method(cFastMappingSet, "map_defaults", mapset_map_defaults, 0);
     rb_define_method(cFastMappingSet, "map", mapset_map, 1);
+    rb_define_method(cFastMappingSet, "precompile!", mapset_precompile, 0);
 
     // Define FastClassMapping
-    VALUE cFastClassMapping = rb_define_class_under(mRocketAMFExt, "FastClassMapping", rb_cObject);
+    cFastClassMapping = rb_define_class_under(mRocketAMFExt, "FastClassMapping", rb_cObject);
     rb_define_alloc_func(cFastClassMapping, mapping_alloc);
     rb_define_singleton_method(cFastClassMapping, "use_array_collection", mapping_s_array_collection_get, 0);
     rb_define_singleton_method(cFastClassMapping, "use_array_collection=", mapping_s_array_collection_set, 1);
     rb_define_singleton_method(cFastClassMapping, "mappings", mapping_s_mappings, 0);
     rb_define_singleton_method(cFastClassMapping, "reset", mapping_s_reset, 0);
     rb_define_singleton_method(cFastClassMapping, "define", mapping_s_define, 0);
+    rb_define_singleton_method(cFastClassMapping, "precompile!", mapping_s_precompile, 0);
     rb_define_attr(cFastClassMapping, "use_array_collection", 1, 0);
     rb_define_method(cFastClassMapping, "initialize", mapping_init, 0);
     rb_define_method(cFastClassMapping, "get_as_class_name", mapping_as_class_name, 1);
+    rb_define_method(cFastClassMapping, "get_as_traits", mapping_as_traits, 1);
     rb_define_method(cFastClassMapping, "get_ruby_obj", mapping_get_ruby_obj, 1);
     rb_define_method(cFastClassMapping, "populate_ruby_obj", mapping_populate, -1);
     rb_define_method(cFastClassMapping, "props_for_serialization", mapping_props, 1);
@@ -481,4 +813,7 @@ void Init_rocket_amf_fast_class_mapping() {
     id_mappings = rb_intern("mappings");
     id_mappings_ivar = rb_intern("@mappings");
     id_hashset = rb_intern("[]=");
+    sym_as = ID2SYM(rb_intern("as"));
+    sym_ruby = ID2SYM(rb_intern("ruby"));
+    sym_ivars = ID2SYM(rb_intern("ivars"));
 }
\ No newline at end of file
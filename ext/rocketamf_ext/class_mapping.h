@@ -0,0 +1,2 @@
+VALUE mapping_ivars(VALUE self, VALUE obj, VALUE ivars);
+int mapping_native(VALUE mapper, ID mid);
@@ -45,8 +45,11 @@
 #define AMF3_CLOSE_DYNAMIC_ARRAY   0x01
 
 // Other Constants
+#define ARRAY_COLLECTION_CLASS "flex.messaging.io.ArrayCollection"
 #define MAX_INTEGER  268435455
 #define MIN_INTEGER  -268435456
 #define INITIAL_STREAM_LENGTH 128 // Initial buffer length for serializer output
 #define MAX_STREAM_LENGTH 10*1024*1024 // Let's cap it at 10MB for now
-#define MAX_ARRAY_PREALLOC 100000
\ No newline at end of file
+#define DEFAULT_FLUSH_SIZE 64*1024 // Buffered bytes before writing to a target IO
+#define MAX_ARRAY_PREALLOC 100000
+#define MAX_SHAPE_CACHE 4096 // Sorted key lists kept for deterministic property order
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include "deserializer.h"
+#include "class_mapping.h"
 #include "constants.h"
+#include "utf8.h"
+#include "stats.h"
+#include "probes.h"
 
 #define DES_BOUNDS_CHECK(des, i) if(des->pos + (i) > des->size || des->pos + (i) < des->pos) rb_raise(rb_eRangeError, "reading %lu bytes is beyond end of source: %ld (pos), %ld (size)", (unsigned long)(i), des->pos, des->size);
 
@@ -13,6 +17,12 @@ extern VALUE sym_externalizable;
 extern VALUE sym_dynamic;
 ID id_get_ruby_obj;
 ID id_populate_ruby_obj;
+extern ID id_hashset;
+static VALUE sym_setters;
+static VALUE sym_deserialize;
+static VALUE sym_plain;
+static VALUE sym_class_key;
+extern VALUE sym_profile;
 
 static VALUE des0_deserialize(VALUE self, char type);
 static VALUE des3_deserialize(VALUE self);
@@ -101,17 +111,28 @@ int des_read_int(AMF_DESERIALIZER *des) {
 }
 
 /*
- * Read a string and then force the encoding to UTF 8 if running ruby 1.9
+ * Read a string and then force the encoding to UTF 8 if running ruby 1.9. The
+ * bytes are validated as they're read and the coderange set from the result,
+ * so ruby doesn't need to scan the string again later.
  */
 VALUE des_read_string(AMF_DESERIALIZER *des, unsigned int len) {
     DES_BOUNDS_CHECK(des, len);
     VALUE str = rb_str_new(des->stream + des->pos, len);
 #ifdef HAVE_RB_STR_ENCODE
-    rb_encoding *utf8 = rb_utf8_encoding();
-    rb_enc_associate(str, utf8);
-    ENC_CODERANGE_CLEAR(str);
+    rb_enc_associate_index(str, rb_utf8_encindex());
+    switch(utf8_scan(des->stream + des->pos, len)) {
+        case UTF8_7BIT:
+            ENC_CODERANGE_SET(str, ENC_CODERANGE_7BIT);
+            break;
+        case UTF8_VALID:
+            ENC_CODERANGE_SET(str, ENC_CODERANGE_VALID);
+            break;
+        default:
+            ENC_CODERANGE_SET(str, ENC_CODERANGE_BROKEN);
+    }
 #endif
     des->pos += len;
+    if(len > 0) STATS_INC(deserializer.strings);
     return str;
 }
 
@@ -174,36 +195,71 @@ static void des0_read_props(VALUE self, VALUE hash) {
     }
 }
 
+/*
+ * Reads an AMF0 object straight into a hash when decoding plain data, storing
+ * the class name under the class key if there is one
+ */
+static VALUE des0_read_plain_object(VALUE self, long frame, VALUE class_name) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    VALUE obj = rb_hash_new();
+    if(des->class_key != Qnil && class_name != Qnil) rb_hash_aset(obj, des->class_key, class_name);
+    rb_ary_push(des->obj_cache, obj);
+    STATS_INC(deserializer.objects);
+    des0_read_props(self, obj);
+
+    if(des->prof) profile_leave(des->prof, frame, rb_cHash, class_name, des->pos);
+    return obj;
+}
+
 static VALUE des0_read_object(VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    long frame = des->prof ? profile_enter(des->prof, des->pos - 1) : 0; // Including the type marker
+
+    if(des->plain) return des0_read_plain_object(self, frame, Qnil);
 
     // Create object and add to cache
-    VALUE obj = rb_funcall(des->class_mapper, id_get_ruby_obj, 1, rb_str_new(NULL, 0));
+    STATS_INC(deserializer.mapper_calls);
+    PROBE_MAPPER_CALL("get_ruby_obj", "");
+    VALUE obj = profile_funcall(des->prof, des->class_mapper, id_get_ruby_obj, 1, rb_str_new(NULL, 0));
     rb_ary_push(des->obj_cache, obj);
+    STATS_INC(deserializer.objects);
 
     // Populate object
     VALUE props = rb_hash_new();
     des0_read_props(self, props);
-    rb_funcall(des->class_mapper, id_populate_ruby_obj, 2, obj, props);
+    STATS_INC(deserializer.mapper_calls);
+    PROBE_MAPPER_CALL("populate_ruby_obj", rb_obj_classname(obj));
+    profile_funcall(des->prof, des->class_mapper, id_populate_ruby_obj, 2, obj, props);
 
+    if(des->prof) profile_leave(des->prof, frame, rb_obj_class(obj), Qnil, des->pos);
     return obj;
 }
 
 static VALUE des0_read_typed_object(VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    long frame = des->prof ? profile_enter(des->prof, des->pos - 1) : 0; // Including the type marker
 
     // Create object and add to cache
     VALUE class_name = des_read_string(des, des_read_uint16(des));
-    VALUE obj = rb_funcall(des->class_mapper, id_get_ruby_obj, 1, class_name);
+    if(des->plain) return des0_read_plain_object(self, frame, class_name);
+    STATS_INC(deserializer.mapper_calls);
+    PROBE_MAPPER_CALL("get_ruby_obj", RSTRING_PTR(class_name));
+    VALUE obj = profile_funcall(des->prof, des->class_mapper, id_get_ruby_obj, 1, class_name);
     rb_ary_push(des->obj_cache, obj);
+    STATS_INC(deserializer.objects);
 
     // Populate object
     VALUE props = rb_hash_new();
     des0_read_props(self, props);
-    rb_funcall(des->class_mapper, id_populate_ruby_obj, 2, obj, props);
+    STATS_INC(deserializer.mapper_calls);
+    PROBE_MAPPER_CALL("populate_ruby_obj", rb_obj_classname(obj));
+    profile_funcall(des->prof, des->class_mapper, id_populate_ruby_obj, 2, obj, props);
 
+    if(des->prof) profile_leave(des->prof, frame, rb_obj_class(obj), class_name, des->pos);
     return obj;
 }
 
@@ -213,6 +269,7 @@ static VALUE des0_read_hash(VALUE self) {
     des_read_uint32(des); // Hash size, but there's no optimization I can perform with this
     VALUE obj = rb_hash_new();
     rb_ary_push(des->obj_cache, obj);
+    STATS_INC(deserializer.objects);
     des0_read_props(self, obj);
     return obj;
 }
@@ -227,6 +284,7 @@ static VALUE des0_read_array(VALUE self) {
     unsigned int len = des_read_uint32(des);
     VALUE ary = rb_ary_new2(len < MAX_ARRAY_PREALLOC ? len : MAX_ARRAY_PREALLOC);
     rb_ary_push(des->obj_cache, ary);
+    STATS_INC(deserializer.objects);
 
     unsigned int i;
     for(i = 0; i < len; i++) {
@@ -241,6 +299,7 @@ static VALUE des0_read_time(VALUE self) {
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
     double milli = des_read_double(des);
     des_read_uint16(des); // Timezone - unused
+    if(des->plain) return rb_float_new(milli);
     time_t sec = milli/1000.0;
     time_t micro = (milli-sec*1000)*1000;
     return rb_time_new(sec, micro);
@@ -289,6 +348,7 @@ static VALUE des0_deserialize(VALUE self, char type) {
         case AMF0_REFERENCE_MARKER:
             tmp = des_read_uint16(des);
             if(tmp >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "reference index beyond end");
+            STATS_INC(deserializer.obj_refs);
             ret = RARRAY_PTR(des->obj_cache)[tmp];
             break;
         case AMF0_DATE_MARKER:
@@ -311,6 +371,7 @@ static VALUE des3_read_string(AMF_DESERIALIZER *des) {
     if((header & 1) == 0) {
         header >>= 1;
         if(header >= RARRAY_LEN(des->str_cache)) rb_raise(rb_eRangeError, "str reference index beyond end");
+        STATS_INC(deserializer.str_refs);
         return RARRAY_PTR(des->str_cache)[header];
     } else {
         VALUE str = des_read_string(des, header >> 1);
@@ -331,91 +392,190 @@ static VALUE des3_read_xml(VALUE self) {
     if((header & 1) == 0) {
         header >>= 1;
         if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        STATS_INC(deserializer.obj_refs);
         return RARRAY_PTR(des->obj_cache)[header];
     } else {
         VALUE str = des_read_string(des, header >> 1);
-        if(RSTRING_LEN(str) > 0) rb_ary_push(des->obj_cache, str);
+        if(RSTRING_LEN(str) > 0) {
+            rb_ary_push(des->obj_cache, str);
+            STATS_INC(deserializer.objects);
+        }
         return str;
     }
 }
 
-static VALUE des3_read_object(VALUE self) {
-    AMF_DESERIALIZER *des;
-    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+/*
+ * Works out how the fast class mapper would set each sealed member on objects
+ * like obj: a setter symbol, Qtrue to use []=, or Qnil to skip it
+ */
+static VALUE des3_sealed_setters(VALUE obj, VALUE members) {
+    long i, len = RARRAY_LEN(members);
+    VALUE setters = rb_ary_new2(len);
+    int hash_like = rb_respond_to(obj, id_hashset);
+    for(i = 0; i < len; i++) {
+        VALUE setter_name = rb_str_dup(RARRAY_PTR(members)[i]);
+        rb_str_cat(setter_name, "=", 1);
+        ID setter = rb_intern_str(setter_name);
+        if(rb_respond_to(obj, setter)) {
+            rb_ary_push(setters, ID2SYM(setter));
+        } else {
+            rb_ary_push(setters, hash_like ? Qtrue : Qnil);
+        }
+    }
+    return setters;
+}
 
-    int header = des_read_int(des);
+/*
+ * Reads the traits for an object given the object header without its low
+ * (inline object) bit, or looks them up if they're a reference
+ */
+static VALUE des3_read_traits(AMF_DESERIALIZER *des, int header) {
     if((header & 1) == 0) {
         header >>= 1;
-        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
-        return RARRAY_PTR(des->obj_cache)[header];
-    } else {
-        VALUE externalizable, dynamic, members, class_name, traits;
-        long i, members_len;
-
-        // Parse traits
-        header >>= 1;
-        if((header & 1) == 0) {
-            header >>= 1;
-            if(header >= RARRAY_LEN(des->trait_cache)) rb_raise(rb_eRangeError, "trait reference index beyond end");
-            traits = RARRAY_PTR(des->trait_cache)[header];
-            externalizable = rb_hash_aref(traits, sym_externalizable);
-            dynamic = rb_hash_aref(traits, sym_dynamic);
-            members = rb_hash_aref(traits, sym_members);
-            members_len = members == Qnil ? 0 : RARRAY_LEN(members);
-            class_name = rb_hash_aref(traits, sym_class_name);
-        } else {
-            externalizable = (header & 2) != 0 ? Qtrue : Qfalse;
-            dynamic = (header & 4) != 0 ? Qtrue : Qfalse;
-            members_len = header >> 3;
-            class_name = des3_read_string(des);
-
-            members = rb_ary_new2(members_len);
-            for(i = 0; i < members_len; i++) rb_ary_push(members, des3_read_string(des));
-
-            traits = rb_hash_new();
-            rb_hash_aset(traits, sym_externalizable, externalizable);
-            rb_hash_aset(traits, sym_dynamic, dynamic);
-            rb_hash_aset(traits, sym_members, members);
-            rb_hash_aset(traits, sym_class_name, class_name);
-            rb_ary_push(des->trait_cache, traits);
-        }
+        if(header >= RARRAY_LEN(des->trait_cache)) rb_raise(rb_eRangeError, "trait reference index beyond end");
+        STATS_INC(deserializer.trait_refs);
+        return RARRAY_PTR(des->trait_cache)[header];
+    }
 
-        // Optimization for deserializing ArrayCollection
-        if(strcmp(RSTRING_PTR(class_name), "flex.messaging.io.ArrayCollection") == 0) {
-            VALUE arr = des3_deserialize(self); // Adds ArrayCollection array to object cache automatically
-            rb_ary_push(des->obj_cache, arr); // Add again for ArrayCollection source array
-            return arr;
-        }
+    long i, members_len = header >> 3;
+    VALUE class_name = des3_read_string(des);
+    VALUE members = rb_ary_new2(members_len);
+    for(i = 0; i < members_len; i++) rb_ary_push(members, des3_read_string(des));
+
+    VALUE traits = rb_hash_new();
+    rb_hash_aset(traits, sym_externalizable, (header & 2) != 0 ? Qtrue : Qfalse);
+    rb_hash_aset(traits, sym_dynamic, (header & 4) != 0 ? Qtrue : Qfalse);
+    rb_hash_aset(traits, sym_members, members);
+    rb_hash_aset(traits, sym_class_name, class_name);
+    rb_ary_push(des->trait_cache, traits);
+    STATS_INC(deserializer.traits);
+    return traits;
+}
 
-        VALUE obj = rb_funcall(des->class_mapper, id_get_ruby_obj, 1, class_name);
+/*
+ * Creates and populates an object that isn't a reference, given its traits
+ */
+static VALUE des3_read_object_body(VALUE self, VALUE traits) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    long i;
+
+    VALUE externalizable = rb_hash_aref(traits, sym_externalizable);
+    VALUE dynamic = rb_hash_aref(traits, sym_dynamic);
+    VALUE members = rb_hash_aref(traits, sym_members);
+    long members_len = members == Qnil ? 0 : RARRAY_LEN(members);
+    VALUE class_name = rb_hash_aref(traits, sym_class_name);
+
+    // Plain data goes straight into a hash. Externalizable objects still need
+    // the class mapper, as only their class knows how to read them.
+    if(des->plain && externalizable != Qtrue) {
+        VALUE obj = rb_hash_new();
+        if(des->class_key != Qnil && RSTRING_LEN(class_name) > 0) rb_hash_aset(obj, des->class_key, class_name);
         rb_ary_push(des->obj_cache, obj);
-
-        if(externalizable == Qtrue) {
-            rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
-            rb_funcall(obj, rb_intern("read_external"), 1, self);
-            des->pos = NUM2LONG(rb_funcall(des->src, rb_intern("pos"), 0)); // Update from source
-            return obj;
-        }
-
-        VALUE props = rb_hash_new();
+        STATS_INC(deserializer.objects);
         for(i = 0; i < members_len; i++) {
-            rb_hash_aset(props, RARRAY_PTR(members)[i], des3_deserialize(self));
+            rb_hash_aset(obj, RARRAY_PTR(members)[i], des3_deserialize(self));
         }
-
-        VALUE dynamic_props = Qnil;
         if(dynamic == Qtrue) {
-            dynamic_props = rb_hash_new();
             while(1) {
                 VALUE key = des3_read_string(des);
                 if(RSTRING_LEN(key) == 0) break;
-                rb_hash_aset(dynamic_props, key, des3_deserialize(self));
+                rb_hash_aset(obj, key, des3_deserialize(self));
             }
         }
+        return obj;
+    }
 
-        rb_funcall(des->class_mapper, id_populate_ruby_obj, 3, obj, props, dynamic_props);
+    STATS_INC(deserializer.mapper_calls);
+    PROBE_MAPPER_CALL("get_ruby_obj", RSTRING_PTR(class_name));
+    VALUE obj = profile_funcall(des->prof, des->class_mapper, id_get_ruby_obj, 1, class_name);
+    rb_ary_push(des->obj_cache, obj);
+    STATS_INC(deserializer.objects);
 
+    if(externalizable == Qtrue) {
+        PROBE_READ_EXTERNAL_START(RSTRING_PTR(class_name), (long)des->pos);
+#ifdef AMF_DTRACE
+        long external_pos = des->pos;
+#endif
+        rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
+        rb_funcall(obj, rb_intern("read_external"), 1, self);
+        des->pos = NUM2LONG(rb_funcall(des->src, rb_intern("pos"), 0)); // Update from source
+        PROBE_READ_EXTERNAL_DONE(RSTRING_PTR(class_name), (long)des->pos - external_pos);
         return obj;
     }
+
+    VALUE props = rb_hash_new();
+    if(members_len > 0 && TYPE(obj) != T_HASH && des->mapper_setters) {
+        // Positional fast path for sealed members, with the setters worked
+        // out once per trait
+        VALUE setters = rb_hash_aref(traits, sym_setters);
+        if(setters == Qnil) {
+            setters = des3_sealed_setters(obj, members);
+            rb_hash_aset(traits, sym_setters, setters);
+        }
+        for(i = 0; i < members_len; i++) {
+            VALUE val = des3_deserialize(self);
+            VALUE setter = RARRAY_PTR(setters)[i];
+            if(SYMBOL_P(setter)) {
+                rb_funcall(obj, SYM2ID(setter), 1, val);
+            } else if(setter == Qtrue) {
+                rb_funcall(obj, id_hashset, 2, rb_str_intern(RARRAY_PTR(members)[i]), val);
+            }
+        }
+        if(dynamic != Qtrue) return obj;
+    } else {
+        for(i = 0; i < members_len; i++) {
+            rb_hash_aset(props, RARRAY_PTR(members)[i], des3_deserialize(self));
+        }
+    }
+
+    VALUE dynamic_props = Qnil;
+    if(dynamic == Qtrue) {
+        dynamic_props = rb_hash_new();
+        while(1) {
+            VALUE key = des3_read_string(des);
+            if(RSTRING_LEN(key) == 0) break;
+            rb_hash_aset(dynamic_props, key, des3_deserialize(self));
+        }
+    }
+
+    STATS_INC(deserializer.mapper_calls);
+    PROBE_MAPPER_CALL("populate_ruby_obj", rb_obj_classname(obj));
+    profile_funcall(des->prof, des->class_mapper, id_populate_ruby_obj, 3, obj, props, dynamic_props);
+
+    return obj;
+}
+
+static VALUE des3_read_object(VALUE self) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+    unsigned long start_pos = des->pos - 1; // Including the type marker
+
+    int header = des_read_int(des);
+    if((header & 1) == 0) {
+        header >>= 1;
+        if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        STATS_INC(deserializer.obj_refs);
+        return RARRAY_PTR(des->obj_cache)[header];
+    }
+
+    // Parse traits
+    VALUE traits = des3_read_traits(des, header >> 1);
+    VALUE class_name = rb_hash_aref(traits, sym_class_name);
+
+    // Optimization for deserializing ArrayCollection
+    if(strcmp(RSTRING_PTR(class_name), "flex.messaging.io.ArrayCollection") == 0) {
+        VALUE arr = des3_deserialize(self); // Adds ArrayCollection array to object cache automatically
+        rb_ary_push(des->obj_cache, arr); // Add again for ArrayCollection source array
+        return arr;
+    }
+
+    // Read the rest, attributing it to the object's classes when profiling
+    if(!des->prof) return des3_read_object_body(self, traits);
+    long frame = profile_enter(des->prof, start_pos);
+    VALUE obj = des3_read_object_body(self, traits);
+    profile_leave(des->prof, frame, rb_obj_class(obj), RSTRING_LEN(class_name) ? class_name : Qnil, des->pos);
+    return obj;
 }
 
 static VALUE des3_read_array(VALUE self) {
@@ -427,6 +587,7 @@ static VALUE des3_read_array(VALUE self) {
     if((header & 1) == 0) {
         header >>= 1;
         if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        STATS_INC(deserializer.obj_refs);
         return RARRAY_PTR(des->obj_cache)[header];
     } else {
         header >>= 1;
@@ -436,6 +597,7 @@ static VALUE des3_read_array(VALUE self) {
         if(RSTRING_LEN(key) != 0) {
             obj = rb_hash_new();
             rb_ary_push(des->obj_cache, obj);
+            STATS_INC(deserializer.objects);
             while(RSTRING_LEN(key) != 0) {
                 rb_hash_aset(obj, key, des3_deserialize(self));
                 key = des3_read_string(des);
@@ -449,6 +611,7 @@ static VALUE des3_read_array(VALUE self) {
             // crash the server
             obj = rb_ary_new2(header < MAX_ARRAY_PREALLOC ? header : MAX_ARRAY_PREALLOC);
             rb_ary_push(des->obj_cache, obj);
+            STATS_INC(deserializer.objects);
             for(i = 0; i < header; i++) {
                 rb_ary_push(obj, des3_deserialize(self));
             }
@@ -465,13 +628,20 @@ static VALUE des3_read_time(VALUE self) {
     if((header & 1) == 0) {
         header >>= 1;
         if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        STATS_INC(deserializer.obj_refs);
         return RARRAY_PTR(des->obj_cache)[header];
     } else {
         double milli = des_read_double(des);
-        time_t sec = milli/1000.0;
-        time_t micro = (milli-sec*1000)*1000;
-        VALUE time = rb_time_new(sec, micro);
+        VALUE time;
+        if(des->plain) {
+            time = rb_float_new(milli);
+        } else {
+            time_t sec = milli/1000.0;
+            time_t micro = (milli-sec*1000)*1000;
+            time = rb_time_new(sec, micro);
+        }
         rb_ary_push(des->obj_cache, time);
+        STATS_INC(deserializer.objects);
         return time;
     }
 }
@@ -484,6 +654,7 @@ static VALUE des3_read_byte_array(VALUE self) {
     if((header & 1) == 0) {
         header >>= 1;
         if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        STATS_INC(deserializer.obj_refs);
         return RARRAY_PTR(des->obj_cache)[header];
     } else {
         header >>= 1;
@@ -494,8 +665,9 @@ static VALUE des3_read_byte_array(VALUE self) {
         rb_enc_associate(args[0], ascii);
         ENC_CODERANGE_CLEAR(args[0]);
 #endif
-        VALUE ba = rb_class_new_instance(1, args, cStringIO);
+        VALUE ba = des->plain ? args[0] : rb_class_new_instance(1, args, cStringIO);
         rb_ary_push(des->obj_cache, ba);
+        STATS_INC(deserializer.objects);
         return ba;
     }
 }
@@ -508,12 +680,14 @@ static VALUE des3_read_dict(VALUE self) {
     if((header & 1) == 0) {
         header >>= 1;
         if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        STATS_INC(deserializer.obj_refs);
         return RARRAY_PTR(des->obj_cache)[header];
     } else {
         header >>= 1;
 
         VALUE dict = rb_hash_new();
         rb_ary_push(des->obj_cache, dict);
+        STATS_INC(deserializer.objects);
 
         des_read_byte(des); // Weak Keys: Not supported in ruby
 
@@ -536,6 +710,7 @@ static VALUE des3_read_vec(VALUE self, char type) {
     if((header & 1) == 0) {
         header >>= 1;
         if(header >= RARRAY_LEN(des->obj_cache)) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        STATS_INC(deserializer.obj_refs);
         return RARRAY_PTR(des->obj_cache)[header];
     } else {
         header >>= 1;
@@ -545,6 +720,7 @@ static VALUE des3_read_vec(VALUE self, char type) {
         // crash the server
         VALUE vec = rb_ary_new2(header < MAX_ARRAY_PREALLOC ? header : MAX_ARRAY_PREALLOC);
         rb_ary_push(des->obj_cache, vec);
+        STATS_INC(deserializer.objects);
 
         des_read_byte(des); // Fixed Length: Not supported in ruby
 
@@ -652,13 +828,18 @@ static void des_mark(AMF_DESERIALIZER *des) {
     if(des->obj_cache) rb_gc_mark(des->obj_cache);
     if(des->str_cache) rb_gc_mark(des->str_cache);
     if(des->trait_cache) rb_gc_mark(des->trait_cache);
+    rb_gc_mark(des->profile);
+    rb_gc_mark(des->class_key);
+    profile_mark(des->prof);
 }
 
 /*
- * Free the reader. Don't need to free anything but the struct because we didn't
- * alloc anything - source is from the ruby source object.
+ * Free the reader. Don't need to free anything but the struct and profile
+ * tallies because we didn't alloc anything - source is from the ruby source
+ * object.
  */
 static void des_free(AMF_DESERIALIZER *des) {
+    profile_free(des->prof);
     xfree(des);
 }
 
@@ -672,12 +853,48 @@ static VALUE des_alloc(VALUE klass) {
 }
 
 /*
- * Initializer
+ * call-seq:
+ *   RocketAMF::Ext::Deserializer.new(class_mapper)
+ *   RocketAMF::Ext::Deserializer.new(class_mapper, options)
+ *
+ * Creates a deserializer using the given class mapper. Supported options:
+ *
+ * [:profile] A RocketAMF::Profile to add the cost of each object read to, by
+ *            class, at the end of every <tt>deserialize</tt> and
+ *            <tt>each_element</tt>.
+ * [:plain] Decode to core types only, without calling the class mapper.
+ *          Objects become hashes with string keys, dates become epoch
+ *          milliseconds as a float and byte arrays become binary strings.
+ *          Externalizable objects are still read by their mapped class.
+ * [:class_key] With <tt>:plain</tt>, store the AS class name of typed objects
+ *              in their hash under this key.
  */
-static VALUE des_initialize(VALUE self, VALUE class_mapper) {
+static VALUE des_initialize(int argc, VALUE *argv, VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    VALUE class_mapper, options;
+    rb_scan_args(argc, argv, "11", &class_mapper, &options);
     des->class_mapper = class_mapper;
+    des->mapper_setters = mapping_native(class_mapper, id_populate_ruby_obj);
+    des->profile = Qnil;
+    profile_free(des->prof);
+    des->prof = NULL;
+    des->plain = 0;
+    des->class_key = Qnil;
+
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+        VALUE opt;
+        if((opt = rb_hash_aref(options, sym_profile)) != Qnil) {
+            des->profile = opt;
+            des->prof = profile_new();
+        }
+        des->plain = RTEST(rb_hash_aref(options, sym_plain));
+        if((opt = rb_hash_aref(options, sym_class_key)) != Qnil) {
+            des->class_key = rb_obj_freeze(rb_obj_dup(rb_obj_as_string(opt)));
+        }
+    }
     return self;
 }
 
@@ -717,6 +934,11 @@ VALUE des_deserialize(VALUE self, VALUE ver, VALUE src) {
     }
 
     // Deserialize from source
+    STATS_TIMER timer;
+    stats_start(&timer);
+    unsigned long start_pos = des->pos;
+    if(des->prof) des->prof->depth = 0;
+    PROBE_DESERIALIZE_START(des->version, (long)(des->size - des->pos));
     VALUE ret;
     if(des->version == 0) {
         des->obj_cache = rb_ary_new();
@@ -727,6 +949,10 @@ VALUE des_deserialize(VALUE self, VALUE ver, VALUE src) {
         des->trait_cache = rb_ary_new();
         ret = des3_deserialize(self);
     }
+    STATS_ADD(deserializer.bytes, des->pos - start_pos);
+    stats_stop(&timer, STATS_DESERIALIZE);
+    PROBE_DESERIALIZE_DONE(des->version, (long)(des->pos - start_pos));
+    if(des->prof) profile_flush(des->prof, des->profile, sym_deserialize);
 
     // Update source position
     rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
@@ -734,6 +960,131 @@ VALUE des_deserialize(VALUE self, VALUE ver, VALUE src) {
     return ret;
 }
 
+/*
+ * Reads the header of the outermost AMF3 array, unwrapping an ArrayCollection,
+ * and returns the number of elements that follow
+ */
+static long des3_read_outer_array(VALUE self) {
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    int collection = 0;
+    int header;
+    char type = des_read_byte(des);
+    if(type == AMF3_OBJECT_MARKER) {
+        header = des_read_int(des);
+        if((header & 1) == 0) rb_raise(rb_eRangeError, "obj reference index beyond end");
+        VALUE class_name = rb_hash_aref(des3_read_traits(des, header >> 1), sym_class_name);
+        if(strcmp(RSTRING_PTR(class_name), ARRAY_COLLECTION_CLASS) != 0) rb_raise(rb_eTypeError, "can only iterate over an array or ArrayCollection");
+        type = des_read_byte(des);
+        collection = 1;
+    }
+    if(type != AMF3_ARRAY_MARKER) rb_raise(rb_eTypeError, "can only iterate over an array or ArrayCollection");
+
+    header = des_read_int(des);
+    if((header & 1) == 0) rb_raise(rb_eRangeError, "obj reference index beyond end");
+    if(RSTRING_LEN(des3_read_string(des)) != 0) rb_raise(rb_eTypeError, "can't iterate over an associative array");
+
+    // The elements aren't kept, so an empty array stands in for references to
+    // the array (and the ArrayCollection's copy of it)
+    VALUE placeholder = rb_ary_new();
+    rb_ary_push(des->obj_cache, placeholder);
+    if(collection) rb_ary_push(des->obj_cache, placeholder);
+    STATS_INC(deserializer.objects);
+    return header >> 1;
+}
+
+typedef struct {
+    VALUE self;
+    AMF_DESERIALIZER *des;
+    unsigned long start_pos;
+    STATS_TIMER timer;
+} EACH_ELEMENT_STATE;
+
+static VALUE des_each_element_body(VALUE arg) {
+    EACH_ELEMENT_STATE *state = (EACH_ELEMENT_STATE *)arg;
+    AMF_DESERIALIZER *des = state->des;
+    long i, len;
+
+    des->obj_cache = rb_ary_new();
+    int amf3 = des->version == 3;
+    if(!amf3) {
+        char type = des_read_byte(des);
+        if(type == AMF0_AMF3_MARKER) {
+            amf3 = 1;
+        } else if(type != AMF0_STRICT_ARRAY_MARKER) {
+            rb_raise(rb_eTypeError, "can only iterate over an array or ArrayCollection");
+        }
+    }
+
+    if(amf3) {
+        des->version = 3;
+        des->str_cache = rb_ary_new();
+        des->trait_cache = rb_ary_new();
+        len = des3_read_outer_array(state->self);
+    } else {
+        len = des_read_uint32(des);
+        rb_ary_push(des->obj_cache, rb_ary_new()); // Stand-in for references to the array
+        STATS_INC(deserializer.objects);
+    }
+
+    for(i = 0; i < len; i++) {
+        rb_yield(amf3 ? des3_deserialize(state->self) : des0_deserialize(state->self, des_read_byte(des)));
+    }
+    return state->self;
+}
+
+static VALUE des_each_element_done(VALUE arg) {
+    EACH_ELEMENT_STATE *state = (EACH_ELEMENT_STATE *)arg;
+    AMF_DESERIALIZER *des = state->des;
+    STATS_ADD(deserializer.bytes, des->pos - state->start_pos);
+    stats_stop(&state->timer, STATS_DESERIALIZE);
+    PROBE_DESERIALIZE_DONE(des->version, (long)(des->pos - state->start_pos));
+    if(des->prof) profile_flush(des->prof, des->profile, sym_deserialize);
+    rb_funcall(des->src, rb_intern("pos="), 1, LONG2NUM(des->pos)); // Update source StringIO pos
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   des.each_element(amf_ver, str) {|obj| ... } => des
+ *   des.each_element(amf_ver, StringIO) {|obj| ... } => des
+ *
+ * Deserializes the source, which must be an array or ArrayCollection, one
+ * element at a time. Each element is yielded as soon as it's read rather than
+ * being collected into an array first. Elements that are objects stay in the
+ * reference table until the end, as later elements can refer back to them.
+ * Returns an enumerator if no block is given.
+ */
+static VALUE des_each_element(VALUE self, VALUE ver, VALUE src) {
+    VALUE args[2] = {ver, src};
+    RETURN_ENUMERATOR(self, 2, args);
+
+    AMF_DESERIALIZER *des;
+    Data_Get_Struct(self, AMF_DESERIALIZER, des);
+
+    // Process version
+    int int_ver = FIX2INT(ver);
+    if(int_ver != 0 && int_ver != 3) rb_raise(rb_eArgError, "unsupported version %d", int_ver);
+    des->version = int_ver;
+
+    // Process source
+    if(src != Qnil) {
+        des_set_src(des, src);
+    } else if(!des->src) {
+        rb_raise(rb_eArgError, "Missing deserialization source");
+    }
+
+    EACH_ELEMENT_STATE state;
+    state.self = self;
+    state.des = des;
+    state.start_pos = des->pos;
+    stats_start(&state.timer);
+    if(des->prof) des->prof->depth = 0;
+    PROBE_DESERIALIZE_START(des->version, (long)(des->size - des->pos));
+    return rb_ensure(des_each_element_body, (VALUE)&state, des_each_element_done, (VALUE)&state);
+}
+
 /*
  * call-seq:
  *   des.read_object => obj
@@ -765,12 +1116,17 @@ void Init_rocket_amf_deserializer() {
     // Define Deserializer
     cDeserializer = rb_define_class_under(mRocketAMFExt, "Deserializer", rb_cObject);
     rb_define_alloc_func(cDeserializer, des_alloc);
-    rb_define_method(cDeserializer, "initialize", des_initialize, 1);
+    rb_define_method(cDeserializer, "initialize", des_initialize, -1);
     rb_define_method(cDeserializer, "source", des_source, 0);
     rb_define_method(cDeserializer, "deserialize", des_deserialize, 2);
+    rb_define_method(cDeserializer, "each_element", des_each_element, 2);
     rb_define_method(cDeserializer, "read_object", des_read_object, 0);
 
     // Get refs to commonly used symbols and ids
     id_get_ruby_obj = rb_intern("get_ruby_obj");
     id_populate_ruby_obj = rb_intern("populate_ruby_obj");
+    sym_setters = ID2SYM(rb_intern("setters"));
+    sym_deserialize = ID2SYM(rb_intern("deserialize"));
+    sym_plain = ID2SYM(rb_intern("plain"));
+    sym_class_key = ID2SYM(rb_intern("class_key"));
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <ruby.h>
+#include "profile.h"
 #ifdef HAVE_RB_STR_ENCODE
 #include <ruby/encoding.h>
 #endif
@@ -13,6 +14,11 @@ typedef struct {
     VALUE obj_cache;
     VALUE str_cache;
     VALUE trait_cache;
+    int mapper_setters; // Class mapper's populate_ruby_obj is the native one
+    VALUE profile;
+    AMF_PROFILE *prof; // Tallies for profile, or NULL
+    int plain; // Decode to core types without the class mapper
+    VALUE class_key; // Hash key for AS class names when plain, or Qnil
 } AMF_DESERIALIZER;
 
 char des_read_byte(AMF_DESERIALIZER *des);
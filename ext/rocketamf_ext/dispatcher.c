@@ -0,0 +1,352 @@
+#include <ruby.h>
+
+extern VALUE mRocketAMF;
+extern VALUE mRocketAMFExt;
+VALUE cDispatcher;
+static VALUE cMessage;
+static VALUE cAbstractMessage;
+static VALUE cCommandMessage;
+static VALUE cRemotingMessage;
+static VALUE cAcknowledgeMessage;
+static VALUE cAcknowledgeMessageExt;
+static VALUE mSmallMessage;
+static VALUE cErrorMessage;
+static ID id_call;
+static ID id_message;
+static ID id_backtrace;
+static ID id_ivar_amf_version;
+static ID id_ivar_messages;
+static ID id_ivar_constructed;
+static ID id_ivar_target_uri;
+static ID id_ivar_response_uri;
+static ID id_ivar_data;
+static ID id_ivar_operation;
+static ID id_ivar_source;
+static ID id_ivar_body;
+static ID id_ivar_client_id;
+static ID id_ivar_destination;
+static ID id_ivar_message_id;
+static ID id_ivar_timestamp;
+static ID id_ivar_time_to_live;
+static ID id_ivar_headers;
+static ID id_ivar_correlation_id;
+static ID id_ivar_fault_code;
+static ID id_ivar_fault_detail;
+static ID id_ivar_fault_string;
+static ID id_ivar_e;
+
+#define CLIENT_PING_OPERATION 5
+
+typedef struct {
+    VALUE routes;
+    VALUE fallback;
+} AMF_DISPATCHER;
+
+/*
+ * The message classes live in the pure Ruby part of the library, so they're
+ * looked up the first time they're needed
+ */
+static void disp_load_classes(void) {
+    if(cMessage) return;
+    VALUE mValues = rb_const_get(mRocketAMF, rb_intern("Values"));
+    cMessage = rb_const_get(mRocketAMF, rb_intern("Message"));
+    cAbstractMessage = rb_const_get(mValues, rb_intern("AbstractMessage"));
+    cCommandMessage = rb_const_get(mValues, rb_intern("CommandMessage"));
+    cRemotingMessage = rb_const_get(mValues, rb_intern("RemotingMessage"));
+    cAcknowledgeMessage = rb_const_get(mValues, rb_intern("AcknowledgeMessage"));
+    cAcknowledgeMessageExt = rb_const_get(mValues, rb_intern("AcknowledgeMessageExt"));
+    mSmallMessage = rb_const_get(mValues, rb_intern("SmallMessage"));
+    cErrorMessage = rb_const_get(mValues, rb_intern("ErrorMessage"));
+    rb_gc_register_address(&cMessage);
+    rb_gc_register_address(&cAbstractMessage);
+    rb_gc_register_address(&cCommandMessage);
+    rb_gc_register_address(&cRemotingMessage);
+    rb_gc_register_address(&cAcknowledgeMessage);
+    rb_gc_register_address(&cAcknowledgeMessageExt);
+    rb_gc_register_address(&mSmallMessage);
+    rb_gc_register_address(&cErrorMessage);
+}
+
+/*
+ * Returns a random UUID-formatted string of 32 random hex digits, with no
+ * version or variant bits set, like AbstractMessage#rand_uuid but without
+ * going through sprintf
+ */
+static VALUE disp_uuid(void) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned int words[4];
+    char buf[36];
+    int i, j = 0;
+    for(i = 0; i < 4; i++) words[i] = rb_genrand_int32();
+    for(i = 0; i < 32; i++) {
+        if(i == 8 || i == 12 || i == 16 || i == 20) buf[j++] = '-';
+        buf[j++] = hex[(words[i >> 3] >> ((7 - (i & 7)) << 2)) & 0xF];
+    }
+    return rb_str_new(buf, 36);
+}
+
+/*
+ * Sets up the fields AcknowledgeMessage#initialize would on a freshly
+ * allocated acknowledge or error message
+ */
+static VALUE disp_init_ack(VALUE klass, VALUE source) {
+    VALUE ack = rb_obj_alloc(klass);
+    rb_ivar_set(ack, id_ivar_client_id, disp_uuid());
+    rb_ivar_set(ack, id_ivar_destination, Qnil);
+    rb_ivar_set(ack, id_ivar_message_id, disp_uuid());
+    rb_ivar_set(ack, id_ivar_timestamp, LONG2NUM((long)time(NULL) * 100));
+    rb_ivar_set(ack, id_ivar_time_to_live, INT2FIX(0));
+    rb_ivar_set(ack, id_ivar_headers, rb_hash_new());
+    rb_ivar_set(ack, id_ivar_body, Qnil);
+    if(rb_obj_is_kind_of(source, cAbstractMessage) == Qtrue) {
+        rb_ivar_set(ack, id_ivar_correlation_id, rb_ivar_get(source, id_ivar_message_id));
+    }
+    return ack;
+}
+
+/*
+ * Builds the ErrorMessage for an exception raised while handling the source
+ * message
+ */
+static VALUE disp_error(VALUE source, VALUE exception) {
+    VALUE err = disp_init_ack(cErrorMessage, source);
+    VALUE backtrace = rb_funcall(exception, id_backtrace, 0);
+    rb_ivar_set(err, id_ivar_e, exception);
+    rb_ivar_set(err, id_ivar_fault_code, rb_class_name(CLASS_OF(exception)));
+    rb_ivar_set(err, id_ivar_fault_detail, NIL_P(backtrace) ? rb_str_new(NULL, 0) : rb_ary_join(backtrace, rb_str_new2("\n")));
+    rb_ivar_set(err, id_ivar_fault_string, rb_funcall(exception, id_message, 0));
+    return err;
+}
+
+static VALUE disp_call_handler(VALUE args) {
+    VALUE *argv = (VALUE *)args;
+    AMF_DISPATCHER *disp;
+    Data_Get_Struct(argv[0], AMF_DISPATCHER, disp);
+
+    VALUE handler = rb_hash_lookup2(disp->routes, argv[1], Qundef);
+    if(handler != Qundef) return rb_funcall(handler, id_call, 1, argv[2]);
+    if(disp->fallback != Qnil) return rb_funcall(disp->fallback, id_call, 2, argv[1], argv[2]);
+    rb_raise(rb_eNoMethodError, "no route for %s", StringValueCStr(argv[1]));
+    return Qnil;
+}
+
+static VALUE disp_handler_failed(VALUE args, VALUE exception) {
+    return disp_error(((VALUE *)args)[3], exception);
+}
+
+/*
+ * Calls the handler for the method, returning an ErrorMessage built from the
+ * source message if it raises
+ */
+static VALUE disp_call(VALUE self, VALUE method, VALUE call_args, VALUE source) {
+    VALUE args[4] = {self, method, call_args, source};
+    return rb_rescue2(disp_call_handler, (VALUE)args, disp_handler_failed, (VALUE)args, rb_eException, (VALUE)0);
+}
+
+/*
+ * Builds "source.operation", or just the operation if there's no source
+ */
+static VALUE disp_remoting_method(VALUE msg) {
+    VALUE source = rb_ivar_get(msg, id_ivar_source);
+    VALUE operation = rb_obj_as_string(rb_ivar_get(msg, id_ivar_operation));
+    if(NIL_P(source)) return operation;
+    source = rb_obj_as_string(source);
+    if(RSTRING_LEN(source) == 0) return operation;
+
+    VALUE method = rb_str_buf_new(RSTRING_LEN(source) + 1 + RSTRING_LEN(operation));
+    rb_str_buf_cat(method, RSTRING_PTR(source), RSTRING_LEN(source));
+    rb_str_buf_cat(method, ".", 1);
+    rb_str_buf_cat(method, RSTRING_PTR(operation), RSTRING_LEN(operation));
+    return method;
+}
+
+static VALUE disp_response_message(VALUE response_uri, VALUE value) {
+    const char *suffix = rb_obj_is_kind_of(value, cErrorMessage) == Qtrue ? "/onStatus" : "/onResult";
+    response_uri = rb_obj_as_string(response_uri);
+    VALUE target_uri = rb_str_buf_new(RSTRING_LEN(response_uri) + 9);
+    rb_str_buf_cat(target_uri, RSTRING_PTR(response_uri), RSTRING_LEN(response_uri));
+    rb_str_buf_cat(target_uri, suffix, 9);
+
+    VALUE msg = rb_obj_alloc(cMessage);
+    rb_ivar_set(msg, id_ivar_target_uri, target_uri);
+    rb_ivar_set(msg, id_ivar_response_uri, rb_str_new(NULL, 0));
+    rb_ivar_set(msg, id_ivar_data, value);
+    return msg;
+}
+
+static void disp_mark(AMF_DISPATCHER *disp) {
+    if(!disp) return;
+    rb_gc_mark(disp->routes);
+    rb_gc_mark(disp->fallback);
+}
+
+static void disp_free(AMF_DISPATCHER *disp) {
+    xfree(disp);
+}
+
+static VALUE disp_alloc(VALUE klass) {
+    AMF_DISPATCHER *disp = ALLOC(AMF_DISPATCHER);
+    disp->routes = Qnil;
+    disp->fallback = Qnil;
+    return Data_Wrap_Struct(klass, disp_mark, disp_free, disp);
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext::Dispatcher.new
+ *   RocketAMF::Ext::Dispatcher.new(routes)
+ *   RocketAMF::Ext::Dispatcher.new(routes) {|method, args| ... }
+ *
+ * Creates a dispatcher that answers the method calls in a request envelope.
+ * <tt>routes</tt> maps method names to objects that respond to <tt>call</tt>,
+ * which are called with the arguments array. Method names are the target URI
+ * for simple calls and "source.operation" for flex RemoteObject calls. Calls
+ * without a route go to the block, which is called with the method name and
+ * arguments just like the block given to <tt>Envelope#each_method_call</tt>.
+ *
+ * Example:
+ *
+ *   dispatcher = RocketAMF::Ext::Dispatcher.new('UserService.find' => lambda {|args| User.find(args[0])})
+ *   response = dispatcher.dispatch(request)
+ */
+static VALUE disp_initialize(int argc, VALUE *argv, VALUE self) {
+    AMF_DISPATCHER *disp;
+    Data_Get_Struct(self, AMF_DISPATCHER, disp);
+
+    VALUE routes, fallback;
+    rb_scan_args(argc, argv, "01&", &routes, &fallback);
+    disp->routes = rb_hash_new();
+    if(!NIL_P(routes)) rb_funcall(disp->routes, rb_intern("update"), 1, routes);
+    disp->fallback = fallback;
+    return self;
+}
+
+/*
+ * call-seq:
+ *   dispatcher.route(method, handler) => dispatcher
+ *   dispatcher.route(method) {|args| ... } => dispatcher
+ *
+ * Routes calls to the given method name to the handler or block
+ */
+static VALUE disp_route(int argc, VALUE *argv, VALUE self) {
+    AMF_DISPATCHER *disp;
+    Data_Get_Struct(self, AMF_DISPATCHER, disp);
+
+    VALUE method, handler, block;
+    rb_scan_args(argc, argv, "11&", &method, &handler, &block);
+    if(NIL_P(handler)) handler = block;
+    if(NIL_P(handler)) rb_raise(rb_eArgError, "missing handler for %s", StringValueCStr(method));
+    rb_hash_aset(disp->routes, rb_obj_as_string(method), handler);
+    return self;
+}
+
+/*
+ * call-seq:
+ *   dispatcher.dispatch(request) => response
+ *   dispatcher.dispatch(request, response) => response
+ *
+ * Builds the response envelope for the request, in the same way as
+ * <tt>Envelope#each_method_call</tt>. Pings are acknowledged without calling
+ * any handler and other command messages are answered with an error. Handler
+ * return values are wrapped in an AcknowledgeMessage for flex calls, and
+ * exceptions are turned into ErrorMessages. Acknowledgements use the compact
+ * AcknowledgeMessageExt form if the client sent any small messages.
+ */
+static VALUE disp_dispatch(int argc, VALUE *argv, VALUE self) {
+    static VALUE cEnvelope = 0;
+    disp_load_classes();
+    if(cEnvelope == 0) cEnvelope = rb_const_get(mRocketAMF, rb_intern("Envelope"));
+
+    VALUE request, response;
+    rb_scan_args(argc, argv, "11", &request, &response);
+    if(NIL_P(response)) response = rb_class_new_instance(0, NULL, cEnvelope);
+    if(RTEST(rb_ivar_get(response, id_ivar_constructed))) rb_raise(rb_eRuntimeError, "Response already constructed");
+
+    // Can't just copy version because FMS sends version as 1
+    VALUE version = rb_ivar_get(request, id_ivar_amf_version);
+    rb_ivar_set(response, id_ivar_amf_version, INT2FIX(version == INT2FIX(3) ? 3 : 0));
+
+    VALUE messages = rb_ivar_get(request, id_ivar_messages);
+    VALUE responses = rb_ivar_get(response, id_ivar_messages);
+    if(NIL_P(responses)) {
+        responses = rb_ary_new();
+        rb_ivar_set(response, id_ivar_messages, responses);
+    }
+
+    // Answer in the small form if the client used it
+    long i;
+    VALUE ack_class = cAcknowledgeMessage;
+    for(i = 0; i < RARRAY_LEN(messages); i++) {
+        if(rb_obj_is_kind_of(rb_ivar_get(RARRAY_PTR(messages)[i], id_ivar_data), mSmallMessage) == Qtrue) {
+            ack_class = cAcknowledgeMessageExt;
+            break;
+        }
+    }
+
+    for(i = 0; i < RARRAY_LEN(messages); i++) {
+        VALUE m = RARRAY_PTR(messages)[i];
+        VALUE data = rb_ivar_get(m, id_ivar_data);
+        VALUE value;
+
+        if(rb_obj_is_kind_of(data, cCommandMessage) == Qtrue) {
+            VALUE operation = rb_ivar_get(data, id_ivar_operation);
+            if(operation == INT2FIX(CLIENT_PING_OPERATION)) {
+                value = disp_init_ack(ack_class, data);
+            } else {
+                VALUE desc = rb_str_new2("CommandMessage ");
+                rb_str_append(desc, rb_obj_as_string(operation));
+                rb_str_cat2(desc, " not implemented");
+                VALUE e = rb_exc_new3(rb_eException, desc);
+                rb_funcall(e, rb_intern("set_backtrace"), 1, rb_ary_new3(1, rb_str_new2("RocketAMF::Ext::Dispatcher dispatch")));
+                value = disp_error(data, e);
+            }
+        } else if(rb_obj_is_kind_of(data, cRemotingMessage) == Qtrue) {
+            value = disp_call(self, disp_remoting_method(data), rb_ivar_get(data, id_ivar_body), data);
+            if(rb_obj_is_kind_of(value, cErrorMessage) != Qtrue) {
+                VALUE ack = disp_init_ack(ack_class, data);
+                rb_ivar_set(ack, id_ivar_body, value);
+                value = ack;
+            }
+        } else {
+            value = disp_call(self, rb_obj_as_string(rb_ivar_get(m, id_ivar_target_uri)), data, m);
+        }
+
+        rb_ary_push(responses, disp_response_message(rb_ivar_get(m, id_ivar_response_uri), value));
+    }
+
+    rb_ivar_set(response, id_ivar_constructed, Qtrue);
+    return response;
+}
+
+void Init_rocket_amf_dispatcher() {
+    cDispatcher = rb_define_class_under(mRocketAMFExt, "Dispatcher", rb_cObject);
+    rb_define_alloc_func(cDispatcher, disp_alloc);
+    rb_define_method(cDispatcher, "initialize", disp_initialize, -1);
+    rb_define_method(cDispatcher, "route", disp_route, -1);
+    rb_define_method(cDispatcher, "dispatch", disp_dispatch, -1);
+
+    // Get refs to commonly used symbols and ids
+    id_call = rb_intern("call");
+    id_message = rb_intern("message");
+    id_backtrace = rb_intern("backtrace");
+    id_ivar_amf_version = rb_intern("@amf_version");
+    id_ivar_messages = rb_intern("@messages");
+    id_ivar_constructed = rb_intern("@constructed");
+    id_ivar_target_uri = rb_intern("@target_uri");
+    id_ivar_response_uri = rb_intern("@response_uri");
+    id_ivar_data = rb_intern("@data");
+    id_ivar_operation = rb_intern("@operation");
+    id_ivar_source = rb_intern("@source");
+    id_ivar_body = rb_intern("@body");
+    id_ivar_client_id = rb_intern("@clientId");
+    id_ivar_destination = rb_intern("@destination");
+    id_ivar_message_id = rb_intern("@messageId");
+    id_ivar_timestamp = rb_intern("@timestamp");
+    id_ivar_time_to_live = rb_intern("@timeToLive");
+    id_ivar_headers = rb_intern("@headers");
+    id_ivar_correlation_id = rb_intern("@correlationId");
+    id_ivar_fault_code = rb_intern("@faultCode");
+    id_ivar_fault_detail = rb_intern("@faultDetail");
+    id_ivar_fault_string = rb_intern("@faultString");
+    id_ivar_e = rb_intern("@e");
+}
@@ -11,7 +11,17 @@ end
 if enable_config("sort-props", false)
   $defs.push("-DSORT_PROPS") unless $defs.include? "-DSORT_PROPS"
 end
+if enable_config("dtrace", false)
+  if have_header("sys/sdt.h")
+    $defs.push("-DAMF_DTRACE") unless $defs.include? "-DAMF_DTRACE"
+  else
+    message "sys/sdt.h not found, building without tracepoints\n"
+  end
+end
 have_func('rb_str_encode')
+have_func('rb_sym2str')
+have_func('rb_gc_stat')
+have_func('rb_gc_count')
 
 $CFLAGS += " -Wall"
 
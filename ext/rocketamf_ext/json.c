@@ -0,0 +1,324 @@
+#include "serializer.h"
+#include "deserializer.h"
+#include "constants.h"
+#include "transcoder.h"
+#include "utf8.h"
+#include <math.h>
+#include <time.h>
+
+static VALUE sym_refs;
+static VALUE sym_inline;
+static VALUE sym_ref;
+static VALUE sym_dates;
+static VALUE sym_ms;
+static VALUE sym_iso8601;
+static VALUE sym_byte_arrays;
+static VALUE sym_base64;
+static VALUE sym_array;
+static VALUE sym_class_key;
+
+static const char hex_chars[] = "0123456789abcdef";
+static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define JSON_CAT(tc, str) rb_str_buf_cat(tc->ser.stream, str, sizeof(str) - 1)
+
+/*
+ * Writes the separator needed before a value. Values in objects always follow
+ * their key, which has already written it.
+ */
+static void json_sep(TRANSCODER *tc) {
+    if(tc->after_key) {
+        tc->after_key = 0;
+    } else if(tc->depth > 0) {
+        if(tc->levels[tc->depth - 1].count++ > 0) ser_write_byte(&tc->ser, ',');
+    }
+}
+
+static void json_push(TRANSCODER *tc, long idx) {
+    if(tc->depth == tc->level_capa) {
+        tc->level_capa = tc->level_capa ? tc->level_capa * 2 : 16;
+        REALLOC_N(tc->levels, TC_JSON_LEVEL, tc->level_capa);
+    }
+    tc->levels[tc->depth].count = 0;
+    tc->levels[tc->depth].idx = idx;
+    tc->depth++;
+}
+
+static void json_pop(TRANSCODER *tc) {
+    tc->depth--;
+    if(tc->json_refs == JSON_REFS_INLINE) {
+        tc->spans[tc->levels[tc->depth].idx * 2 + 1] = RSTRING_LEN(tc->ser.stream);
+    }
+}
+
+/*
+ * Writes a quoted string. Strings that aren't valid UTF-8 have their high bytes
+ * escaped individually, as if they were Latin-1, so the output stays valid.
+ */
+static void json_write_string(TRANSCODER *tc, const char *ptr, long len) {
+    VALUE stream = tc->ser.stream;
+    int broken = utf8_scan(ptr, len) == UTF8_BROKEN;
+    long i, run = 0;
+    char esc[6] = {'\\', 'u', '0', '0', 0, 0};
+
+    ser_write_byte(&tc->ser, '"');
+    for(i = 0; i < len; i++) {
+        unsigned char c = ptr[i];
+        if(c >= 0x20 && c != '"' && c != '\\' && (c < 0x80 || !broken)) continue;
+
+        // Flush the run of plain characters before this one
+        rb_str_buf_cat(stream, ptr + run, i - run);
+        run = i + 1;
+        switch(c) {
+            case '"':  JSON_CAT(tc, "\\\""); break;
+            case '\\': JSON_CAT(tc, "\\\\"); break;
+            case '\n': JSON_CAT(tc, "\\n"); break;
+            case '\r': JSON_CAT(tc, "\\r"); break;
+            case '\t': JSON_CAT(tc, "\\t"); break;
+            default:
+                esc[4] = hex_chars[c >> 4];
+                esc[5] = hex_chars[c & 0x0f];
+                rb_str_buf_cat(stream, esc, sizeof(esc));
+        }
+    }
+    rb_str_buf_cat(stream, ptr + run, len - run);
+    ser_write_byte(&tc->ser, '"');
+}
+
+void json_w_null(TRANSCODER *tc) {
+    json_sep(tc);
+    JSON_CAT(tc, "null");
+}
+
+void json_w_bool(TRANSCODER *tc, int val) {
+    json_sep(tc);
+    if(val) {
+        JSON_CAT(tc, "true");
+    } else {
+        JSON_CAT(tc, "false");
+    }
+}
+
+/*
+ * Writes the shortest of the usual precisions that reads back the same.
+ * JSON has no NaN or Infinity, so those become null.
+ */
+void json_w_number(TRANSCODER *tc, double num) {
+    char buf[32];
+    int len;
+
+    json_sep(tc);
+    if(isnan(num) || isinf(num)) {
+        JSON_CAT(tc, "null");
+        return;
+    }
+    len = snprintf(buf, sizeof(buf), "%.15g", num);
+    if(strtod(buf, NULL) != num) len = snprintf(buf, sizeof(buf), "%.17g", num);
+    rb_str_buf_cat(tc->ser.stream, buf, len);
+}
+
+void json_w_int(TRANSCODER *tc, long num) {
+    char buf[24];
+    int len = snprintf(buf, sizeof(buf), "%ld", num);
+    json_sep(tc);
+    rb_str_buf_cat(tc->ser.stream, buf, len);
+}
+
+void json_w_string(TRANSCODER *tc, const char *ptr, long len) {
+    json_sep(tc);
+    json_write_string(tc, ptr, len);
+}
+
+void json_w_date(TRANSCODER *tc, double ms) {
+    if(tc->json_dates == JSON_DATES_MS || isnan(ms) || isinf(ms)) {
+        json_w_number(tc, ms);
+        return;
+    }
+
+    double secs = floor(ms / 1000);
+    time_t time = (time_t)secs;
+    struct tm tm;
+#ifdef HAVE_GMTIME_R
+    gmtime_r(&time, &tm);
+#else
+    tm = *gmtime(&time);
+#endif
+
+    char buf[40];
+    int len = snprintf(buf, sizeof(buf), "\"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\"",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        (int)(ms - secs * 1000));
+    json_sep(tc);
+    rb_str_buf_cat(tc->ser.stream, buf, len);
+}
+
+void json_w_byte_array(TRANSCODER *tc, const char *ptr, long len) {
+    const unsigned char *bytes = (const unsigned char*)ptr;
+    long i;
+
+    json_sep(tc);
+    if(tc->json_bytes == JSON_BYTES_ARRAY) {
+        char buf[4];
+        ser_write_byte(&tc->ser, '[');
+        for(i = 0; i < len; i++) {
+            int buf_len = snprintf(buf, sizeof(buf), "%d", bytes[i]);
+            if(i > 0) ser_write_byte(&tc->ser, ',');
+            rb_str_buf_cat(tc->ser.stream, buf, buf_len);
+        }
+        ser_write_byte(&tc->ser, ']');
+        return;
+    }
+
+    // Encode straight into the stream
+    VALUE stream = tc->ser.stream;
+    long start = RSTRING_LEN(stream);
+    rb_str_resize(stream, start + 2 + (len + 2) / 3 * 4);
+    char *out = RSTRING_PTR(stream) + start;
+    *out++ = '"';
+    for(i = 0; i + 2 < len; i += 3) {
+        *out++ = base64_chars[bytes[i] >> 2];
+        *out++ = base64_chars[(bytes[i] & 0x03) << 4 | bytes[i + 1] >> 4];
+        *out++ = base64_chars[(bytes[i + 1] & 0x0f) << 2 | bytes[i + 2] >> 6];
+        *out++ = base64_chars[bytes[i + 2] & 0x3f];
+    }
+    if(i < len) {
+        *out++ = base64_chars[bytes[i] >> 2];
+        if(i + 1 < len) {
+            *out++ = base64_chars[(bytes[i] & 0x03) << 4 | bytes[i + 1] >> 4];
+            *out++ = base64_chars[(bytes[i + 1] & 0x0f) << 2];
+        } else {
+            *out++ = base64_chars[(bytes[i] & 0x03) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    *out = '"';
+}
+
+/*
+ * Either tags the reference with the output index of the object or array it
+ * points to, or copies its earlier output. Cycles can't be inlined. Copies can
+ * double the output with each level of nesting, so the length cap is checked
+ * before growing the buffer.
+ */
+void json_w_ref(TRANSCODER *tc, long idx) {
+    json_sep(tc);
+    if(tc->json_refs == JSON_REFS_TAG) {
+        char buf[40];
+        int len = snprintf(buf, sizeof(buf), "{\"$ref\":%ld}", idx);
+        rb_str_buf_cat(tc->ser.stream, buf, len);
+        return;
+    }
+
+    long start = tc->spans[idx * 2], end = tc->spans[idx * 2 + 1];
+    if(end < 0) rb_raise(rb_eArgError, "cannot inline circular reference; use :refs => :ref");
+    ser_check_length(&tc->ser, end - start);
+    VALUE stream = tc->ser.stream;
+    long len = RSTRING_LEN(stream);
+    rb_str_resize(stream, len + end - start);
+    memcpy(RSTRING_PTR(stream) + len, RSTRING_PTR(stream) + start, end - start);
+}
+
+void json_w_array_begin(TRANSCODER *tc, long k) {
+    json_sep(tc);
+    tc_new_obj(tc, k, 0);
+    json_push(tc, tc->obj_index - 1);
+    ser_write_byte(&tc->ser, '[');
+}
+
+void json_w_array_end(TRANSCODER *tc) {
+    ser_write_byte(&tc->ser, ']');
+    json_pop(tc);
+}
+
+void json_w_object_begin(TRANSCODER *tc, long k, const char *name, long len) {
+    json_sep(tc);
+    tc_new_obj(tc, k, 0);
+    json_push(tc, tc->obj_index - 1);
+    ser_write_byte(&tc->ser, '{');
+    if(len > 0 && tc->json_class_key != Qnil) {
+        json_w_key(tc, RSTRING_PTR(tc->json_class_key), RSTRING_LEN(tc->json_class_key));
+        json_w_string(tc, name, len);
+    }
+}
+
+void json_w_key(TRANSCODER *tc, const char *ptr, long len) {
+    if(tc->levels[tc->depth - 1].count++ > 0) ser_write_byte(&tc->ser, ',');
+    json_write_string(tc, ptr, len);
+    ser_write_byte(&tc->ser, ':');
+    tc->after_key = 1;
+}
+
+void json_w_object_end(TRANSCODER *tc) {
+    ser_write_byte(&tc->ser, '}');
+    json_pop(tc);
+}
+
+void json_free(TRANSCODER *tc) {
+    xfree(tc->levels);
+    xfree(tc->spans);
+}
+
+/*
+ * Reads the JSON options for transcode:
+ *
+ * [:refs] <tt>:ref</tt> (the default) writes <tt>{"$ref": n}</tt> for a
+ *         reference, where n counts objects and arrays in the order they open
+ *         in the output, from 0. <tt>:inline</tt> writes the referenced object
+ *         or array out again in full, raising on cycles. A small input can
+ *         inline to exponentially large output, so don't use it on untrusted
+ *         input without a <tt>:max_length</tt>. Inlined output is also
+ *         buffered in full before being written to an <tt>:io</tt>.
+ * [:dates] <tt>:ms</tt> (the default) for milliseconds since the epoch, or
+ *          <tt>:iso8601</tt> for a UTC string with milliseconds.
+ * [:byte_arrays] <tt>:base64</tt> (the default) for a base64 string, or
+ *                <tt>:array</tt> for an array of byte values.
+ * [:class_key] Key typed objects get their class name under, "_class" by
+ *              default. Pass nil to leave class names out.
+ */
+void json_parse_options(TRANSCODER *tc, VALUE options) {
+    VALUE opt;
+
+    opt = rb_hash_aref(options, sym_refs);
+    if(opt == sym_inline) {
+        tc->json_refs = JSON_REFS_INLINE;
+    } else if(opt == Qnil || opt == sym_ref) {
+        tc->json_refs = JSON_REFS_TAG;
+    } else {
+        rb_raise(rb_eArgError, "unknown :refs option");
+    }
+
+    opt = rb_hash_aref(options, sym_dates);
+    if(opt == sym_iso8601) {
+        tc->json_dates = JSON_DATES_ISO8601;
+    } else if(opt != Qnil && opt != sym_ms) {
+        rb_raise(rb_eArgError, "unknown :dates option");
+    }
+
+    opt = rb_hash_aref(options, sym_byte_arrays);
+    if(opt == sym_array) {
+        tc->json_bytes = JSON_BYTES_ARRAY;
+    } else if(opt != Qnil && opt != sym_base64) {
+        rb_raise(rb_eArgError, "unknown :byte_arrays option");
+    }
+
+    opt = rb_hash_lookup2(options, sym_class_key, Qundef);
+    if(opt != Qundef) {
+        tc->json_class_key = opt == Qnil ? Qnil : rb_str_new_frozen(rb_obj_as_string(opt));
+    } else {
+        tc->json_class_key = rb_str_new2("_class");
+    }
+}
+
+void Init_rocket_amf_json() {
+    sym_refs = ID2SYM(rb_intern("refs"));
+    sym_inline = ID2SYM(rb_intern("inline"));
+    sym_ref = ID2SYM(rb_intern("ref"));
+    sym_dates = ID2SYM(rb_intern("dates"));
+    sym_ms = ID2SYM(rb_intern("ms"));
+    sym_iso8601 = ID2SYM(rb_intern("iso8601"));
+    sym_byte_arrays = ID2SYM(rb_intern("byte_arrays"));
+    sym_base64 = ID2SYM(rb_intern("base64"));
+    sym_array = ID2SYM(rb_intern("array"));
+    sym_class_key = ID2SYM(rb_intern("class_key"));
+}
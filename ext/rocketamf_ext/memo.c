@@ -0,0 +1,177 @@
+#include <ruby.h>
+#ifdef HAVE_RB_STR_ENCODE
+#include <ruby/st.h>
+#else
+#include <st.h>
+#endif
+#include "memo.h"
+
+extern VALUE mRocketAMF;
+extern VALUE mRocketAMFExt;
+VALUE cMemoCache;
+
+#define DEFAULT_MEMO_ENTRIES 4096
+
+/*
+ * Encodings depend on how they were written, so there's a table for each
+ * combination of class mapper class, sorted properties and AMF version
+ */
+typedef struct {
+    VALUE mapper_class;
+    int sort_props;
+    int version;
+    st_table* table; // Keyed by object identity
+} MEMO_CONTEXT;
+
+typedef struct {
+    MEMO_CONTEXT *contexts;
+    long num_contexts;
+    long max_entries;
+} AMF_MEMO;
+
+static long memo_entries(AMF_MEMO *memo) {
+    long i, entries = 0;
+    for(i = 0; i < memo->num_contexts; i++) entries += (long)memo->contexts[i].table->num_entries;
+    return entries;
+}
+
+/*
+ * Returns the context for encodings written by the given serializer settings,
+ * adding it if it hasn't been used before. There are rarely more than a couple,
+ * so they're searched in order.
+ */
+long memo_context(VALUE self, VALUE class_mapper, int sort_props, int version) {
+    AMF_MEMO *memo;
+    Data_Get_Struct(self, AMF_MEMO, memo);
+
+    VALUE mapper_class = rb_obj_class(class_mapper);
+    version = version == 0 ? 0 : 3;
+    long i;
+    for(i = 0; i < memo->num_contexts; i++) {
+        MEMO_CONTEXT *ctx = &memo->contexts[i];
+        if(ctx->mapper_class == mapper_class && ctx->sort_props == sort_props && ctx->version == version) return i;
+    }
+
+    REALLOC_N(memo->contexts, MEMO_CONTEXT, memo->num_contexts + 1);
+    MEMO_CONTEXT *ctx = &memo->contexts[memo->num_contexts];
+    ctx->mapper_class = mapper_class;
+    ctx->sort_props = sort_props;
+    ctx->version = version;
+    ctx->table = st_init_numtable();
+    return memo->num_contexts++;
+}
+
+/*
+ * Returns the cached entry for the object, or Qundef if it hasn't been seen
+ */
+VALUE memo_get(VALUE self, long context, VALUE obj) {
+    AMF_MEMO *memo;
+    Data_Get_Struct(self, AMF_MEMO, memo);
+    VALUE entry;
+    if(st_lookup(memo->contexts[context].table, obj, &entry)) return entry;
+    return Qundef;
+}
+
+/*
+ * Returns true if no more entries can be added
+ */
+int memo_full(VALUE self) {
+    AMF_MEMO *memo;
+    Data_Get_Struct(self, AMF_MEMO, memo);
+    return memo->max_entries > 0 && memo_entries(memo) >= memo->max_entries;
+}
+
+/*
+ * Caches the encoding for the object, unless the cache is full. Entries keep
+ * their objects alive, so that their identity can't be reused by another
+ * object, which is why objects that can't be memoized are never added.
+ */
+void memo_set(VALUE self, long context, VALUE obj, VALUE entry) {
+    AMF_MEMO *memo;
+    Data_Get_Struct(self, AMF_MEMO, memo);
+    if(memo_full(self)) return;
+    st_insert(memo->contexts[context].table, obj, entry);
+}
+
+static void memo_mark(AMF_MEMO *memo) {
+    if(!memo) return;
+    long i;
+    for(i = 0; i < memo->num_contexts; i++) {
+        rb_gc_mark(memo->contexts[i].mapper_class);
+        rb_mark_hash(memo->contexts[i].table);
+    }
+}
+
+static void memo_free(AMF_MEMO *memo) {
+    long i;
+    for(i = 0; i < memo->num_contexts; i++) st_free_table(memo->contexts[i].table);
+    xfree(memo->contexts);
+    xfree(memo);
+}
+
+static VALUE memo_alloc(VALUE klass) {
+    AMF_MEMO *memo = ALLOC(AMF_MEMO);
+    memo->contexts = NULL;
+    memo->num_contexts = 0;
+    memo->max_entries = DEFAULT_MEMO_ENTRIES;
+    return Data_Wrap_Struct(klass, memo_mark, memo_free, memo);
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext::MemoCache.new
+ *   RocketAMF::Ext::MemoCache.new(max_entries)
+ *
+ * Creates a cache of encoded frozen object graphs that can be shared between
+ * serializers using the <tt>:memo</tt> option. Objects are remembered by
+ * identity and held on to, so it should only be used for long-lived data like
+ * lookup tables frozen at boot. Encodings are kept separately for each class
+ * mapper class, <tt>:sort_props</tt> setting and AMF version, so serializers
+ * set up differently never share bytes. Once <tt>max_entries</tt> objects
+ * have been cached no more are added. Pass 0 for no limit.
+ */
+static VALUE memo_initialize(int argc, VALUE *argv, VALUE self) {
+    AMF_MEMO *memo;
+    Data_Get_Struct(self, AMF_MEMO, memo);
+
+    VALUE max_entries;
+    rb_scan_args(argc, argv, "01", &max_entries);
+    if(max_entries != Qnil) memo->max_entries = NUM2LONG(max_entries);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   memo.size => int
+ *
+ * Returns the number of encodings cached across all serializer settings
+ */
+static VALUE memo_size(VALUE self) {
+    AMF_MEMO *memo;
+    Data_Get_Struct(self, AMF_MEMO, memo);
+    return LONG2NUM(memo_entries(memo));
+}
+
+/*
+ * call-seq:
+ *   memo.clear => memo
+ *
+ * Forgets all cached encodings
+ */
+static VALUE memo_clear(VALUE self) {
+    AMF_MEMO *memo;
+    Data_Get_Struct(self, AMF_MEMO, memo);
+    long i;
+    for(i = 0; i < memo->num_contexts; i++) st_clear(memo->contexts[i].table);
+    return self;
+}
+
+void Init_rocket_amf_memo() {
+    // Define MemoCache
+    cMemoCache = rb_define_class_under(mRocketAMFExt, "MemoCache", rb_cObject);
+    rb_define_alloc_func(cMemoCache, memo_alloc);
+    rb_define_method(cMemoCache, "initialize", memo_initialize, -1);
+    rb_define_method(cMemoCache, "size", memo_size, 0);
+    rb_define_method(cMemoCache, "clear", memo_clear, 0);
+}
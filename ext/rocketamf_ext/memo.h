@@ -0,0 +1,4 @@
+long memo_context(VALUE self, VALUE class_mapper, int sort_props, int version);
+VALUE memo_get(VALUE self, long context, VALUE obj);
+void memo_set(VALUE self, long context, VALUE obj, VALUE entry);
+int memo_full(VALUE self);
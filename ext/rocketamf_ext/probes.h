@@ -0,0 +1,55 @@
+/*
+ * Static tracepoints for the rocketamf provider, compiled in with
+ * <tt>ruby extconf.rb --enable-dtrace</tt> when sys/sdt.h is available. They
+ * can be listed with <tt>bpftrace -l 'usdt:/path/to/rocketamf_ext.so:*'</tt>
+ * or <tt>perf list sdt_rocketamf:*</tt>. Without the flag the macros expand to
+ * nothing, so probe arguments are never evaluated.
+ *
+ *   deserialize__start(int version, long size)      size is the unread source length
+ *   deserialize__done(int version, long bytes)
+ *   serialize__start(int version)
+ *   serialize__done(int version, long bytes)
+ *   populate__start(long size)
+ *   populate__done(long bytes, int headers, int messages)
+ *   envelope__serialize__start(int version)
+ *   envelope__serialize__done(int version, long bytes)
+ *   mapper__call(char *method, char *class_name)    class_name is the AS name for get_ruby_obj
+ *   read__external__start(char *class_name, long pos)
+ *   read__external__done(char *class_name, long bytes)
+ *   write__external__start(char *class_name)
+ *   write__external__done(char *class_name, long bytes)
+ */
+#ifdef AMF_DTRACE
+#include <sys/sdt.h>
+
+#define PROBE_DESERIALIZE_START(version, size) DTRACE_PROBE2(rocketamf, deserialize__start, version, size)
+#define PROBE_DESERIALIZE_DONE(version, bytes) DTRACE_PROBE2(rocketamf, deserialize__done, version, bytes)
+#define PROBE_SERIALIZE_START(version) DTRACE_PROBE1(rocketamf, serialize__start, version)
+#define PROBE_SERIALIZE_DONE(version, bytes) DTRACE_PROBE2(rocketamf, serialize__done, version, bytes)
+#define PROBE_POPULATE_START(size) DTRACE_PROBE1(rocketamf, populate__start, size)
+#define PROBE_POPULATE_DONE(bytes, headers, messages) DTRACE_PROBE3(rocketamf, populate__done, bytes, headers, messages)
+#define PROBE_ENVELOPE_SERIALIZE_START(version) DTRACE_PROBE1(rocketamf, envelope__serialize__start, version)
+#define PROBE_ENVELOPE_SERIALIZE_DONE(version, bytes) DTRACE_PROBE2(rocketamf, envelope__serialize__done, version, bytes)
+#define PROBE_MAPPER_CALL(method, class_name) DTRACE_PROBE2(rocketamf, mapper__call, method, class_name)
+#define PROBE_READ_EXTERNAL_START(class_name, pos) DTRACE_PROBE2(rocketamf, read__external__start, class_name, pos)
+#define PROBE_READ_EXTERNAL_DONE(class_name, bytes) DTRACE_PROBE2(rocketamf, read__external__done, class_name, bytes)
+#define PROBE_WRITE_EXTERNAL_START(class_name) DTRACE_PROBE1(rocketamf, write__external__start, class_name)
+#define PROBE_WRITE_EXTERNAL_DONE(class_name, bytes) DTRACE_PROBE2(rocketamf, write__external__done, class_name, bytes)
+
+#else
+
+#define PROBE_DESERIALIZE_START(version, size)
+#define PROBE_DESERIALIZE_DONE(version, bytes)
+#define PROBE_SERIALIZE_START(version)
+#define PROBE_SERIALIZE_DONE(version, bytes)
+#define PROBE_POPULATE_START(size)
+#define PROBE_POPULATE_DONE(bytes, headers, messages)
+#define PROBE_ENVELOPE_SERIALIZE_START(version)
+#define PROBE_ENVELOPE_SERIALIZE_DONE(version, bytes)
+#define PROBE_MAPPER_CALL(method, class_name)
+#define PROBE_READ_EXTERNAL_START(class_name, pos)
+#define PROBE_READ_EXTERNAL_DONE(class_name, bytes)
+#define PROBE_WRITE_EXTERNAL_START(class_name)
+#define PROBE_WRITE_EXTERNAL_DONE(class_name, bytes)
+
+#endif
@@ -0,0 +1,148 @@
+#include "profile.h"
+#include "stats.h"
+#include <stdarg.h>
+
+#define PROFILE_MAX_ARGS 4
+
+static ID id_add;
+
+/*
+ * Creates the per-class tallies for a serializer or deserializer that was
+ * given a <tt>:profile</tt>. They're added to the ruby profile by
+ * profile_flush at the end of each call, so that objects aren't slowed down
+ * by a method call apiece.
+ */
+AMF_PROFILE* profile_new(void) {
+    AMF_PROFILE *prof = ALLOC(AMF_PROFILE);
+    prof->entries = st_init_numtable();
+    prof->capacity = 16;
+    prof->frames = ALLOC_N(PROFILE_FRAME, prof->capacity);
+    prof->depth = 0;
+    return prof;
+}
+
+static int profile_free_iter(st_data_t key, st_data_t val, st_data_t arg) {
+    PROFILE_ENTRY *entry = (PROFILE_ENTRY*)val;
+    while(entry) {
+        PROFILE_ENTRY *next = entry->next;
+        xfree(entry);
+        entry = next;
+    }
+    return ST_DELETE;
+}
+
+void profile_free(AMF_PROFILE *prof) {
+    if(!prof) return;
+    st_foreach(prof->entries, profile_free_iter, 0);
+    st_free_table(prof->entries);
+    xfree(prof->frames);
+    xfree(prof);
+}
+
+static int profile_mark_iter(st_data_t key, st_data_t val, st_data_t arg) {
+    rb_gc_mark((VALUE)key);
+    PROFILE_ENTRY *entry;
+    for(entry = (PROFILE_ENTRY*)val; entry; entry = entry->next) rb_gc_mark(entry->as_class);
+    return ST_CONTINUE;
+}
+
+void profile_mark(AMF_PROFILE *prof) {
+    if(!prof) return;
+    st_foreach(prof->entries, profile_mark_iter, 0);
+}
+
+/*
+ * Starts attributing to a new object, beginning at the given stream position.
+ * Returns the frame to pass to profile_leave. Frames live in the profile
+ * rather than on the C stack, so one abandoned by an exception is harmless.
+ */
+long profile_enter(AMF_PROFILE *prof, long pos) {
+    if(prof->depth == prof->capacity) {
+        prof->capacity *= 2;
+        REALLOC_N(prof->frames, PROFILE_FRAME, prof->capacity);
+    }
+    PROFILE_FRAME *frame = &prof->frames[prof->depth];
+    frame->start_pos = pos;
+    frame->child_time = 0;
+    frame->child_bytes = 0;
+    frame->mapper_time = 0;
+    frame->start = stats_now();
+    return prof->depth++;
+}
+
+/*
+ * Finishes the object started by profile_enter, adding its cost less that of
+ * the objects nested in it to the tally for its classes. Any frames left
+ * above it by an exception that was rescued are dropped.
+ */
+void profile_leave(AMF_PROFILE *prof, long frame_index, VALUE klass, VALUE as_class, long pos) {
+    PROFILE_FRAME *frame = &prof->frames[frame_index];
+    double time = stats_now() - frame->start;
+    long bytes = pos - frame->start_pos;
+    prof->depth = frame_index;
+    if(frame_index > 0) {
+        prof->frames[frame_index - 1].child_time += time;
+        prof->frames[frame_index - 1].child_bytes += bytes;
+    }
+
+    PROFILE_ENTRY *head = NULL, *entry;
+    st_lookup(prof->entries, klass, (st_data_t*)&head);
+    for(entry = head; entry; entry = entry->next) {
+        if(entry->as_class == as_class) break;
+        if(entry->as_class != Qnil && as_class != Qnil && rb_str_equal(entry->as_class, as_class) == Qtrue) break;
+    }
+    if(!entry) {
+        entry = ALLOC(PROFILE_ENTRY);
+        memset(entry, 0, sizeof(PROFILE_ENTRY));
+        entry->as_class = as_class == Qnil ? Qnil : rb_str_new_frozen(as_class);
+        entry->next = head;
+        st_insert(prof->entries, klass, (st_data_t)entry);
+    }
+    entry->count++;
+    entry->time += time - frame->child_time;
+    entry->bytes += bytes - frame->child_bytes;
+    entry->mapper_time += frame->mapper_time;
+}
+
+/*
+ * Calls a class mapper method, adding the time it takes to the object being
+ * written or read. Without a profile it's a plain method call.
+ */
+VALUE profile_funcall(AMF_PROFILE *prof, VALUE recv, ID mid, int argc, ...) {
+    VALUE argv[PROFILE_MAX_ARGS];
+    va_list ap;
+    int i;
+    va_start(ap, argc);
+    for(i = 0; i < argc && i < PROFILE_MAX_ARGS; i++) argv[i] = va_arg(ap, VALUE);
+    va_end(ap);
+
+    if(!prof || prof->depth == 0) return rb_funcall2(recv, mid, argc, argv);
+    double start = stats_now();
+    VALUE ret = rb_funcall2(recv, mid, argc, argv);
+    prof->frames[prof->depth - 1].mapper_time += stats_now() - start;
+    return ret;
+}
+
+static int profile_flush_iter(st_data_t key, st_data_t val, st_data_t arg) {
+    VALUE *args = (VALUE*)arg;
+    PROFILE_ENTRY *entry;
+    for(entry = (PROFILE_ENTRY*)val; entry; entry = entry->next) {
+        rb_funcall(args[0], id_add, 7, args[1], (VALUE)key, entry->as_class, LONG2NUM(entry->count),
+                   rb_float_new(entry->time), LONG2NUM(entry->bytes), rb_float_new(entry->mapper_time));
+    }
+    return profile_free_iter(key, val, arg);
+}
+
+/*
+ * Adds the tallies to the ruby profile under the given operation and clears
+ * them. Frames still open from a call that raised are discarded too.
+ */
+void profile_flush(AMF_PROFILE *prof, VALUE profile, VALUE operation) {
+    prof->depth = 0;
+    VALUE args[2] = {profile, operation};
+    st_foreach(prof->entries, profile_flush_iter, (st_data_t)args);
+}
+
+void Init_rocket_amf_profile() {
+    id_add = rb_intern("add");
+}
@@ -0,0 +1,43 @@
+#ifndef RAMF_PROFILE_H
+#define RAMF_PROFILE_H
+
+#include <ruby.h>
+#ifdef HAVE_RB_STR_ENCODE
+#include <ruby/st.h>
+#else
+#include <st.h>
+#endif
+
+typedef struct PROFILE_ENTRY {
+    VALUE as_class;
+    long count;
+    double time;
+    long bytes;
+    double mapper_time;
+    struct PROFILE_ENTRY *next; // Same ruby class, different AS class
+} PROFILE_ENTRY;
+
+typedef struct {
+    double start;
+    long start_pos;
+    double child_time; // Spent in nested objects, which are attributed separately
+    long child_bytes;
+    double mapper_time;
+} PROFILE_FRAME;
+
+typedef struct {
+    st_table *entries; // Ruby class to its PROFILE_ENTRY list
+    PROFILE_FRAME *frames;
+    long depth;
+    long capacity;
+} AMF_PROFILE;
+
+AMF_PROFILE* profile_new(void);
+void profile_free(AMF_PROFILE *prof);
+void profile_mark(AMF_PROFILE *prof);
+long profile_enter(AMF_PROFILE *prof, long pos);
+void profile_leave(AMF_PROFILE *prof, long frame, VALUE klass, VALUE as_class, long pos);
+VALUE profile_funcall(AMF_PROFILE *prof, VALUE recv, ID mid, int argc, ...);
+void profile_flush(AMF_PROFILE *prof, VALUE profile, VALUE operation);
+
+#endif
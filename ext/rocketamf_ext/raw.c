@@ -0,0 +1,479 @@
+#include "serializer.h"
+#include "deserializer.h"
+#include "raw.h"
+#include "constants.h"
+
+extern VALUE mRocketAMF;
+extern VALUE mRocketAMFExt;
+VALUE cRaw;
+
+typedef struct {
+    long members;
+    int dynamic;
+    int externalizable;
+    int array_collection;
+} RAW_TRAIT;
+
+/*
+ * Walks a fragment once, tracking the reference tables it builds up. When given
+ * an output serializer, it also copies the fragment into it, rewriting any
+ * references to be relative to the given table bases.
+ */
+typedef struct {
+    AMF_DESERIALIZER des;
+    long *strs; // Offset and length pairs into the fragment
+    long str_count;
+    long str_capa;
+    RAW_TRAIT *traits;
+    long trait_count;
+    long trait_capa;
+    long obj_count;
+    int has_refs;
+    AMF_SERIALIZER *out;
+    unsigned long copied;
+    long str_base;
+    long obj_base;
+    long trait_base;
+} RAW_SCANNER;
+
+static void raw0_scan(RAW_SCANNER *sc, char marker);
+static void raw3_scan(RAW_SCANNER *sc);
+
+static void raw_skip(RAW_SCANNER *sc, unsigned long len) {
+    AMF_DESERIALIZER *des = &sc->des;
+    if(des->pos + len > des->size || des->pos + len < des->pos) {
+        rb_raise(rb_eRangeError, "reading %lu bytes is beyond end of fragment: %ld (pos), %ld (size)", len, des->pos, des->size);
+    }
+    des->pos += len;
+}
+
+/*
+ * Copies everything up to start into the output, leaving the caller to write a
+ * replacement for the bytes between start and the current position
+ */
+static void raw_copy_to(RAW_SCANNER *sc, unsigned long start) {
+    rb_str_buf_cat(sc->out->stream, sc->des.stream + sc->copied, start - sc->copied);
+    sc->copied = sc->des.pos;
+}
+
+static void raw0_scan_props(RAW_SCANNER *sc) {
+    AMF_DESERIALIZER *des = &sc->des;
+    while(1) {
+        int len = des_read_uint16(des);
+        if(len == 0 && des_read_ahead_byte(des) == AMF0_OBJECT_END_MARKER) {
+            des->pos++;
+            return;
+        }
+        raw_skip(sc, len);
+        raw0_scan(sc, des_read_byte(des));
+    }
+}
+
+static void raw0_scan(RAW_SCANNER *sc, char marker) {
+    AMF_DESERIALIZER *des = &sc->des;
+    unsigned long start = des->pos;
+    unsigned int i, len;
+
+    switch(marker) {
+        case AMF0_NUMBER_MARKER:
+            raw_skip(sc, 8);
+            break;
+        case AMF0_BOOLEAN_MARKER:
+            raw_skip(sc, 1);
+            break;
+        case AMF0_STRING_MARKER:
+            raw_skip(sc, des_read_uint16(des));
+            break;
+        case AMF0_LONG_STRING_MARKER:
+        case AMF0_XML_MARKER:
+            raw_skip(sc, des_read_uint32(des));
+            break;
+        case AMF0_NULL_MARKER:
+        case AMF0_UNDEFINED_MARKER:
+        case AMF0_UNSUPPORTED_MARKER:
+            break;
+        case AMF0_DATE_MARKER:
+            raw_skip(sc, 10);
+            break;
+        case AMF0_OBJECT_MARKER:
+            sc->obj_count++;
+            raw0_scan_props(sc);
+            break;
+        case AMF0_TYPED_OBJECT_MARKER:
+            sc->obj_count++;
+            raw_skip(sc, des_read_uint16(des));
+            raw0_scan_props(sc);
+            break;
+        case AMF0_HASH_MARKER:
+            sc->obj_count++;
+            raw_skip(sc, 4);
+            raw0_scan_props(sc);
+            break;
+        case AMF0_STRICT_ARRAY_MARKER:
+            sc->obj_count++;
+            len = des_read_uint32(des);
+            for(i = 0; i < len; i++) raw0_scan(sc, des_read_byte(des));
+            break;
+        case AMF0_REFERENCE_MARKER:
+            i = des_read_uint16(des);
+            if(i >= sc->obj_count) rb_raise(rb_eArgError, "fragment references object %u outside of itself", i);
+            sc->has_refs = 1;
+            if(sc->out) {
+                raw_copy_to(sc, start);
+                ser_write_uint16(sc->out, i + sc->obj_base);
+            }
+            break;
+        default:
+            rb_raise(rb_eArgError, "cannot splice AMF0 fragment containing marker 0x%x", (unsigned char)marker);
+    }
+}
+
+static unsigned int raw3_read_header(RAW_SCANNER *sc) {
+    return des_read_int(&sc->des) & 0x1fffffff;
+}
+
+/*
+ * Checks and rewrites an object reference, returning true if the header was one
+ */
+static int raw3_obj_ref(RAW_SCANNER *sc, unsigned long start, unsigned int header) {
+    if(header & 0x01) return 0;
+    unsigned int idx = header >> 1;
+    if(idx >= sc->obj_count) rb_raise(rb_eArgError, "fragment references object %u outside of itself", idx);
+    sc->has_refs = 1;
+    if(sc->out) {
+        raw_copy_to(sc, start);
+        ser_write_int(sc->out, (int)(idx + sc->obj_base) << 1);
+    }
+    return 1;
+}
+
+/*
+ * Scans a UTF-8-vr and returns its index in the fragment's string table, or -1
+ * for the empty string
+ */
+static long raw3_scan_string(RAW_SCANNER *sc) {
+    AMF_DESERIALIZER *des = &sc->des;
+    unsigned long start = des->pos;
+    unsigned int header = raw3_read_header(sc);
+    unsigned int len = header >> 1;
+
+    if((header & 0x01) == 0) {
+        if(len >= sc->str_count) rb_raise(rb_eArgError, "fragment references string %u outside of itself", len);
+        sc->has_refs = 1;
+        if(sc->out) {
+            raw_copy_to(sc, start);
+            ser_write_int(sc->out, (int)(len + sc->str_base) << 1);
+        }
+        return len;
+    }
+
+    if(len == 0) return -1;
+    if(sc->str_count == sc->str_capa) {
+        sc->str_capa *= 2;
+        REALLOC_N(sc->strs, long, sc->str_capa * 2);
+    }
+    sc->strs[sc->str_count * 2] = des->pos;
+    sc->strs[sc->str_count * 2 + 1] = len;
+    raw_skip(sc, len);
+    return sc->str_count++;
+}
+
+static void raw3_scan_object(RAW_SCANNER *sc, unsigned long start) {
+    unsigned int header = raw3_read_header(sc);
+    if(raw3_obj_ref(sc, start, header)) return;
+    sc->obj_count++;
+
+    RAW_TRAIT *trait;
+    long i;
+    if((header & 0x02) == 0) {
+        unsigned int idx = header >> 2;
+        if(idx >= sc->trait_count) rb_raise(rb_eArgError, "fragment references traits %u outside of itself", idx);
+        sc->has_refs = 1;
+        if(sc->out) {
+            raw_copy_to(sc, start);
+            ser_write_int(sc->out, (int)(idx + sc->trait_base) << 2 | 0x01);
+        }
+        trait = sc->traits + idx;
+    } else {
+        if(sc->trait_count == sc->trait_capa) {
+            sc->trait_capa *= 2;
+            REALLOC_N(sc->traits, RAW_TRAIT, sc->trait_capa);
+        }
+        trait = sc->traits + sc->trait_count;
+        trait->externalizable = (header & 0x04) != 0;
+        trait->dynamic = (header & 0x08) != 0;
+        trait->members = header >> 4;
+        trait->array_collection = 0;
+
+        long name = raw3_scan_string(sc);
+        if(name >= 0 && sc->strs[name * 2 + 1] == sizeof(ARRAY_COLLECTION_CLASS) - 1) {
+            trait->array_collection = memcmp(sc->des.stream + sc->strs[name * 2], ARRAY_COLLECTION_CLASS, sizeof(ARRAY_COLLECTION_CLASS) - 1) == 0;
+        }
+        for(i = 0; i < trait->members; i++) raw3_scan_string(sc);
+        sc->trait_count++;
+    }
+
+    if(trait->externalizable) {
+        if(!trait->array_collection) rb_raise(rb_eArgError, "cannot splice AMF3 fragment containing externalizable objects");
+        raw3_scan(sc);
+        return;
+    }
+
+    long members = trait->members;
+    int dynamic = trait->dynamic;
+    for(i = 0; i < members; i++) raw3_scan(sc);
+    if(dynamic) {
+        while(raw3_scan_string(sc) != -1) raw3_scan(sc);
+    }
+}
+
+static void raw3_scan(RAW_SCANNER *sc) {
+    AMF_DESERIALIZER *des = &sc->des;
+    char marker = des_read_byte(des);
+    unsigned long start = des->pos;
+    unsigned int header, i, len;
+
+    switch(marker) {
+        case AMF3_UNDEFINED_MARKER:
+        case AMF3_NULL_MARKER:
+        case AMF3_FALSE_MARKER:
+        case AMF3_TRUE_MARKER:
+            break;
+        case AMF3_INTEGER_MARKER:
+            des_read_int(des);
+            break;
+        case AMF3_DOUBLE_MARKER:
+            raw_skip(sc, 8);
+            break;
+        case AMF3_STRING_MARKER:
+            raw3_scan_string(sc);
+            break;
+        case AMF3_XML_DOC_MARKER:
+        case AMF3_XML_MARKER:
+        case AMF3_BYTE_ARRAY_MARKER:
+            header = raw3_read_header(sc);
+            if(raw3_obj_ref(sc, start, header)) break;
+            sc->obj_count++;
+            raw_skip(sc, header >> 1);
+            break;
+        case AMF3_DATE_MARKER:
+            header = raw3_read_header(sc);
+            if(raw3_obj_ref(sc, start, header)) break;
+            sc->obj_count++;
+            raw_skip(sc, 8);
+            break;
+        case AMF3_ARRAY_MARKER:
+            header = raw3_read_header(sc);
+            if(raw3_obj_ref(sc, start, header)) break;
+            sc->obj_count++;
+            while(raw3_scan_string(sc) != -1) raw3_scan(sc);
+            len = header >> 1;
+            for(i = 0; i < len; i++) raw3_scan(sc);
+            break;
+        case AMF3_OBJECT_MARKER:
+            raw3_scan_object(sc, start);
+            break;
+        case AMF3_VECTOR_INT_MARKER:
+        case AMF3_VECTOR_UINT_MARKER:
+        case AMF3_VECTOR_DOUBLE_MARKER:
+            header = raw3_read_header(sc);
+            if(raw3_obj_ref(sc, start, header)) break;
+            sc->obj_count++;
+            raw_skip(sc, 1);
+            raw_skip(sc, (unsigned long)(header >> 1) * (marker == AMF3_VECTOR_DOUBLE_MARKER ? 8 : 4));
+            break;
+        case AMF3_VECTOR_OBJECT_MARKER:
+            header = raw3_read_header(sc);
+            if(raw3_obj_ref(sc, start, header)) break;
+            sc->obj_count++;
+            raw_skip(sc, 1);
+            raw3_scan_string(sc);
+            len = header >> 1;
+            for(i = 0; i < len; i++) raw3_scan(sc);
+            break;
+        case AMF3_DICT_MARKER:
+            header = raw3_read_header(sc);
+            if(raw3_obj_ref(sc, start, header)) break;
+            sc->obj_count++;
+            raw_skip(sc, 1);
+            len = header >> 1;
+            for(i = 0; i < len * 2; i++) raw3_scan(sc);
+            break;
+        default:
+            rb_raise(rb_eArgError, "cannot splice AMF3 fragment containing marker 0x%x", (unsigned char)marker);
+    }
+}
+
+static VALUE raw_scan_body(VALUE arg) {
+    RAW_SCANNER *sc = (RAW_SCANNER*)arg;
+    if(sc->des.version == 0) {
+        raw0_scan(sc, des_read_byte(&sc->des));
+    } else {
+        raw3_scan(sc);
+    }
+    if(sc->des.pos != sc->des.size) {
+        rb_raise(rb_eArgError, "fragment has %ld trailing bytes", sc->des.size - sc->des.pos);
+    }
+    if(sc->out) raw_copy_to(sc, sc->des.pos);
+    return Qnil;
+}
+
+static VALUE raw_scan_free(VALUE arg) {
+    RAW_SCANNER *sc = (RAW_SCANNER*)arg;
+    xfree(sc->strs);
+    xfree(sc->traits);
+    return Qnil;
+}
+
+static void raw_scan(AMF_RAW *raw, RAW_SCANNER *sc) {
+    sc->des.version = raw->version;
+    sc->des.stream = RSTRING_PTR(raw->bytes);
+    sc->des.size = RSTRING_LEN(raw->bytes);
+    sc->str_capa = 16;
+    sc->strs = ALLOC_N(long, sc->str_capa * 2);
+    sc->trait_capa = 8;
+    sc->traits = ALLOC_N(RAW_TRAIT, sc->trait_capa);
+    rb_ensure(raw_scan_body, (VALUE)sc, raw_scan_free, (VALUE)sc);
+}
+
+/*
+ * Splices the fragment into the serializer's stream, bumping its reference
+ * tables so that everything written afterwards lines up. References inside the
+ * fragment only need rewriting if it isn't being written at the very start.
+ */
+void ser_write_raw(VALUE self, VALUE obj, VALUE key) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    AMF_RAW *raw;
+    Data_Get_Struct(obj, AMF_RAW, raw);
+
+    if(raw->version != ser->version) {
+        if(raw->version == 0) rb_raise(rb_eArgError, "cannot splice AMF0 fragment into AMF3 stream");
+
+        // AMF3 fragments start with fresh tables after the AVM+ marker
+        ser_write_byte(ser, AMF0_AMF3_MARKER);
+        rb_str_buf_append(ser->stream, raw->bytes);
+        return;
+    }
+
+    if(raw->root_is_obj) {
+        VALUE obj_index;
+        if(ser->version == 3 && st_lookup(ser->obj_cache, key, &obj_index)) {
+            ser_write_byte(ser, RSTRING_PTR(raw->bytes)[0]);
+            ser_write_int(ser, FIX2INT(obj_index) << 1);
+            return;
+        }
+        st_add_direct(ser->obj_cache, key, LONG2FIX(ser->obj_index));
+    }
+
+    if(!raw->has_refs || (ser->str_index == 0 && ser->obj_index == 0 && ser->trait_index == 0)) {
+        rb_str_buf_append(ser->stream, raw->bytes);
+    } else {
+        RAW_SCANNER sc;
+        memset(&sc, 0, sizeof(RAW_SCANNER));
+        sc.out = ser;
+        sc.str_base = ser->str_index;
+        sc.obj_base = ser->obj_index;
+        sc.trait_base = ser->trait_index;
+        raw_scan(raw, &sc);
+    }
+
+    ser->obj_index += raw->obj_count;
+    if(ser->version == 3) {
+        ser->str_index += raw->str_count;
+        ser->trait_index += raw->trait_count;
+    }
+}
+
+static void raw_mark(AMF_RAW *raw) {
+    if(!raw) return;
+    rb_gc_mark(raw->bytes);
+}
+
+static VALUE raw_alloc(VALUE klass) {
+    AMF_RAW *raw = ALLOC(AMF_RAW);
+    memset(raw, 0, sizeof(AMF_RAW));
+    raw->bytes = Qnil;
+    return Data_Wrap_Struct(klass, raw_mark, -1, raw);
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext::Raw.new(bytes, amf_ver) => raw
+ *
+ * Wraps an already encoded AMF value so that it can be dropped into a larger
+ * object graph and copied straight into the serializer output. The fragment
+ * must hold exactly one complete value, encoded from fresh reference tables,
+ * as RocketAMF.serialize produces. Externalizable objects other than
+ * ArrayCollections aren't supported, as their length can't be determined.
+ */
+static VALUE raw_initialize(VALUE self, VALUE bytes, VALUE ver) {
+    AMF_RAW *raw;
+    Data_Get_Struct(self, AMF_RAW, raw);
+
+    int int_ver = FIX2INT(ver);
+    if(int_ver != 0 && int_ver != 3) rb_raise(rb_eArgError, "unsupported version %d", int_ver);
+    StringValue(bytes);
+    if(RSTRING_LEN(bytes) == 0) rb_raise(rb_eArgError, "fragment is empty");
+
+    raw->version = int_ver;
+    raw->bytes = rb_str_new_frozen(bytes);
+
+    RAW_SCANNER sc;
+    memset(&sc, 0, sizeof(RAW_SCANNER));
+    raw_scan(raw, &sc);
+    raw->str_count = sc.str_count;
+    raw->obj_count = sc.obj_count;
+    raw->trait_count = sc.trait_count;
+    raw->has_refs = sc.has_refs;
+
+    // Fragments can't start with a reference, so an object root is the first
+    // entry in the object table
+    char marker = RSTRING_PTR(bytes)[0];
+    if(int_ver == 0) {
+        raw->root_is_obj = marker == AMF0_OBJECT_MARKER || marker == AMF0_TYPED_OBJECT_MARKER || marker == AMF0_HASH_MARKER || marker == AMF0_STRICT_ARRAY_MARKER;
+    } else {
+        raw->root_is_obj = marker >= AMF3_XML_DOC_MARKER && marker <= AMF3_DICT_MARKER;
+    }
+
+    return self;
+}
+
+VALUE raw_new(VALUE bytes, int version) {
+    VALUE raw = raw_alloc(cRaw);
+    raw_initialize(raw, bytes, INT2FIX(version));
+    return raw;
+}
+
+/*
+ * call-seq:
+ *   raw.version => int
+ *
+ * Returns the AMF version the fragment was encoded with
+ */
+static VALUE raw_version(VALUE self) {
+    AMF_RAW *raw;
+    Data_Get_Struct(self, AMF_RAW, raw);
+    return INT2FIX(raw->version);
+}
+
+/*
+ * call-seq:
+ *   raw.bytes => string
+ *
+ * Returns the encoded fragment
+ */
+static VALUE raw_bytes(VALUE self) {
+    AMF_RAW *raw;
+    Data_Get_Struct(self, AMF_RAW, raw);
+    return raw->bytes;
+}
+
+void Init_rocket_amf_raw() {
+    // Define Raw
+    cRaw = rb_define_class_under(mRocketAMFExt, "Raw", rb_cObject);
+    rb_define_alloc_func(cRaw, raw_alloc);
+    rb_define_method(cRaw, "initialize", raw_initialize, 2);
+    rb_define_method(cRaw, "version", raw_version, 0);
+    rb_define_method(cRaw, "bytes", raw_bytes, 0);
+}
@@ -0,0 +1,12 @@
+typedef struct {
+    int version;
+    VALUE bytes;
+    long str_count;
+    long obj_count;
+    long trait_count;
+    int has_refs;
+    int root_is_obj;
+} AMF_RAW;
+
+VALUE raw_new(VALUE bytes, int version);
+void ser_write_raw(VALUE self, VALUE raw, VALUE key);
@@ -1,6 +1,8 @@
 #include "deserializer.h"
 #include "serializer.h"
 #include "constants.h"
+#include "stats.h"
+#include "probes.h"
 
 extern VALUE mRocketAMF;
 extern VALUE mRocketAMFExt;
@@ -31,6 +33,9 @@ static VALUE env_populate_from_stream(int argc, VALUE *argv, VALUE self) {
     rb_scan_args(argc, argv, "11", &src, &class_mapper);
     if(class_mapper == Qnil) class_mapper = rb_class_new_instance(0, NULL, cClassMapper);
 
+    STATS_TIMER timer;
+    stats_start(&timer);
+
     // Create AMF0 deserializer
     VALUE args[3];
     args[0] = class_mapper;
@@ -38,6 +43,10 @@ static VALUE env_populate_from_stream(int argc, VALUE *argv, VALUE self) {
     AMF_DESERIALIZER *des;
     Data_Get_Struct(des_rb, AMF_DESERIALIZER, des);
     des_set_src(des, src);
+    PROBE_POPULATE_START((long)(des->size - des->pos));
+#ifdef AMF_DTRACE
+    unsigned long start_pos = des->pos;
+#endif
 
     // Read amf version
     int amf_ver = des_read_uint16(des);
@@ -83,23 +92,65 @@ static VALUE env_populate_from_stream(int argc, VALUE *argv, VALUE self) {
     rb_ivar_set(self, id_headers, headers);
     rb_ivar_set(self, id_messages, messages);
 
+    stats_stop(&timer, STATS_POPULATE);
+    PROBE_POPULATE_DONE((long)(des->pos - start_pos), header_cnt, message_cnt);
     return self;
 }
 
+/*
+ * Reserves the header or message body length, and holds the output back until
+ * it's filled in
+ */
+static void env_reserve_length(AMF_SERIALIZER *ser) {
+    ser->flush_holds++;
+    ser->length_pos = RSTRING_LEN(ser->stream);
+    ser_write_uint32(ser, -1);
+}
+
+/*
+ * Fills in the reserved length, now that the body following it has been
+ * written, and releases the hold. Bodies too large for the field are left
+ * marked as unknown, as are ones the serializer had to flush before they were
+ * done.
+ */
+static void env_patch_length(AMF_SERIALIZER *ser) {
+    long pos = ser->length_pos;
+    if(pos < 0) return;
+    ser->length_pos = -1;
+    ser->flush_holds--;
+
+    unsigned long len = RSTRING_LEN(ser->stream) - pos - 4;
+    if(len > 0xFFFFFFFFUL) len = 0xFFFFFFFFUL;
+    rb_str_modify(ser->stream);
+    unsigned char *dst = (unsigned char *)RSTRING_PTR(ser->stream) + pos;
+    dst[0] = (len >> 24) & 0xFF;
+    dst[1] = (len >> 16) & 0xFF;
+    dst[2] = (len >> 8) & 0xFF;
+    dst[3] = len & 0xFF;
+}
+
 /*
  * call-seq:
- *   env.serialize(class_mapper=nil)
+ *   env.serialize(class_mapper=nil) => string
+ *   env.serialize(class_mapper, options) => string or io
  *
  * Included into RocketAMF::Envelope, this method handles serializing an AMF
- * request/response into a string
+ * request/response into a string. The byte length of every header and message
+ * body is filled in, so that readers can skip or split them without decoding.
+ *
+ * The options are passed on to the serializer. With <tt>:io</tt>, output is
+ * written to it as it's produced and the io is returned. A header or message
+ * body is held back until its length has been filled in, unless it grows past
+ * <tt>:flush_size</tt>. Its length is then written as unknown, which readers
+ * already handle, so that it can be streamed out like everything else.
  */
 static VALUE env_serialize(int argc, VALUE *argv, VALUE self) {
     static VALUE cClassMapper = 0;
     if(cClassMapper == 0) cClassMapper = rb_const_get(mRocketAMF, rb_intern("ClassMapper"));
 
     // Parse args
-    VALUE class_mapper;
-    rb_scan_args(argc, argv, "01", &class_mapper);
+    VALUE class_mapper, options;
+    rb_scan_args(argc, argv, "02", &class_mapper, &options);
     if(class_mapper == Qnil) class_mapper = rb_class_new_instance(0, NULL, cClassMapper);
 
     // Get instance variables
@@ -108,12 +159,13 @@ static VALUE env_serialize(int argc, VALUE *argv, VALUE self) {
     VALUE messages = rb_ivar_get(self, id_messages);
 
     // Create AMF0 serializer
-    VALUE args[1] = {class_mapper};
-    VALUE ser_rb = rb_class_new_instance(1, args, cSerializer);
+    VALUE args[2] = {class_mapper, options};
+    VALUE ser_rb = rb_class_new_instance(options == Qnil ? 1 : 2, args, cSerializer);
     AMF_SERIALIZER *ser;
     Data_Get_Struct(ser_rb, AMF_SERIALIZER, ser);
 
     // Write version
+    PROBE_ENVELOPE_SERIALIZE_START((int)amf_ver);
     ser_write_uint16(ser, amf_ver);
 
     // Write headers
@@ -134,8 +186,10 @@ static VALUE env_serialize(int argc, VALUE *argv, VALUE self) {
         ser_write_byte(ser, rb_funcall(header, rb_intern("must_understand"), 0) == Qtrue ? 1 : 0);
 
         // Serialize data
-        ser_write_uint32(ser, -1); // length of data - -1 if you don't know
+        env_reserve_length(ser);
         ser_serialize(ser_rb, INT2FIX(0), rb_funcall(header, id_data, 0));
+        env_patch_length(ser);
+        ser_flush(ser, 0);
     }
 
     // Write messages
@@ -155,15 +209,22 @@ static VALUE env_serialize(int argc, VALUE *argv, VALUE self) {
         rb_str_buf_cat(ser->stream, str, str_len);
 
         // Serialize data
-        ser_write_uint32(ser, -1); // length of data - -1 if you don't know
+        env_reserve_length(ser);
         if(amf_ver == 3) {
             ser_write_byte(ser, AMF0_AMF3_MARKER);
             ser_serialize(ser_rb, INT2FIX(3), rb_funcall(message, id_data, 0));
         } else {
             ser_serialize(ser_rb, INT2FIX(0), rb_funcall(message, id_data, 0));
         }
+        env_patch_length(ser);
+        ser_flush(ser, 0);
     }
 
+    PROBE_ENVELOPE_SERIALIZE_DONE((int)amf_ver, ser->flushed + RSTRING_LEN(ser->stream));
+    if(ser->io != Qnil) {
+        ser_flush(ser, 1);
+        return ser->io;
+    }
     return ser->stream;
 }
 
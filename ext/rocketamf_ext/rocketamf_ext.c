@@ -16,6 +16,13 @@ void Init_rocket_amf_deserializer();
 void Init_rocket_amf_serializer();
 void Init_rocket_amf_fast_class_mapping();
 void Init_rocket_amf_remoting();
+void Init_rocket_amf_raw();
+void Init_rocket_amf_memo();
+void Init_rocket_amf_transcoder();
+void Init_rocket_amf_json();
+void Init_rocket_amf_stats();
+void Init_rocket_amf_profile();
+void Init_rocket_amf_dispatcher();
 
 void Init_rocketamf_ext() {
     mRocketAMF = rb_define_module("RocketAMF");
@@ -26,6 +33,13 @@ void Init_rocketamf_ext() {
     Init_rocket_amf_serializer();
     Init_rocket_amf_fast_class_mapping();
     Init_rocket_amf_remoting();
+    Init_rocket_amf_raw();
+    Init_rocket_amf_memo();
+    Init_rocket_amf_transcoder();
+    Init_rocket_amf_json();
+    Init_rocket_amf_stats();
+    Init_rocket_amf_profile();
+    Init_rocket_amf_dispatcher();
 
     // Get refs to commonly used symbols and ids
     cStringIO = rb_const_get(rb_cObject, rb_intern("StringIO"));
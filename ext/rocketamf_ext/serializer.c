@@ -1,6 +1,17 @@
 #include "serializer.h"
+#include "raw.h"
+#include "memo.h"
+#include "class_mapping.h"
 #include "constants.h"
 #include "utility.h"
+#include "stats.h"
+#include "probes.h"
+#include <math.h>
+#ifdef HAVE_RB_STR_ENCODE
+#include <ruby/util.h>
+#else
+#include <util.h>
+#endif
 
 extern VALUE mRocketAMF;
 extern VALUE mRocketAMFExt;
@@ -12,19 +23,43 @@ extern VALUE sym_class_name;
 extern VALUE sym_members;
 extern VALUE sym_externalizable;
 extern VALUE sym_dynamic;
+extern VALUE cRaw;
+extern VALUE cMemoCache;
 VALUE cArrayCollection;
+VALUE cVector;
 ID id_haskey;
 ID id_encode_amf;
+static ID id_amf_memoizable;
 ID id_is_array_collection;
 ID id_use_array_collection;
 ID id_get_as_class_name;
+ID id_get_as_traits;
 ID id_props_for_serialization;
 ID id_utc;
 ID id_to_f;
 ID id_is_integer;
+ID id_to_a;
+ID id_each;
+ID id_size;
+ID id_keys;
+ID id_vector_type;
+ID id_vector_data;
+ID id_vector_fixed;
+ID id_vector_class_name;
+VALUE sym_io;
+VALUE sym_flush_size;
+VALUE sym_max_length;
+VALUE sym_memo;
+VALUE sym_sort_props;
+VALUE sym_dedupe;
+VALUE sym_profile;
+static VALUE sym_serialize;
+static VALUE sym_ivars;
+static VALUE shape_cache;
 
 static VALUE ser0_serialize(VALUE self, VALUE obj);
 static VALUE ser3_serialize(VALUE self, VALUE obj);
+static int ser_write_memo(VALUE self, VALUE obj);
 
 void ser_write_byte(AMF_SERIALIZER *ser, char byte) {
     char bytes[2] = {byte, '\0'};
@@ -94,18 +129,29 @@ void ser_get_string(VALUE obj, VALUE encode, char** str, long* len) {
     if(type == T_STRING) {
 #ifdef HAVE_RB_STR_ENCODE
         if(encode == Qtrue) {
-            rb_encoding *enc = rb_enc_get(obj);
-            if (enc != rb_ascii8bit_encoding()) {
-                rb_encoding *utf8 = rb_utf8_encoding();
-                if (enc != utf8) obj = rb_str_encode(obj, rb_enc_from_encoding(utf8), 0, Qnil);
+            // Only transcode if the string isn't already UTF-8 compatible. Plain
+            // ASCII in an ASCII compatible encoding is written as-is, and the
+            // coderange check is cached on the string after the first scan.
+            int enc_index = rb_enc_get_index(obj);
+            if(enc_index != rb_utf8_encindex() && enc_index != rb_ascii8bit_encindex()) {
+                if(!rb_enc_asciicompat(rb_enc_from_index(enc_index)) || rb_enc_str_coderange(obj) != ENC_CODERANGE_7BIT) {
+                    obj = rb_str_encode(obj, rb_enc_from_encoding(rb_utf8_encoding()), 0, Qnil);
+                }
             }
         }
 #endif
         *str = RSTRING_PTR(obj);
         *len = RSTRING_LEN(obj);
     } else if(type == T_SYMBOL) {
+#ifdef HAVE_RB_SYM2STR
+        // Ruby keeps a frozen string per symbol, so this avoids the strlen
+        VALUE sym_str = rb_sym2str(obj);
+        *str = RSTRING_PTR(sym_str);
+        *len = RSTRING_LEN(sym_str);
+#else
         *str = (char*)rb_id2name(SYM2ID(obj));
         *len = strlen(*str);
+#endif
     } else if(obj == Qnil) {
         *len = 0;
     } else {
@@ -114,7 +160,139 @@ void ser_get_string(VALUE obj, VALUE encode, char** str, long* len) {
 }
 
 /*
- * Write the given array in AMF0 notation
+ * Raises if the output would exceed the cap once another extra bytes are
+ * added to the buffer
+ */
+void ser_check_length(AMF_SERIALIZER *ser, long extra) {
+    long len = ser->flushed + RSTRING_LEN(ser->stream) + extra;
+    if(ser->max_length > 0 && len > ser->max_length) {
+        rb_raise(rb_eRangeError, "serialized output of %ld bytes exceeds max length of %ld", len, ser->max_length);
+    }
+}
+
+/*
+ * Gives up on backpatching the envelope body length held open at length_pos,
+ * marking it as unknown so that the body can be flushed as it's written
+ */
+static void ser_release_length(AMF_SERIALIZER *ser) {
+    rb_str_modify(ser->stream);
+    memset(RSTRING_PTR(ser->stream) + ser->length_pos, 0xFF, 4);
+    ser->length_pos = -1;
+    ser->flush_holds--;
+}
+
+/*
+ * Enforces the output cap, and writes the buffered output to the target IO if
+ * there is one and either the buffer has grown past the flush size or force is
+ * set. Nothing is written while a hold is open, even if forced, as the held
+ * output is still to be backpatched. The exception is an envelope body that
+ * outgrows the flush size, whose length is given up on instead. The buffer is
+ * replaced rather than truncated, as the IO may hold on to the string it was
+ * given.
+ */
+void ser_flush(AMF_SERIALIZER *ser, int force) {
+    long len = RSTRING_LEN(ser->stream);
+    ser_check_length(ser, 0);
+    if(ser->io == Qnil || len == 0) return;
+    if(ser->flush_holds == 1 && ser->length_pos >= 0 && len >= ser->flush_size) ser_release_length(ser);
+    if(ser->flush_holds > 0 || (!force && len < ser->flush_size)) return;
+
+    rb_io_write(ser->io, ser->stream);
+    ser->flushed += len;
+    ser->stream = rb_str_buf_new(ser->flush_size);
+}
+
+/*
+ * Only call into ser_flush if there's something for it to do
+ */
+#define SER_CHECK_FLUSH(ser) if(ser->io != Qnil || ser->max_length > 0) ser_flush(ser, 0);
+
+/*
+ * State for writing out the elements of an enumerator. len is the number of
+ * elements the array header promised, or -1 if the header gets backpatched
+ * once the enumerator is done.
+ */
+typedef struct {
+    VALUE self;
+    VALUE enumerator;
+    VALUE (*serialize)(VALUE self, VALUE obj);
+    long count;
+    long len;
+} SER_ENUM_STATE;
+
+/*
+ * Block for Enumerator#each that serializes each yielded element. Multiple
+ * yielded values are packed into an array, like Enumerator#to_a does.
+ */
+static VALUE ser_enum_iter(RB_BLOCK_CALL_FUNC_ARGLIST(elem, data)) {
+    SER_ENUM_STATE *state = (SER_ENUM_STATE *)data;
+    if(argc > 1) elem = rb_ary_new4(argc, argv);
+    if(state->len >= 0 && state->count >= state->len) {
+        rb_raise(rb_eRangeError, "enumerator yielded more than its size of %ld elements", state->len);
+    }
+    state->count++;
+    state->serialize(state->self, elem);
+    return Qnil;
+}
+
+static VALUE ser_enum_each(VALUE data) {
+    SER_ENUM_STATE *state = (SER_ENUM_STATE *)data;
+    rb_block_call(state->enumerator, id_each, 0, 0, ser_enum_iter, data);
+    return Qnil;
+}
+
+static VALUE ser_enum_release(VALUE data) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(((SER_ENUM_STATE *)data)->self, AMF_SERIALIZER, ser);
+    ser->flush_holds--;
+    return Qnil;
+}
+
+/*
+ * Returns the size an enumerator reports, or -1 if it doesn't know it
+ */
+static long ser_enum_size(VALUE enumerator) {
+    VALUE size = rb_funcall(enumerator, id_size, 0);
+    return FIXNUM_P(size) ? FIX2LONG(size) : -1;
+}
+
+/*
+ * Serializes the elements of an enumerator one at a time. If len is -1, the
+ * uint32 at len_pos in the stream is backpatched with the element count, and
+ * flushing is held off until then so the placeholder is still in the buffer.
+ */
+static void ser_write_enum(VALUE self, VALUE enumerator, long len, long len_pos, VALUE (*serialize)(VALUE, VALUE)) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    SER_ENUM_STATE state;
+    state.self = self;
+    state.enumerator = enumerator;
+    state.serialize = serialize;
+    state.count = 0;
+    state.len = len;
+
+    if(len >= 0) {
+        ser_enum_each((VALUE)&state);
+        if(state.count != len) {
+            rb_raise(rb_eRangeError, "enumerator yielded %ld elements but its size was %ld", state.count, len);
+        }
+    } else {
+        ser->flush_holds++;
+        rb_ensure(ser_enum_each, (VALUE)&state, ser_enum_release, (VALUE)&state);
+        if(state.count > 0xffffffff) rb_raise(rb_eRangeError, "int %ld out of range", state.count);
+        rb_str_modify(ser->stream);
+        unsigned char *ptr = (unsigned char *)RSTRING_PTR(ser->stream) + len_pos;
+        ptr[0] = (state.count >> 24) & 0xff;
+        ptr[1] = (state.count >> 16) & 0xff;
+        ptr[2] = (state.count >> 8) & 0xff;
+        ptr[3] = state.count & 0xff;
+    }
+}
+
+/*
+ * Write the given array in AMF0 notation. Enumerators are written as they are
+ * iterated, with the length backpatched if the enumerator has no size.
  */
 static void ser0_write_array(VALUE self, VALUE ary) {
     AMF_SERIALIZER *ser;
@@ -122,11 +300,20 @@ static void ser0_write_array(VALUE self, VALUE ary) {
 
     // Cache it
     st_add_direct(ser->obj_cache, ary, LONG2FIX(ser->obj_index));
+    STATS_INC(serializer.objects);
     ser->obj_index++;
 
     // Write it out
-    long i, len = RARRAY_LEN(ary);
     ser_write_byte(ser, AMF0_STRICT_ARRAY_MARKER);
+    if(TYPE(ary) != T_ARRAY) {
+        long len = ser_enum_size(ary);
+        long len_pos = RSTRING_LEN(ser->stream);
+        ser_write_uint32(ser, len >= 0 ? len : 0);
+        ser_write_enum(self, ary, len, len_pos, ser0_serialize);
+        return;
+    }
+
+    long i, len = RARRAY_LEN(ary);
     ser_write_uint32(ser, len);
     for(i = 0; i < len; i++) {
         ser0_serialize(self, RARRAY_PTR(ary)[i]);
@@ -153,6 +340,7 @@ static void ser0_write_string(AMF_SERIALIZER *ser, VALUE obj, VALUE write_marker
         ser_write_uint16(ser, len);
     }
     rb_str_buf_cat(ser->stream, str, len);
+    STATS_INC(serializer.strings);
 }
 
 /*
@@ -170,27 +358,84 @@ static int ser0_hash_iter(VALUE key, VALUE val, const VALUE args[1]) {
     return ST_CONTINUE;
 }
 
+/*
+ * Compares property keys bytewise, as String#<=> does
+ */
+static int ser_key_cmp(const void *a, const void *b, void *ignored) {
+    char *str_a = NULL, *str_b = NULL;
+    long len_a, len_b;
+    ser_get_string(*(VALUE*)a, Qfalse, &str_a, &len_a);
+    ser_get_string(*(VALUE*)b, Qfalse, &str_b, &len_b);
+    int cmp = memcmp(str_a, str_b, len_a < len_b ? len_a : len_b);
+    if(cmp != 0) return cmp;
+    return len_a < len_b ? -1 : (len_a > len_b ? 1 : 0);
+}
+
+static int ser_shape_iter(VALUE key, VALUE val, st_index_t *hash) {
+    st_index_t h = TYPE(key) == T_STRING ? rb_str_hash(key) : (st_index_t)key;
+    *hash += (h ^ (h >> 17)) * 0x9e3779b1;
+    return ST_CONTINUE;
+}
+
+/*
+ * Returns the keys of the props hash in sorted order. Sorted key lists are
+ * cached by an order-insensitive hash of the keys, so objects with the same
+ * properties, like all instances of a mapped class, are only sorted once. A
+ * cached list is only used after checking it holds exactly the same keys.
+ */
+static VALUE ser_sorted_keys(VALUE props) {
+    long i, len = RHASH_SIZE(props);
+    st_index_t hash = len;
+    rb_hash_foreach(props, ser_shape_iter, (st_data_t)&hash);
+    VALUE shape = LONG2FIX((long)(hash & (st_index_t)FIXNUM_MAX));
+
+    VALUE keys = rb_hash_lookup(shape_cache, shape);
+    if(keys != Qnil && RARRAY_LEN(keys) == len) {
+        for(i = 0; i < len; i++) {
+            if(rb_hash_lookup2(props, RARRAY_PTR(keys)[i], Qundef) == Qundef) break;
+        }
+        if(i == len) return keys;
+    }
+
+    keys = rb_funcall(props, id_keys, 0);
+    for(i = 0; i < len; i++) {
+        VALUE key = RARRAY_PTR(keys)[i];
+        if(TYPE(key) == T_STRING) rb_ary_store(keys, i, rb_str_new_frozen(key));
+    }
+    ruby_qsort(RARRAY_PTR(keys), len, sizeof(VALUE), ser_key_cmp, NULL);
+    rb_obj_freeze(keys);
+
+    if(RHASH_SIZE(shape_cache) >= MAX_SHAPE_CACHE) rb_hash_clear(shape_cache);
+    rb_hash_aset(shape_cache, shape, keys);
+    return keys;
+}
+
 /*
  * Used for both hashes and objects. Takes the object and the props hash or Qnil,
- * which forces a call to the class mapper for props for serialization. Prop
- * sorting must be enabled by an explicit call to extconf.rb, so the tests will
- * not pass typically on Ruby 1.8.
+ * which forces a call to the class mapper for props for serialization. Props
+ * are written in sorted order if the serializer has sort_props set.
  */
 static void ser0_write_object(VALUE self, VALUE obj, VALUE props) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    long frame = ser->prof ? profile_enter(ser->prof, ser->flushed + RSTRING_LEN(ser->stream)) : 0;
 
     // Cache it
     st_add_direct(ser->obj_cache, obj, LONG2FIX(ser->obj_index));
+    STATS_INC(serializer.objects);
     ser->obj_index++;
 
     // Make a request for props hash unless we already have it
     if(props == Qnil) {
-        props = rb_funcall(ser->class_mapper, id_props_for_serialization, 1, obj);
+        STATS_INC(serializer.mapper_calls);
+        PROBE_MAPPER_CALL("props_for_serialization", rb_obj_classname(obj));
+        props = profile_funcall(ser->prof, ser->class_mapper, id_props_for_serialization, 1, obj);
     }
 
     // Write header
-    VALUE class_name = rb_funcall(ser->class_mapper, id_get_as_class_name, 1, obj);
+    STATS_INC(serializer.mapper_calls);
+    PROBE_MAPPER_CALL("get_as_class_name", rb_obj_classname(obj));
+    VALUE class_name = profile_funcall(ser->prof, ser->class_mapper, id_get_as_class_name, 1, obj);
     if(class_name != Qnil) {
         ser_write_byte(ser, AMF0_TYPED_OBJECT_MARKER);
         ser0_write_string(ser, class_name, Qfalse);
@@ -200,20 +445,20 @@ static void ser0_write_object(VALUE self, VALUE obj, VALUE props) {
 
     // Write out data
     VALUE args[1] = {self};
-#ifdef SORT_PROPS
-    // Sort is required prior to Ruby 1.9 to pass all the tests, as Ruby 1.8 hashes don't store insert order
-    VALUE sorted_props = rb_funcall(props, rb_intern("sort"), 0);
-    long i, len = RARRAY_LEN(sorted_props);
-    for(i = 0; i < len; i++) {
-        VALUE pair = RARRAY_PTR(sorted_props)[i];
-        ser0_hash_iter(RARRAY_PTR(pair)[0], RARRAY_PTR(pair)[1], args);
+    if(ser->sort_props) {
+        VALUE keys = ser_sorted_keys(props);
+        long i, len = RARRAY_LEN(keys);
+        for(i = 0; i < len; i++) {
+            VALUE key = RARRAY_PTR(keys)[i];
+            ser0_hash_iter(key, rb_hash_lookup(props, key), args);
+        }
+    } else {
+        rb_hash_foreach(props, ser0_hash_iter, (st_data_t)args);
     }
-#else
-    rb_hash_foreach(props, ser0_hash_iter, (st_data_t)args);
-#endif
 
     ser_write_uint16(ser, 0);
     ser_write_byte(ser, AMF0_OBJECT_END_MARKER);
+    if(ser->prof) profile_leave(ser->prof, frame, rb_obj_class(obj), class_name, ser->flushed + RSTRING_LEN(ser->stream));
 }
 
 static void ser0_write_time(VALUE self, VALUE time) {
@@ -257,8 +502,13 @@ static VALUE ser0_serialize(VALUE self, VALUE obj) {
 
     VALUE obj_index;
     if(st_lookup(ser->obj_cache, obj, &obj_index)) {
+        STATS_INC(serializer.obj_refs);
         ser_write_byte(ser, AMF0_REFERENCE_MARKER);
         ser_write_uint16(ser, FIX2LONG(obj_index));
+    } else if(klass == cRaw) {
+        ser_write_raw(self, obj, obj);
+    } else if(ser->memo != Qnil && ser_write_memo(self, obj)) {
+        // Spliced from cache
     } else if(rb_respond_to(obj, id_encode_amf)) {
         rb_funcall(obj, id_encode_amf, 1, self);
     } else if(type == T_STRING || type == T_SYMBOL) {
@@ -277,10 +527,15 @@ static VALUE ser0_serialize(VALUE self, VALUE obj) {
         ser0_write_time(self, obj);
     } else if(klass == cDate || klass == cDateTime) {
         ser0_write_date(self, obj);
+    } else if(klass == cVector) {
+        ser0_write_array(self, rb_funcall(obj, id_to_a, 0)); // AMF0 has no vectors
+    } else if(rb_obj_is_kind_of(obj, rb_cEnumerator)) {
+        ser0_write_array(self, obj);
     } else if(type == T_HASH || type == T_OBJECT) {
         ser0_write_object(self, obj, Qnil);
     }
 
+    SER_CHECK_FLUSH(ser);
     return ser->stream;
 }
 
@@ -299,9 +554,11 @@ static void ser3_write_utf8vr(AMF_SERIALIZER *ser, VALUE obj) {
     if(len == 0) {
         ser_write_byte(ser, AMF3_EMPTY_STRING);
     } else if(st_lookup(ser->str_cache, (st_data_t)str, &str_index)) {
+        STATS_INC(serializer.str_refs);
         ser_write_int(ser, FIX2INT(str_index) << 1);
     } else {
         st_add_direct(ser->str_cache, (st_data_t)strdup(str), LONG2FIX(ser->str_index));
+        STATS_INC(serializer.strings);
         ser->str_index++;
 
         ser_write_int(ser, ((int)len) << 1 | 1);
@@ -344,12 +601,19 @@ static void ser3_write_array(VALUE self, VALUE ary) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
+    // AMF3 array lengths are variable width, so enumerators need a known size
+    int is_enum = TYPE(ary) != T_ARRAY;
+    long len = is_enum ? ser_enum_size(ary) : RARRAY_LEN(ary);
+    if(len < 0) rb_raise(rb_eArgError, "cannot serialize an enumerator without a size to AMF3");
+
     // Is it an array collection?
     VALUE is_ac = Qfalse;
     if(rb_respond_to(ary, id_is_array_collection)) {
         is_ac = rb_funcall(ary, id_is_array_collection, 0);
     } else {
-        is_ac = rb_funcall(ser->class_mapper, id_use_array_collection, 0);
+        STATS_INC(serializer.mapper_calls);
+        PROBE_MAPPER_CALL("use_array_collection", rb_obj_classname(ary));
+        is_ac = profile_funcall(ser->prof, ser->class_mapper, id_use_array_collection, 0);
     }
 
     // Write type marker
@@ -358,10 +622,12 @@ static void ser3_write_array(VALUE self, VALUE ary) {
     // Write object ref, or cache it
     VALUE obj_index;
     if(st_lookup(ser->obj_cache, ary, &obj_index)) {
+        STATS_INC(serializer.obj_refs);
         ser_write_int(ser, FIX2INT(obj_index) << 1);
         return;
     } else {
         st_add_direct(ser->obj_cache, ary, LONG2FIX(ser->obj_index));
+        STATS_INC(serializer.objects);
         ser->obj_index++;
         if(is_ac) ser->obj_index++; // The array collection source array
     }
@@ -371,9 +637,11 @@ static void ser3_write_array(VALUE self, VALUE ary) {
         VALUE trait_index;
         char array_collection_name[34] = "flex.messaging.io.ArrayCollection";
         if(st_lookup(ser->trait_cache, (st_data_t)array_collection_name, &trait_index)) {
+            STATS_INC(serializer.trait_refs);
             ser_write_int(ser, FIX2INT(trait_index) << 2 | 0x01);
         } else {
             st_add_direct(ser->trait_cache, (st_data_t)strdup(array_collection_name), LONG2FIX(ser->trait_index));
+            STATS_INC(serializer.traits);
             ser->trait_index++;
             ser_write_byte(ser, 0x07); // Trait header
             ser3_write_utf8vr(ser, rb_str_new2(array_collection_name));
@@ -382,17 +650,171 @@ static void ser3_write_array(VALUE self, VALUE ary) {
     }
 
     // Write header
-    int header = ((int)RARRAY_LEN(ary)) << 1 | 1;
+    int header = ((int)len) << 1 | 1;
     ser_write_int(ser, header);
     ser_write_byte(ser, AMF3_CLOSE_DYNAMIC_ARRAY);
 
     // Write contents
-    long i, len = RARRAY_LEN(ary);
+    if(is_enum) {
+        ser_write_enum(self, ary, len, 0, ser3_serialize);
+        return;
+    }
+    long i;
     for(i = 0; i < len; i++) {
         ser3_serialize(self, RARRAY_PTR(ary)[i]);
     }
 }
 
+/*
+ * Byte swapping kernels for vector data. Values are copied through memcpy so
+ * the source buffer doesn't need to be aligned.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define SER_BSWAP32(v) __builtin_bswap32(v)
+#define SER_BSWAP64(v) __builtin_bswap64(v)
+#else
+#define SER_BSWAP32(v) ((((v) & 0xff) << 24) | (((v) & 0xff00) << 8) | (((v) >> 8) & 0xff00) | ((v) >> 24))
+#define SER_BSWAP64(v) (((uint64_t)SER_BSWAP32((uint32_t)(v)) << 32) | SER_BSWAP32((uint32_t)((v) >> 32)))
+#endif
+
+static inline void ser_pack_uint32(char *dst, uint32_t val) {
+#ifndef WORDS_BIGENDIAN
+    val = SER_BSWAP32(val);
+#endif
+    memcpy(dst, &val, 4);
+}
+
+static inline void ser_pack_double(char *dst, double num) {
+    uint64_t val;
+    memcpy(&val, &num, 8);
+#ifndef WORDS_BIGENDIAN
+    val = SER_BSWAP64(val);
+#endif
+    memcpy(dst, &val, 8);
+}
+
+/*
+ * Converts a buffer of count native order values that are width bytes wide
+ * into network order in one pass
+ */
+static void ser_swap_buffer(char *dst, const char *src, long count, int width) {
+#ifdef WORDS_BIGENDIAN
+    memcpy(dst, src, count * width);
+#else
+    long i;
+    if(width == 4) {
+        uint32_t val;
+        for(i = 0; i < count; i++) {
+            memcpy(&val, src + i*4, 4);
+            val = SER_BSWAP32(val);
+            memcpy(dst + i*4, &val, 4);
+        }
+    } else {
+        uint64_t val;
+        for(i = 0; i < count; i++) {
+            memcpy(&val, src + i*8, 8);
+            val = SER_BSWAP64(val);
+            memcpy(dst + i*8, &val, 8);
+        }
+    }
+#endif
+}
+
+/*
+ * Grows the stream by len bytes and returns a pointer to the new space
+ */
+static char* ser_reserve(AMF_SERIALIZER *ser, long len) {
+    long pos = RSTRING_LEN(ser->stream);
+    rb_str_resize(ser->stream, pos + len);
+    return RSTRING_PTR(ser->stream) + pos;
+}
+
+/*
+ * Writes a RocketAMF::Values::Vector using AMF3 notation. Numeric vectors are
+ * written without per-element markers, and packed string data is byte
+ * swapped in bulk.
+ */
+static void ser3_write_vector(VALUE self, VALUE vec) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    VALUE type = rb_ivar_get(vec, id_vector_type);
+    VALUE data = rb_ivar_get(vec, id_vector_data);
+    ID type_id = SYM2ID(type);
+    char marker;
+    int width = 0;
+    if(type_id == rb_intern("int")) {
+        marker = AMF3_VECTOR_INT_MARKER;
+        width = 4;
+    } else if(type_id == rb_intern("uint")) {
+        marker = AMF3_VECTOR_UINT_MARKER;
+        width = 4;
+    } else if(type_id == rb_intern("double")) {
+        marker = AMF3_VECTOR_DOUBLE_MARKER;
+        width = 8;
+    } else if(type_id == rb_intern("object")) {
+        marker = AMF3_VECTOR_OBJECT_MARKER;
+    } else {
+        rb_raise(rb_eArgError, "unsupported vector type %s", rb_id2name(type_id));
+    }
+
+    ser_write_byte(ser, marker);
+
+    // Write object ref, or cache it
+    VALUE obj_index;
+    if(st_lookup(ser->obj_cache, vec, &obj_index)) {
+        STATS_INC(serializer.obj_refs);
+        ser_write_int(ser, FIX2INT(obj_index) << 1);
+        return;
+    } else {
+        st_add_direct(ser->obj_cache, vec, LONG2FIX(ser->obj_index));
+        STATS_INC(serializer.objects);
+        ser->obj_index++;
+    }
+
+    // Write header and fixed flag
+    long i, len;
+    int packed = TYPE(data) == T_STRING;
+    if(packed) {
+        if(width == 0 || RSTRING_LEN(data) % width != 0) rb_raise(rb_eArgError, "packed vector data length must be a multiple of %d", width);
+        len = RSTRING_LEN(data) / width;
+    } else {
+        Check_Type(data, T_ARRAY);
+        len = RARRAY_LEN(data);
+    }
+    ser_write_int(ser, ((int)len) << 1 | 1);
+    ser_write_byte(ser, RTEST(rb_ivar_get(vec, id_vector_fixed)) ? 1 : 0);
+
+    // Write contents
+    if(marker == AMF3_VECTOR_OBJECT_MARKER) {
+        ser3_write_utf8vr(ser, rb_ivar_get(vec, id_vector_class_name));
+        for(i = 0; i < len; i++) {
+            ser3_serialize(self, RARRAY_PTR(data)[i]);
+        }
+    } else if(packed) {
+        char *dst = ser_reserve(ser, len * width);
+        ser_swap_buffer(dst, RSTRING_PTR(data), len, width);
+    } else {
+        // Convert everything before reserving space, as conversion can call
+        // back into ruby. The scratch buffer is a ruby string so that it's
+        // collected if a conversion raises.
+        VALUE scratch = rb_str_new(NULL, len * width);
+        char *buf = RSTRING_PTR(scratch);
+        for(i = 0; i < len; i++) {
+            VALUE elem = RARRAY_PTR(data)[i];
+            if(marker == AMF3_VECTOR_DOUBLE_MARKER) {
+                ser_pack_double(buf + i*8, NUM2DBL(elem));
+            } else if(marker == AMF3_VECTOR_INT_MARKER) {
+                ser_pack_uint32(buf + i*4, (uint32_t)NUM2INT(elem));
+            } else {
+                ser_pack_uint32(buf + i*4, (uint32_t)NUM2UINT(elem));
+            }
+        }
+        rb_str_buf_cat(ser->stream, buf, len * width);
+        RB_GC_GUARD(scratch);
+    }
+}
+
 /*
  * AMF3 property hash write iterator. Checks the args->extra hash, if given,
  * and skips properties that are keys in that hash.
@@ -410,31 +832,36 @@ static int ser3_hash_iter(VALUE key, VALUE val, const VALUE args[2]) {
 }
 
 /*
- * Used for both hashes and objects. Takes the object and the props hash or Qnil,
- * which forces a call to the class mapper for props for serialization. Prop
- * sorting must be enabled by an explicit call to extconf.rb, so the tests will
- * not pass typically on Ruby 1.8. If you need to have specific traits, you can
- * also pass that in, or pass Qnil to use the default traits - dynamic with no
- * defined members.
+ * Looks up a sealed member's value. Hash keys may be strings or symbols,
+ * whichever way the member was declared.
  */
-static void ser3_write_object(VALUE self, VALUE obj, VALUE props, VALUE traits) {
+static VALUE ser3_member_value(VALUE props, VALUE member) {
+    VALUE val = rb_hash_lookup2(props, member, Qundef);
+    if(val != Qundef) return val;
+    if(TYPE(member) == T_SYMBOL) return rb_hash_aref(props, rb_sym_to_s(member));
+    if(TYPE(member) == T_STRING) return rb_hash_aref(props, rb_str_intern(member));
+    return Qnil;
+}
+
+/*
+ * Reads a sealed member straight from its getter, or nil if the object has no
+ * public getter taking no arguments, just as the props hash would have it
+ */
+static VALUE ser3_member_getter(VALUE obj, VALUE member) {
+    ID getter = TYPE(member) == T_SYMBOL ? SYM2ID(member) : rb_intern_str(member);
+    if(!rb_respond_to(obj, getter) || rb_obj_method_arity(obj, getter) != 0) return Qnil;
+    return rb_funcall(obj, getter, 0);
+}
+
+/*
+ * Writes the traits and properties of an object that isn't a reference, and
+ * returns its AS class name
+ */
+static VALUE ser3_write_object_body(VALUE self, VALUE obj, VALUE props, VALUE traits) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
     long i;
 
-    // Write type marker
-    ser_write_byte(ser, AMF3_OBJECT_MARKER);
-
-    // Write object ref, or cache it
-    VALUE obj_index;
-    if(st_lookup(ser->obj_cache, obj, &obj_index)) {
-        ser_write_int(ser, FIX2INT(obj_index) << 1);
-        return;
-    } else {
-        st_add_direct(ser->obj_cache, obj, LONG2FIX(ser->obj_index));
-        ser->obj_index++;
-    }
-
     // Extract traits data, or use defaults
     VALUE is_default = Qfalse;
     VALUE class_name = Qnil;
@@ -442,9 +869,25 @@ static void ser3_write_object(VALUE self, VALUE obj, VALUE props, VALUE traits)
     long members_len = 0;
     VALUE dynamic = Qtrue;
     VALUE externalizable = Qfalse;
+    int getters = 0;
+    if(traits == Qnil && ser->mapper_traits) {
+        STATS_INC(serializer.mapper_calls);
+        PROBE_MAPPER_CALL("get_as_traits", rb_obj_classname(obj));
+        traits = profile_funcall(ser->prof, ser->class_mapper, id_get_as_traits, 1, obj);
+        if(traits == Qnil) is_default = Qtrue;
+
+        // The fast mapper reads props straight from getters, so do the same for
+        // sealed members rather than building a props hash, unless a subclass
+        // has its own way of reading them
+        getters = TYPE(obj) != T_HASH && ser->mapper_getters;
+    }
     if(traits == Qnil) {
-        class_name = rb_funcall(ser->class_mapper, id_get_as_class_name, 1, obj);
-        if(class_name == Qnil) is_default = Qtrue;
+        if(is_default == Qfalse) {
+            STATS_INC(serializer.mapper_calls);
+            PROBE_MAPPER_CALL("get_as_class_name", rb_obj_classname(obj));
+            class_name = profile_funcall(ser->prof, ser->class_mapper, id_get_as_class_name, 1, obj);
+            if(class_name == Qnil) is_default = Qtrue;
+        }
     } else {
         class_name = rb_hash_aref(traits, sym_class_name);
         members = rb_hash_aref(traits, sym_members);
@@ -459,10 +902,12 @@ static void ser3_write_object(VALUE self, VALUE obj, VALUE props, VALUE traits)
     if(is_default == Qtrue || class_name != Qnil) {
         const char *ref_class_name = is_default == Qtrue ? "__default__" : RSTRING_PTR(class_name);
         if(st_lookup(ser->trait_cache, (st_data_t)ref_class_name, &trait_index)) {
+            STATS_INC(serializer.trait_refs);
             ser_write_int(ser, FIX2INT(trait_index) << 2 | 0x01);
             did_ref = 1;
         } else {
             st_add_direct(ser->trait_cache, (st_data_t)strdup(ref_class_name), LONG2FIX(ser->trait_index));
+            STATS_INC(serializer.traits);
             ser->trait_index++;
         }
     }
@@ -487,38 +932,107 @@ static void ser3_write_object(VALUE self, VALUE obj, VALUE props, VALUE traits)
 
     // Raise exception if marked externalizable
     if(externalizable == Qtrue) {
+        PROBE_WRITE_EXTERNAL_START(rb_obj_classname(obj));
+#ifdef AMF_DTRACE
+        long external_len = ser->flushed + RSTRING_LEN(ser->stream);
+#endif
         rb_funcall(obj, rb_intern("write_external"), 1, self);
-        return;
+        PROBE_WRITE_EXTERNAL_DONE(rb_obj_classname(obj), ser->flushed + RSTRING_LEN(ser->stream) - external_len);
+        return class_name;
+    }
+
+    // Classes mapped with :ivars write instance variables straight out
+    VALUE ivars = getters && props == Qnil ? rb_hash_aref(traits, sym_ivars) : Qnil;
+    if(ivars != Qnil) {
+        VALUE pairs = mapping_ivars(ser->class_mapper, obj, ivars);
+        long pairs_len = RARRAY_LEN(pairs);
+        for(i = 0; i < pairs_len; i++) {
+            VALUE pair = RARRAY_PTR(pairs)[i];
+            if(dynamic == Qtrue) ser3_write_utf8vr(ser, RARRAY_PTR(pair)[1]);
+            ser3_serialize(self, rb_attr_get(obj, SYM2ID(RARRAY_PTR(pair)[0])));
+        }
+        if(dynamic == Qtrue) ser_write_byte(ser, AMF3_CLOSE_DYNAMIC_OBJECT);
+        return class_name;
+    }
+
+    // Positional fast path for sealed classes
+    if(getters && props == Qnil && dynamic != Qtrue) {
+        for(i = 0; i < members_len; i++) {
+            ser3_serialize(self, ser3_member_getter(obj, RARRAY_PTR(members)[i]));
+        }
+        return class_name;
     }
 
     // Make a request for props hash unless we already have it
     if(props == Qnil) {
-        props = rb_funcall(ser->class_mapper, id_props_for_serialization, 1, obj);
+        STATS_INC(serializer.mapper_calls);
+        PROBE_MAPPER_CALL("props_for_serialization", rb_obj_classname(obj));
+        props = profile_funcall(ser->prof, ser->class_mapper, id_props_for_serialization, 1, obj);
     }
 
     // Write sealed members
     VALUE skipped_members = members_len ? rb_hash_new() : Qnil;
     for(i = 0; i < members_len; i++) {
-        ser3_serialize(self, rb_hash_aref(props, RARRAY_PTR(members)[i]));
+        ser3_serialize(self, ser3_member_value(props, RARRAY_PTR(members)[i]));
         rb_hash_aset(skipped_members, RARRAY_PTR(members)[i], Qtrue);
     }
 
     // Write dynamic properties
     if(dynamic == Qtrue) {
         VALUE args[2] = {self, skipped_members};
-#ifdef SORT_PROPS
-        // Sort is required prior to Ruby 1.9 to pass all the tests, as Ruby 1.8 hashes don't store insert order
-        VALUE sorted_props = rb_funcall(props, rb_intern("sort"), 0);
-        for(i = 0; i < RARRAY_LEN(sorted_props); i++) {
-            VALUE pair = RARRAY_PTR(sorted_props)[i];
-            ser3_hash_iter(RARRAY_PTR(pair)[0], RARRAY_PTR(pair)[1], args);
+        if(ser->sort_props) {
+            VALUE keys = ser_sorted_keys(props);
+            for(i = 0; i < RARRAY_LEN(keys); i++) {
+                VALUE key = RARRAY_PTR(keys)[i];
+                ser3_hash_iter(key, rb_hash_lookup(props, key), args);
+            }
+        } else {
+            rb_hash_foreach(props, ser3_hash_iter, (st_data_t)args);
         }
-#else
-        rb_hash_foreach(props, ser3_hash_iter, (st_data_t)args);
-#endif
 
         ser_write_byte(ser, AMF3_CLOSE_DYNAMIC_OBJECT);
     }
+
+    return class_name;
+}
+
+/*
+ * Used for both hashes and objects. Takes the object and the props hash or Qnil,
+ * which forces a call to the class mapper for props for serialization. Prop
+ * sorting must be enabled by an explicit call to extconf.rb, so the tests will
+ * not pass typically on Ruby 1.8. If you need to have specific traits, you can
+ * also pass that in, or pass Qnil to use the class mapper's traits if it has
+ * <tt>get_as_traits</tt>, or the default traits - dynamic with no defined
+ * members.
+ */
+static void ser3_write_object(VALUE self, VALUE obj, VALUE props, VALUE traits) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+    long start_pos = ser->flushed + RSTRING_LEN(ser->stream);
+
+    // Write type marker
+    ser_write_byte(ser, AMF3_OBJECT_MARKER);
+
+    // Write object ref, or cache it
+    VALUE obj_index;
+    if(st_lookup(ser->obj_cache, obj, &obj_index)) {
+        STATS_INC(serializer.obj_refs);
+        ser_write_int(ser, FIX2INT(obj_index) << 1);
+        return;
+    } else {
+        st_add_direct(ser->obj_cache, obj, LONG2FIX(ser->obj_index));
+        STATS_INC(serializer.objects);
+        ser->obj_index++;
+    }
+
+    // Write the rest, attributing it to the object's classes when profiling
+    if(ser->prof) {
+        long frame = profile_enter(ser->prof, start_pos);
+        VALUE class_name = ser3_write_object_body(self, obj, props, traits);
+        profile_leave(ser->prof, frame, rb_obj_class(obj), class_name, ser->flushed + RSTRING_LEN(ser->stream));
+    } else {
+        ser3_write_object_body(self, obj, props, traits);
+    }
 }
 
 static void ser3_write_time(VALUE self, VALUE time_obj) {
@@ -530,10 +1044,12 @@ static void ser3_write_time(VALUE self, VALUE time_obj) {
     // Write object ref, or cache it
     VALUE obj_index;
     if(st_lookup(ser->obj_cache, time_obj, &obj_index)) {
+        STATS_INC(serializer.obj_refs);
         ser_write_int(ser, FIX2INT(obj_index) << 1);
         return;
     } else {
         st_add_direct(ser->obj_cache, time_obj, LONG2FIX(ser->obj_index));
+        STATS_INC(serializer.objects);
         ser->obj_index++;
     }
 
@@ -554,10 +1070,12 @@ static void ser3_write_date(VALUE self, VALUE date) {
     // Write object ref, or cache it
     VALUE obj_index;
     if(st_lookup(ser->obj_cache, date, &obj_index)) {
+        STATS_INC(serializer.obj_refs);
         ser_write_int(ser, FIX2INT(obj_index) << 1);
         return;
     } else {
         st_add_direct(ser->obj_cache, date, LONG2FIX(ser->obj_index));
+        STATS_INC(serializer.objects);
         ser->obj_index++;
     }
 
@@ -576,10 +1094,12 @@ static void ser3_write_byte_array(VALUE self, VALUE ba) {
     // Write object ref, or cache it
     VALUE obj_index;
     if(st_lookup(ser->obj_cache, ba, &obj_index)) {
+        STATS_INC(serializer.obj_refs);
         ser_write_int(ser, FIX2INT(obj_index) << 1);
         return;
     } else {
         st_add_direct(ser->obj_cache, ba, LONG2FIX(ser->obj_index));
+        STATS_INC(serializer.objects);
         ser->obj_index++;
     }
 
@@ -590,6 +1110,67 @@ static void ser3_write_byte_array(VALUE self, VALUE ba) {
     rb_str_buf_cat(ser->stream, RSTRING_PTR(str), RSTRING_LEN(str));
 }
 
+/*
+ * Checks that a hash or array holds nothing but plain values: nil, booleans,
+ * numbers, symbols, strings and more plain hashes and arrays, none of them
+ * subclassed or extended. Equal plain subtrees always encode the same way.
+ * Deeper nesting than SER_DEDUPE_MAX_DEPTH, which includes any cycle, fails.
+ */
+#define SER_DEDUPE_MAX_DEPTH 32
+static int ser_dedupe_plain(VALUE obj, int depth);
+static int ser_dedupe_plain_iter(VALUE key, VALUE val, st_data_t arg) {
+    int *depth = (int*)arg;
+    if(ser_dedupe_plain(key, *depth) && ser_dedupe_plain(val, *depth)) return ST_CONTINUE;
+    *depth = -1;
+    return ST_STOP;
+}
+static int ser_dedupe_plain(VALUE obj, int depth) {
+    switch(TYPE(obj)) {
+        case T_NIL:
+        case T_TRUE:
+        case T_FALSE:
+        case T_FIXNUM:
+        case T_BIGNUM:
+        case T_SYMBOL:
+            return 1;
+        case T_FLOAT:
+            // -0.0 hashes and compares equal to 0.0
+            return !signbit(RFLOAT_VALUE(obj));
+        case T_STRING:
+            return CLASS_OF(obj) == rb_cString;
+        case T_ARRAY:
+            if(CLASS_OF(obj) != rb_cArray || depth >= SER_DEDUPE_MAX_DEPTH) return 0;
+            long i, len = RARRAY_LEN(obj);
+            for(i = 0; i < len; i++) {
+                if(!ser_dedupe_plain(RARRAY_PTR(obj)[i], depth + 1)) return 0;
+            }
+            return 1;
+        case T_HASH:
+            if(CLASS_OF(obj) != rb_cHash || depth >= SER_DEDUPE_MAX_DEPTH) return 0;
+            int child_depth = depth + 1;
+            rb_hash_foreach(obj, ser_dedupe_plain_iter, (st_data_t)&child_depth);
+            return child_depth != -1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * With <tt>:dedupe</tt>, a plain hash or array equal to one already written is
+ * registered under that one's object index, so writing it emits a reference.
+ * Otherwise it's remembered under the index it's about to be written with.
+ */
+static void ser3_dedupe(AMF_SERIALIZER *ser, VALUE obj) {
+    if(st_lookup(ser->obj_cache, obj, 0) || !ser_dedupe_plain(obj, 0)) return;
+
+    VALUE obj_index = rb_hash_lookup2(ser->dedupe_cache, obj, Qundef);
+    if(obj_index != Qundef) {
+        st_add_direct(ser->obj_cache, obj, obj_index);
+    } else {
+        rb_hash_aset(ser->dedupe_cache, obj, LONG2FIX(ser->obj_index));
+    }
+}
+
 /*
  * Serializes the object to a string and returns that string
  */
@@ -603,7 +1184,11 @@ static VALUE ser3_serialize(VALUE self, VALUE obj) {
         klass = CLASS_OF(obj);
     }
 
-    if(rb_respond_to(obj, id_encode_amf)) {
+    if(klass == cRaw) {
+        ser_write_raw(self, obj, obj);
+    } else if(ser->memo != Qnil && ser_write_memo(self, obj)) {
+        // Spliced from cache
+    } else if(rb_respond_to(obj, id_encode_amf)) {
         rb_funcall(obj, id_encode_amf, 1, self);
     } else if(type == T_STRING || type == T_SYMBOL) {
         ser_write_byte(ser, AMF3_STRING_MARKER);
@@ -617,8 +1202,10 @@ static VALUE ser3_serialize(VALUE self, VALUE obj) {
     } else if(type == T_FALSE) {
         ser_write_byte(ser, AMF3_FALSE_MARKER);
     } else if(type == T_ARRAY) {
+        if(ser->dedupe_cache != Qnil) ser3_dedupe(ser, obj);
         ser3_write_array(self, obj);
     } else if(type == T_HASH) {
+        if(ser->dedupe_cache != Qnil) ser3_dedupe(ser, obj);
         ser3_write_object(self, obj, Qnil, Qnil);
     } else if(klass == rb_cTime) {
         ser3_write_time(self, obj);
@@ -626,10 +1213,15 @@ static VALUE ser3_serialize(VALUE self, VALUE obj) {
         ser3_write_date(self, obj);
     } else if(klass == cStringIO) {
         ser3_write_byte_array(self, obj);
+    } else if(klass == cVector) {
+        ser3_write_vector(self, obj);
+    } else if(rb_obj_is_kind_of(obj, rb_cEnumerator)) {
+        ser3_write_array(self, obj);
     } else if(type == T_OBJECT) {
         ser3_write_object(self, obj, Qnil, Qnil);
     }
 
+    SER_CHECK_FLUSH(ser);
     return ser->stream;
 }
 
@@ -640,6 +1232,11 @@ static void ser_mark(AMF_SERIALIZER *ser) {
     if(!ser) return;
     rb_gc_mark(ser->class_mapper);
     rb_gc_mark(ser->stream);
+    rb_gc_mark(ser->io);
+    rb_gc_mark(ser->memo);
+    rb_gc_mark(ser->dedupe_cache);
+    rb_gc_mark(ser->profile);
+    profile_mark(ser->prof);
 }
 
 /*
@@ -666,9 +1263,14 @@ static inline void ser_free_cache(AMF_SERIALIZER *ser) {
         st_free_table(ser->obj_cache);
         ser->obj_cache = NULL;
     }
+    if(ser->memo_misses) {
+        st_free_table(ser->memo_misses);
+        ser->memo_misses = NULL;
+    }
 }
 static void ser_free(AMF_SERIALIZER *ser) {
     ser_free_cache(ser);
+    profile_free(ser->prof);
     xfree(ser);
 }
 
@@ -679,19 +1281,277 @@ static VALUE ser_alloc(VALUE klass) {
     // Allocate struct
     AMF_SERIALIZER *ser = ALLOC(AMF_SERIALIZER);
     memset(ser, 0, sizeof(AMF_SERIALIZER));
+    ser->length_pos = -1;
     return Data_Wrap_Struct(klass, ser_mark, ser_free, ser);
 }
 
 /*
- * Initializer
+ * Checks that the object's encoding can't change: it has to be a frozen
+ * string, or a frozen plain hash or array holding only such values,
+ * immediates and numbers. Any other object has to vouch for itself by
+ * returning true from <tt>amf_memoizable?</tt>, as its encoding comes from
+ * the class mapper and its methods rather than what's frozen. Cycles are fine,
+ * as visited objects are skipped.
  */
-static VALUE ser_initialize(VALUE self, VALUE class_mapper) {
+typedef struct {
+    st_table *seen;
+    int memoizable;
+} SER_MEMO_CHECK;
+
+static int ser_memoizable(VALUE obj, SER_MEMO_CHECK *check);
+static int ser_memoizable_iter(VALUE key, VALUE val, st_data_t arg) {
+    SER_MEMO_CHECK *check = (SER_MEMO_CHECK*)arg;
+    if(ser_memoizable(key, check) && ser_memoizable(val, check)) return ST_CONTINUE;
+    check->memoizable = 0;
+    return ST_STOP;
+}
+static int ser_opts_in_memo(VALUE obj) {
+    return rb_respond_to(obj, id_amf_memoizable) && RTEST(rb_funcall(obj, id_amf_memoizable, 0));
+}
+static int ser_memoizable(VALUE obj, SER_MEMO_CHECK *check) {
+    if(SPECIAL_CONST_P(obj)) return 1;
+    int type = TYPE(obj);
+    if(type == T_FLOAT || type == T_BIGNUM || type == T_SYMBOL) return 1;
+    VALUE klass = rb_obj_class(obj);
+    if(klass != rb_cString && klass != rb_cHash && klass != rb_cArray) return ser_opts_in_memo(obj);
+    if(!OBJ_FROZEN(obj)) return 0;
+    if(type == T_STRING) return 1;
+    if(st_lookup(check->seen, obj, 0)) return 1;
+    st_add_direct(check->seen, obj, 0);
+
+    long i, len;
+    if(type == T_ARRAY) {
+        len = RARRAY_LEN(obj);
+        for(i = 0; i < len; i++) {
+            if(!ser_memoizable(RARRAY_PTR(obj)[i], check)) return 0;
+        }
+    } else {
+        rb_hash_foreach(obj, ser_memoizable_iter, (st_data_t)check);
+    }
+    return check->memoizable;
+}
+
+static int ser_memo_objs_iter(st_data_t key, st_data_t val, st_data_t objs) {
+    rb_ary_store((VALUE)objs, FIX2LONG((VALUE)val), (VALUE)key);
+    return ST_CONTINUE;
+}
+
+static int ser_memo_strs_iter(st_data_t key, st_data_t val, st_data_t strs) {
+    rb_ary_store((VALUE)strs, FIX2LONG((VALUE)val), rb_str_new2((const char*)key));
+    return ST_CONTINUE;
+}
+
+/*
+ * Adds the strings or traits written by a spliced fragment to the live table,
+ * so later values can reference them just as if the fragment had been encoded
+ * in place. Ones already in the table stay pointing at the earlier copy.
+ */
+static void ser_memo_add_strs(st_table *table, VALUE strs, long base) {
+    long i, len = RARRAY_LEN(strs);
+    for(i = 0; i < len; i++) {
+        VALUE str = RARRAY_PTR(strs)[i];
+        if(str == Qnil || st_lookup(table, (st_data_t)RSTRING_PTR(str), 0)) continue;
+        st_add_direct(table, (st_data_t)strdup(RSTRING_PTR(str)), LONG2FIX(base + i));
+    }
+}
+
+static VALUE ser_memo_raw(VALUE sub_self) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(sub_self, AMF_SERIALIZER, ser);
+    return raw_new(ser->stream, ser->version);
+}
+
+static VALUE ser_memo_raw_failed(VALUE arg, VALUE err) {
+    return Qfalse;
+}
+
+/*
+ * Encodes the object on its own, and returns an array of the resulting Raw and
+ * the objects, strings and trait names it holds in the order they appear in
+ * the reference tables. Returns false if the object can't be memoized.
+ */
+static VALUE ser_memo_encode(VALUE self, VALUE obj) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    SER_MEMO_CHECK check = {st_init_numtable(), 1};
+    int memoizable = ser_memoizable(obj, &check);
+    st_free_table(check.seen);
+    if(!memoizable) return Qfalse;
+
+    VALUE sub_self = rb_class_new_instance(1, &ser->class_mapper, cSerializer);
+    AMF_SERIALIZER *sub;
+    Data_Get_Struct(sub_self, AMF_SERIALIZER, sub);
+    sub->version = ser->version;
+    sub->sort_props = ser->sort_props;
+    sub->obj_cache = st_init_numtable();
+    if(sub->version == 3) {
+        sub->str_cache = st_init_strtable();
+        sub->trait_cache = st_init_strtable();
+    }
+    sub->depth = 1;
+    if(sub->version == 0) {
+        ser0_serialize(sub_self, obj);
+    } else {
+        ser3_serialize(sub_self, obj);
+    }
+
+    VALUE objs = rb_ary_new2(sub->obj_index);
+    VALUE strs = rb_ary_new();
+    VALUE traits = rb_ary_new();
+    st_foreach(sub->obj_cache, ser_memo_objs_iter, (st_data_t)objs);
+    if(sub->version == 3) {
+        st_foreach(sub->str_cache, ser_memo_strs_iter, (st_data_t)strs);
+        st_foreach(sub->trait_cache, ser_memo_strs_iter, (st_data_t)traits);
+    }
+    ser_free_cache(sub);
+
+    VALUE raw = rb_rescue2(ser_memo_raw, sub_self, ser_memo_raw_failed, Qnil, rb_eArgError, (VALUE)0);
+    if(raw == Qfalse) return Qfalse;
+    return rb_obj_freeze(rb_ary_new3(4, raw, objs, strs, traits));
+}
+
+/*
+ * Splices the memoized encoding of the object into the stream, encoding and
+ * caching it first if it hasn't been seen before. Returns false if the object
+ * needs to be serialized normally, either because it isn't memoizable or
+ * because an object inside it has already been written and must be referenced.
+ * Strings and traits already written are repeated rather than referenced.
+ * Only encodings go in the shared cache. Objects that turn out not to be
+ * memoizable are remembered for this call only, so the cache never holds on
+ * to them.
+ */
+static int ser_write_memo(VALUE self, VALUE obj) {
     AMF_SERIALIZER *ser;
     Data_Get_Struct(self, AMF_SERIALIZER, ser);
 
+    // Cheap checks first, as this is tried for every object written
+    VALUE klass = rb_obj_class(obj);
+    if(klass == rb_cHash || klass == rb_cArray) {
+        if(!OBJ_FROZEN(obj)) return 0;
+    } else if(TYPE(obj) != T_OBJECT || !ser_opts_in_memo(obj)) {
+        return 0;
+    }
+    if(ser->memo_misses && st_lookup(ser->memo_misses, obj, 0)) return 0;
+
+    long context = ser->memo_contexts[ser->version == 0 ? 0 : 1];
+    VALUE entry = memo_get(ser->memo, context, obj);
+    if(entry == Qundef) {
+        if(memo_full(ser->memo)) return 0;
+        entry = ser_memo_encode(self, obj);
+        if(entry == Qfalse) {
+            if(!ser->memo_misses) ser->memo_misses = st_init_numtable();
+            st_insert(ser->memo_misses, obj, 0);
+            return 0;
+        }
+        memo_set(ser->memo, context, obj, entry);
+    }
+
+    VALUE objs = RARRAY_PTR(entry)[1];
+    long i, len = RARRAY_LEN(objs);
+    for(i = 0; i < len; i++) {
+        if(st_lookup(ser->obj_cache, RARRAY_PTR(objs)[i], 0)) return 0;
+    }
+
+    // Register everything inside so that later references to it still work
+    long obj_base = ser->obj_index;
+    long str_base = ser->str_index;
+    long trait_base = ser->trait_index;
+    ser_write_raw(self, RARRAY_PTR(entry)[0], obj);
+    for(i = 1; i < len; i++) {
+        VALUE inner = RARRAY_PTR(objs)[i];
+        if(inner != Qnil) st_add_direct(ser->obj_cache, inner, LONG2FIX(obj_base + i));
+    }
+    if(ser->version == 3) {
+        ser_memo_add_strs(ser->str_cache, RARRAY_PTR(entry)[2], str_base);
+        ser_memo_add_strs(ser->trait_cache, RARRAY_PTR(entry)[3], trait_base);
+    }
+    return 1;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext::Serializer.new(class_mapper)
+ *   RocketAMF::Ext::Serializer.new(class_mapper, options)
+ *
+ * Creates a serializer using the given class mapper. Supported options:
+ *
+ * [:io] Write output to the given IO (or anything with a <tt>write</tt>
+ *       method) instead of accumulating it all in one string. Output is
+ *       buffered and written out every <tt>:flush_size</tt> bytes, and once
+ *       more when the top-level <tt>serialize</tt> call completes.
+ * [:flush_size] Bytes to buffer before writing to <tt>:io</tt>. Defaults to
+ *               64KB.
+ * [:max_length] Raise a RangeError once the total serialized output exceeds
+ *               this many bytes.
+ * [:sort_props] Write object properties in sorted key order, so that equal
+ *               objects always produce identical output. The sorted order is
+ *               cached per set of keys. Defaults to true if the extension was
+ *               built with <tt>--enable-sort-props</tt>.
+ * [:memo] A RocketAMF::Ext::MemoCache. Deep-frozen plain hashes and arrays
+ *         of strings, numbers and other such hashes and arrays are encoded
+ *         once and the bytes reused from then on, as long as nothing inside
+ *         them has already been written to the stream. Other objects are only
+ *         memoized if they return true from <tt>amf_memoizable?</tt>, which
+ *         promises that they and everything they write always serialize the
+ *         same way.
+ * [:dedupe] In AMF3, write a hash or array that is equal to one already
+ *           written as a reference to that one, even when it's a different
+ *           Ruby object. Only hashes and arrays made up entirely of nil,
+ *           booleans, numbers, symbols, strings and more such hashes and
+ *           arrays are compared, as their encoding follows from their
+ *           contents. Each one costs a content hash, and the client decodes
+ *           them all as a single shared object, so it's off by default.
+ * [:profile] A RocketAMF::Profile to add the cost of each object written to,
+ *            by class, at the end of every top-level <tt>serialize</tt>.
+ */
+static VALUE ser_initialize(int argc, VALUE *argv, VALUE self) {
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(self, AMF_SERIALIZER, ser);
+
+    VALUE class_mapper, options;
+    rb_scan_args(argc, argv, "11", &class_mapper, &options);
+
     ser->class_mapper = class_mapper;
+    ser->mapper_traits = rb_respond_to(class_mapper, id_get_as_traits);
+    ser->mapper_getters = mapping_native(class_mapper, id_props_for_serialization);
     ser->depth = 0;
-    ser->stream = rb_str_buf_new(0);
+    ser->io = Qnil;
+    ser->flush_size = DEFAULT_FLUSH_SIZE;
+    ser->max_length = 0;
+    ser->flushed = 0;
+    ser->memo = Qnil;
+    ser->dedupe = 0;
+    ser->dedupe_cache = Qnil;
+    ser->profile = Qnil;
+    profile_free(ser->prof);
+    ser->prof = NULL;
+#ifdef SORT_PROPS
+    ser->sort_props = 1;
+#else
+    ser->sort_props = 0;
+#endif
+
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+        VALUE opt;
+        ser->io = rb_hash_aref(options, sym_io);
+        if((opt = rb_hash_aref(options, sym_flush_size)) != Qnil) ser->flush_size = NUM2LONG(opt);
+        if((opt = rb_hash_aref(options, sym_max_length)) != Qnil) ser->max_length = NUM2LONG(opt);
+        if((opt = rb_hash_aref(options, sym_sort_props)) != Qnil) ser->sort_props = RTEST(opt);
+        ser->dedupe = RTEST(rb_hash_aref(options, sym_dedupe));
+        if((opt = rb_hash_aref(options, sym_profile)) != Qnil) {
+            ser->profile = opt;
+            ser->prof = profile_new();
+        }
+        if((opt = rb_hash_aref(options, sym_memo)) != Qnil) {
+            if(!rb_obj_is_kind_of(opt, cMemoCache)) rb_raise(rb_eTypeError, "memo must be a RocketAMF::Ext::MemoCache");
+            ser->memo = opt;
+            ser->memo_contexts[0] = memo_context(opt, class_mapper, ser->sort_props, 0);
+            ser->memo_contexts[1] = memo_context(opt, class_mapper, ser->sort_props, 3);
+        }
+    }
+    ser->stream = rb_str_buf_new(ser->io == Qnil ? 0 : ser->flush_size);
 
     return self;
 }
@@ -721,11 +1581,62 @@ static VALUE ser_stream(VALUE self) {
     return ser->stream;
 }
 
+/*
+ * State for an outermost serialize call, so the serializer can be reset if it
+ * raises part way through
+ */
+typedef struct {
+    VALUE self;
+    VALUE obj;
+    long start_pos; // Stream length when the call started
+    long start_flushed;
+    STATS_TIMER timer;
+    int done;
+} SER_CALL_STATE;
+
+static VALUE ser_serialize_body(VALUE arg) {
+    SER_CALL_STATE *state = (SER_CALL_STATE *)arg;
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(state->self, AMF_SERIALIZER, ser);
+    if(ser->version == 0) {
+        ser0_serialize(state->self, state->obj);
+    } else {
+        ser3_serialize(state->self, state->obj);
+    }
+    state->done = 1;
+    return Qnil;
+}
+
+/*
+ * Frees the reference caches once the outermost call is over. If it raised,
+ * the partial output is dropped too, so that the next call starts clean. Output
+ * already written to the IO can't be taken back.
+ */
+static VALUE ser_serialize_finish(VALUE arg) {
+    SER_CALL_STATE *state = (SER_CALL_STATE *)arg;
+    AMF_SERIALIZER *ser;
+    Data_Get_Struct(state->self, AMF_SERIALIZER, ser);
+    ser->depth = 0;
+    ser_free_cache(ser);
+    ser->dedupe_cache = Qnil;
+    if(!state->done) {
+        ser->flush_holds = 0;
+        ser->length_pos = -1;
+        rb_str_resize(ser->stream, ser->flushed == state->start_flushed ? state->start_pos : 0);
+    }
+    if(ser->prof) profile_flush(ser->prof, ser->profile, sym_serialize);
+    stats_stop(&state->timer, STATS_SERIALIZE);
+    return Qnil;
+}
+
 /*
  * call-seq:
  *   ser.serialize(amf_ver, obj) => string
+ *   ser.serialize(amf_ver, obj) => io
  *
- * Serialize the given object to the current stream and returns the stream
+ * Serialize the given object to the current stream and returns the stream. If
+ * the serializer was created with an <tt>:io</tt>, remaining buffered output is
+ * written to it once the outermost call finishes, and the IO is returned.
  */
 VALUE ser_serialize(VALUE self, VALUE ver, VALUE obj) {
     AMF_SERIALIZER *ser;
@@ -736,30 +1647,49 @@ VALUE ser_serialize(VALUE self, VALUE ver, VALUE obj) {
     if(int_ver != 0 && int_ver != 3) rb_raise(rb_eArgError, "unsupported version %d", int_ver);
     ser->version = int_ver;
 
-    // Initialize caches
-    if(ser->depth == 0) {
-        ser->obj_cache = st_init_numtable();
-        ser->obj_index = 0;
-        if(ser->version == 3) {
-            ser->str_cache = st_init_strtable();
-            ser->str_index = 0;
-            ser->trait_cache = st_init_strtable();
-            ser->trait_index = 0;
+    // Calls from encode_amf share the outer call's caches and clean up
+    if(ser->depth > 0) {
+        ser->depth++;
+        if(ser->version == 0) {
+            ser0_serialize(self, obj);
+        } else {
+            ser3_serialize(self, obj);
         }
+        ser->depth--;
+        return ser->stream;
     }
-    ser->depth++;
 
-    // Perform serialization
-    if(ser->version == 0) {
-        ser0_serialize(self, obj);
-    } else {
-        ser3_serialize(self, obj);
+    // Initialize caches
+    SER_CALL_STATE state;
+    state.self = self;
+    state.obj = obj;
+    state.start_pos = RSTRING_LEN(ser->stream);
+    state.start_flushed = ser->flushed;
+    state.done = 0;
+    stats_start(&state.timer);
+    PROBE_SERIALIZE_START(int_ver);
+    ser->obj_cache = st_init_numtable();
+    ser->obj_index = 0;
+    if(ser->prof) ser->prof->depth = 0;
+    if(ser->version == 3) {
+        ser->str_cache = st_init_strtable();
+        ser->str_index = 0;
+        ser->trait_cache = st_init_strtable();
+        ser->trait_index = 0;
+        if(ser->dedupe) ser->dedupe_cache = rb_hash_new();
     }
+    ser->depth = 1;
 
-    // Clean up
-    ser->depth--;
-    if(ser->depth == 0) ser_free_cache(ser);
+    // Perform serialization, cleaning up even if it raises
+    rb_ensure(ser_serialize_body, (VALUE)&state, ser_serialize_finish, (VALUE)&state);
 
+    long written = ser->flushed + RSTRING_LEN(ser->stream) - state.start_flushed - state.start_pos;
+    STATS_ADD(serializer.bytes, written);
+    PROBE_SERIALIZE_DONE(int_ver, written);
+    if(ser->io != Qnil) {
+        ser_flush(ser, 1);
+        return ser->io;
+    }
     return ser->stream;
 }
 
@@ -767,7 +1697,8 @@ VALUE ser_serialize(VALUE self, VALUE ver, VALUE obj) {
  * call-seq:
  *   ser.write_array(ary) => ser
  *
- * Serializes the given array to the serializer stream
+ * Serializes the given array to the serializer stream. Enumerators are also
+ * accepted, and are written one element at a time as they are iterated.
  */
 static VALUE ser_write_array(VALUE self, VALUE ary) {
     AMF_SERIALIZER *ser;
@@ -814,7 +1745,7 @@ void Init_rocket_amf_serializer() {
     // Define Serializer
     cSerializer = rb_define_class_under(mRocketAMFExt, "Serializer", rb_cObject);
     rb_define_alloc_func(cSerializer, ser_alloc);
-    rb_define_method(cSerializer, "initialize", ser_initialize, 1);
+    rb_define_method(cSerializer, "initialize", ser_initialize, -1);
     rb_define_method(cSerializer, "version", ser_version, 0);
     rb_define_method(cSerializer, "stream", ser_stream, 0);
     rb_define_method(cSerializer, "serialize", ser_serialize, 2);
@@ -822,13 +1753,37 @@ void Init_rocket_amf_serializer() {
     rb_define_method(cSerializer, "write_object", ser_write_object, -1);
 
     // Get refs to commonly used symbols and ids
+    cVector = rb_const_get(rb_const_get(mRocketAMF, rb_intern("Values")), rb_intern("Vector"));
     id_haskey = rb_intern("has_key?");
     id_encode_amf = rb_intern("encode_amf");
+    id_amf_memoizable = rb_intern("amf_memoizable?");
     id_is_array_collection = rb_intern("is_array_collection?");
     id_use_array_collection = rb_intern("use_array_collection");
     id_get_as_class_name = rb_intern("get_as_class_name");
+    id_get_as_traits = rb_intern("get_as_traits");
+    sym_ivars = ID2SYM(rb_intern("ivars"));
     id_props_for_serialization = rb_intern("props_for_serialization");
     id_utc = rb_intern("utc");
     id_to_f = rb_intern("to_f");
     id_is_integer = rb_intern("integer?");
+    id_to_a = rb_intern("to_a");
+    id_each = rb_intern("each");
+    id_size = rb_intern("size");
+    id_keys = rb_intern("keys");
+    id_vector_type = rb_intern("@type");
+    id_vector_data = rb_intern("@data");
+    id_vector_fixed = rb_intern("@fixed");
+    id_vector_class_name = rb_intern("@class_name");
+    sym_io = ID2SYM(rb_intern("io"));
+    sym_flush_size = ID2SYM(rb_intern("flush_size"));
+    sym_max_length = ID2SYM(rb_intern("max_length"));
+    sym_memo = ID2SYM(rb_intern("memo"));
+    sym_sort_props = ID2SYM(rb_intern("sort_props"));
+    sym_dedupe = ID2SYM(rb_intern("dedupe"));
+    sym_profile = ID2SYM(rb_intern("profile"));
+    sym_serialize = ID2SYM(rb_intern("serialize"));
+
+    // Sorted key lists by key shape, shared by all serializers
+    shape_cache = rb_hash_new();
+    rb_global_variable(&shape_cache);
 }
@@ -1,4 +1,5 @@
 #include <ruby.h>
+#include "profile.h"
 #ifdef HAVE_RB_STR_ENCODE
 #include <ruby/st.h>
 #include <ruby/encoding.h>
@@ -17,6 +18,22 @@ typedef struct {
     long trait_index;
     st_table* obj_cache;
     long obj_index;
+    VALUE io;
+    long flush_size;
+    long max_length;
+    long flushed;
+    long flush_holds; // Open lengths still to be backpatched, which keep output buffered
+    long length_pos; // Envelope body length held open, which can be given up to flush, or -1
+    VALUE memo;
+    long memo_contexts[2]; // Memo contexts for AMF0 and AMF3 with these settings
+    st_table* memo_misses; // Objects found unmemoizable during this call
+    int sort_props;
+    int dedupe;
+    VALUE dedupe_cache; // Plain hashes and arrays already written, keyed by content
+    int mapper_traits; // Class mapper provides get_as_traits
+    int mapper_getters; // Class mapper's props_for_serialization is the native one
+    VALUE profile;
+    AMF_PROFILE *prof; // Tallies for profile, or NULL
 } AMF_SERIALIZER;
 
 void ser_write_byte(AMF_SERIALIZER *ser, char byte);
@@ -25,5 +42,7 @@ void ser_write_uint16(AMF_SERIALIZER *ser, long num);
 void ser_write_uint32(AMF_SERIALIZER *ser, long num);
 void ser_write_double(AMF_SERIALIZER *ser, double num);
 void ser_get_string(VALUE obj, VALUE encode, char** str, long* len);
+void ser_check_length(AMF_SERIALIZER *ser, long extra);
+void ser_flush(AMF_SERIALIZER *ser, int force);
 
 VALUE ser_serialize(VALUE self, VALUE ver, VALUE obj);
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+extern VALUE mRocketAMFExt;
+int amf_stats_enabled = 0;
+AMF_STATS amf_stats;
+#ifdef HAVE_RB_GC_STAT
+static VALUE sym_total_allocated_objects;
+#endif
+
+static const char *stats_op_names[STATS_OPS] = {"deserialize", "serialize", "populate_from_stream"};
+
+double stats_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+#endif
+}
+
+static size_t stats_allocations(void) {
+#ifdef HAVE_RB_GC_STAT
+    return rb_gc_stat(sym_total_allocated_objects);
+#else
+    return 0;
+#endif
+}
+
+static size_t stats_gc_runs(void) {
+#ifdef HAVE_RB_GC_COUNT
+    return rb_gc_count();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Starts timing an operation. Does nothing if stats are disabled, so the
+ * matching stats_stop is cheap as well.
+ */
+void stats_start(STATS_TIMER *timer) {
+    timer->active = amf_stats_enabled;
+    if(!timer->active) return;
+    timer->allocations = stats_allocations();
+    timer->gc_runs = stats_gc_runs();
+    timer->start = stats_now();
+}
+
+/*
+ * Records the time, allocations and garbage collections since stats_start
+ * against the given operation. Operations that raise are not recorded.
+ */
+void stats_stop(STATS_TIMER *timer, int op) {
+    if(!timer->active || !amf_stats_enabled) return;
+    double elapsed = stats_now() - timer->start;
+    stats_count usec = elapsed > 0 ? (stats_count)(elapsed * 1e6) : 0;
+
+    int bucket = 0;
+    while(bucket < STATS_BUCKETS - 1 && (usec >> bucket) > 0) bucket++;
+
+    STATS_OP *stats = &amf_stats.ops[op];
+    stats->count++;
+    stats->usec += usec;
+    stats->allocations += stats_allocations() - timer->allocations;
+    stats->gc_runs += stats_gc_runs() - timer->gc_runs;
+    stats->buckets[bucket]++;
+}
+
+static VALUE stats_codec_hash(STATS_CODEC *codec) {
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("objects")), ULL2NUM(codec->objects));
+    rb_hash_aset(hash, ID2SYM(rb_intern("strings")), ULL2NUM(codec->strings));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULL2NUM(codec->bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("object_refs")), ULL2NUM(codec->obj_refs));
+    rb_hash_aset(hash, ID2SYM(rb_intern("string_refs")), ULL2NUM(codec->str_refs));
+    rb_hash_aset(hash, ID2SYM(rb_intern("traits")), ULL2NUM(codec->traits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("trait_refs")), ULL2NUM(codec->trait_refs));
+    rb_hash_aset(hash, ID2SYM(rb_intern("mapper_calls")), ULL2NUM(codec->mapper_calls));
+    return hash;
+}
+
+static VALUE stats_op_hash(STATS_OP *op) {
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("count")), ULL2NUM(op->count));
+    rb_hash_aset(hash, ID2SYM(rb_intern("usec")), ULL2NUM(op->usec));
+    rb_hash_aset(hash, ID2SYM(rb_intern("allocations")), ULL2NUM(op->allocations));
+    rb_hash_aset(hash, ID2SYM(rb_intern("gc_runs")), ULL2NUM(op->gc_runs));
+
+    VALUE histogram = rb_hash_new();
+    int i;
+    for(i = 0; i < STATS_BUCKETS; i++) {
+        if(op->buckets[i] == 0) continue;
+        rb_hash_aset(histogram, ULL2NUM(1ULL << i), ULL2NUM(op->buckets[i]));
+    }
+    rb_hash_aset(hash, ID2SYM(rb_intern("histogram")), histogram);
+    return hash;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.stats => hash
+ *
+ * Returns the counters collected since the last reset while stats were
+ * enabled. <tt>:deserializer</tt> and <tt>:serializer</tt> hold the number of
+ * objects, strings and traits added to the reference tables, how often the
+ * tables were hit instead, the bytes read or written and the number of class
+ * mapper callbacks. <tt>:operations</tt> holds the call count, total time,
+ * Ruby allocations and GC runs for <tt>deserialize</tt>, <tt>serialize</tt>
+ * and <tt>populate_from_stream</tt>, along with a histogram of call latency
+ * keyed by its exclusive upper bound in microseconds, doubling per bucket.
+ * Envelope calls are also counted under the codec operations they make.
+ *
+ * Example:
+ *
+ *   RocketAMF::Ext.stats_enabled = true
+ *   RocketAMF.deserialize(data, 3)
+ *   RocketAMF::Ext.stats[:operations][:deserialize][:histogram] #=> {64=>1}
+ */
+static VALUE stats_get(VALUE self) {
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("enabled")), amf_stats_enabled ? Qtrue : Qfalse);
+    rb_hash_aset(hash, ID2SYM(rb_intern("deserializer")), stats_codec_hash(&amf_stats.deserializer));
+    rb_hash_aset(hash, ID2SYM(rb_intern("serializer")), stats_codec_hash(&amf_stats.serializer));
+
+    VALUE ops = rb_hash_new();
+    int i;
+    for(i = 0; i < STATS_OPS; i++) {
+        rb_hash_aset(ops, ID2SYM(rb_intern(stats_op_names[i])), stats_op_hash(&amf_stats.ops[i]));
+    }
+    rb_hash_aset(hash, ID2SYM(rb_intern("operations")), ops);
+    return hash;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.reset_stats => nil
+ *
+ * Zeroes all counters and histograms
+ */
+static VALUE stats_reset(VALUE self) {
+    memset(&amf_stats, 0, sizeof(amf_stats));
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.stats_enabled? => bool
+ *
+ * Whether stats are being collected. They are off by default.
+ */
+static VALUE stats_enabled_get(VALUE self) {
+    return amf_stats_enabled ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.stats_enabled = bool
+ *
+ * Turns collection on or off. Counters are process-wide and kept when
+ * collection is turned off.
+ */
+static VALUE stats_enabled_set(VALUE self, VALUE enabled) {
+    amf_stats_enabled = RTEST(enabled);
+    return enabled;
+}
+
+void Init_rocket_amf_stats() {
+    rb_define_module_function(mRocketAMFExt, "stats", stats_get, 0);
+    rb_define_module_function(mRocketAMFExt, "reset_stats", stats_reset, 0);
+    rb_define_module_function(mRocketAMFExt, "stats_enabled?", stats_enabled_get, 0);
+    rb_define_module_function(mRocketAMFExt, "stats_enabled=", stats_enabled_set, 1);
+
+#ifdef HAVE_RB_GC_STAT
+    sym_total_allocated_objects = ID2SYM(rb_intern("total_allocated_objects"));
+#endif
+}
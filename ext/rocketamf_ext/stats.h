@@ -0,0 +1,51 @@
+#include <ruby.h>
+
+#define STATS_DESERIALIZE 0
+#define STATS_SERIALIZE   1
+#define STATS_POPULATE    2
+#define STATS_OPS         3
+#define STATS_BUCKETS     32 // Bucket i counts calls taking less than 2**i usec
+
+typedef unsigned long long stats_count;
+
+typedef struct {
+    stats_count objects;      // Entries added to the object reference table
+    stats_count strings;
+    stats_count bytes;
+    stats_count obj_refs;     // Object reference table hits
+    stats_count str_refs;
+    stats_count traits;
+    stats_count trait_refs;
+    stats_count mapper_calls; // Callbacks into the class mapper
+} STATS_CODEC;
+
+typedef struct {
+    stats_count count;
+    stats_count usec;
+    stats_count allocations;
+    stats_count gc_runs;
+    stats_count buckets[STATS_BUCKETS];
+} STATS_OP;
+
+typedef struct {
+    STATS_CODEC deserializer;
+    STATS_CODEC serializer;
+    STATS_OP ops[STATS_OPS];
+} AMF_STATS;
+
+typedef struct {
+    int active;
+    double start;
+    size_t allocations;
+    size_t gc_runs;
+} STATS_TIMER;
+
+extern int amf_stats_enabled;
+extern AMF_STATS amf_stats;
+
+#define STATS_ADD(field, n) do { if(amf_stats_enabled) amf_stats.field += (n); } while(0)
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+double stats_now(void);
+void stats_start(STATS_TIMER *timer);
+void stats_stop(STATS_TIMER *timer, int op);
@@ -0,0 +1,816 @@
+#include "serializer.h"
+#include "deserializer.h"
+#include "constants.h"
+#include "transcoder.h"
+
+extern VALUE mRocketAMF;
+extern VALUE mRocketAMFExt;
+extern VALUE sym_io;
+extern VALUE sym_max_length;
+static VALUE sym_from;
+static VALUE sym_to;
+static VALUE sym_json;
+
+static void tc_read0(TRANSCODER *tc);
+static void tc_read3(TRANSCODER *tc);
+
+static int tc_span_cmp(st_data_t a, st_data_t b) {
+    const TC_SPAN *x = (const TC_SPAN*)a, *y = (const TC_SPAN*)b;
+    return x->len != y->len || memcmp(x->ptr, y->ptr, x->len) != 0;
+}
+
+static st_index_t tc_span_hash(st_data_t a) {
+    const TC_SPAN *x = (const TC_SPAN*)a;
+    return rb_memhash(x->ptr, x->len);
+}
+
+static const struct st_hash_type tc_span_type = {
+    tc_span_cmp,
+    tc_span_hash
+};
+
+static void tc_skip(TRANSCODER *tc, unsigned long len) {
+    AMF_DESERIALIZER *des = &tc->des;
+    if(des->pos + len > des->size || des->pos + len < des->pos) {
+        rb_raise(rb_eRangeError, "reading %lu bytes is beyond end of source: %ld (pos), %ld (size)", len, des->pos, des->size);
+    }
+    des->pos += len;
+}
+
+static TC_SOURCE* tc_push_source(TRANSCODER *tc) {
+    TC_SOURCE *src = ALLOC(TC_SOURCE);
+    memset(src, 0, sizeof(TC_SOURCE));
+    src->parent = tc->src;
+    tc->src = src;
+    return src;
+}
+
+static void tc_pop_source(TRANSCODER *tc) {
+    TC_SOURCE *src = tc->src;
+    long i;
+    tc->src = src->parent;
+    for(i = 0; i < src->trait_count; i++) xfree(src->traits[i].member_strs);
+    xfree(src->offsets);
+    xfree(src->map);
+    xfree(src->strs);
+    xfree(src->traits);
+    xfree(src);
+}
+
+/*
+ * Adds an object to the source table, returning its index
+ */
+static long tc_register(TRANSCODER *tc, unsigned long offset) {
+    TC_SOURCE *src = tc->src;
+    if(src->obj_count == src->obj_capa) {
+        src->obj_capa = src->obj_capa ? src->obj_capa * 2 : 16;
+        REALLOC_N(src->offsets, long, src->obj_capa);
+        REALLOC_N(src->map, long, src->obj_capa);
+    }
+    src->offsets[src->obj_count] = offset;
+    src->map[src->obj_count] = -1;
+    return src->obj_count++;
+}
+
+/*
+ * Adds an object to the output table and maps the source object to it
+ */
+void tc_new_obj(TRANSCODER *tc, long k, char marker) {
+    if(tc->to == TC_JSON && tc->json_refs == JSON_REFS_INLINE) {
+        if(tc->obj_index * 2 == tc->span_capa) {
+            tc->span_capa = tc->span_capa ? tc->span_capa * 2 : 32;
+            REALLOC_N(tc->spans, long, tc->span_capa);
+        }
+        tc->spans[tc->obj_index * 2] = RSTRING_LEN(tc->ser.stream);
+        tc->spans[tc->obj_index * 2 + 1] = -1;
+    } else if(tc->to == 3) {
+        if(tc->obj_index == tc->marker_capa) {
+            tc->marker_capa = tc->marker_capa ? tc->marker_capa * 2 : 16;
+            REALLOC_N(tc->markers, char, tc->marker_capa);
+        }
+        tc->markers[tc->obj_index] = marker;
+    }
+    if(k >= 0) tc->src->map[k] = tc->obj_index;
+    tc->obj_index++;
+}
+
+static void tc_w3_utf8vr(TRANSCODER *tc, const char *ptr, long len) {
+    if(len == 0) {
+        ser_write_byte(&tc->ser, AMF3_EMPTY_STRING);
+        return;
+    }
+
+    TC_SPAN key = {ptr, len};
+    st_data_t str_index;
+    if(st_lookup(tc->strs, (st_data_t)&key, &str_index)) {
+        ser_write_int(&tc->ser, (int)str_index << 1);
+    } else {
+        TC_SPAN *stored = ALLOC(TC_SPAN);
+        *stored = key;
+        st_add_direct(tc->strs, (st_data_t)stored, tc->str_index++);
+        ser_write_int(&tc->ser, ((int)len) << 1 | 1);
+        rb_str_buf_cat(tc->ser.stream, ptr, len);
+    }
+}
+
+/*
+ * Output writers. Each one handles both AMF formats, and mirrors how the ruby
+ * serializer would write the value the deserializer produces. JSON output is
+ * handed off to json.c.
+ */
+static void tc_w_null(TRANSCODER *tc) {
+    if(tc->to == TC_JSON) {
+        json_w_null(tc);
+        return;
+    }
+    ser_write_byte(&tc->ser, tc->to == 0 ? AMF0_NULL_MARKER : AMF3_NULL_MARKER);
+}
+
+static void tc_w_bool(TRANSCODER *tc, int val) {
+    if(tc->to == TC_JSON) {
+        json_w_bool(tc, val);
+        return;
+    }
+    if(tc->to == 0) {
+        ser_write_byte(&tc->ser, AMF0_BOOLEAN_MARKER);
+        ser_write_byte(&tc->ser, val ? 1 : 0);
+    } else {
+        ser_write_byte(&tc->ser, val ? AMF3_TRUE_MARKER : AMF3_FALSE_MARKER);
+    }
+}
+
+static void tc_w_number(TRANSCODER *tc, double num) {
+    if(tc->to == TC_JSON) {
+        json_w_number(tc, num);
+        return;
+    }
+    ser_write_byte(&tc->ser, tc->to == 0 ? AMF0_NUMBER_MARKER : AMF3_DOUBLE_MARKER);
+    ser_write_double(&tc->ser, num);
+}
+
+static void tc_w_int(TRANSCODER *tc, long num) {
+    if(tc->to == TC_JSON) {
+        json_w_int(tc, num);
+        return;
+    }
+    if(tc->to == 3 && num >= MIN_INTEGER && num <= MAX_INTEGER) {
+        ser_write_byte(&tc->ser, AMF3_INTEGER_MARKER);
+        ser_write_int(&tc->ser, (int)num);
+    } else {
+        tc_w_number(tc, (double)num);
+    }
+}
+
+static void tc_w_string(TRANSCODER *tc, const char *ptr, long len) {
+    if(tc->to == TC_JSON) {
+        json_w_string(tc, ptr, len);
+    } else if(tc->to == 3) {
+        ser_write_byte(&tc->ser, AMF3_STRING_MARKER);
+        tc_w3_utf8vr(tc, ptr, len);
+    } else if(len > 0xffff) {
+        ser_write_byte(&tc->ser, AMF0_LONG_STRING_MARKER);
+        ser_write_uint32(&tc->ser, len);
+        rb_str_buf_cat(tc->ser.stream, ptr, len);
+    } else {
+        ser_write_byte(&tc->ser, AMF0_STRING_MARKER);
+        ser_write_uint16(&tc->ser, len);
+        rb_str_buf_cat(tc->ser.stream, ptr, len);
+    }
+}
+
+static void tc_w_date(TRANSCODER *tc, long k, double ms) {
+    if(tc->to == TC_JSON) {
+        json_w_date(tc, ms);
+        return;
+    }
+    if(tc->to == 0) {
+        ser_write_byte(&tc->ser, AMF0_DATE_MARKER);
+        ser_write_double(&tc->ser, ms);
+        ser_write_uint16(&tc->ser, 0); // Time zone
+    } else {
+        ser_write_byte(&tc->ser, AMF3_DATE_MARKER);
+        tc_new_obj(tc, k, AMF3_DATE_MARKER);
+        ser_write_int(&tc->ser, 0x01);
+        ser_write_double(&tc->ser, ms);
+    }
+}
+
+static void tc_w_byte_array(TRANSCODER *tc, long k, const char *ptr, long len) {
+    if(tc->to == TC_JSON) {
+        json_w_byte_array(tc, ptr, len);
+        return;
+    }
+    if(tc->to == 0) {
+        // AMF0 has no byte arrays, so embed an AMF3 one
+        ser_write_byte(&tc->ser, AMF0_AMF3_MARKER);
+    } else {
+        tc_new_obj(tc, k, AMF3_BYTE_ARRAY_MARKER);
+    }
+    ser_write_byte(&tc->ser, AMF3_BYTE_ARRAY_MARKER);
+    ser_write_int(&tc->ser, ((int)len) << 1 | 1);
+    rb_str_buf_cat(tc->ser.stream, ptr, len);
+}
+
+static void tc_w_ref(TRANSCODER *tc, long idx) {
+    if(tc->to == TC_JSON) {
+        json_w_ref(tc, idx);
+        return;
+    }
+    if(tc->to == 0) {
+        ser_write_byte(&tc->ser, AMF0_REFERENCE_MARKER);
+        ser_write_uint16(&tc->ser, idx);
+    } else {
+        ser_write_byte(&tc->ser, tc->markers[idx]);
+        ser_write_int(&tc->ser, (int)idx << 1);
+    }
+}
+
+static void tc_w_array_begin(TRANSCODER *tc, long k, long len) {
+    if(tc->to == TC_JSON) {
+        json_w_array_begin(tc, k);
+        return;
+    }
+    if(tc->to == 0) {
+        ser_write_byte(&tc->ser, AMF0_STRICT_ARRAY_MARKER);
+        tc_new_obj(tc, k, 0);
+        ser_write_uint32(&tc->ser, len);
+    } else {
+        ser_write_byte(&tc->ser, AMF3_ARRAY_MARKER);
+        tc_new_obj(tc, k, AMF3_ARRAY_MARKER);
+        ser_write_int(&tc->ser, ((int)len) << 1 | 1);
+        ser_write_byte(&tc->ser, AMF3_CLOSE_DYNAMIC_ARRAY);
+    }
+}
+
+/*
+ * AMF arrays don't need closing, as their length comes first
+ */
+static void tc_w_array_end(TRANSCODER *tc) {
+    if(tc->to == TC_JSON) json_w_array_end(tc);
+}
+
+static void tc_w_object_begin(TRANSCODER *tc, long k, const char *name, long len) {
+    if(tc->to == TC_JSON) {
+        json_w_object_begin(tc, k, name, len);
+        return;
+    }
+    if(tc->to == 0) {
+        if(len > 0) {
+            ser_write_byte(&tc->ser, AMF0_TYPED_OBJECT_MARKER);
+            ser_write_uint16(&tc->ser, len);
+            rb_str_buf_cat(tc->ser.stream, name, len);
+        } else {
+            ser_write_byte(&tc->ser, AMF0_OBJECT_MARKER);
+        }
+        tc_new_obj(tc, k, 0);
+        return;
+    }
+
+    ser_write_byte(&tc->ser, AMF3_OBJECT_MARKER);
+    tc_new_obj(tc, k, AMF3_OBJECT_MARKER);
+
+    // Everything is written as a dynamic object, so traits only vary by name
+    st_data_t trait_index;
+    if(len == 0) {
+        if(tc->default_trait >= 0) {
+            ser_write_int(&tc->ser, (int)tc->default_trait << 2 | 0x01);
+            return;
+        }
+        tc->default_trait = tc->trait_index++;
+    } else {
+        TC_SPAN key = {name, len};
+        if(st_lookup(tc->traits, (st_data_t)&key, &trait_index)) {
+            ser_write_int(&tc->ser, (int)trait_index << 2 | 0x01);
+            return;
+        }
+        TC_SPAN *stored = ALLOC(TC_SPAN);
+        *stored = key;
+        st_add_direct(tc->traits, (st_data_t)stored, tc->trait_index++);
+    }
+    ser_write_byte(&tc->ser, AMF3_DYNAMIC_OBJECT);
+    tc_w3_utf8vr(tc, name, len);
+}
+
+static void tc_w_key(TRANSCODER *tc, const char *ptr, long len) {
+    if(tc->to == TC_JSON) {
+        json_w_key(tc, ptr, len);
+    } else if(tc->to == 0) {
+        ser_write_uint16(&tc->ser, len);
+        rb_str_buf_cat(tc->ser.stream, ptr, len);
+    } else {
+        tc_w3_utf8vr(tc, ptr, len);
+    }
+}
+
+static void tc_w_object_end(TRANSCODER *tc) {
+    if(tc->to == TC_JSON) {
+        json_w_object_end(tc);
+    } else if(tc->to == 0) {
+        ser_write_uint16(&tc->ser, 0);
+        ser_write_byte(&tc->ser, AMF0_OBJECT_END_MARKER);
+    } else {
+        ser_write_byte(&tc->ser, AMF3_CLOSE_DYNAMIC_OBJECT);
+    }
+}
+
+/*
+ * Writes out to the io between values, and enforces the length cap. Inlined
+ * JSON references copy earlier output, so that has to stay buffered until the
+ * end.
+ */
+#define TC_CHECK_FLUSH(tc) \
+    if(tc->to == TC_JSON && tc->json_refs == JSON_REFS_INLINE) { \
+        ser_check_length(&tc->ser, 0); \
+    } else if(tc->ser.io != Qnil || tc->ser.max_length > 0) { \
+        ser_flush(&tc->ser, 0); \
+    }
+
+/*
+ * AMF0 reader
+ */
+static void tc_read0_props(TRANSCODER *tc) {
+    AMF_DESERIALIZER *des = &tc->des;
+    while(1) {
+        int len = des_read_uint16(des);
+        if(len == 0 && des_read_ahead_byte(des) == AMF0_OBJECT_END_MARKER) {
+            des->pos++;
+            return;
+        }
+        const char *key = des->stream + des->pos;
+        tc_skip(tc, len);
+        tc_w_key(tc, key, len);
+        tc_read0(tc);
+    }
+}
+
+static void tc_read0(TRANSCODER *tc) {
+    AMF_DESERIALIZER *des = &tc->des;
+    unsigned long start = des->pos;
+    char marker = des_read_byte(des);
+    const char *ptr;
+    unsigned int len, i;
+    long k;
+
+    switch(marker) {
+        case AMF0_NUMBER_MARKER:
+            tc_w_number(tc, des_read_double(des));
+            break;
+        case AMF0_BOOLEAN_MARKER:
+            tc_w_bool(tc, des_read_byte(des) != 0);
+            break;
+        case AMF0_STRING_MARKER:
+        case AMF0_LONG_STRING_MARKER:
+        case AMF0_XML_MARKER:
+            len = marker == AMF0_STRING_MARKER ? (unsigned int)des_read_uint16(des) : des_read_uint32(des);
+            ptr = des->stream + des->pos;
+            tc_skip(tc, len);
+            tc_w_string(tc, ptr, len);
+            break;
+        case AMF0_NULL_MARKER:
+        case AMF0_UNDEFINED_MARKER:
+        case AMF0_UNSUPPORTED_MARKER:
+            tc_w_null(tc);
+            break;
+        case AMF0_DATE_MARKER:
+            tc_w_date(tc, -1, des_read_double(des));
+            des_read_uint16(des); // Time zone
+            break;
+        case AMF0_OBJECT_MARKER:
+        case AMF0_HASH_MARKER:
+            if(marker == AMF0_HASH_MARKER) des_read_uint32(des);
+            k = tc_register(tc, start);
+            tc_w_object_begin(tc, k, NULL, 0);
+            tc_read0_props(tc);
+            tc_w_object_end(tc);
+            break;
+        case AMF0_TYPED_OBJECT_MARKER:
+            len = des_read_uint16(des);
+            ptr = des->stream + des->pos;
+            tc_skip(tc, len);
+            k = tc_register(tc, start);
+            tc_w_object_begin(tc, k, ptr, len);
+            tc_read0_props(tc);
+            tc_w_object_end(tc);
+            break;
+        case AMF0_STRICT_ARRAY_MARKER:
+            len = des_read_uint32(des);
+            k = tc_register(tc, start);
+            tc_w_array_begin(tc, k, len);
+            for(i = 0; i < len; i++) tc_read0(tc);
+            tc_w_array_end(tc);
+            break;
+        case AMF0_REFERENCE_MARKER:
+            i = des_read_uint16(des);
+            if(i >= tc->src->obj_count) rb_raise(rb_eRangeError, "obj reference index beyond end");
+            tc_w_ref(tc, tc->src->map[i]);
+            break;
+        case AMF0_AMF3_MARKER:
+            tc_push_source(tc);
+            tc_read3(tc);
+            tc_pop_source(tc);
+            break;
+        default:
+            rb_raise(rb_eArgError, "cannot transcode AMF0 marker 0x%x", (unsigned char)marker);
+    }
+    TC_CHECK_FLUSH(tc);
+}
+
+/*
+ * AMF3 reader
+ */
+static unsigned int tc_read3_header(TRANSCODER *tc) {
+    return des_read_int(&tc->des) & 0x1fffffff;
+}
+
+/*
+ * Reads a UTF-8-vr into span, returning its index in the source string table
+ * or -1 for the empty string
+ */
+static long tc_read3_string(TRANSCODER *tc, TC_SPAN *span) {
+    AMF_DESERIALIZER *des = &tc->des;
+    TC_SOURCE *src = tc->src;
+    unsigned int header = tc_read3_header(tc);
+    unsigned int len = header >> 1;
+
+    if((header & 0x01) == 0) {
+        if(len >= src->str_count) rb_raise(rb_eRangeError, "str reference index beyond end");
+        *span = src->strs[len];
+        return len;
+    }
+
+    span->ptr = des->stream + des->pos;
+    span->len = len;
+    tc_skip(tc, len);
+    if(len == 0) return -1;
+    if(src->str_count == src->str_capa) {
+        src->str_capa = src->str_capa ? src->str_capa * 2 : 16;
+        REALLOC_N(src->strs, TC_SPAN, src->str_capa);
+    }
+    src->strs[src->str_count] = *span;
+    return src->str_count++;
+}
+
+/*
+ * Writes a reference to an earlier source object. Values that don't take up a
+ * slot in the output table, like dates in AMF0 or XML, are written out again.
+ */
+static void tc_read3_ref(TRANSCODER *tc, unsigned int header) {
+    AMF_DESERIALIZER *des = &tc->des;
+    TC_SOURCE *src = tc->src;
+    unsigned int idx = header >> 1;
+    if(idx >= src->obj_count) rb_raise(rb_eRangeError, "obj reference index beyond end");
+    if(src->map[idx] >= 0) {
+        tc_w_ref(tc, src->map[idx]);
+        return;
+    }
+
+    unsigned long pos = des->pos;
+    des->pos = src->offsets[idx];
+    char marker = des_read_byte(des);
+    unsigned int len = tc_read3_header(tc) >> 1;
+    const char *ptr = des->stream + des->pos;
+    if(marker == AMF3_DATE_MARKER) {
+        tc_w_date(tc, -1, des_read_double(des));
+    } else if(marker == AMF3_BYTE_ARRAY_MARKER) {
+        tc_w_byte_array(tc, -1, ptr, len);
+    } else if(marker == AMF3_XML_MARKER || marker == AMF3_XML_DOC_MARKER) {
+        tc_w_string(tc, ptr, len);
+    } else {
+        rb_raise(rb_eArgError, "cannot transcode reference to unfinished object %u", idx);
+    }
+    des->pos = pos;
+}
+
+static void tc_read3_object(TRANSCODER *tc, unsigned long start) {
+    TC_SOURCE *src = tc->src;
+    unsigned int header = tc_read3_header(tc);
+    if((header & 0x01) == 0) {
+        tc_read3_ref(tc, header);
+        return;
+    }
+    long k = tc_register(tc, start);
+
+    TC_TRAIT *trait;
+    TC_SPAN span;
+    long i;
+    if((header & 0x02) == 0) {
+        unsigned int idx = header >> 2;
+        if(idx >= src->trait_count) rb_raise(rb_eRangeError, "trait reference index beyond end");
+        trait = src->traits + idx;
+    } else {
+        if(src->trait_count == src->trait_capa) {
+            src->trait_capa = src->trait_capa ? src->trait_capa * 2 : 8;
+            REALLOC_N(src->traits, TC_TRAIT, src->trait_capa);
+        }
+        trait = src->traits + src->trait_count;
+        memset(trait, 0, sizeof(TC_TRAIT));
+        trait->externalizable = (header & 0x04) != 0;
+        trait->dynamic = (header & 0x08) != 0;
+        trait->name = tc_read3_string(tc, &span);
+        if(trait->name >= 0 && span.len == sizeof(ARRAY_COLLECTION_CLASS) - 1) {
+            trait->array_collection = memcmp(span.ptr, ARRAY_COLLECTION_CLASS, span.len) == 0;
+        }
+        src->trait_count++; // Count it now so member_strs gets freed on error
+
+        long members = header >> 4;
+        trait->member_strs = ALLOC_N(long, members > 0 ? members : 1);
+        for(i = 0; i < members; i++) {
+            trait->member_strs[i] = tc_read3_string(tc, &span);
+            trait->members++;
+        }
+    }
+
+    if(trait->externalizable) {
+        if(!trait->array_collection) rb_raise(rb_eArgError, "cannot transcode externalizable objects");
+
+        // ArrayCollections are unwrapped to their source array, which may
+        // itself be a reference
+        AMF_DESERIALIZER *des = &tc->des;
+        unsigned long pos = des->pos;
+        long inner = src->obj_count;
+        if(des_read_byte(des) == AMF3_ARRAY_MARKER && ((header = tc_read3_header(tc)) & 0x01) == 0) {
+            if((header >> 1) < src->obj_count) inner = header >> 1;
+        }
+        des->pos = pos;
+        tc_read3(tc);
+        if(inner < src->obj_count) src->map[k] = src->map[inner];
+        return;
+    }
+
+    // Copy out what's needed, as nested objects can grow the trait table
+    long name = trait->name, members = trait->members, *member_strs = trait->member_strs;
+    int dynamic = trait->dynamic;
+    if(name >= 0) {
+        tc_w_object_begin(tc, k, src->strs[name].ptr, src->strs[name].len);
+    } else {
+        tc_w_object_begin(tc, k, NULL, 0);
+    }
+    for(i = 0; i < members; i++) {
+        if(member_strs[i] >= 0) {
+            tc_w_key(tc, src->strs[member_strs[i]].ptr, src->strs[member_strs[i]].len);
+        } else {
+            tc_w_key(tc, "", 0);
+        }
+        tc_read3(tc);
+    }
+    if(dynamic) {
+        while(tc_read3_string(tc, &span) != -1) {
+            tc_w_key(tc, span.ptr, span.len);
+            tc_read3(tc);
+        }
+    }
+    tc_w_object_end(tc);
+}
+
+static void tc_read3_array(TRANSCODER *tc, unsigned long start) {
+    unsigned int header = tc_read3_header(tc);
+    if((header & 0x01) == 0) {
+        tc_read3_ref(tc, header);
+        return;
+    }
+    long k = tc_register(tc, start);
+    long i, len = header >> 1;
+
+    TC_SPAN span;
+    if(tc_read3_string(tc, &span) == -1) {
+        tc_w_array_begin(tc, k, len);
+        for(i = 0; i < len; i++) tc_read3(tc);
+        tc_w_array_end(tc);
+        return;
+    }
+
+    // Arrays with named keys come out as hashes, so write them as anonymous
+    // objects with the dense portion under numbered keys
+    tc_w_object_begin(tc, k, NULL, 0);
+    do {
+        tc_w_key(tc, span.ptr, span.len);
+        tc_read3(tc);
+    } while(tc_read3_string(tc, &span) != -1);
+    for(i = 0; i < len; i++) {
+        char key[24];
+        int key_len = snprintf(key, sizeof(key), "%ld", i);
+        tc_w_key(tc, key, key_len);
+        tc_read3(tc);
+    }
+    tc_w_object_end(tc);
+}
+
+static void tc_read3_vector(TRANSCODER *tc, char marker, unsigned long start) {
+    AMF_DESERIALIZER *des = &tc->des;
+    unsigned int header = tc_read3_header(tc);
+    if((header & 0x01) == 0) {
+        tc_read3_ref(tc, header);
+        return;
+    }
+    long k = tc_register(tc, start);
+    long i, len = header >> 1;
+    TC_SPAN span;
+
+    des_read_byte(des); // Fixed flag
+    if(marker == AMF3_VECTOR_OBJECT_MARKER) tc_read3_string(tc, &span); // Class name
+
+    // Vectors come out as plain arrays
+    tc_w_array_begin(tc, k, len);
+    for(i = 0; i < len; i++) {
+        if(marker == AMF3_VECTOR_INT_MARKER) {
+            tc_w_int(tc, (int32_t)des_read_uint32(des));
+        } else if(marker == AMF3_VECTOR_UINT_MARKER) {
+            unsigned int val = des_read_uint32(des);
+            if(val > MAX_INTEGER) {
+                tc_w_number(tc, (double)val);
+            } else {
+                tc_w_int(tc, val);
+            }
+        } else if(marker == AMF3_VECTOR_DOUBLE_MARKER) {
+            tc_w_number(tc, des_read_double(des));
+        } else {
+            tc_read3(tc);
+        }
+    }
+    tc_w_array_end(tc);
+}
+
+static void tc_read3(TRANSCODER *tc) {
+    AMF_DESERIALIZER *des = &tc->des;
+    unsigned long start = des->pos;
+    char marker = des_read_byte(des);
+    unsigned int header;
+    const char *ptr;
+    TC_SPAN span;
+    long k;
+
+    switch(marker) {
+        case AMF3_UNDEFINED_MARKER:
+        case AMF3_NULL_MARKER:
+            tc_w_null(tc);
+            break;
+        case AMF3_FALSE_MARKER:
+        case AMF3_TRUE_MARKER:
+            tc_w_bool(tc, marker == AMF3_TRUE_MARKER);
+            break;
+        case AMF3_INTEGER_MARKER:
+            tc_w_int(tc, des_read_int(des));
+            break;
+        case AMF3_DOUBLE_MARKER:
+            tc_w_number(tc, des_read_double(des));
+            break;
+        case AMF3_STRING_MARKER:
+            tc_read3_string(tc, &span);
+            tc_w_string(tc, span.ptr, span.len);
+            break;
+        case AMF3_XML_DOC_MARKER:
+        case AMF3_XML_MARKER:
+        case AMF3_BYTE_ARRAY_MARKER:
+            header = tc_read3_header(tc);
+            if((header & 0x01) == 0) {
+                tc_read3_ref(tc, header);
+                break;
+            }
+            k = tc_register(tc, start);
+            ptr = des->stream + des->pos;
+            tc_skip(tc, header >> 1);
+            if(marker == AMF3_BYTE_ARRAY_MARKER) {
+                tc_w_byte_array(tc, k, ptr, header >> 1);
+            } else {
+                tc_w_string(tc, ptr, header >> 1);
+            }
+            break;
+        case AMF3_DATE_MARKER:
+            header = tc_read3_header(tc);
+            if((header & 0x01) == 0) {
+                tc_read3_ref(tc, header);
+                break;
+            }
+            k = tc_register(tc, start);
+            tc_w_date(tc, k, des_read_double(des));
+            break;
+        case AMF3_ARRAY_MARKER:
+            tc_read3_array(tc, start);
+            break;
+        case AMF3_OBJECT_MARKER:
+            tc_read3_object(tc, start);
+            break;
+        case AMF3_VECTOR_INT_MARKER:
+        case AMF3_VECTOR_UINT_MARKER:
+        case AMF3_VECTOR_DOUBLE_MARKER:
+        case AMF3_VECTOR_OBJECT_MARKER:
+            tc_read3_vector(tc, marker, start);
+            break;
+        default:
+            rb_raise(rb_eArgError, "cannot transcode AMF3 marker 0x%x", (unsigned char)marker);
+    }
+    TC_CHECK_FLUSH(tc);
+}
+
+static int tc_free_span_key(st_data_t key, st_data_t value, st_data_t ignored) {
+    xfree((void*)key);
+    return ST_DELETE;
+}
+
+static VALUE tc_run(VALUE arg) {
+    TRANSCODER *tc = (TRANSCODER*)arg;
+    if(tc->des.version == 0) {
+        tc_read0(tc);
+    } else {
+        tc_read3(tc);
+    }
+    if(tc->des.pos != tc->des.size) {
+        rb_raise(rb_eArgError, "source has %ld trailing bytes", tc->des.size - tc->des.pos);
+    }
+    ser_flush(&tc->ser, 1);
+    return Qnil;
+}
+
+static VALUE tc_cleanup(VALUE arg) {
+    TRANSCODER *tc = (TRANSCODER*)arg;
+    while(tc->src) tc_pop_source(tc);
+    xfree(tc->markers);
+    if(tc->strs) {
+        st_foreach(tc->strs, tc_free_span_key, 0);
+        st_free_table(tc->strs);
+    }
+    if(tc->traits) {
+        st_foreach(tc->traits, tc_free_span_key, 0);
+        st_free_table(tc->traits);
+    }
+    json_free(tc);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   RocketAMF::Ext.transcode(src, :from => 0, :to => 3) => string
+ *   RocketAMF::Ext.transcode(src, :from => 3, :to => :json) => string
+ *   RocketAMF::Ext.transcode(src, :to => 3, :io => io) => io
+ *
+ * Converts a single encoded value between AMF0 and AMF3 without building ruby
+ * objects for it, producing what deserializing and then serializing it again
+ * would. Reference tables are rebuilt for the output format. As the class
+ * mapper isn't involved, typed objects keep their class name with all their
+ * properties written as dynamic properties, like an unmapped
+ * RocketAMF::Values::TypedHash. ArrayCollections and vectors become arrays,
+ * and AMF3 byte arrays are embedded in AMF0 output with the AVM+ marker.
+ * Dictionaries and other externalizable objects are not supported.
+ *
+ * With <tt>:to => :json</tt> the value is written as JSON instead, with the
+ * same mapping. See <tt>json_parse_options</tt> in json.c for the options
+ * controlling references, dates, byte arrays and class names. If an
+ * <tt>:io</tt> is given, output is written to it in chunks as it's produced
+ * and the io is returned. <tt>:max_length</tt> raises a RangeError once the
+ * output grows past that many bytes, as with the serializer.
+ */
+static VALUE tc_transcode(int argc, VALUE *argv, VALUE self) {
+    VALUE src, options;
+    rb_scan_args(argc, argv, "11", &src, &options);
+
+    TRANSCODER tc;
+    memset(&tc, 0, sizeof(TRANSCODER));
+    tc.ser.io = Qnil;
+    tc.ser.flush_size = DEFAULT_FLUSH_SIZE;
+    tc.json_class_key = Qnil;
+
+    int from = 0, to = 3;
+    if(options != Qnil) {
+        Check_Type(options, T_HASH);
+        VALUE opt;
+        if((opt = rb_hash_aref(options, sym_from)) != Qnil) from = FIX2INT(opt);
+        if((opt = rb_hash_aref(options, sym_to)) == sym_json) {
+            to = TC_JSON;
+            json_parse_options(&tc, options);
+        } else if(opt != Qnil) {
+            to = FIX2INT(opt);
+        }
+        tc.ser.io = rb_hash_aref(options, sym_io);
+        if((opt = rb_hash_aref(options, sym_max_length)) != Qnil) tc.ser.max_length = NUM2LONG(opt);
+    }
+    if(from != 0 && from != 3) rb_raise(rb_eArgError, "unsupported version %d", from);
+    if(to != 0 && to != 3 && to != TC_JSON) rb_raise(rb_eArgError, "unsupported version %d", to);
+
+    StringValue(src);
+    src = rb_str_new_frozen(src);
+
+    tc.des.version = from;
+    tc.des.stream = RSTRING_PTR(src);
+    tc.des.size = RSTRING_LEN(src);
+    tc.ser.stream = rb_str_buf_new(tc.ser.io == Qnil ? RSTRING_LEN(src) : tc.ser.flush_size);
+    tc.to = to;
+    tc.default_trait = -1;
+    if(to == 3) {
+        tc.strs = st_init_table(&tc_span_type);
+        tc.traits = st_init_table(&tc_span_type);
+    }
+    tc_push_source(&tc);
+
+    rb_ensure(tc_run, (VALUE)&tc, tc_cleanup, (VALUE)&tc);
+    RB_GC_GUARD(src);
+    RB_GC_GUARD(options);
+    return tc.ser.io == Qnil ? tc.ser.stream : tc.ser.io;
+}
+
+void Init_rocket_amf_transcoder() {
+    rb_define_module_function(mRocketAMFExt, "transcode", tc_transcode, -1);
+
+    sym_from = ID2SYM(rb_intern("from"));
+    sym_to = ID2SYM(rb_intern("to"));
+    sym_json = ID2SYM(rb_intern("json"));
+}
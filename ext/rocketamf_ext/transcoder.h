@@ -0,0 +1,102 @@
+typedef struct {
+    const char *ptr;
+    long len;
+} TC_SPAN;
+
+typedef struct {
+    long name; // Index in the source string table, or -1 if anonymous
+    long members;
+    long *member_strs;
+    int dynamic;
+    int externalizable;
+    int array_collection;
+} TC_TRAIT;
+
+/*
+ * Reference tables for the source being read. An AMF3 value embedded in an
+ * AMF0 stream gets its own set, as the AVM+ marker starts fresh tables.
+ */
+typedef struct TC_SOURCE {
+    struct TC_SOURCE *parent;
+    long *offsets; // Position of each object's marker, for re-reading
+    long *map;     // Output object index for each object, or -1 if none
+    long obj_count;
+    long obj_capa;
+    TC_SPAN *strs;
+    long str_count;
+    long str_capa;
+    TC_TRAIT *traits;
+    long trait_count;
+    long trait_capa;
+} TC_SOURCE;
+
+// Output target for JSON, alongside the AMF versions
+#define TC_JSON -1
+
+#define JSON_REFS_INLINE 0 // Referenced values are written out again
+#define JSON_REFS_TAG    1 // References become {"$ref": n}
+
+#define JSON_DATES_MS      0 // Milliseconds since the epoch
+#define JSON_DATES_ISO8601 1 // UTC ISO 8601 string
+
+#define JSON_BYTES_BASE64 0
+#define JSON_BYTES_ARRAY  1
+
+typedef struct {
+    long count; // Entries written so far
+    long idx;   // Output object index of the container
+} TC_JSON_LEVEL;
+
+/*
+ * Reads one format and writes the other without building ruby objects. The
+ * output is what deserializing and then serializing with the default class
+ * mapper would produce, with the output's own reference tables built up as it
+ * goes. Only the stream, io and flush settings of the embedded serializer are
+ * used.
+ */
+typedef struct {
+    AMF_DESERIALIZER des;
+    AMF_SERIALIZER ser;
+    int to;
+    TC_SOURCE *src;
+    long obj_index;
+    char *markers; // AMF3 marker of each output object, for writing references
+    long marker_capa;
+    st_table *strs;
+    long str_index;
+    st_table *traits;
+    long trait_index;
+    long default_trait;
+
+    // JSON output state
+    int json_refs;
+    int json_dates;
+    int json_bytes;
+    VALUE json_class_key;  // Key for class names, or Qnil to leave them out
+    TC_JSON_LEVEL *levels; // Open objects and arrays
+    long depth;
+    long level_capa;
+    int after_key;         // Next value belongs to a key, so needs no separator
+    long *spans;           // Start and end of each output object, for inlining
+    long span_capa;
+} TRANSCODER;
+
+void tc_new_obj(TRANSCODER *tc, long k, char marker);
+
+void json_w_null(TRANSCODER *tc);
+void json_w_bool(TRANSCODER *tc, int val);
+void json_w_number(TRANSCODER *tc, double num);
+void json_w_int(TRANSCODER *tc, long num);
+void json_w_string(TRANSCODER *tc, const char *ptr, long len);
+void json_w_date(TRANSCODER *tc, double ms);
+void json_w_byte_array(TRANSCODER *tc, const char *ptr, long len);
+void json_w_ref(TRANSCODER *tc, long idx);
+void json_w_array_begin(TRANSCODER *tc, long k);
+void json_w_array_end(TRANSCODER *tc);
+void json_w_object_begin(TRANSCODER *tc, long k, const char *name, long len);
+void json_w_key(TRANSCODER *tc, const char *ptr, long len);
+void json_w_object_end(TRANSCODER *tc);
+void json_free(TRANSCODER *tc);
+void json_parse_options(TRANSCODER *tc, VALUE options);
+
+
@@ -0,0 +1,71 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "utf8.h"
+
+/*
+ * Returns the length of the run of ASCII bytes at the start of str. Checks 16
+ * bytes at a time with SSE2 where available, otherwise a word at a time.
+ */
+static long utf8_ascii_prefix(const unsigned char *str, long len) {
+    long i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(str + i));
+        if(_mm_movemask_epi8(chunk)) break;
+    }
+#endif
+    for(; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, str + i, 8);
+        if(word & 0x8080808080808080ULL) break;
+    }
+    while(i < len && str[i] < 0x80) i++;
+    return i;
+}
+
+/*
+ * Validates the multibyte sequence at the start of str, returning its length or
+ * 0 if it's malformed. Rejects overlong forms, surrogates and anything past
+ * U+10FFFF, as Ruby does.
+ */
+static int utf8_sequence(const unsigned char *str, long len) {
+    unsigned char c = str[0];
+    if(c >= 0xC2 && c <= 0xDF) {
+        if(len < 2 || (str[1] & 0xC0) != 0x80) return 0;
+        return 2;
+    } else if(c >= 0xE0 && c <= 0xEF) {
+        if(len < 3 || (str[1] & 0xC0) != 0x80 || (str[2] & 0xC0) != 0x80) return 0;
+        if(c == 0xE0 && str[1] < 0xA0) return 0; // Overlong
+        if(c == 0xED && str[1] > 0x9F) return 0; // Surrogate
+        return 3;
+    } else if(c >= 0xF0 && c <= 0xF4) {
+        if(len < 4 || (str[1] & 0xC0) != 0x80 || (str[2] & 0xC0) != 0x80 || (str[3] & 0xC0) != 0x80) return 0;
+        if(c == 0xF0 && str[1] < 0x90) return 0; // Overlong
+        if(c == 0xF4 && str[1] > 0x8F) return 0; // Past U+10FFFF
+        return 4;
+    }
+    return 0;
+}
+
+/*
+ * Scans the string and returns whether it's plain ASCII, valid UTF-8, or broken.
+ * Runs of ASCII between multibyte characters take the fast path too, so mostly
+ * ASCII text with the odd accented character stays cheap.
+ */
+int utf8_scan(const char *str, long len) {
+    const unsigned char *s = (const unsigned char*)str;
+    long i = utf8_ascii_prefix(s, len);
+    if(i == len) return UTF8_7BIT;
+
+    while(i < len) {
+        int seq = utf8_sequence(s + i, len - i);
+        if(seq == 0) return UTF8_BROKEN;
+        i += seq;
+        i += utf8_ascii_prefix(s + i, len - i);
+    }
+    return UTF8_VALID;
+}
@@ -0,0 +1,5 @@
+#define UTF8_7BIT   0 // Only ASCII bytes
+#define UTF8_VALID  1 // Well-formed UTF-8 with at least one multibyte character
+#define UTF8_BROKEN 2 // Not well-formed UTF-8
+
+int utf8_scan(const char *str, long len);
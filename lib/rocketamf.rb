@@ -6,6 +6,8 @@ require "stringio"
 require 'rocketamf/extensions'
 require 'rocketamf/class_mapping'
 require 'rocketamf/constants'
+require 'rocketamf/values/vector'
+require 'rocketamf/profile'
 require 'rocketamf/remoting'
 
 # RocketAMF is a full featured AMF0/3 serializer and deserializer with support for
@@ -42,6 +44,11 @@ require 'rocketamf/remoting'
 #     minimum serialize time: 31.637864s
 #     minimum deserialize time: 14.773969s
 #
+# A more thorough suite covering the spec fixtures, large generated payloads
+# and remoting envelopes can be run with <tt>rake bench</tt>. Pass
+# <tt>BENCH_JSON=file</tt> to save the results and compare runs with
+# <tt>bench/compare.rb</tt>.
+#
 # == Serialization & Deserialization
 #
 # RocketAMF provides two main methods - <tt>serialize</tt> and <tt>deserialize</tt>.
@@ -62,7 +69,14 @@ require 'rocketamf/remoting'
 #
 # == Remoting
 #
-# You can use RocketAMF bare to write an AMF gateway using the following code.
+# RocketAMF ships a Rack endpoint and middleware in <tt>rocketamf/rack</tt>,
+# which decode straight from <tt>rack.input</tt> and stream the response body:
+#
+#   # config.ru
+#   require 'rocketamf/rack'
+#   run RocketAMF::Rack::Endpoint.new {|method, args| 'Hello world'}
+#
+# You can also use RocketAMF bare to write an AMF gateway using the following code.
 # In addition, you can use rack-amf (http://github.com/rubyamf/rack-amf) or
 # RubyAMF (http://github.com/rubyamf/rubyamf), both of which provide rack-compliant
 # AMF gateways.
@@ -191,10 +205,27 @@ module RocketAMF
     des.deserialize(amf_version, source)
   end
 
+  # Deserialize the AMF string _source_, which must hold an array or
+  # ArrayCollection, yielding its elements one at a time rather than building
+  # the whole array. See <tt>RocketAMF::Deserializer#each_element</tt>.
+  def self.each_element source, amf_version = 0, &block
+    des = RocketAMF::Deserializer.new(RocketAMF::ClassMapper.new)
+    des.each_element(amf_version, source, &block)
+  end
+
   # Serialize the given Ruby data structure _obj_ into an AMF stream using the
   # given AMF version. Creates an instance of <tt>RocketAMF::Serializer</tt>
   # with a new instance of <tt>RocketAMF::ClassMapper</tt> and calls serialize
   # on it with the given object and amf version, returning the result.
+  #
+  # Enumerators are serialized as arrays, encoding each element as it is
+  # yielded, so a database cursor can be streamed out without building an
+  # intermediate array. AMF3 needs the element count up front, which can be
+  # given with <tt>Enumerator.new(count)</tt>. In AMF0 the length is
+  # backpatched if the enumerator has no size.
+  #
+  #   rows = Enumerator.new(User.count) {|y| User.find_each {|u| y << u } }
+  #   RocketAMF.serialize(rows, 3)
   def self.serialize obj, amf_version = 0
     ser = RocketAMF::Serializer.new(RocketAMF::ClassMapper.new)
     ser.serialize(amf_version, obj)
@@ -8,6 +8,7 @@ module RocketAMF
     def initialize
       @as_mappings = {}
       @ruby_mappings = {}
+      @traits = {}
       map_defaults
     end
 
@@ -28,15 +29,50 @@ module RocketAMF
 
     # Map a given AS class to a ruby class.
     #
-    # Use fully qualified names for both.
+    # Use fully qualified names for both. If given a list of <tt>:members</tt>,
+    # the class is serialized with sealed traits containing just those
+    # properties, in that order, rather than as a dynamic object.
     #
     # Example:
     #
     #   m.map :as => 'com.example.Date', :ruby => 'Example::Date'
+    #   m.map :as => 'com.example.Row', :ruby => 'Example::Row', :members => [:id, :name]
     def map params
       [:as, :ruby].each {|k| params[k] = params[k].to_s} # Convert params to strings
       @as_mappings[params[:as]] = params[:ruby]
       @ruby_mappings[params[:ruby]] = params[:as]
+
+      members = (params[:members] || []).map {|m| m.to_s}.freeze
+      @traits[params[:as]] = {
+        :class_name => params[:as].dup.freeze,
+        :members => members,
+        :externalizable => false,
+        :dynamic => members.empty?
+      }.freeze
+    end
+
+    # Resolves every mapped ruby class that's currently loaded and freezes the
+    # set, so that mappers using it skip the constant lookups. Call it at boot
+    # in a preforking server so workers inherit the result. Mapped classes
+    # can't be redefined or reloaded afterwards.
+    def precompile!
+      return self if frozen?
+      @ruby_classes = {}
+      @as_mappings.each do |as_class_name, ruby_class_name|
+        begin
+          @ruby_classes[as_class_name] = ruby_class_name.split('::').inject(Kernel) {|scope, const_name| scope.const_get(const_name)}
+        rescue NameError
+          # Not loaded
+        end
+      end
+      [@as_mappings, @ruby_mappings, @traits, @ruby_classes].each {|h| h.freeze}
+      freeze
+    end
+
+    # Returns the precompiled ruby class for the given AS class name, returning
+    # nil if not found
+    def get_ruby_class class_name #:nodoc:
+      @ruby_classes[class_name.to_s] if @ruby_classes
     end
 
     # Returns the AS class name for the given ruby class name, returing nil if
@@ -50,6 +86,12 @@ module RocketAMF
     def get_ruby_class_name class_name #:nodoc:
       @as_mappings[class_name.to_s]
     end
+
+    # Returns the frozen traits hash for the given AS class name, returning nil
+    # if not found
+    def get_traits class_name #:nodoc:
+      @traits[class_name.to_s]
+    end
   end
 
   # Handles class name mapping between actionscript and ruby and assists in
@@ -107,7 +149,8 @@ module RocketAMF
   # class mapper instance will result in the changes not being detected.  As such,
   # it's not enabled by default. So long as you aren't planning on modifying
   # classes during serialization using <tt>encode_amf</tt>, the faster C class
-  # mapper should be perfectly safe to use.
+  # mapper should be perfectly safe to use. Where the C extension isn't
+  # available, <tt>RocketAMF::Pure::FastClassMapping</tt> caches the same way.
   #
   # Activating the C Class Mapper:
   #
@@ -138,6 +181,12 @@ module RocketAMF
         yield mappings
       end
 
+      # Precompiles the class mappings at boot. See MappingSet#precompile!.
+      def precompile!
+        mappings.precompile!
+        self
+      end
+
       # Reset all class mappings except the defaults and return
       # <tt>use_array_collection</tt> to false
       def reset
@@ -172,6 +221,15 @@ module RocketAMF
       @mappings.get_as_class_name ruby_class_name
     end
 
+    # Returns the AMF3 traits for the given ruby object, or nil if it should be
+    # serialized as an anonymous object. Classes mapped with <tt>:members</tt>
+    # get sealed traits.
+    def get_as_traits obj
+      class_name = get_as_class_name obj
+      return nil unless class_name
+      @mappings.get_traits(class_name) || {:class_name => class_name, :members => [], :externalizable => false, :dynamic => true}
+    end
+
     # Instantiates a ruby object using the mapping configuration based on the
     # source ActionScript class name. If there is no mapping defined, it returns
     # a <tt>RocketAMF::Values::TypedHash</tt> with the serialized class name.
@@ -181,7 +239,8 @@ module RocketAMF
         # Populate a simple hash, since no mapping
         return Values::TypedHash.new(as_class_name)
       else
-        ruby_class = ruby_class_name.split('::').inject(Kernel) {|scope, const_name| scope.const_get(const_name)}
+        ruby_class = @mappings.get_ruby_class(as_class_name)
+        ruby_class ||= ruby_class_name.split('::').inject(Kernel) {|scope, const_name| scope.const_get(const_name)}
         return ruby_class.new
       end
     end
@@ -226,7 +285,7 @@ module RocketAMF
       # Generic object serializer
       props = {}
       @ignored_props ||= Object.new.public_methods
-      (ruby_obj.public_methods - @ignored_props).each do |method_name|
+      (ruby_obj.public_methods - @ignored_props).sort.each do |method_name|
         # Add them to the prop hash if they take no arguments
         method_def = ruby_obj.method(method_name)
         props[method_name.to_s] = ruby_obj.send(method_name) if method_def.arity == 0
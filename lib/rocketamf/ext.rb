@@ -17,6 +17,7 @@ module RocketAMF
   # Import serializer/deserializer
   Deserializer = RocketAMF::Ext::Deserializer
   Serializer = RocketAMF::Ext::Serializer
+  Dispatcher = RocketAMF::Ext::Dispatcher
 
   # Modify envelope so it can serialize/deserialize
   class Envelope
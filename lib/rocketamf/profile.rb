@@ -0,0 +1,81 @@
+require 'thread'
+
+module RocketAMF
+  # Collects what serializing and deserializing each class costs. Pass one in
+  # as the <tt>:profile</tt> option of a serializer or deserializer, and every
+  # object written or read is attributed to its ruby class and AS class name:
+  # how many there were, the time spent on them, the bytes they took up and
+  # the time spent in class mapper callbacks for them. Time and bytes are
+  # exclusive of nested objects, which are attributed to their own class, so
+  # that everything adds up to the cost of the objects in the payload. Arrays,
+  # strings and other values are attributed to the object they're inside.
+  #
+  # A profile can be shared between serializers, deserializers and threads,
+  # and keeps adding up until it's reset.
+  #
+  # Example:
+  #
+  #   profile = RocketAMF::Profile.new
+  #   ser = RocketAMF::Serializer.new(RocketAMF::ClassMapper.new, :profile => profile)
+  #   ser.serialize(3, rows)
+  #   puts profile.report
+  class Profile
+    FIELDS = [:count, :time, :bytes, :mapper_time] #:nodoc:
+
+    def initialize
+      @entries = {}
+      @lock = Mutex.new
+    end
+
+    # Adds <tt>count</tt> objects of the given classes to the profile. Times
+    # are in seconds. Called by the serializers and deserializers.
+    def add operation, ruby_class, as_class, count, time, bytes, mapper_time
+      @lock.synchronize do
+        key = [operation, ruby_class, as_class]
+        entry = @entries[key] ||= {:operation => operation, :ruby_class => ruby_class, :as_class => as_class,
+                                   :count => 0, :time => 0.0, :bytes => 0, :mapper_time => 0.0}
+        entry[:count] += count
+        entry[:time] += time
+        entry[:bytes] += bytes
+        entry[:mapper_time] += mapper_time
+      end
+      self
+    end
+
+    # Returns a hash for every combination of operation (<tt>:serialize</tt>
+    # or <tt>:deserialize</tt>), ruby class and AS class name seen, holding
+    # those along with the totals for each field. They're sorted with the
+    # largest value of the given field first.
+    def to_a sort_by=:time
+      raise ArgumentError, "unknown field #{sort_by.inspect}" unless FIELDS.include?(sort_by)
+      entries = @lock.synchronize { @entries.values.map {|entry| entry.dup} }
+      entries.sort_by {|entry| -entry[sort_by]}
+    end
+
+    # Returns the profile as a table, sorted like <tt>to_a</tt>, with times in
+    # milliseconds
+    def report sort_by=:time
+      rows = [['operation', 'ruby class', 'AS class', 'count', 'time ms', 'bytes', 'mapper ms']]
+      to_a(sort_by).each do |entry|
+        rows << [entry[:operation].to_s, entry[:ruby_class].to_s, entry[:as_class].to_s, entry[:count].to_s,
+                 '%.3f' % (entry[:time] * 1000), entry[:bytes].to_s, '%.3f' % (entry[:mapper_time] * 1000)]
+      end
+
+      widths = rows.transpose.map {|column| column.map {|cell| cell.length}.max}
+      rows.map do |row|
+        row.each_with_index.map {|cell, i| i < 3 ? cell.ljust(widths[i]) : cell.rjust(widths[i])}.join('  ').rstrip
+      end.join("\n") + "\n"
+    end
+
+    # Whether nothing has been recorded
+    def empty?
+      @lock.synchronize { @entries.empty? }
+    end
+
+    # Discards everything recorded so far
+    def reset
+      @lock.synchronize { @entries.clear }
+      self
+    end
+  end
+end
@@ -1,6 +1,8 @@
 require 'rocketamf/pure/deserializer'
 require 'rocketamf/pure/serializer'
 require 'rocketamf/pure/remoting'
+require 'rocketamf/pure/dispatcher'
+require 'rocketamf/pure/class_mapping'
 
 module RocketAMF
   # This module holds all the modules/classes that implement AMF's functionality
@@ -13,6 +15,7 @@ module RocketAMF
   # Import serializer/deserializer
   Deserializer = RocketAMF::Pure::Deserializer
   Serializer = RocketAMF::Pure::Serializer
+  Dispatcher = RocketAMF::Pure::Dispatcher
 
   # Modify envelope so it can serialize/deserialize
   class Envelope
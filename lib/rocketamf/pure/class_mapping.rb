@@ -0,0 +1,70 @@
+require 'rocketamf/class_mapping'
+
+module RocketAMF
+  module Pure
+    # Pure ruby counterpart to <tt>RocketAMF::Ext::FastClassMapping</tt> for
+    # JRuby and installs without a compiler. It caches by class, for the life
+    # of the mapper instance, the AS class name, the list of serializable
+    # properties and the setter for every property it populates. The same
+    # caveats as the C class mapper apply, so it isn't enabled by default.
+    #
+    # Activating it:
+    #
+    #   RocketAMF::ClassMapper = RocketAMF::Pure::FastClassMapping
+    class FastClassMapping < RocketAMF::ClassMapping
+      def initialize
+        super
+        @class_names = {}
+        @class_props = {}
+        @class_setters = {}
+      end
+
+      def get_as_class_name obj #:nodoc:
+        return super if obj.is_a?(String) || obj.is_a?(Hash)
+        klass = obj.class
+        @class_names.fetch(klass) { @class_names[klass] = super }
+      end
+
+      def populate_ruby_obj obj, props, dynamic_props=nil #:nodoc:
+        props.merge! dynamic_props if dynamic_props
+
+        if obj.is_a?(Values::TypedHash)
+          obj.merge! props
+          return obj
+        end
+
+        setters = (@class_setters[obj.class] ||= {})
+        hash_like = obj.respond_to?(:[]=)
+        props.each do |key, value|
+          setter = setters.fetch(key) { setters[key] = obj.respond_to?("#{key}=") ? :"#{key}=" : nil }
+          if setter
+            obj.send(setter, value)
+          elsif hash_like
+            obj[key] = value
+          end
+        end
+        obj
+      end
+
+      def props_for_serialization ruby_obj #:nodoc:
+        return super if ruby_obj.is_a?(Hash)
+
+        props = {}
+        class_props(ruby_obj.class).each {|name, method| props[name] = ruby_obj.send(method)}
+        props
+      end
+
+      private
+      # Returns [name, method] pairs for the public methods that take no
+      # arguments, skipping the ones every object has
+      def class_props klass
+        @class_props[klass] ||= begin
+          @ignored_props ||= Object.public_instance_methods
+          (klass.public_instance_methods - @ignored_props).sort.select do |method|
+            klass.instance_method(method).arity == 0
+          end.map {|method| [method.to_s, method.to_sym]}
+        end
+      end
+    end
+  end
+end
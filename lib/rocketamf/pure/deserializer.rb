@@ -1,16 +1,31 @@
 require 'rocketamf/pure/io_helpers'
+require 'rocketamf/pure/profiling'
 
 module RocketAMF
   module Pure
     # Pure ruby deserializer for AMF0 and AMF3
     class Deserializer
-      attr_accessor :source
-
       # Pass in the class mapper instance to use when deserializing. This
       # enables better caching behavior in the class mapper and allows
       # one to change mappings between deserialization attempts.
-      def initialize class_mapper
+      #
+      # Supported options:
+      # [:profile] A RocketAMF::Profile to add the cost of each object read to,
+      #            by class
+      # [:plain] Decode to core types only, without calling the class mapper.
+      #          Objects become hashes with string keys, dates become epoch
+      #          milliseconds as a float and byte arrays become binary strings.
+      #          Externalizable objects are still read by their mapped class.
+      # [:class_key] With <tt>:plain</tt>, store the AS class name of typed
+      #              objects in their hash under this key
+      def initialize class_mapper, options={}
         @class_mapper = class_mapper
+        @plain = !!options[:plain]
+        @class_key = options[:class_key].to_s.dup.freeze unless options[:class_key].nil?
+        if (@profile = options[:profile])
+          @profile_frames = []
+          @class_mapper = ProfiledClassMapper.new(class_mapper, @profile_frames)
+        end
       end
 
       # Deserialize the source using AMF0 or AMF3. Source should either
@@ -20,40 +35,111 @@ module RocketAMF
       def deserialize version, source
         raise ArgumentError, "unsupported version #{version}" unless [0,3].include?(version)
         @version = version
-
-        if StringIO === source
-          @source = source
-        elsif source
-          @source = StringIO.new(source)
-        elsif @source.nil?
-          raise AMFError, "no source to deserialize"
-        end
+        set_source source
+        @profile_frames.clear if @profile
 
         if @version == 0
           @ref_cache = []
-          return amf0_deserialize
+          obj = amf0_deserialize
         else
           @string_cache = []
           @object_cache = []
           @trait_cache = []
-          return amf3_deserialize
+          obj = amf3_deserialize
+        end
+        @source.pos = @pos if @source
+        obj
+      end
+
+      # Returns the source as a StringIO positioned where the deserializer is.
+      # Reading from it inside <tt>read_external</tt> moves the deserializer
+      # along with it.
+      def source
+        if @source.nil? && @data
+          @source = StringIO.new(@data)
+          @source.pos = @pos
+        end
+        @source
+      end
+
+      def source= source
+        set_source source
+      end
+
+      # Deserializes the source, which must be an array or ArrayCollection, one
+      # element at a time. Each element is yielded as soon as it's read rather
+      # than being collected into an array first. Elements that are objects stay
+      # in the reference cache until the end, as later elements can refer back
+      # to them. Returns an enumerator if no block is given.
+      def each_element version, source
+        return enum_for(:each_element, version, source) unless block_given?
+        raise ArgumentError, "unsupported version #{version}" unless [0,3].include?(version)
+        @version = version
+        set_source source
+        @profile_frames.clear if @profile
+
+        amf3 = @version == 3
+        unless amf3
+          type = read_int8
+          if type == AMF0_AMF3_MARKER
+            amf3 = true
+          elsif type == AMF0_STRICT_ARRAY_MARKER
+            @ref_cache = [[]] # Stand-in for references to the array
+            length = read_word32_network
+          else
+            raise TypeError, "can only iterate over an array or ArrayCollection"
+          end
+        end
+
+        if amf3
+          @version = 3
+          @string_cache = []
+          @object_cache = []
+          @trait_cache = []
+          length = amf3_read_outer_array
+        end
+
+        length.times do
+          elem = amf3 ? amf3_deserialize : amf0_deserialize
+          @source.pos = @pos if @source
+          yield elem
         end
+        self
       end
 
       # Reads an object from the deserializer's stream and returns it.
       def read_object
-        if @version == 0
-          return amf0_deserialize
-        else
-          return amf3_deserialize
-        end
+        @pos = @source.pos if @source # In case it was read from directly
+        obj = @version == 0 ? amf0_deserialize : amf3_deserialize
+        @source.pos = @pos if @source
+        obj
       end
 
       private
-      include RocketAMF::Pure::ReadIOHelpers
+      include RocketAMF::Pure::ReadBufferHelpers
+      include RocketAMF::Pure::ProfileHelpers
+
+      # Reads go straight to the source string at the offset in @pos. StringIO
+      # sources have their position synced back whenever control returns to
+      # the caller.
+      def set_source source
+        if StringIO === source
+          @source = source
+          @data = source.string
+          @pos = source.pos
+        elsif source
+          @source = nil
+          @data = source
+          @pos = 0
+        elsif @data.nil?
+          raise AMFError, "no source to deserialize"
+        elsif @source
+          @pos = @source.pos
+        end
+      end
 
       def amf0_deserialize type=nil
-        type = read_int8 @source unless type
+        type = read_int8 unless type
         case type
         when AMF0_NUMBER_MARKER
           amf0_read_number
@@ -84,35 +170,44 @@ module RocketAMF
         when AMF0_TYPED_OBJECT_MARKER
           amf0_read_typed_object
         when AMF0_AMF3_MARKER
-          deserialize(3, nil)
+          amf0_read_amf3
         else
           raise AMFError, "Invalid type: #{type}"
         end
       end
 
+      # Switches to AMF3 for the rest of the source, as the marker means
+      def amf0_read_amf3
+        @version = 3
+        @string_cache = []
+        @object_cache = []
+        @trait_cache = []
+        amf3_deserialize
+      end
+
       def amf0_read_number
-        res = read_double @source
+        res = read_double
         (res.is_a?(Float) && res.nan?) ? nil : res # check for NaN and convert them to nil
       end
 
       def amf0_read_boolean
-        read_int8(@source) != 0
+        read_int8 != 0
       end
 
       def amf0_read_string long=false
-        len = long ? read_word32_network(@source) : read_word16_network(@source)
-        str = @source.read(len)
+        len = long ? read_word32_network : read_word16_network
+        str = read_bytes(len)
         str.force_encoding("UTF-8") if str.respond_to?(:force_encoding)
         str
       end
 
       def amf0_read_reference
-        index = read_word16_network(@source)
+        index = read_word16_network
         @ref_cache[index]
       end
 
       def amf0_read_array
-        len = read_word32_network(@source)
+        len = read_word32_network
         array = []
         @ref_cache << array
 
@@ -123,16 +218,16 @@ module RocketAMF
       end
 
       def amf0_read_date
-        seconds = read_double(@source).to_f/1000
-        time = Time.at(seconds)
-        tz = read_word16_network(@source) # Unused
-        time
+        milli = read_double.to_f
+        tz = read_word16_network # Unused
+        return milli if @plain
+        Time.at(milli/1000)
       end
 
       def amf0_read_props obj={}
         while true
           key = amf0_read_string
-          type = read_int8 @source
+          type = read_int8
           break if type == AMF0_OBJECT_END_MARKER
           obj[key] = amf0_deserialize(type)
         end
@@ -140,13 +235,16 @@ module RocketAMF
       end
 
       def amf0_read_hash
-        len = read_word32_network(@source) # Read and ignore length
+        len = read_word32_network # Read and ignore length
         obj = {}
         @ref_cache << obj
         amf0_read_props obj
       end
 
       def amf0_read_object add_to_ref_cache=true
+        return amf0_read_plain_object(nil) if @plain
+        frame = profile_enter(@pos - 1) if @profile # Including the type marker
+
         # Create "object" and add to ref cache (it's always a Hash)
         obj = @class_mapper.get_ruby_obj ""
         @ref_cache << obj
@@ -154,23 +252,40 @@ module RocketAMF
         # Populate object
         props = amf0_read_props
         @class_mapper.populate_ruby_obj obj, props
+        profile_leave frame, :deserialize, obj.class, nil, @pos if @profile
         return obj
       end
 
       def amf0_read_typed_object
+        frame = profile_enter(@pos - 1) if @profile # Including the type marker
+
         # Create object to add to ref cache
         class_name = amf0_read_string
+        return amf0_read_plain_object(class_name, frame) if @plain
         obj = @class_mapper.get_ruby_obj class_name
         @ref_cache << obj
 
         # Populate object
         props = amf0_read_props
         @class_mapper.populate_ruby_obj obj, props
+        profile_leave frame, :deserialize, obj.class, class_name, @pos if @profile
         return obj
       end
 
+      # Reads an AMF0 object straight into a hash when decoding plain data,
+      # storing the class name under the class key if there is one
+      def amf0_read_plain_object class_name, frame=nil
+        frame ||= profile_enter(@pos - 1) if @profile
+        obj = {}
+        obj[@class_key] = class_name if @class_key && class_name
+        @ref_cache << obj
+        amf0_read_props obj
+        profile_leave frame, :deserialize, Hash, class_name, @pos if @profile
+        obj
+      end
+
       def amf3_deserialize
-        type = read_int8 @source
+        type = read_int8
         case type
         when AMF3_UNDEFINED_MARKER
           nil
@@ -206,14 +321,17 @@ module RocketAMF
       end
 
       def amf3_read_integer
+        b = @data.getbyte(@pos) || 0
+        @pos += 1
+        return b if b < 0x80 # Most integers and headers fit in a byte
+
         n = 0
-        b = read_word8(@source) || 0
         result = 0
-
         while ((b & 0x80) != 0 && n < 3)
           result = result << 7
           result = result | (b & 0x7f)
-          b = read_word8(@source) || 0
+          b = @data.getbyte(@pos) || 0
+          @pos += 1
           n = n + 1
         end
 
@@ -234,7 +352,7 @@ module RocketAMF
       end
 
       def amf3_read_number
-        res = read_double @source
+        res = read_double
         (res.is_a?(Float) && res.nan?) ? nil : res # check for NaN and convert them to nil
       end
 
@@ -249,7 +367,7 @@ module RocketAMF
           length = type >> 1
           str = ""
           if length > 0
-            str = @source.read(length)
+            str = read_bytes(length)
             str.force_encoding("UTF-8") if str.respond_to?(:force_encoding)
             @string_cache << str
           end
@@ -268,7 +386,7 @@ module RocketAMF
           length = type >> 1
           str = ""
           if length > 0
-            str = @source.read(length)
+            str = read_bytes(length)
             str.force_encoding("UTF-8") if str.respond_to?(:force_encoding)
             @object_cache << str
           end
@@ -285,7 +403,7 @@ module RocketAMF
           return @object_cache[reference]
         else
           length = type >> 1
-          obj = StringIO.new @source.read(length)
+          obj = @plain ? read_bytes(length) : StringIO.new(read_bytes(length))
           @object_cache << obj
           obj
         end
@@ -316,6 +434,7 @@ module RocketAMF
       end
 
       def amf3_read_object
+        start_pos = @pos - 1 # Including the type marker
         type = amf3_read_integer
         is_reference = (type & 0x01) == 0
 
@@ -323,29 +442,7 @@ module RocketAMF
           reference = type >> 1
           return @object_cache[reference]
         else
-          class_type = type >> 1
-          class_is_reference = (class_type & 0x01) == 0
-
-          if class_is_reference
-            reference = class_type >> 1
-            traits = @trait_cache[reference]
-          else
-            externalizable = (class_type & 0x02) != 0
-            dynamic = (class_type & 0x04) != 0
-            attribute_count = class_type >> 3
-            class_name = amf3_read_string
-
-            class_attributes = []
-            attribute_count.times{class_attributes << amf3_read_string} # Read class members
-
-            traits = {
-                      :class_name => class_name,
-                      :members => class_attributes,
-                      :externalizable => externalizable,
-                      :dynamic => dynamic
-                     }
-            @trait_cache << traits
-          end
+          traits = amf3_read_traits(type >> 1)
 
           # Optimization for deserializing ArrayCollection
           if traits[:class_name] == "flex.messaging.io.ArrayCollection"
@@ -354,11 +451,23 @@ module RocketAMF
             return arr
           end
 
+          frame = profile_enter(start_pos) if @profile
+
+          # Plain data goes straight into a hash. Externalizable objects still
+          # need the class mapper, as only their class knows how to read them.
+          if @plain && !traits[:externalizable]
+            obj = amf3_read_plain_object traits
+            profile_leave frame, :deserialize, Hash, traits[:class_name].empty? ? nil : traits[:class_name], @pos if @profile
+            return obj
+          end
+
           obj = @class_mapper.get_ruby_obj traits[:class_name]
           @object_cache << obj
 
           if traits[:externalizable]
+            @source.pos = @pos if @source
             obj.read_external self
+            @pos = @source.pos if @source
           else
             props = {}
             traits[:members].each do |key|
@@ -377,10 +486,77 @@ module RocketAMF
 
             @class_mapper.populate_ruby_obj obj, props, dynamic_props
           end
+          profile_leave frame, :deserialize, obj.class, traits[:class_name].empty? ? nil : traits[:class_name], @pos if @profile
           obj
         end
       end
 
+      def amf3_read_plain_object traits
+        obj = {}
+        obj[@class_key] = traits[:class_name] if @class_key && !traits[:class_name].empty?
+        @object_cache << obj
+        traits[:members].each {|key| obj[key] = amf3_deserialize }
+        if traits[:dynamic]
+          while (key = amf3_read_string) && key.length != 0 do
+            obj[key] = amf3_deserialize
+          end
+        end
+        obj
+      end
+
+      def amf3_read_traits class_type
+        class_is_reference = (class_type & 0x01) == 0
+
+        if class_is_reference
+          reference = class_type >> 1
+          @trait_cache[reference]
+        else
+          externalizable = (class_type & 0x02) != 0
+          dynamic = (class_type & 0x04) != 0
+          attribute_count = class_type >> 3
+          class_name = amf3_read_string
+
+          class_attributes = []
+          attribute_count.times{class_attributes << amf3_read_string} # Read class members
+
+          traits = {
+                    :class_name => class_name,
+                    :members => class_attributes,
+                    :externalizable => externalizable,
+                    :dynamic => dynamic
+                   }
+          @trait_cache << traits
+          traits
+        end
+      end
+
+      # Reads the header of the outermost array for each_element, unwrapping an
+      # ArrayCollection, and returns the number of elements that follow
+      def amf3_read_outer_array
+        type = read_int8
+        collection = false
+        if type == AMF3_OBJECT_MARKER
+          header = amf3_read_integer
+          raise RangeError, "obj reference index beyond end" if (header & 0x01) == 0
+          traits = amf3_read_traits(header >> 1)
+          raise TypeError, "can only iterate over an array or ArrayCollection" unless traits[:class_name] == "flex.messaging.io.ArrayCollection"
+          type = read_int8
+          collection = true
+        end
+        raise TypeError, "can only iterate over an array or ArrayCollection" unless type == AMF3_ARRAY_MARKER
+
+        header = amf3_read_integer
+        raise RangeError, "obj reference index beyond end" if (header & 0x01) == 0
+        raise TypeError, "can't iterate over an associative array" unless amf3_read_string.empty?
+
+        # The elements aren't kept, so an empty array stands in for references
+        # to the array (and the ArrayCollection's copy of it)
+        placeholder = []
+        @object_cache << placeholder
+        @object_cache << placeholder if collection
+        header >> 1
+      end
+
       def amf3_read_date
         type = amf3_read_integer
         is_reference = (type & 0x01) == 0
@@ -388,8 +564,8 @@ module RocketAMF
           reference = type >> 1
           return @object_cache[reference]
         else
-          seconds = read_double(@source).to_f/1000
-          time = Time.at(seconds)
+          milli = read_double.to_f
+          time = @plain ? milli : Time.at(milli/1000)
           @object_cache << time
           time
         end
@@ -405,7 +581,7 @@ module RocketAMF
           dict = {}
           @object_cache << dict
           length = type >> 1
-          weak_keys = read_int8 @source # Ignore: Not supported in ruby
+          weak_keys = read_int8 # Ignore: Not supported in ruby
           0.upto(length - 1) do |i|
             dict[amf3_deserialize] = amf3_deserialize
           end
@@ -423,18 +599,17 @@ module RocketAMF
           vec = []
           @object_cache << vec
           length = type >> 1
-          fixed_vector = read_int8 @source # Ignore
+          fixed_vector = read_int8 # Ignore
           case vector_type
           when AMF3_VECTOR_INT_MARKER
             0.upto(length - 1) do |i|
-              int = read_word32_network(@source)
+              int = read_word32_network
               int = int - 2**32 if int > MAX_INTEGER
               vec << int
             end
           when AMF3_VECTOR_UINT_MARKER
             0.upto(length - 1) do |i|
-              vec << read_word32_network(@source)
-              puts vec[i].to_s(2)
+              vec << read_word32_network
             end
           when AMF3_VECTOR_DOUBLE_MARKER
             0.upto(length - 1) do |i|
@@ -442,7 +617,6 @@ module RocketAMF
             end
           when AMF3_VECTOR_OBJECT_MARKER
             vector_class = amf3_read_string # Ignore
-            puts vector_class
             0.upto(length - 1) do |i|
               vec << amf3_deserialize
             end
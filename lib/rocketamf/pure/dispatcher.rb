@@ -0,0 +1,47 @@
+module RocketAMF
+  module Pure
+    # Answers the method calls in a request envelope using a routing table from
+    # method name to handler. Method names are the target URI for simple calls
+    # and "source.operation" for flex RemoteObject calls. Handlers are anything
+    # that responds to <tt>call</tt>, and are called with the arguments array.
+    # Calls without a route go to the block given to <tt>new</tt>, which gets
+    # the method name and arguments like the <tt>Envelope#each_method_call</tt>
+    # block does.
+    #
+    # Example:
+    #
+    #   dispatcher = RocketAMF::Dispatcher.new('UserService.find' => lambda {|args| User.find(args[0])})
+    #   response = dispatcher.dispatch(request)
+    class Dispatcher
+      def initialize routes=nil, &fallback
+        @routes = {}
+        @routes.update(routes) if routes
+        @fallback = fallback
+      end
+
+      # Routes calls to the given method name to the handler or block
+      def route method, handler=nil, &block
+        handler ||= block
+        raise ArgumentError, "missing handler for #{method}" if handler.nil?
+        @routes[method.to_s] = handler
+        self
+      end
+
+      # Builds the response envelope for the request using
+      # <tt>Envelope#each_method_call</tt>, and returns it
+      def dispatch request, response=RocketAMF::Envelope.new
+        response.each_method_call request do |method, args|
+          handler = @routes[method]
+          if handler
+            handler.call(args)
+          elsif @fallback
+            @fallback.call(method, args)
+          else
+            raise NoMethodError, "no route for #{method}"
+          end
+        end
+        response
+      end
+    end
+  end
+end
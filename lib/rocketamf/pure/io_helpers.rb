@@ -18,9 +18,7 @@ module RocketAMF
       end
 
       def read_int16_network source
-        str = source.read(2)
-        str.reverse! if byte_order_little? # swap bytes as native=little (and we want network)
-        str.unpack('s').first
+        source.read(2).unpack('s>').first
       end
 
       def read_word32_network source
@@ -40,26 +38,106 @@ module RocketAMF
       end
     end
 
+    # Readers for primitives at the current offset into a source string, used
+    # by the deserializer in place of ReadIOHelpers. They expect <tt>@data</tt>
+    # to hold the string and <tt>@pos</tt> the byte offset, and advance the
+    # offset past what they read. Nothing is copied except for the strings
+    # returned by <tt>read_bytes</tt>.
+    module ReadBufferHelpers #:nodoc:
+      # <tt>unpack1</tt> with an <tt>offset</tt> avoids slicing out a string
+      # per primitive. Older rubies fall back to <tt>byteslice</tt>.
+      UNPACK_OFFSET = begin
+        "\001".unpack1('C', :offset => 0) == 1
+      rescue StandardError
+        false
+      end
+
+      def read_int8
+        b = @data.getbyte(@pos)
+        @pos += 1
+        b > 127 ? b - 256 : b
+      end
+
+      def read_word8
+        b = @data.getbyte(@pos)
+        @pos += 1
+        b
+      end
+
+      def read_bytes len
+        str = @data.byteslice(@pos, len)
+        @pos += len
+        str
+      end
+
+      if UNPACK_OFFSET
+        def read_double
+          val = @data.unpack1('G', :offset => @pos)
+          @pos += 8
+          val
+        end
+
+        def read_word16_network
+          val = @data.unpack1('n', :offset => @pos)
+          @pos += 2
+          val
+        end
+
+        def read_word32_network
+          val = @data.unpack1('N', :offset => @pos)
+          @pos += 4
+          val
+        end
+      else
+        def read_double
+          read_bytes(8).unpack('G').first
+        end
+
+        def read_word16_network
+          read_bytes(2).unpack('n').first
+        end
+
+        def read_word32_network
+          read_bytes(4).unpack('N').first
+        end
+      end
+    end
+
+    # Writers that append primitives straight to a binary output buffer. Single
+    # bytes are appended as integers, so they never allocate.
     module WriteIOHelpers #:nodoc:
-      def pack_integer(integer)
+      # Returns an empty binary string with room for size bytes
+      def new_buffer size
+        String.new(:capacity => size)
+      rescue ArgumentError, TypeError
+        String.new.force_encoding("ASCII-8BIT")
+      end
+
+      def write_integer buf, integer
         integer = integer & 0x1fffffff
-        if(integer < 0x80)
-          [integer].pack('c')
-        elsif(integer < 0x4000)
-          [integer >> 7 & 0x7f | 0x80].pack('c')+
-          [integer & 0x7f].pack('c')
-        elsif(integer < 0x200000)
-          [integer >> 14 & 0x7f | 0x80].pack('c') +
-          [integer >> 7 & 0x7f | 0x80].pack('c') +
-          [integer & 0x7f].pack('c')
+        if integer < 0x80
+          buf << integer
+        elsif integer < 0x4000
+          buf << (integer >> 7 & 0x7f | 0x80) << (integer & 0x7f)
+        elsif integer < 0x200000
+          buf << (integer >> 14 & 0x7f | 0x80) << (integer >> 7 & 0x7f | 0x80) << (integer & 0x7f)
         else
-          [integer >> 22 & 0x7f | 0x80].pack('c')+
-          [integer >> 15 & 0x7f | 0x80].pack('c')+
-          [integer >> 8 & 0x7f | 0x80].pack('c')+
-          [integer & 0xff].pack('c')
+          buf << (integer >> 22 & 0x7f | 0x80) << (integer >> 15 & 0x7f | 0x80) << (integer >> 8 & 0x7f | 0x80) << (integer & 0xff)
         end
       end
 
+      def write_word16_network buf, val
+        buf << (val >> 8 & 0xff) << (val & 0xff)
+      end
+
+      def write_word32_network buf, val
+        buf << (val >> 24 & 0xff) << (val >> 16 & 0xff) << (val >> 8 & 0xff) << (val & 0xff)
+      end
+
+      def pack_integer(integer)
+        write_integer new_buffer(4), integer
+      end
+
       def pack_double(double)
         [double].pack('G')
       end
@@ -73,9 +151,7 @@ module RocketAMF
       end
 
       def pack_word32_network(val)
-        str = [val].pack('L')
-        str.reverse! if byte_order_little? # swap bytes as native=little (and we want network)
-        str
+        [val].pack('N')
       end
 
       def byte_order
@@ -91,4 +167,4 @@ module RocketAMF
       end
     end
   end
-end
\ No newline at end of file
+end
@@ -0,0 +1,66 @@
+module RocketAMF
+  module Pure
+    # Attributes the cost of each object read or written to its classes for
+    # the <tt>:profile</tt> option. Expects <tt>@profile</tt> to hold the
+    # RocketAMF::Profile and <tt>@profile_frames</tt> an array.
+    module ProfileHelpers #:nodoc:
+      if defined?(Process::CLOCK_MONOTONIC)
+        def profile_now
+          Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        end
+      else
+        def profile_now
+          Time.now.to_f
+        end
+      end
+
+      # Starts attributing to a new object, beginning at the given position.
+      # Returns the frame to pass to profile_leave.
+      def profile_enter pos
+        # Start time, start position, nested time and bytes, mapper time
+        @profile_frames << [profile_now, pos, 0.0, 0, 0.0]
+        @profile_frames.length - 1
+      end
+
+      # Adds the cost of the object started by profile_enter, less that of the
+      # objects nested in it, to the profile. Any frames left above it by an
+      # exception that was rescued are dropped.
+      def profile_leave frame, operation, ruby_class, as_class, pos
+        start, start_pos, child_time, child_bytes, mapper_time = @profile_frames[frame]
+        @profile_frames.slice!(frame..-1)
+        time = profile_now - start
+        bytes = pos - start_pos
+        if (parent = @profile_frames.last)
+          parent[2] += time
+          parent[3] += bytes
+        end
+        @profile.add operation, ruby_class, as_class, 1, time - child_time, bytes - child_bytes, mapper_time
+      end
+    end
+
+    # Wraps a class mapper to add the time spent in each callback to the
+    # object being read or written
+    class ProfiledClassMapper #:nodoc:
+      include ProfileHelpers
+
+      def initialize class_mapper, frames
+        @class_mapper = class_mapper
+        @profile_frames = frames
+      end
+
+      def method_missing name, *args, &block
+        start = profile_now
+        begin
+          @class_mapper.__send__(name, *args, &block)
+        ensure
+          frame = @profile_frames.last
+          frame[4] += profile_now - start if frame
+        end
+      end
+
+      def respond_to_missing? name, include_private=false
+        @class_mapper.respond_to?(name, include_private)
+      end
+    end
+  end
+end
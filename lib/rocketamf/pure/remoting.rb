@@ -56,9 +56,18 @@ module RocketAMF
       end
 
       # Included into RocketAMF::Envelope, this method handles serializing an
-      # AMF request/response into a string
-      def serialize class_mapper=nil
-        ser = Serializer.new(class_mapper || RocketAMF::ClassMapper.new)
+      # AMF request/response into a string. The byte length of every header
+      # and message body is filled in, so that readers can skip or split them
+      # without decoding.
+      #
+      # The options are passed on to the serializer. With <tt>:io</tt>, output
+      # is written to it as it's produced and the io is returned. A header or
+      # message body is held back until its length has been filled in, unless
+      # it grows past <tt>:flush_size</tt>. Its length is then written as
+      # unknown, which readers already handle, so that it can be streamed out
+      # like everything else.
+      def serialize class_mapper=nil, options={}
+        ser = Serializer.new(class_mapper || RocketAMF::ClassMapper.new, options)
         stream = ser.stream
 
         # Write version
@@ -77,8 +86,8 @@ module RocketAMF
           stream << pack_int8(h.must_understand ? 1 : 0)
 
           # Serialize data
-          stream << pack_word32_network(-1) # length of data - -1 if you don't know
-          ser.serialize(0, h.data)
+          ser.write_length { ser.serialize(0, h.data) }
+          stream = ser.stream
         end
 
         # Write messages
@@ -97,16 +106,18 @@ module RocketAMF
           stream << uri_str
 
           # Serialize data
-          stream << pack_word32_network(-1) # length of data - -1 if you don't know
-          if @amf_version == 3
-            stream << AMF0_AMF3_MARKER
-            ser.serialize(3, m.data)
-          else
-            ser.serialize(0, m.data)
+          ser.write_length do
+            if @amf_version == 3
+              stream << AMF0_AMF3_MARKER
+              ser.serialize(3, m.data)
+            else
+              ser.serialize(0, m.data)
+            end
           end
+          stream = ser.stream
         end
 
-        stream
+        ser.finish_stream
       end
 
       private
@@ -1,4 +1,5 @@
 require 'rocketamf/pure/io_helpers'
+require 'rocketamf/pure/profiling'
 
 module RocketAMF
   module Pure
@@ -6,13 +7,45 @@ module RocketAMF
     class Serializer
       attr_reader :stream, :version
 
+      UTF_8 = defined?(Encoding) ? Encoding::UTF_8 : nil #:nodoc:
+
       # Pass in the class mapper instance to use when serializing. This enables
       # better caching behavior in the class mapper and allows one to change
       # mappings between serialization attempts.
-      def initialize class_mapper
+      #
+      # Supported options:
+      # [:io] Write output to the given IO (or anything with a <tt>write</tt>
+      #       method) every <tt>:flush_size</tt> bytes instead of accumulating
+      #       it all in one string
+      # [:flush_size] Bytes to buffer before writing to <tt>:io</tt>. Defaults
+      #               to 64KB.
+      # [:max_length] Raise a RangeError once the total serialized output
+      #               exceeds this many bytes
+      # [:sort_props] Write object properties in sorted key order. Defaults to
+      #               true.
+      # [:dedupe] In AMF3, write a hash or array equal to one already written
+      #           as a reference to that one. Only hashes and arrays of nil,
+      #           booleans, numbers, symbols, strings and more such hashes and
+      #           arrays are compared. Off by default.
+      # [:profile] A RocketAMF::Profile to add the cost of each object written
+      #            to, by class
+      def initialize class_mapper, options={}
         @class_mapper = class_mapper
-        @stream = ""
+        @mapper_traits = class_mapper.respond_to?(:get_as_traits)
+        if (@profile = options[:profile])
+          @profile_frames = []
+          @class_mapper = ProfiledClassMapper.new(class_mapper, @profile_frames)
+        end
         @depth = 0
+        @io = options[:io]
+        @flush_size = options[:flush_size] || 64*1024
+        @stream = new_buffer(@io ? @flush_size : 0)
+        @max_length = options[:max_length]
+        @flushed = 0
+        @flush_holds = 0
+        @length_pos = nil
+        @sort_props = options.fetch(:sort_props, true)
+        @dedupe = options[:dedupe]
       end
 
       # Serialize the given object using AMF0 or AMF3. Can be called from inside
@@ -22,39 +55,59 @@ module RocketAMF
         raise ArgumentError, "unsupported version #{version}" unless [0,3].include?(version)
         @version = version
 
-        # Initialize caches
-        if @depth == 0
-          if @version == 0
-            @ref_cache = SerializerCache.new :object
-          else
-            @string_cache = SerializerCache.new :string
-            @object_cache = SerializerCache.new :object
-            @trait_cache = SerializerCache.new :string
-          end
+        # Calls from encode_amf share the outer call's caches and clean up
+        if @depth > 0
+          @depth += 1
+          @version == 0 ? amf0_serialize(obj) : amf3_serialize(obj)
+          @depth -= 1
+          return @stream
         end
-        @depth += 1
 
-        # Perform serialization
+        # Initialize caches
+        @profile_frames.clear if @profile
         if @version == 0
-          amf0_serialize(obj)
+          @ref_cache = SerializerCache.new :object
         else
-          amf3_serialize(obj)
+          @string_cache = SerializerCache.new :string
+          @object_cache = SerializerCache.new :object
+          @trait_cache = SerializerCache.new :string
+          @dedupe_cache = {} if @dedupe
         end
+        @depth = 1
+        start_pos = @stream.bytesize
+        start_flushed = @flushed
 
-        # Cleanup
-        @depth -= 1
-        if @depth == 0
+        # Perform serialization
+        done = false
+        begin
+          @version == 0 ? amf0_serialize(obj) : amf3_serialize(obj)
+          done = true
+        ensure
+          # Cleanup, dropping partial output if it raised so that the next call
+          # starts clean. Output already written to the IO can't be taken back.
+          @depth = 0
           @ref_cache = nil
           @string_cache = nil
           @object_cache = nil
           @trait_cache = nil
+          @dedupe_cache = nil
+          unless done
+            @flush_holds = 0
+            @length_pos = nil
+            @stream.slice!((@flushed == start_flushed ? start_pos : 0)..-1)
+          end
         end
 
+        if @io
+          flush_stream true
+          return @io
+        end
         return @stream
       end
 
       # Helper for writing arrays inside encode_amf. It uses the current AMF
-      # version to write the array.
+      # version to write the array. Enumerators are also accepted, and are
+      # written one element at a time as they are iterated.
       def write_array arr
         if @version == 0
           amf0_write_array arr
@@ -76,31 +129,91 @@ module RocketAMF
         end
       end
 
+      # Writes a length in front of whatever the block writes, holding the
+      # output back until it's filled in, and flushes afterwards if there's
+      # enough of it. If the output grows past flush_size while writing to an
+      # IO, the length is written as unknown instead so that it can be flushed.
+      def write_length #:nodoc:
+        @flush_holds += 1
+        @length_pos = @stream.bytesize
+        @stream << pack_word32_network(-1)
+        yield
+        if @length_pos
+          len = @stream.bytesize - @length_pos - 4
+          len = 0xFFFFFFFF if len > 0xFFFFFFFF
+          @stream[@length_pos, 4] = pack_word32_network(len)
+          @length_pos = nil
+          @flush_holds -= 1
+        end
+        flush_stream
+      end
+
+      # Hands whatever is still buffered off to the target IO, and returns the
+      # IO, or the stream if there isn't one
+      def finish_stream #:nodoc:
+        flush_stream true
+        @io || @stream
+      end
+
       private
       include RocketAMF::Pure::WriteIOHelpers
+      include RocketAMF::Pure::ProfileHelpers
+
+      # Enforces max_length and hands buffered output off to the target IO once
+      # there's enough of it. Nothing is handed off while a hold is open, even
+      # if forced, as the held output is still to be backpatched. The exception
+      # is a length from write_length, which is given up on as unknown once
+      # there's enough to flush.
+      def flush_stream force=false
+        if @max_length && @flushed + @stream.bytesize > @max_length
+          raise RangeError, "serialized output of #{@flushed + @stream.bytesize} bytes exceeds max length of #{@max_length}"
+        end
+        return if @io.nil? || @stream.empty?
+        if @flush_holds == 1 && @length_pos && @stream.bytesize >= @flush_size
+          @stream[@length_pos, 4] = pack_word32_network(0xFFFFFFFF)
+          @length_pos = nil
+          @flush_holds -= 1
+        end
+        return if @flush_holds > 0
+        return if !force && @stream.bytesize < @flush_size
+
+        @io.write @stream
+        @flushed += @stream.bytesize
+        @stream = new_buffer(@flush_size)
+      end
 
       def amf0_serialize obj
-        if @ref_cache[obj] != nil
-          amf0_write_reference @ref_cache[obj]
+        if (index = @ref_cache[obj])
+          amf0_write_reference index
         elsif obj.respond_to?(:encode_amf)
           obj.encode_amf(self)
-        elsif obj.is_a?(NilClass)
-          amf0_write_null
-        elsif obj.is_a?(TrueClass) || obj.is_a?(FalseClass)
-          amf0_write_boolean obj
-        elsif obj.is_a?(Numeric)
-          amf0_write_number obj
-        elsif obj.is_a?(Symbol) || obj.is_a?(String)
-          amf0_write_string obj.to_s
-        elsif obj.is_a?(Time)
-          amf0_write_time obj
-        elsif obj.is_a?(Date)
-          amf0_write_date obj
-        elsif obj.is_a?(Array)
-          amf0_write_array obj
-        elsif obj.is_a?(Hash) ||obj.is_a?(Object)
-          amf0_write_object obj
+        else
+          case obj
+          when NilClass
+            amf0_write_null
+          when TrueClass, FalseClass
+            amf0_write_boolean obj
+          when Numeric
+            amf0_write_number obj
+          when String
+            amf0_write_string obj
+          when Symbol
+            amf0_write_string obj.to_s
+          when Time
+            amf0_write_time obj
+          when Date
+            amf0_write_date obj
+          when Array
+            amf0_write_array obj
+          when Values::Vector
+            amf0_write_array obj.to_a # AMF0 has no vectors
+          when Enumerator
+            amf0_write_array obj
+          when Hash, Object
+            amf0_write_object obj
+          end
         end
+        flush_stream if @io || @max_length
       end
 
       def amf0_write_null
@@ -108,8 +221,7 @@ module RocketAMF
       end
 
       def amf0_write_boolean bool
-        @stream << AMF0_BOOLEAN_MARKER
-        @stream << pack_int8(bool ? 1 : 0)
+        @stream << AMF0_BOOLEAN_MARKER << (bool ? 1 : 0)
       end
 
       def amf0_write_number num
@@ -118,14 +230,14 @@ module RocketAMF
       end
 
       def amf0_write_string str
-        str = str.encode("UTF-8").force_encoding("ASCII-8BIT") if str.respond_to?(:encode)
+        str = binary_utf8(str)
         len = str.bytesize
         if len > 2**16-1
           @stream << AMF0_LONG_STRING_MARKER
-          @stream << pack_word32_network(len)
+          write_word32_network @stream, len
         else
           @stream << AMF0_STRING_MARKER
-          @stream << pack_int16_network(len)
+          write_word16_network @stream, len
         end
         @stream << str
       end
@@ -137,30 +249,74 @@ module RocketAMF
         milli = (time.to_f * 1000).to_i
         @stream << pack_double(milli)
 
-        @stream << pack_int16_network(0) # Time zone
+        write_word16_network @stream, 0 # Time zone
       end
 
       def amf0_write_date date
         @stream << AMF0_DATE_MARKER
         @stream << pack_double(date.strftime("%Q").to_i)
-        @stream << pack_int16_network(0) # Time zone
+        write_word16_network @stream, 0 # Time zone
       end
 
       def amf0_write_reference index
         @stream << AMF0_REFERENCE_MARKER
-        @stream << pack_int16_network(index)
+        write_word16_network @stream, index
       end
 
       def amf0_write_array array
         @ref_cache.add_obj array
         @stream << AMF0_STRICT_ARRAY_MARKER
-        @stream << pack_word32_network(array.length)
-        array.each do |elem|
-          amf0_serialize elem
+        if array.is_a?(Array)
+          write_word32_network @stream, array.length
+          array.each do |elem|
+            amf0_serialize elem
+          end
+          return
+        end
+
+        # Enumerators without a size get their length backpatched, so hold off
+        # flushing until the placeholder has been filled in
+        len = enum_size(array)
+        len_pos = @stream.bytesize
+        write_word32_network @stream, len || 0
+        if len
+          write_enum(array, len) {|elem| amf0_serialize elem}
+        else
+          begin
+            @flush_holds += 1
+            count = write_enum(array, nil) {|elem| amf0_serialize elem}
+          ensure
+            @flush_holds -= 1
+          end
+          raise RangeError, "int #{count} out of range" if count > 0xffffffff
+          @stream[len_pos, 4] = pack_word32_network(count)
         end
       end
 
+      # Returns the size an enumerator reports, or nil if it doesn't know it
+      def enum_size enum
+        size = enum.size
+        size.is_a?(Integer) ? size : nil
+      end
+
+      # Yields each element of the enumerator, checking the count against the
+      # length already written to the stream if there is one. Returns the count.
+      def write_enum enum, len
+        count = 0
+        enum.each do |*elem|
+          elem = elem.length > 1 ? elem : elem[0]
+          raise RangeError, "enumerator yielded more than its size of #{len} elements" if len && count >= len
+          count += 1
+          yield elem
+        end
+        if len && count != len
+          raise RangeError, "enumerator yielded #{count} elements but its size was #{len}"
+        end
+        count
+      end
+
       def amf0_write_object obj, props=nil
+        frame = profile_enter(@flushed + @stream.bytesize) if @profile
         @ref_cache.add_obj obj
 
         props = @class_mapper.props_for_serialization obj if props.nil?
@@ -168,56 +324,107 @@ module RocketAMF
         # Is it a typed object?
         class_name = @class_mapper.get_as_class_name obj
         if class_name
-          class_name = class_name.encode("UTF-8").force_encoding("ASCII-8BIT") if class_name.respond_to?(:encode)
+          name = binary_utf8(class_name)
           @stream << AMF0_TYPED_OBJECT_MARKER
-          @stream << pack_int16_network(class_name.bytesize)
-          @stream << class_name
+          write_word16_network @stream, name.bytesize
+          @stream << name
         else
           @stream << AMF0_OBJECT_MARKER
         end
 
         # Write prop list
-        props.sort.each do |key, value| # Sort keys before writing
-          key = key.encode("UTF-8").force_encoding("ASCII-8BIT") if key.respond_to?(:encode)
-          @stream << pack_int16_network(key.bytesize)
+        props = props.sort if @sort_props
+        props.each do |key, value|
+          key = binary_utf8(key)
+          write_word16_network @stream, key.bytesize
           @stream << key
           amf0_serialize value
         end
 
         # Write end
-        @stream << pack_int16_network(0)
+        write_word16_network @stream, 0
         @stream << AMF0_OBJECT_END_MARKER
+        profile_leave frame, :serialize, obj.class, class_name, @flushed + @stream.bytesize if @profile
       end
 
       def amf3_serialize obj
         if obj.respond_to?(:encode_amf)
           obj.encode_amf(self)
-        elsif obj.is_a?(NilClass)
-          amf3_write_null
-        elsif obj.is_a?(TrueClass)
-          amf3_write_true
-        elsif obj.is_a?(FalseClass)
-          amf3_write_false
-        elsif obj.is_a?(Numeric)
-          amf3_write_numeric obj
-        elsif obj.is_a?(Symbol) || obj.is_a?(String)
-          amf3_write_string obj.to_s
-        elsif obj.is_a?(Time)
-          amf3_write_time obj
-        elsif obj.is_a?(Date)
-          amf3_write_date obj
-        elsif obj.is_a?(StringIO)
-          amf3_write_byte_array obj
-        elsif obj.is_a?(Array)
-          amf3_write_array obj
-        elsif obj.is_a?(Hash) || obj.is_a?(Object)
-          amf3_write_object obj
+        else
+          case obj
+          when NilClass
+            amf3_write_null
+          when TrueClass
+            amf3_write_true
+          when FalseClass
+            amf3_write_false
+          when Numeric
+            amf3_write_numeric obj
+          when String
+            amf3_write_string obj
+          when Symbol
+            amf3_write_string obj.to_s
+          when Time
+            amf3_write_time obj
+          when Date
+            amf3_write_date obj
+          when StringIO
+            amf3_write_byte_array obj
+          when Array
+            amf3_dedupe obj if @dedupe_cache
+            amf3_write_array obj
+          when Values::Vector
+            amf3_write_vector obj
+          when Enumerator
+            amf3_write_array obj
+          when Hash
+            amf3_dedupe obj if @dedupe_cache
+            amf3_write_object obj
+          when Object
+            amf3_write_object obj
+          end
+        end
+        flush_stream if @io || @max_length
+      end
+
+      DEDUPE_MAX_DEPTH = 32 #:nodoc:
+
+      # Registers a plain hash or array equal to one already written under that
+      # one's object index, so that it's written as a reference, or otherwise
+      # remembers it under the index it's about to be written with
+      def amf3_dedupe obj
+        return if @object_cache.key?(obj) || !dedupe_plain?(obj, 0)
+        if (index = @dedupe_cache[obj])
+          @object_cache[obj] = index
+        else
+          @dedupe_cache[obj] = @object_cache.next_index
+        end
+      end
+
+      # Plain values encode the same way whenever they're equal. Cycles fail
+      # the depth check.
+      def dedupe_plain? obj, depth
+        case obj
+        when nil, true, false, Integer, Symbol
+          true
+        when Float
+          !(obj.zero? && 1.0 / obj < 0) # -0.0 is eql? to 0.0
+        when String
+          obj.instance_of?(String)
+        when Array
+          obj.instance_of?(Array) && depth < DEDUPE_MAX_DEPTH && !obj.respond_to?(:is_array_collection?) &&
+            obj.all? {|val| dedupe_plain?(val, depth + 1)}
+        when Hash
+          obj.instance_of?(Hash) && depth < DEDUPE_MAX_DEPTH &&
+            obj.all? {|key, val| dedupe_plain?(key, depth + 1) && dedupe_plain?(val, depth + 1)}
+        else
+          false
         end
       end
 
       def amf3_write_reference index
         header = index << 1 # shift value left to leave a low bit of 0
-        @stream << pack_integer(header)
+        write_integer @stream, header
       end
 
       def amf3_write_null
@@ -238,7 +445,7 @@ module RocketAMF
           @stream << pack_double(num)
         else
           @stream << AMF3_INTEGER_MARKER
-          @stream << pack_integer(num)
+          write_integer @stream, num
         end
       end
 
@@ -284,12 +491,17 @@ module RocketAMF
         else
           @object_cache.add_obj array
           str = array.string
-          @stream << pack_integer(str.bytesize << 1 | 1)
+          write_integer @stream, str.bytesize << 1 | 1
           @stream << str
         end
       end
 
       def amf3_write_array array
+        # AMF3 array lengths are variable width, so enumerators need a known size
+        is_enum = !array.is_a?(Array)
+        len = is_enum ? enum_size(array) : array.length
+        raise ArgumentError, "cannot serialize an enumerator without a size to AMF3" if len.nil?
+
         # Is it an array collection?
         is_ac = false
         if array.respond_to?(:is_array_collection?)
@@ -314,26 +526,64 @@ module RocketAMF
         if is_ac
           class_name = "flex.messaging.io.ArrayCollection"
           if @trait_cache[class_name] != nil
-            @stream << pack_integer(@trait_cache[class_name] << 2 | 0x01)
+            write_integer @stream, @trait_cache[class_name] << 2 | 0x01
           else
             @trait_cache.add_obj class_name
-            @stream << "\a" # Externalizable, non-dynamic
+            @stream << 0x07 # Externalizable, non-dynamic
             amf3_write_utf8_vr(class_name)
           end
           @stream << AMF3_ARRAY_MARKER
         end
 
         # Build AMF string for array
-        header = array.length << 1 # make room for a low bit of 1
+        header = len << 1 # make room for a low bit of 1
         header = header | 1 # set the low bit to 1
-        @stream << pack_integer(header)
+        write_integer @stream, header
         @stream << AMF3_CLOSE_DYNAMIC_ARRAY
-        array.each do |elem|
-          amf3_serialize elem
+        if is_enum
+          write_enum(array, len) {|elem| amf3_serialize elem}
+        else
+          array.each do |elem|
+            amf3_serialize elem
+          end
+        end
+      end
+
+      def amf3_write_vector vec
+        marker = case vec.type
+        when :int then AMF3_VECTOR_INT_MARKER
+        when :uint then AMF3_VECTOR_UINT_MARKER
+        when :double then AMF3_VECTOR_DOUBLE_MARKER
+        when :object then AMF3_VECTOR_OBJECT_MARKER
+        end
+        @stream << marker
+
+        # Write reference or cache vector
+        if @object_cache[vec] != nil
+          amf3_write_reference @object_cache[vec]
+          return
+        else
+          @object_cache.add_obj vec
+        end
+
+        # Write header and fixed flag
+        elems = vec.to_a
+        write_integer @stream, elems.length << 1 | 1
+        @stream << (vec.fixed ? 1 : 0)
+
+        # Write contents
+        case vec.type
+        when :int then @stream << elems.pack('N*') # Two's complement is the same bits
+        when :uint then @stream << elems.pack('N*')
+        when :double then @stream << elems.pack('G*')
+        when :object
+          amf3_write_utf8_vr vec.class_name.to_s
+          elems.each {|elem| amf3_serialize elem }
         end
       end
 
       def amf3_write_object obj, props=nil, traits=nil
+        start_pos = @flushed + @stream.bytesize
         @stream << AMF3_OBJECT_MARKER
 
         # Caching...
@@ -343,11 +593,28 @@ module RocketAMF
         end
         @object_cache.add_obj obj
 
+        # Write the rest, attributing it to the object's classes when profiling
+        if @profile
+          frame = profile_enter start_pos
+          as_class = amf3_write_object_body(obj, props, traits)
+          profile_leave frame, :serialize, obj.class, as_class, @flushed + @stream.bytesize
+        else
+          amf3_write_object_body obj, props, traits
+        end
+      end
+
+      # Writes the traits and properties of an object that isn't a reference,
+      # and returns its AS class name
+      def amf3_write_object_body obj, props, traits
         # Calculate traits if not given
         is_default = false
+        if traits.nil? && @mapper_traits
+          traits = @class_mapper.get_as_traits(obj)
+          is_default = true unless traits
+        end
         if traits.nil?
           traits = {
-                    :class_name => @class_mapper.get_as_class_name(obj),
+                    :class_name => is_default ? nil : @class_mapper.get_as_class_name(obj),
                     :members => [],
                     :externalizable => false,
                     :dynamic => true
@@ -358,7 +625,7 @@ module RocketAMF
 
         # Write out traits
         if (class_name && @trait_cache[class_name] != nil)
-          @stream << pack_integer(@trait_cache[class_name] << 2 | 0x01)
+          write_integer @stream, @trait_cache[class_name] << 2 | 0x01
         else
           @trait_cache.add_obj class_name if class_name
 
@@ -367,7 +634,7 @@ module RocketAMF
           header |= 0x02 << 2 if traits[:dynamic]
           header |= 0x01 << 2 if traits[:externalizable]
           header |= traits[:members].length << 4
-          @stream << pack_integer(header)
+          write_integer @stream, header
 
           # Write out class name
           if class_name == "__default__"
@@ -383,7 +650,7 @@ module RocketAMF
         # If externalizable, take externalized data shortcut
         if traits[:externalizable]
           obj.write_external(self)
-          return
+          return traits[:class_name]
         end
 
         # Extract properties if not given
@@ -398,7 +665,8 @@ module RocketAMF
         # Write out dynamic properties
         if traits[:dynamic]
           # Write out dynamic properties
-          props.sort.each do |key, val| # Sort props until Ruby 1.9 becomes common
+          props = props.sort if @sort_props
+          props.each do |key, val|
             amf3_write_utf8_vr key.to_s
             amf3_serialize val
           end
@@ -406,31 +674,35 @@ module RocketAMF
           # Write close
           @stream << AMF3_CLOSE_DYNAMIC_OBJECT
         end
+        traits[:class_name]
       end
 
+      # Strings are cached by their UTF-8 form, and only copied when they have
+      # to be converted or written out for the first time
       def amf3_write_utf8_vr str, encode=true
-        if str.respond_to?(:encode)
-          if encode
-            str = str.encode("UTF-8")
-          else
-            str = str.dup if str.frozen?
-          end
-          str.force_encoding("ASCII-8BIT")
-        end
+        str = str.encode(UTF_8) if encode && str.respond_to?(:encode) && str.encoding != UTF_8
 
-        if str == ''
+        if str.empty?
           @stream << AMF3_EMPTY_STRING
-        elsif @string_cache[str] != nil
-          amf3_write_reference @string_cache[str]
+        elsif (index = @string_cache[str])
+          amf3_write_reference index
         else
           # Cache string
           @string_cache.add_obj str
 
           # Build AMF string
-          @stream << pack_integer(str.bytesize << 1 | 1)
-          @stream << str
+          write_integer @stream, str.bytesize << 1 | 1
+          @stream << (str.ascii_only? ? str : str.b)
         end
       end
+
+      # Returns the string's UTF-8 bytes as a binary string, copying it only if
+      # it isn't plain ASCII already
+      def binary_utf8 str
+        return str unless str.respond_to?(:encode)
+        str = str.encode(UTF_8) if str.encoding != UTF_8
+        str.ascii_only? ? str : str.b
+      end
     end
 
     class SerializerCache #:nodoc:
@@ -453,21 +725,23 @@ module RocketAMF
         end
       end
 
+      # Keyed by identity, so lookups never call hash or eql? on the objects
+      # being serialized, and the keys keep them alive for the whole run
       class ObjectCache < Hash #:nodoc:
         def initialize
+          compare_by_identity
           @cache_index = 0
-          @obj_references = []
-        end
-
-        def [] obj
-          super(obj.object_id)
         end
 
         def add_obj obj
-          @obj_references << obj
-          self[obj.object_id] = @cache_index
+          self[obj] = @cache_index
           @cache_index += 1
         end
+
+        # The index the next object added will get
+        def next_index
+          @cache_index
+        end
       end
     end
   end
@@ -0,0 +1,129 @@
+require 'rocketamf'
+
+module RocketAMF
+  # Rack glue for AMF gateways. Nothing here depends on the rack gem, as
+  # both classes only implement the Rack calling convention.
+  #
+  # Example:
+  #
+  #   # config.ru
+  #   require 'rocketamf/rack'
+  #
+  #   use RocketAMF::Rack::Middleware, :path => '/amf' do |method, args|
+  #     raise "Service #{method} does not exists" unless method == 'App.helloWorld'
+  #     'Hello world'
+  #   end
+  #   run MyApp
+  module Rack
+    APPLICATION_AMF = 'application/x-amf'.freeze
+
+    # Rack application that answers every POST as an AMF request. Method calls
+    # go to the dispatcher, if given, and otherwise to the block, which is used
+    # like the <tt>Envelope#each_method_call</tt> block.
+    #
+    # Options:
+    # <tt>:class_mapper</tt>:: Class mapper instance used to decode the request and encode the response
+    # <tt>:concurrency</tt>:: Passed on to <tt>each_method_call</tt> when a block is used
+    class Endpoint
+      def initialize dispatcher=nil, options={}, &block
+        dispatcher, options = nil, dispatcher if dispatcher.is_a?(Hash)
+        raise ArgumentError, 'a dispatcher or block is required' if dispatcher.nil? && block.nil?
+        @dispatcher = dispatcher
+        @block = block
+        @options = options
+      end
+
+      def call env
+        return error(405, 'Method Not Allowed', 'allow' => 'POST') unless env['REQUEST_METHOD'] == 'POST'
+
+        request = RocketAMF::Envelope.new
+        begin
+          request.populate_from_stream(Rack.read_input(env), @options[:class_mapper])
+        rescue StandardError
+          return error(400, 'Invalid AMF request')
+        end
+
+        if @dispatcher
+          response = @dispatcher.dispatch(request)
+        else
+          response = RocketAMF::Envelope.new
+          response.each_method_call request, @options, &@block
+        end
+
+        [200, {'content-type' => APPLICATION_AMF}, Body.new(response, @options[:class_mapper])]
+      end
+
+      private
+      def error status, message, headers={}
+        [status, {'content-type' => 'text/plain', 'content-length' => message.bytesize.to_s}.merge(headers), [message]]
+      end
+    end
+
+    # Middleware that hands AMF requests to an Endpoint and passes everything
+    # else on to the wrapped app. Requests are matched on content type, and on
+    # <tt>PATH_INFO</tt> if <tt>:path</tt> is given. A dispatcher can be passed
+    # as <tt>:dispatcher</tt>, and all other options go to the Endpoint.
+    class Middleware
+      def initialize app, options={}, &block
+        options = options.dup
+        @app = app
+        @path = options.delete(:path)
+        @endpoint = Endpoint.new(options.delete(:dispatcher), options, &block)
+      end
+
+      def call env
+        if env['CONTENT_TYPE'].to_s.start_with?(APPLICATION_AMF) && (@path.nil? || env['PATH_INFO'] == @path)
+          @endpoint.call(env)
+        else
+          @app.call(env)
+        end
+      end
+    end
+
+    # Response body that serializes the envelope while the server writes it
+    # out, yielding output once CHUNK_SIZE bytes of it have built up. Message
+    # bodies larger than that are streamed with their length marked as unknown,
+    # so at most about a chunk is buffered at a time. As the size isn't known
+    # up front there's no content-length, and errors raised while encoding come
+    # from <tt>each</tt>, after the status and headers have gone out.
+    class Body
+      CHUNK_SIZE = 16 * 1024
+
+      def initialize envelope, class_mapper=nil
+        @envelope = envelope
+        @class_mapper = class_mapper
+      end
+
+      def each &block
+        @envelope.serialize(@class_mapper, :io => Writer.new(block), :flush_size => CHUNK_SIZE)
+        self
+      end
+
+      # IO for the serializer that hands each write to the server's block
+      class Writer #:nodoc:
+        def initialize block
+          @block = block
+        end
+
+        def write data
+          @block.call data
+          data.bytesize
+        end
+      end
+    end
+
+    # Returns the request body for <tt>populate_from_stream</tt>. StringIO inputs
+    # are used as is, and other inputs are read in a single call sized from
+    # <tt>CONTENT_LENGTH</tt> so the buffer never has to grow.
+    def self.read_input env
+      input = env['rack.input']
+      return input if StringIO === input
+
+      length = env['CONTENT_LENGTH'].to_i
+      data = length > 0 ? input.read(length) : input.read
+      data = '' if data.nil?
+      data.force_encoding("ASCII-8BIT") if data.respond_to?(:force_encoding)
+      data
+    end
+  end
+end
@@ -1,3 +1,5 @@
+require 'thread'
+
 module RocketAMF
   # Container for the AMF request/response.
   class Envelope
@@ -71,52 +73,46 @@ module RocketAMF
     # Builds response from the request, iterating over each method call and using
     # the return value as the method call's return value. Marks as envelope as
     # constructed after running.
+    #
+    # Batched requests can have their calls run concurrently by passing
+    # <tt>:concurrency</tt> with the maximum number of threads to use. The block
+    # must then be thread-safe. Responses are still added in request order, and
+    # a call that raises still only turns its own response into an ErrorMessage.
+    #
+    # Acknowledgements are sent in the compact <tt>AcknowledgeMessageExt</tt>
+    # form when the client sent any of its messages in a small form, or when
+    # <tt>:small_messages</tt> is true. Passing false forces the full form.
+    #
+    # Example:
+    #
+    #    res.each_method_call req, :concurrency => 8 do |method, args|
+    #      ...
+    #    end
     #--
     # Iterate over all the sent messages. If they're somthing we can handle, like
     # a command message, then simply add the response message ourselves. If it's
     # a method call, then call the block with the method and args, catching errors
     # for handling. Then create the appropriate response message using the return
     # value of the block as the return value for the method call.
-    def each_method_call request, &block
+    def each_method_call request, options={}, &block
       raise 'Response already constructed' if @constructed
 
       # Set version from response
       # Can't just copy version because FMS sends version as 1
       @amf_version = request.amf_version == 3 ? 3 : 0 
 
-      request.messages.each do |m|
-        # What's the request body?
-        case m.data
-        when Values::CommandMessage
-          # Pings should be responded to with an AcknowledgeMessage built using the ping
-          # Everything else is unsupported
-          command_msg = m.data
-          if command_msg.operation == Values::CommandMessage::CLIENT_PING_OPERATION
-            response_value = Values::AcknowledgeMessage.new(command_msg)
-          else
-            e = Exception.new("CommandMessage #{command_msg.operation} not implemented")
-            e.set_backtrace ["RocketAMF::Envelope each_method_call"]
-            response_value = Values::ErrorMessage.new(command_msg, e)
-          end
-        when Values::RemotingMessage
-          # Using RemoteObject style message calls
-          remoting_msg = m.data
-          acknowledge_msg = Values::AcknowledgeMessage.new(remoting_msg)
-          method_base = remoting_msg.source.to_s.empty? ? '' : remoting_msg.source+'.'
-          body = dispatch_call :method => method_base+remoting_msg.operation, :args => remoting_msg.body, :source => remoting_msg, :block => block
-
-          # Response should be the bare ErrorMessage if there was an error
-          if body.is_a?(Values::ErrorMessage)
-            response_value = body
-          else
-            acknowledge_msg.body = body
-            response_value = acknowledge_msg
-          end
-        else
-          # Standard response message
-          response_value = dispatch_call :method => m.target_uri, :args => m.data, :source => m, :block => block
-        end
+      small = options.fetch(:small_messages) { request.messages.any? {|m| m.data.is_a?(Values::SmallMessage)} }
+      ack_class = small ? Values::AcknowledgeMessageExt : Values::AcknowledgeMessage
+
+      concurrency = options[:concurrency].to_i
+      responses = if concurrency > 1 && request.messages.length > 1
+        concurrent_map(request.messages, concurrency) {|m| method_call_response(m, ack_class, block)}
+      else
+        request.messages.map {|m| method_call_response(m, ack_class, block)}
+      end
 
+      request.messages.each_with_index do |m, i|
+        response_value = responses[i]
         target_uri = m.response_uri
         target_uri += response_value.is_a?(Values::ErrorMessage) ? '/onStatus' : '/onResult'
         @messages << ::RocketAMF::Message.new(target_uri, '', response_value)
@@ -162,6 +158,61 @@ module RocketAMF
       serialize
     end
 
+    def method_call_response m, ack_class, block #:nodoc:
+      # What's the request body?
+      case m.data
+      when Values::CommandMessage
+        # Pings should be responded to with an AcknowledgeMessage built using the ping
+        # Everything else is unsupported
+        command_msg = m.data
+        if command_msg.operation == Values::CommandMessage::CLIENT_PING_OPERATION
+          ack_class.new(command_msg)
+        else
+          e = Exception.new("CommandMessage #{command_msg.operation} not implemented")
+          e.set_backtrace ["RocketAMF::Envelope each_method_call"]
+          Values::ErrorMessage.new(command_msg, e)
+        end
+      when Values::RemotingMessage
+        # Using RemoteObject style message calls
+        remoting_msg = m.data
+        acknowledge_msg = ack_class.new(remoting_msg)
+        method_base = remoting_msg.source.to_s.empty? ? '' : remoting_msg.source+'.'
+        body = dispatch_call :method => method_base+remoting_msg.operation, :args => remoting_msg.body, :source => remoting_msg, :block => block
+
+        # Response should be the bare ErrorMessage if there was an error
+        if body.is_a?(Values::ErrorMessage)
+          body
+        else
+          acknowledge_msg.body = body
+          acknowledge_msg
+        end
+      else
+        # Standard response message
+        dispatch_call :method => m.target_uri, :args => m.data, :source => m, :block => block
+      end
+    end
+
+    # Maps items using at most concurrency threads, keeping results in order
+    def concurrent_map items, concurrency #:nodoc:
+      results = Array.new(items.length)
+      queue = Queue.new
+      items.each_index {|i| queue << i}
+      threads = Array.new([concurrency, items.length].min) do
+        Thread.new do
+          loop do
+            i = begin
+              queue.pop(true)
+            rescue ThreadError
+              break
+            end
+            results[i] = yield(items[i])
+          end
+        end
+      end
+      threads.each {|t| t.join}
+      results
+    end
+
     def dispatch_call p #:nodoc:
       begin
         p[:block].call(p[:method], p[:args])
@@ -27,19 +27,62 @@ module RocketAMF
         read_external_fields des, EXTERNALIZABLE_FIELDS
       end
 
-      private
-      def rand_uuid
-        [8,4,4,4,12].map {|n| rand_hex_3(n)}.join('-').to_s
+      def write_external ser
+        write_external_fields ser, EXTERNALIZABLE_FIELDS
       end
 
-      def rand_hex_3(l)
-        "%0#{l}x" % rand(1 << l*4)
+      private
+      UUID_PATTERN = /\A[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-[0-9a-fA-F]{12}\z/ #:nodoc:
+
+      def rand_uuid
+        "%08x-%04x-%04x-%04x-%04x%08x" % [rand(1 << 32), rand(1 << 16), rand(1 << 16), rand(1 << 16), rand(1 << 16), rand(1 << 32)]
       end
 
       def pretty_uuid bytes
         "%08x-%04x-%04x-%04x-%08x%04x" % bytes.string.unpack("NnnnNn")
       end
 
+      # Returns the 16 byte ByteArray form of the UUID, or nil if it isn't one
+      def uuid_bytes uuid
+        StringIO.new([uuid.delete('-')].pack('H*')) if uuid.is_a?(String) && uuid =~ UUID_PATTERN
+      end
+
+      # Returns the value to write for the externalizable field, or nil to skip
+      # it. UUIDs are written in their byte form whenever they're valid UUIDs.
+      def external_value name
+        if name =~ /\A(\w+)Bytes\z/
+          uuid_bytes(send($1))
+        elsif respond_to?("#{name}Bytes=") && uuid_bytes(send(name))
+          nil
+        else
+          value = send(name)
+          value unless (value == 0 && (name == 'timestamp' || name == 'timeToLive')) || (name == 'headers' && value == {})
+        end
+      end
+
+      def write_external_fields ser, fields
+        # Build flags, dropping trailing empty ones, and collect the set fields
+        values = []
+        flags = fields.map do |list|
+          f = 0
+          list.each_with_index do |name, j|
+            value = external_value(name)
+            next if value.nil?
+            f |= 2**j
+            values << value
+          end
+          f
+        end
+        flags.pop while flags.length > 1 && flags.last == 0
+
+        # Write flags with the has-next-field marker on all but the last
+        flags.each_with_index do |f, i|
+          f |= 128 if i < flags.length - 1
+          ser.stream << [f].pack('C')
+        end
+        values.each {|v| ser.serialize(ser.version, v)}
+      end
+
       def read_external_fields des, fields
         # Read flags
         flags = []
@@ -103,9 +146,29 @@ module RocketAMF
         super des
         read_external_fields des, EXTERNALIZABLE_FIELDS
       end
+
+      def write_external ser
+        super ser
+        write_external_fields ser, EXTERNALIZABLE_FIELDS
+      end
+    end
+
+    # Included into the <tt>*Ext</tt> message classes, which Flex uses for its
+    # compact "small message" wire form. They're written as externalizable
+    # objects with flag bytes and 16 byte UUIDs instead of as full objects.
+    module SmallMessage
+      def encode_amf serializer
+        if serializer.version == 0
+          serializer.write_object(self) # AMF0 has no externalizable objects
+        else
+          serializer.write_object(self, nil, {:class_name => self.class::SMALL_CLASS_NAME, :dynamic => false, :externalizable => true, :members => []})
+        end
+      end
     end
 
     class AsyncMessageExt < AsyncMessage #:nodoc:
+      include SmallMessage
+      SMALL_CLASS_NAME = 'DSA'
     end
 
     # Maps to <tt>flex.messaging.messages.CommandMessage</tt>
@@ -136,9 +199,16 @@ module RocketAMF
         super des
         read_external_fields des, EXTERNALIZABLE_FIELDS
       end
+
+      def write_external ser
+        super ser
+        write_external_fields ser, EXTERNALIZABLE_FIELDS
+      end
     end
 
     class CommandMessageExt < CommandMessage #:nodoc:
+      include SmallMessage
+      SMALL_CLASS_NAME = 'DSC'
     end
 
     # Maps to <tt>flex.messaging.messages.AcknowledgeMessage</tt>
@@ -163,9 +233,16 @@ module RocketAMF
         super des
         read_external_fields des, EXTERNALIZABLE_FIELDS
       end
+
+      def write_external ser
+        super ser
+        write_external_fields ser, EXTERNALIZABLE_FIELDS
+      end
     end
 
     class AcknowledgeMessageExt < AcknowledgeMessage #:nodoc:
+      include SmallMessage
+      SMALL_CLASS_NAME = 'DSK'
     end
 
     # Maps to <tt>flex.messaging.messages.ErrorMessage</tt> in AMF3 mode
@@ -0,0 +1,42 @@
+module RocketAMF
+  module Values #:nodoc:
+    # Wraps an array of values so that it's serialized as an AMF3 Vector rather
+    # than an Array. Numeric vectors (<tt>:int</tt>, <tt>:uint</tt> and
+    # <tt>:double</tt>) are written as fixed-width values without per-element
+    # type markers, and can be given either as an Array or as a String packed
+    # in native byte order (<tt>pack('l*')</tt>, <tt>pack('L*')</tt> or
+    # <tt>pack('d*')</tt> respectively), which the C serializer byte-swaps in
+    # bulk. <tt>:object</tt> vectors serialize each element normally and are
+    # tagged with <tt>class_name</tt>. In AMF0, vectors are written as arrays.
+    #
+    # Example:
+    #
+    #   RocketAMF.serialize(RocketAMF::Values::Vector.new(:double, [1.5, 2.5]), 3)
+    #   RocketAMF.serialize(RocketAMF::Values::Vector.new(:int, [1, 2, 3].pack('l*')), 3)
+    class Vector
+      TYPES = [:int, :uint, :double, :object]
+      PACK_FORMATS = {:int => 'l*', :uint => 'L*', :double => 'd*'}
+
+      attr_reader :type, :data
+      attr_accessor :fixed, :class_name
+
+      def initialize type, data, fixed=false, class_name=''
+        raise ArgumentError, "unsupported vector type #{type.inspect}" unless TYPES.include?(type)
+        raise ArgumentError, "packed data is only supported for numeric vectors" if type == :object && data.is_a?(String)
+        @type = type
+        @data = data
+        @fixed = fixed
+        @class_name = class_name
+      end
+
+      # Returns the vector elements as an Array, unpacking them if necessary
+      def to_a
+        @data.is_a?(String) ? @data.unpack(PACK_FORMATS[@type]) : @data
+      end
+
+      def length
+        @data.is_a?(String) ? @data.bytesize / (@type == :double ? 8 : 4) : @data.length
+      end
+    end
+  end
+end
@@ -1,4 +1,5 @@
 require "spec_helper.rb"
+require "rocketamf/pure/class_mapping"
 
 describe RocketAMF::ClassMapping do
   before :each do
@@ -71,6 +72,24 @@ describe RocketAMF::ClassMapping do
     end
   end
 
+  describe "traits" do
+    it "should return dynamic traits for mapped classes" do
+      traits = @mapper.get_as_traits(ClassMappingTest.new)
+      traits[:class_name].should == 'ASClass'
+      traits[:members].should == []
+      traits[:dynamic].should == true
+      @mapper.get_as_traits({}).should be_nil
+    end
+
+    it "should return sealed traits for classes mapped with members" do
+      RocketAMF::ClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :members => [:prop_a, :prop_b]
+      traits = @mapper.get_as_traits(ClassMappingTest.new)
+      traits[:members].should == ['prop_a', 'prop_b']
+      traits[:dynamic].should == false
+      traits[:externalizable].should == false
+    end
+  end
+
   describe "ruby object populator" do
     it "should populate a ruby class" do
       obj = @mapper.populate_ruby_obj ClassMappingTest.new, {:prop_a => 'Data'}
@@ -106,5 +125,81 @@ describe RocketAMF::ClassMapping do
       hash = @mapper.props_for_serialization obj
       hash.should == {'prop_a' => 'Test A', 'prop_b' => nil, 'prop_c' => 'Test C'}
     end
+
+    it "should extract object properties in name order" do
+      names = %w(zeta alpha mid kappa beta omega delta gamma)
+      klass = Class.new { names.each {|name| define_method(name) { 1 } } }
+      @mapper.props_for_serialization(klass.new).keys.should == names.sort
+    end
+  end
+
+  describe "precompilation" do
+    before :each do
+      Object.const_set(:PrecompileTest, Class.new { attr_accessor :a })
+      RocketAMF::ClassMapping.define do |m|
+        m.map :as => 'PrecompileClass', :ruby => 'PrecompileTest'
+        m.map :as => 'MissingClass', :ruby => 'NotLoadedYet'
+      end
+    end
+
+    after :each do
+      Object.send(:remove_const, :PrecompileTest) if defined?(PrecompileTest)
+      RocketAMF::ClassMapping.reset
+    end
+
+    it "should resolve mapped classes once and freeze the mappings" do
+      RocketAMF::ClassMapping.precompile!.should == RocketAMF::ClassMapping
+      RocketAMF::ClassMapping.mappings.frozen?.should == true
+      lambda { RocketAMF::ClassMapping.mappings.map :as => 'Other', :ruby => 'Other' }.should raise_error(RuntimeError)
+
+      klass = PrecompileTest
+      Object.send(:remove_const, :PrecompileTest)
+      RocketAMF::ClassMapping.new.get_ruby_obj('PrecompileClass').class.should == klass
+      RocketAMF::ClassMapping.new.get_ruby_obj('ASClass').should be_a(ClassMappingTest)
+    end
+  end
+end
+
+describe RocketAMF::Pure::FastClassMapping do
+  before :each do
+    RocketAMF::Pure::FastClassMapping.reset
+    RocketAMF::Pure::FastClassMapping.define do |m|
+      m.map :as => 'ASClass', :ruby => 'ClassMappingTest'
+    end
+    @mapper = RocketAMF::Pure::FastClassMapping.new
+  end
+
+  it "should map classes like the default class mapper" do
+    @mapper.get_as_class_name(ClassMappingTest.new).should == 'ASClass'
+    @mapper.get_as_class_name(ClassMappingTest2.new).should be_nil
+    @mapper.get_as_class_name({}).should be_nil
+    @mapper.get_ruby_obj('ASClass').should be_a(ClassMappingTest)
+
+    obj = ClassMappingTest2.new
+    obj.prop_a = 'Test A'
+    @mapper.props_for_serialization(obj).should == {'prop_a' => 'Test A', 'prop_b' => nil, 'prop_c' => nil}
+    @mapper.props_for_serialization({:a => 1}).should == {'a' => 1}
+
+    obj = @mapper.populate_ruby_obj ClassMappingTest.new, {'prop_a' => 'Data', 'missing' => 1}
+    obj.prop_a.should == 'Data'
+  end
+
+  it "should cache property lookups by class for each instance" do
+    klass = Class.new { attr_accessor :prop_a }
+    @mapper.props_for_serialization(klass.new).keys.should == ['prop_a']
+
+    klass.class_eval { attr_accessor :prop_b }
+    @mapper.props_for_serialization(klass.new).keys.should == ['prop_a']
+    RocketAMF::Pure::FastClassMapping.new.props_for_serialization(klass.new).keys.should == ['prop_a', 'prop_b']
+  end
+
+  it "should serialize the same as the default class mapper" do
+    obj = ClassMappingTest2.new
+    obj.prop_a = 'a'
+    data = [obj, {'b' => obj}]
+    [0, 3].each do |version|
+      RocketAMF::Serializer.new(RocketAMF::Pure::FastClassMapping.new).serialize(version, data).should ==
+        RocketAMF::Serializer.new(RocketAMF::ClassMapping.new).serialize(version, data)
+    end
   end
-end
\ No newline at end of file
+end
@@ -185,6 +185,17 @@ describe "when deserializing" do
         output.should == "String . String"
       end
 
+      it "should flag whether strings are valid UTF-8", :if => "".respond_to?(:force_encoding) do
+        ["plain ascii", "caf\xC3\xA9 \xE2\x82\xAC", "a\xED\xA0\x80", "\xE0\x80\x80", "x" * 20 + "\xC3"].each do |str|
+          str = str.dup.force_encoding("ASCII-8BIT")
+          output = RocketAMF.deserialize("\x06".force_encoding("ASCII-8BIT") + [str.bytesize << 1 | 1].pack("C") + str, 3)
+          expected = str.dup.force_encoding("UTF-8")
+          output.encoding.should == Encoding::UTF_8
+          output.valid_encoding?.should == expected.valid_encoding?
+          output.ascii_only?.should == expected.ascii_only?
+        end
+      end
+
       it "should deserialize a symbol as a string" do
         input = object_fixture("amf3-symbol.bin")
         output = RocketAMF.deserialize(input, 3)
@@ -452,4 +463,98 @@ describe "when deserializing" do
       end
     end
   end
-end
\ No newline at end of file
+
+  describe "as plain data" do
+    class RaisingClassMapper
+      def method_missing name, *args
+        raise "class mapper called: #{name}"
+      end
+    end
+
+    def plain data, version, options={}
+      RocketAMF::Deserializer.new(RaisingClassMapper.new, {:plain => true}.merge(options)).deserialize(version, data)
+    end
+
+    it "should read objects as hashes without calling the class mapper" do
+      RocketAMF::ClassMapper.define {|m| m.map :as => 'org.amf.ASClass', :ruby => 'RubyClass'}
+      [0, 3].each do |version|
+        output = plain(object_fixture("amf#{version}-typed-object.bin"), version)
+        output.class.should == Hash
+        output.should == {'foo' => 'bar', 'baz' => nil}
+      end
+      plain(object_fixture('amf0-object.bin'), 0).should == {'foo' => 'baz', 'bar' => 3.14}
+      plain(object_fixture('amf3-dynamic-object.bin'), 3).class.should == Hash
+    end
+
+    it "should store the class name of typed objects under the class key" do
+      [0, 3].each do |version|
+        output = plain(object_fixture("amf#{version}-typed-object.bin"), version, :class_key => :_class)
+        output.should == {'_class' => 'org.amf.ASClass', 'foo' => 'bar', 'baz' => nil}
+      end
+      plain(object_fixture('amf0-object.bin'), 0, :class_key => '_class').has_key?('_class').should == false
+      plain(object_fixture('amf3-dynamic-object.bin'), 3, :class_key => '_class').has_key?('_class').should == false
+    end
+
+    it "should read dates as epoch milliseconds and byte arrays as strings" do
+      plain(object_fixture('amf0-time.bin'), 0).should == Time.utc(2003, 2, 13, 5).to_f * 1000
+      plain(object_fixture('amf3-date.bin'), 3).should == 0.0
+
+      expected = "\000\003これtest\100"
+      expected.force_encoding("ASCII-8BIT") if expected.respond_to?(:force_encoding)
+      plain(object_fixture('amf3-byte-array.bin'), 3).should == expected
+    end
+
+    it "should keep references" do
+      output = plain(object_fixture('amf0-ref-test.bin'), 0)
+      output["0"].should equal(output["1"])
+      output = plain(object_fixture('amf3-object-ref.bin'), 3)
+      output.should == [[{'foo' => 'bar'}, {'foo' => 'bar'}], 'bar', [{'foo' => 'bar'}, {'foo' => 'bar'}]]
+      output[0][0].should equal(output[2][0])
+      output = plain(object_fixture('amf3-date-ref.bin'), 3)
+      output[0].should equal(output[1])
+    end
+
+    it "should still read externalizable objects with the class mapper" do
+      RocketAMF::ClassMapper.define {|m| m.map :as => 'ExternalizableTest', :ruby => 'ExternalizableTest'}
+      des = RocketAMF::Deserializer.new(RocketAMF::ClassMapper.new, :plain => true)
+      output = des.deserialize(3, object_fixture('amf3-externalizable.bin'))
+      output[0].should be_a(ExternalizableTest)
+      output[1].two.should == 5
+    end
+  end
+
+  describe "element by element" do
+    def elements data, version
+      out = []
+      RocketAMF.each_element(data, version) {|e| out << e}
+      out
+    end
+
+    it "should yield the same elements as deserializing the whole array" do
+      %w(amf3-primitive-array amf3-array-ref amf3-empty-array amf3-complex-array-collection amf3-array-collection).each do |name|
+        data = object_fixture("#{name}.bin")
+        elements(data, 3).should == RocketAMF.deserialize(data, 3)
+      end
+      data = object_fixture('amf0-strict-array.bin')
+      elements(data, 0).should == RocketAMF.deserialize(data, 0)
+      elements("\x11" + object_fixture('amf3-primitive-array.bin'), 0).should == [1, 2, 3, 4, 5]
+    end
+
+    it "should return an enumerator without a block" do
+      des = RocketAMF::Deserializer.new(RocketAMF::ClassMapper.new)
+      des.each_element(3, object_fixture('amf3-primitive-array.bin')).to_a.should == [1, 2, 3, 4, 5]
+    end
+
+    it "should update the source position even when stopped early" do
+      input = StringIO.new(object_fixture('amf3-primitive-array.bin'))
+      RocketAMF.each_element(input, 3) {|e| break}
+      input.pos.should == 5 # Marker, length, empty key and the first element
+    end
+
+    it "should only iterate over arrays" do
+      lambda { elements(object_fixture('amf3-associative-array.bin'), 3) }.should raise_error(TypeError)
+      lambda { elements(object_fixture('amf3-hash.bin'), 3) }.should raise_error(TypeError)
+      lambda { elements(object_fixture('amf0-number.bin'), 0) }.should raise_error(TypeError)
+    end
+  end
+end
@@ -0,0 +1,102 @@
+require "spec_helper.rb"
+require "rocketamf/pure/dispatcher"
+
+[RocketAMF::Dispatcher, RocketAMF::Pure::Dispatcher].uniq.each do |dispatcher_class|
+  describe dispatcher_class do
+    it "should acknowledge pings without calling a handler" do
+      req = create_envelope('commandMessage.bin')
+      res = dispatcher_class.new { raise 'should not be called' }.dispatch(req)
+
+      res.constructed?.should == true
+      res.messages.length.should == 1
+      ack = res.messages[0].data
+      ack.should be_a(RocketAMF::Values::AcknowledgeMessage)
+      ack.correlationId.should == req.messages[0].data.messageId
+      ack.messageId.should =~ /\A[0-9a-f]{8}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{12}\z/
+      ack.clientId.should_not == ack.messageId
+    end
+
+    it "should fail on unsupported commands" do
+      res = dispatcher_class.new.dispatch(create_envelope('unsupportedCommandMessage.bin'))
+      res.messages[0].data.should be_a(RocketAMF::Values::ErrorMessage)
+      res.messages[0].data.faultString.should == "CommandMessage 10000 not implemented"
+      res.messages[0].target_uri.should =~ /onStatus$/
+    end
+
+    it "should route RemotingMessages by source and operation" do
+      dispatcher = dispatcher_class.new('WritesController.save' => lambda {|args| args.should == [true]; 'saved'})
+      res = dispatcher.dispatch(create_envelope('remotingMessage.bin'))
+
+      res.messages.length.should == 1
+      res.messages[0].target_uri.should =~ /onResult$/
+      res.messages[0].data.should be_a(RocketAMF::Values::AcknowledgeMessage)
+      res.messages[0].data.body.should == 'saved'
+    end
+
+    it "should route simple calls by target and add routes later" do
+      req = RocketAMF::Envelope.new
+      req.call('TestController.test', 'first_arg')
+      req.call('TestController.test2', 'second_arg')
+      dispatcher = dispatcher_class.new('TestController.test' => lambda {|args| args + ['a']})
+      dispatcher.route('TestController.test2') {|args| args.length}
+
+      res = dispatcher.dispatch(req)
+      res.amf_version.should == 0
+      res.messages.map {|m| m.target_uri}.should == ['/1/onResult', '/2/onResult']
+      res.result.should == [['first_arg', 'a'], 1]
+    end
+
+    it "should send calls without a route to the block" do
+      req = RocketAMF::Envelope.new :amf_version => 3
+      req.call_flex('TestController.missing', 'arg')
+      res = dispatcher_class.new {|method, args| [method, args]}.dispatch(req)
+      res.amf_version.should == 3
+      res.result.should == ['TestController.missing', ['arg']]
+    end
+
+    it "should turn exceptions and missing routes into ErrorMessages" do
+      req = create_envelope('remotingMessage.bin')
+      res = dispatcher_class.new('WritesController.save' => lambda {|args| raise ArgumentError, 'bad call'}).dispatch(req)
+      error = res.messages[0].data
+      error.should be_a(RocketAMF::Values::ErrorMessage)
+      error.faultCode.should == 'ArgumentError'
+      error.faultString.should == 'bad call'
+      error.correlationId.should == req.messages[0].data.messageId
+      res.messages[0].target_uri.should =~ /onStatus$/
+
+      res = dispatcher_class.new.dispatch(req)
+      res.messages[0].data.faultCode.should == 'NoMethodError'
+    end
+
+    it "should serialize the same way as each_method_call responses" do
+      req = create_envelope('remotingMessage.bin')
+      res = dispatcher_class.new('WritesController.save' => lambda {|args| true}).dispatch(req)
+      expected = RocketAMF::Envelope.new
+      expected.each_method_call(req) {|method, args| true}
+
+      [res, expected].each do |r|
+        r.messages[0].data.clientId = r.messages[0].data.messageId = 'id'
+        r.messages[0].data.timestamp = 0
+      end
+      res.serialize.should == expected.serialize
+    end
+
+    it "should acknowledge in the small form when the client uses it" do
+      req = create_envelope('commandMessage.bin')
+      ping = RocketAMF::Values::CommandMessageExt.new
+      ping.operation = RocketAMF::Values::CommandMessage::CLIENT_PING_OPERATION
+      req.messages[0].data = ping
+
+      ack = dispatcher_class.new.dispatch(req).messages[0].data
+      ack.class.should == RocketAMF::Values::AcknowledgeMessageExt
+      RocketAMF.serialize(ack, 3).should =~ /\A\n\a\aDSK/
+    end
+
+    it "should not dispatch into an already constructed response" do
+      req = create_envelope('remotingMessage.bin')
+      dispatcher = dispatcher_class.new {|method, args| true}
+      res = dispatcher.dispatch(req)
+      lambda { dispatcher.dispatch(req, res) }.should raise_error('Response already constructed')
+    end
+  end
+end
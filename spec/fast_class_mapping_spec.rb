@@ -71,6 +71,114 @@ describe RocketAMF::Ext::FastClassMapping do
     end
   end
 
+  describe "traits" do
+    it "should return dynamic traits for mapped classes" do
+      traits = @mapper.get_as_traits(ClassMappingTest.new)
+      traits[:class_name].should == 'ASClass'
+      traits[:members].should == []
+      traits[:dynamic].should == true
+      @mapper.get_as_traits({}).should be_nil
+    end
+
+    it "should return sealed traits for classes mapped with members" do
+      RocketAMF::Ext::FastClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :members => [:prop_a, 'prop_b']
+      @mapper = RocketAMF::Ext::FastClassMapping.new
+      traits = @mapper.get_as_traits(ClassMappingTest.new)
+      traits[:members].should == [:prop_a, :prop_b]
+      traits[:dynamic].should == false
+    end
+
+    it "should round trip sealed objects" do
+      RocketAMF::Ext::FastClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :members => [:prop_a, :prop_b]
+      obj = ClassMappingTest.new
+      obj.prop_a = 'a'
+      obj.prop_b = [obj]
+      data = RocketAMF::Serializer.new(RocketAMF::Ext::FastClassMapping.new).serialize(3, [obj, obj])
+      data.should == "\t\x05\x01\n\x23\x0fASClass\rprop_a\rprop_b\x06\x03a\t\x03\x01\n\x02\n\x02".force_encoding('ASCII-8BIT')
+
+      output = RocketAMF::Deserializer.new(RocketAMF::Ext::FastClassMapping.new).deserialize(3, data)
+      output[0].should be_a(ClassMappingTest)
+      output[0].prop_a.should == 'a'
+      output[0].prop_b[0].should equal(output[0])
+      output[1].should equal(output[0])
+    end
+
+    it "should write nil for sealed members without a public getter" do
+      RocketAMF::Ext::FastClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :members => [:prop_a, :secret, :missing]
+      obj = ClassMappingTest.new
+      obj.prop_a = 'a'
+      class << obj
+        private
+        def secret; 's'; end
+      end
+      data = RocketAMF::Serializer.new(RocketAMF::Ext::FastClassMapping.new).serialize(3, obj)
+      data.should == "\n\x33\x0fASClass\rprop_a\rsecret\x0fmissing\x06\x03a\x01\x01".force_encoding('ASCII-8BIT')
+    end
+
+    it "should use a subclass's own property reading and populating for sealed objects" do
+      mapper_class = Class.new(RocketAMF::Ext::FastClassMapping) do
+        def props_for_serialization obj
+          super.merge(:prop_a => 'written')
+        end
+
+        def populate_ruby_obj obj, props, dynamic_props=nil
+          props.each {|key, value| obj.send("#{key}=", value)}
+          obj.prop_b = 'read'
+          obj
+        end
+      end
+      mapper_class.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :members => [:prop_a, :prop_b]
+      obj = ClassMappingTest.new
+      obj.prop_a = 'a'
+      data = RocketAMF::Serializer.new(mapper_class.new).serialize(3, obj)
+      output = RocketAMF::Deserializer.new(mapper_class.new).deserialize(3, data)
+      output.prop_a.should == 'written'
+      output.prop_b.should == 'read'
+    end
+  end
+
+  describe "instance variable properties" do
+    before :each do
+      @obj = ClassMappingTest.new
+      @obj.prop_a = 'a'
+      @obj.prop_b = 'b'
+      def @obj.expensive; raise "should not be called"; end
+    end
+
+    def serialize obj
+      RocketAMF::Serializer.new(RocketAMF::Ext::FastClassMapping.new).serialize(3, obj)
+    end
+
+    it "should read all instance variables when mapped with :ivars => true" do
+      RocketAMF::Ext::FastClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :ivars => true
+      @mapper = RocketAMF::Ext::FastClassMapping.new
+      @mapper.props_for_serialization(@obj).should == {:prop_a => 'a', :prop_b => 'b'}
+      serialize(@obj).should == "\n\x0b\x0fASClass\rprop_a\x06\x03a\rprop_b\x06\x03b\x01".force_encoding('ASCII-8BIT')
+    end
+
+    it "should read each instance's own instance variables" do
+      RocketAMF::Ext::FastClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :ivars => true
+      @mapper = RocketAMF::Ext::FastClassMapping.new
+      @obj.instance_variable_set(:@prop_cache, 'x')
+      other = ClassMappingTest.new
+      other.prop_b = 'b'
+      other.instance_variable_set(:@extra, 'e')
+      @mapper.props_for_serialization(@obj).should == {:prop_a => 'a', :prop_b => 'b', :prop_cache => 'x'}
+      @mapper.props_for_serialization(other).should == {:extra => 'e', :prop_b => 'b'}
+      RocketAMF.deserialize(serialize(other), 3).should == {'extra' => 'e', 'prop_b' => 'b'}
+    end
+
+    it "should read only the listed instance variables" do
+      RocketAMF::Ext::FastClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :ivars => [:@prop_b]
+      serialize(@obj).should == "\n\x0b\x0fASClass\rprop_b\x06\x03b\x01".force_encoding('ASCII-8BIT')
+    end
+
+    it "should read sealed members from instance variables" do
+      RocketAMF::Ext::FastClassMapping.mappings.map :as => 'ASClass', :ruby => 'ClassMappingTest', :members => [:prop_b, :prop_a], :ivars => true
+      serialize(@obj).should == "\n\x23\x0fASClass\rprop_b\rprop_a\x06\x03b\x06\x03a".force_encoding('ASCII-8BIT')
+    end
+  end
+
   describe "ruby object populator" do
     it "should populate a ruby class" do
       obj = @mapper.populate_ruby_obj ClassMappingTest.new, {:prop_a => 'Data'}
@@ -118,6 +226,12 @@ describe RocketAMF::Ext::FastClassMapping do
       hash.should == prop_hash({'prop_a' => 'Test A', 'prop_b' => nil, 'prop_c' => 'Test C'})
     end
 
+    it "should extract object properties in name order" do
+      names = %w(zeta alpha mid kappa beta omega delta gamma)
+      klass = Class.new { names.each {|name| define_method(name) { 1 } } }
+      @mapper.props_for_serialization(klass.new).keys.should == prop_hash(Hash[names.sort.map {|n| [n, 1]}]).keys
+    end
+
     it "should cache property lookups by instance" do
       class ClassMappingTest3; attr_accessor :prop_a; end;
 
@@ -141,4 +255,54 @@ describe RocketAMF::Ext::FastClassMapping do
       hash.should == prop_hash({'prop_a' => 'Test A', 'prop_b' => 'Test B'})
     end
   end
-end
\ No newline at end of file
+
+  describe "precompilation" do
+    before :each do
+      Object.const_set(:PrecompileTest, Class.new { attr_accessor :a })
+      Object.const_set(:PrecompileSealedTest, Class.new { attr_accessor :a })
+      RocketAMF::Ext::FastClassMapping.define do |m|
+        m.map :as => 'PrecompileClass', :ruby => 'PrecompileTest'
+        m.map :as => 'PrecompileSealed', :ruby => 'PrecompileSealedTest', :members => [:a]
+        m.map :as => 'MissingClass', :ruby => 'NotLoadedYet'
+      end
+    end
+
+    after :each do
+      Object.send(:remove_const, :PrecompileTest) if defined?(PrecompileTest)
+      Object.send(:remove_const, :PrecompileSealedTest) if defined?(PrecompileSealedTest)
+      RocketAMF::Ext::FastClassMapping.reset
+    end
+
+    it "should resolve mapped classes once and freeze the mappings" do
+      RocketAMF::Ext::FastClassMapping.precompile!.should == RocketAMF::Ext::FastClassMapping
+      RocketAMF::Ext::FastClassMapping.mappings.frozen?.should == true
+      lambda { RocketAMF::Ext::FastClassMapping.mappings.map :as => 'Other', :ruby => 'Other' }.should raise_error(RuntimeError)
+
+      klass = PrecompileTest
+      Object.send(:remove_const, :PrecompileTest)
+      RocketAMF::Ext::FastClassMapping.new.get_ruby_obj('PrecompileClass').class.should == klass
+      RocketAMF::Ext::FastClassMapping.new.get_ruby_obj('ASClass').should be_a(ClassMappingTest)
+    end
+
+    it "should share the precompiled property lists of classes mapped with members" do
+      obj = PrecompileSealedTest.new
+      obj.a = 1
+      RocketAMF::Ext::FastClassMapping.precompile!
+      PrecompileSealedTest.class_eval { def b; 2; end }
+      props = RocketAMF::Ext::FastClassMapping.new.props_for_serialization(obj)
+      props.keys.map {|k| k.to_s}.should == ['a']
+
+      copy = RocketAMF::Ext::FastClassMapping.new.populate_ruby_obj(PrecompileSealedTest.new, {:a => 3})
+      copy.a.should == 3
+    end
+
+    it "should see methods defined after precompiling on classes mapped without members" do
+      obj = PrecompileTest.new
+      obj.a = 1
+      RocketAMF::Ext::FastClassMapping.precompile!
+      PrecompileTest.class_eval { def b; 2; end }
+      props = RocketAMF::Ext::FastClassMapping.new.props_for_serialization(obj)
+      props.keys.map {|k| k.to_s}.sort.should == ['a', 'b']
+    end
+  end
+end
@@ -0,0 +1,111 @@
+require "spec_helper.rb"
+
+describe RocketAMF::Ext::MemoCache do
+  class MemoCountingClass
+    def value
+      $memo_calls += 1
+      'value'
+    end
+  end
+
+  before :each do
+    @memo = RocketAMF::Ext::MemoCache.new
+    $memo_calls = 0
+  end
+
+  def serialize obj, version
+    RocketAMF::Ext::Serializer.new(RocketAMF::ClassMapper.new, :memo => @memo).serialize(version, obj)
+  end
+
+  def round_trip obj, version
+    RocketAMF.deserialize(serialize(obj, version), version)
+  end
+
+  it "should produce the same output as an unmemoized serializer" do
+    table = {'one' => ['a'.freeze, 'b'.freeze].freeze, 'two' => 'a'.freeze}.freeze
+    [0, 3].each do |version|
+      input = [table, 'a', table, {'x' => 'b'}]
+      expected = RocketAMF.serialize(input, version)
+      serialize(input, version)
+      serialize(input, version).should == expected
+    end
+    @memo.size.should == 2
+  end
+
+  it "should repeat strings already written instead of referencing them" do
+    table = {'one' => 'a'.freeze}.freeze
+    output = round_trip(['a', table, {'one' => 'a'}], 3)
+    output.should == ['a', {'one' => 'a'}, {'one' => 'a'}]
+  end
+
+  it "should reuse encoded objects that opt in across serializers" do
+    obj = MemoCountingClass.new
+    def obj.amf_memoizable?; true; end
+    serialize([obj], 3)
+    serialize([obj], 3)
+    $memo_calls.should == 1
+  end
+
+  it "should not reuse frozen objects that don't opt in" do
+    obj = MemoCountingClass.new.freeze
+    serialize([obj], 3)
+    serialize([{'a' => obj}.freeze].freeze, 3)
+    $memo_calls.should == 2
+  end
+
+  it "should keep encodings separate for each class mapper class and setting" do
+    extra_mapper = Class.new(RocketAMF::ClassMapper) do
+      def props_for_serialization obj
+        super.merge('extra' => true)
+      end
+    end
+    obj = MemoCountingClass.new
+    def obj.amf_memoizable?; true; end
+    table = [obj].freeze
+
+    plain = serialize(table, 3)
+    extra = RocketAMF::Ext::Serializer.new(extra_mapper.new, :memo => @memo).serialize(3, table)
+    extra.should_not == plain
+    RocketAMF.deserialize(extra, 3)[0]['extra'].should == true
+
+    [false, true].each do |sort_props|
+      RocketAMF::Ext::Serializer.new(RocketAMF::ClassMapper.new, :memo => @memo, :sort_props => sort_props).serialize(3, table)
+    end
+    @memo.size.should == 3 # The default sort_props setting is one of them
+    serialize(table, 3).should == plain
+  end
+
+  it "should not reuse objects that aren't deeply frozen" do
+    list = ['b']
+    obj = {'a' => list}.freeze
+    serialize(obj, 3)
+    list << 'c'
+    serialize(obj, 3).should == RocketAMF.serialize(obj, 3)
+  end
+
+  it "should not fill up with objects that can't be memoized" do
+    row = Class.new { attr_accessor :a }
+    5000.times { serialize([row.new, {'a' => ['b']}.freeze].freeze, 3) }
+    @memo.size.should == 0
+
+    table = {'one' => 'a'.freeze}.freeze
+    serialize(table, 3)
+    @memo.size.should == 1
+  end
+
+  it "should encode normally when something inside was already written" do
+    shared = {'foo' => 'bar'.freeze}.freeze
+    output = round_trip([shared, [shared].freeze], 3)
+    output[0].should equal(output[1][0])
+  end
+
+  it "should allow references to objects inside a memoized graph" do
+    shared = {'foo' => 'bar'.freeze}.freeze
+    table = [shared].freeze
+    serialize(table, 3)
+    [0, 3].each do |version|
+      output = round_trip([table, shared], version)
+      output[0][0].should equal(output[1])
+    end
+  end
+end
@@ -16,6 +16,40 @@ describe RocketAMF::Values::AbstractMessage do
     msg.clientId.should == "8814a067-fe0d-3a9c-a274-4aaed9bd7b0b"
     msg.body.should =~ /xmlsoap\.org/
   end
+
+  it "should write shortened messages the same way BlazeDS does" do
+    data = request_fixture('blaze-response.bin')
+    output = RocketAMF::Envelope.new.populate_from_stream(data).serialize
+
+    # The fixture's message length is unset, so only compare the message body
+    body = lambda {|s| s[s.index("\x11\n\a\aDSK")..-1]}
+    output.bytesize.should == data.bytesize
+    body.call(output).should == body.call(data)
+  end
+
+  it "should round-trip shortened messages with binary UUIDs" do
+    ping = RocketAMF::Values::CommandMessageExt.new
+    ping.operation = RocketAMF::Values::CommandMessage::CLIENT_PING_OPERATION
+    ping.messageId = "7bb01bc0-c836-8f4d-7b47-241543357109"
+    ack = RocketAMF::Values::AcknowledgeMessageExt.new(ping)
+    ack.body = 'result'
+
+    [ping, ack].each do |msg|
+      output = RocketAMF.serialize(msg, 3)
+      output.should =~ /\A\n\a\aDS[CK]/
+      output.index(msg.messageId).should == nil
+      copy = RocketAMF.deserialize(output, 3)
+      copy.class.should == msg.class
+      %w(messageId clientId correlationId timestamp body).each do |field|
+        copy.send(field).should == msg.send(field) if msg.respond_to?(field)
+      end
+    end
+    RocketAMF.deserialize(RocketAMF.serialize(ping, 3), 3).operation.should == ping.operation
+
+    full = RocketAMF::Values::AcknowledgeMessage.new(ping)
+    full.body = 'result'
+    (RocketAMF.serialize(ack, 3).bytesize < RocketAMF.serialize(full, 3).bytesize / 2).should == true
+  end
 end
 
 describe RocketAMF::Values::ErrorMessage do
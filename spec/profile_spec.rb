@@ -0,0 +1,79 @@
+require "spec_helper.rb"
+
+describe RocketAMF::Profile do
+  before :each do
+    RocketAMF::ClassMapper.reset
+    RocketAMF::ClassMapper.define {|m| m.map :as => 'org.amf.ASClass', :ruby => 'RubyClass'}
+    @profile = RocketAMF::Profile.new
+  end
+
+  def rows
+    (1..3).map do |i|
+      obj = RubyClass.new
+      obj.foo = {'id' => i}
+      obj.baz = "row #{i}"
+      obj
+    end
+  end
+
+  def serialize obj, version
+    RocketAMF::Serializer.new(RocketAMF::ClassMapper.new, :profile => @profile).serialize(version, obj)
+  end
+
+  def entry operation, ruby_class
+    @profile.to_a.find {|e| e[:operation] == operation && e[:ruby_class] == ruby_class}
+  end
+
+  it "should attribute serialized objects to their ruby and AS classes" do
+    {0 => 5, 3 => 3}.each do |version, array_header|
+      @profile.reset
+      output = serialize(rows, version)
+
+      mapped = entry(:serialize, RubyClass)
+      mapped[:as_class].should == 'org.amf.ASClass'
+      mapped[:count].should == 3
+      entry(:serialize, Hash)[:as_class].should == nil
+      entry(:serialize, Hash)[:count].should == 3
+
+      # Nested objects aren't counted twice, and only the outer array is left
+      @profile.to_a.map {|e| e[:bytes]}.inject(0) {|s, b| s + b}.should == output.bytesize - array_header
+      (mapped[:mapper_time] > 0).should == true
+      (mapped[:time] >= mapped[:mapper_time]).should == true
+    end
+  end
+
+  it "should attribute deserialized objects to their ruby and AS classes" do
+    [0, 3].each do |version|
+      @profile.reset
+      data = RocketAMF.serialize(rows, version)
+      RocketAMF::Deserializer.new(RocketAMF::ClassMapper.new, :profile => @profile).deserialize(version, data)
+
+      mapped = entry(:deserialize, RubyClass)
+      mapped[:as_class].should == 'org.amf.ASClass'
+      mapped[:count].should == 3
+      @profile.to_a.map {|e| e[:count]}.inject(0) {|s, c| s + c}.should == 6
+      (mapped[:mapper_time] > 0).should == true
+    end
+  end
+
+  it "should add up across calls and sort by the given field" do
+    serialize(rows, 3)
+    serialize(rows.first(1), 3)
+    entry(:serialize, RubyClass)[:count].should == 4
+
+    by_bytes = @profile.to_a(:bytes)
+    by_bytes.first[:bytes].should == by_bytes.map {|e| e[:bytes]}.max
+    lambda { @profile.to_a(:name) }.should raise_error(ArgumentError)
+  end
+
+  it "should produce a report and reset" do
+    serialize(rows, 3)
+    report = @profile.report
+    report.lines.first.should =~ /\Aoperation\s+ruby class\s+AS class\s+count\s+time ms\s+bytes\s+mapper ms$/
+    report.lines.length.should == 3
+    report.should =~ /^serialize\s+RubyClass\s+org\.amf\.ASClass\s+3\s/
+
+    @profile.empty?.should == false
+    @profile.reset.empty?.should == true
+  end
+end
@@ -0,0 +1,150 @@
+require "spec_helper.rb"
+require "rocketamf/rack"
+
+describe RocketAMF::Rack do
+  # Input that isn't a StringIO, recording how it was read
+  class RecordingInput
+    attr_reader :reads
+    def initialize data; @io = StringIO.new(data); @reads = []; end
+    def read *args; @reads << args; @io.read(*args); end
+  end
+
+  def amf_env input, extra={}
+    {
+      'REQUEST_METHOD' => 'POST',
+      'PATH_INFO' => '/amf',
+      'CONTENT_TYPE' => 'application/x-amf',
+      'rack.input' => input
+    }.merge(extra)
+  end
+
+  def call_request
+    req = RocketAMF::Envelope.new
+    req.call('TestController.test', 'first_arg')
+    req.call('TestController.test2', 'second_arg')
+    req.to_s
+  end
+
+  def response_envelope body
+    data = ''
+    body.each {|chunk| data << chunk}
+    RocketAMF::Envelope.new.populate_from_stream(data)
+  end
+
+  describe RocketAMF::Rack::Endpoint do
+    it "should answer requests using the block" do
+      endpoint = RocketAMF::Rack::Endpoint.new {|method, args| "#{method}:#{args[0]}"}
+      status, headers, body = endpoint.call(amf_env(StringIO.new(call_request)))
+
+      status.should == 200
+      headers['content-type'].should == 'application/x-amf'
+      headers.key?('content-length').should == false
+      response_envelope(body).result.should == ['TestController.test:first_arg', 'TestController.test2:second_arg']
+    end
+
+    it "should read other inputs once using the content length" do
+      data = call_request
+      input = RecordingInput.new(data)
+      endpoint = RocketAMF::Rack::Endpoint.new {|method, args| true}
+      status, headers, body = endpoint.call(amf_env(input, 'CONTENT_LENGTH' => data.bytesize.to_s))
+
+      status.should == 200
+      input.reads.should == [[data.bytesize]]
+      response_envelope(body).result.should == [true, true]
+    end
+
+    it "should answer requests using a dispatcher" do
+      dispatcher = RocketAMF::Dispatcher.new('WritesController.save' => lambda {|args| 'saved'})
+      endpoint = RocketAMF::Rack::Endpoint.new(dispatcher)
+      status, headers, body = endpoint.call(amf_env(StringIO.new(request_fixture('remotingMessage.bin'))))
+
+      status.should == 200
+      response_envelope(body).result.should == 'saved'
+    end
+
+    it "should reject non-POST and invalid requests" do
+      endpoint = RocketAMF::Rack::Endpoint.new {|method, args| true}
+      status, headers, body = endpoint.call(amf_env(StringIO.new(''), 'REQUEST_METHOD' => 'GET'))
+      status.should == 405
+      headers['allow'].should == 'POST'
+
+      status, headers, body = endpoint.call(amf_env(StringIO.new('')))
+      status.should == 400
+    end
+
+    it "should require a dispatcher or block" do
+      lambda { RocketAMF::Rack::Endpoint.new }.should raise_error(ArgumentError)
+    end
+  end
+
+  describe RocketAMF::Rack::Middleware do
+    before :each do
+      @app = lambda {|env| [200, {'content-type' => 'text/plain'}, ['app']]}
+    end
+
+    it "should only handle AMF requests to its path" do
+      middleware = RocketAMF::Rack::Middleware.new(@app, :path => '/amf') {|method, args| true}
+      middleware.call(amf_env(StringIO.new(call_request)))[0].should == 200
+      middleware.call(amf_env(StringIO.new(call_request)))[1]['content-type'].should == 'application/x-amf'
+      middleware.call(amf_env(StringIO.new(call_request), 'PATH_INFO' => '/other'))[2].should == ['app']
+      middleware.call(amf_env(StringIO.new(''), 'CONTENT_TYPE' => 'text/html'))[2].should == ['app']
+    end
+
+    it "should pass the dispatcher option to the endpoint" do
+      dispatcher = RocketAMF::Dispatcher.new {|method, args| 'dispatched'}
+      middleware = RocketAMF::Rack::Middleware.new(@app, :dispatcher => dispatcher)
+      response_envelope(middleware.call(amf_env(StringIO.new(call_request)))[2]).result.should == ['dispatched', 'dispatched']
+    end
+  end
+
+  describe RocketAMF::Rack::Body do
+    # Result that logs when it's encoded
+    class LoggedResult
+      def initialize log, data; @log = log; @data = data; end
+      def encode_amf ser
+        @log << :encoded
+        ser.serialize(ser.version, @data)
+      end
+    end
+
+    it "should yield each message as soon as it's encoded" do
+      log = []
+      data = 'a' * RocketAMF::Rack::Body::CHUNK_SIZE
+      request = RocketAMF::Envelope.new.populate_from_stream(call_request)
+      response = RocketAMF::Envelope.new
+      response.each_method_call(request) {|method, args| LoggedResult.new(log, data)}
+
+      chunks = []
+      RocketAMF::Rack::Body.new(response).each {|c| log << :chunk; chunks << c}
+      log.should == [:encoded, :chunk, :encoded, :chunk]
+      RocketAMF::Envelope.new.populate_from_stream(chunks.join).result.should == [data, data]
+    end
+
+    it "should yield a message larger than a chunk before it's done" do
+      log = []
+      data = 'a' * 1024
+      request = RocketAMF::Envelope.new
+      request.call('TestController.test', 'arg')
+      response = RocketAMF::Envelope.new
+      response.each_method_call(RocketAMF::Envelope.new.populate_from_stream(request.to_s)) do |method, args|
+        (1..50).map {|i| LoggedResult.new(log, "#{i}#{data}")}
+      end
+
+      chunks = []
+      RocketAMF::Rack::Body.new(response).each {|c| log << :chunk; chunks << c}
+      (log.index(:chunk) < log.rindex(:encoded)).should == true
+      RocketAMF::Envelope.new.populate_from_stream(chunks.join).result.should == (1..50).map {|i| "#{i}#{data}"}
+    end
+
+    it "should write small responses in one chunk" do
+      request = RocketAMF::Envelope.new.populate_from_stream(call_request)
+      response = RocketAMF::Envelope.new
+      response.each_method_call(request) {|method, args| method}
+
+      chunks = []
+      RocketAMF::Rack::Body.new(response).each {|c| chunks << c}
+      chunks.length.should == 1
+      chunks[0].should == response.to_s
+    end
+  end
+end
@@ -0,0 +1,59 @@
+require "spec_helper.rb"
+
+describe RocketAMF::Ext::Raw do
+  def raw obj, version
+    RocketAMF::Ext::Raw.new(RocketAMF.serialize(obj, version), version)
+  end
+
+  def round_trip obj, version
+    RocketAMF.deserialize(RocketAMF.serialize(obj, version), version)
+  end
+
+  it "should write the fragment as-is at the start of the stream" do
+    bytes = RocketAMF.serialize({'a' => ['foo', 'foo']}, 3)
+    RocketAMF.serialize(RocketAMF::Ext::Raw.new(bytes, 3), 3).should == bytes
+  end
+
+  it "should rewrite AMF3 references relative to the surrounding stream" do
+    shared = {'foo' => 'bar'}
+    inner = {'foo' => 'bar', 'list' => [shared, shared, Time.at(0), Time.at(0)]}
+    output = round_trip(['foo', {'baz' => 1}, raw(inner, 3), 'bar', {'baz' => 2}, 'list'], 3)
+    output.should == ['foo', {'baz' => 1}, RocketAMF.deserialize(RocketAMF.serialize(inner, 3), 3), 'bar', {'baz' => 2}, 'list']
+    output[2]['list'][0].should equal(output[2]['list'][1])
+  end
+
+  it "should rewrite AMF0 references relative to the surrounding stream" do
+    shared = {'foo' => 'bar'}
+    outer = {'a' => 1}
+    output = round_trip([outer, raw([shared, shared], 0), outer], 0)
+    output.should == [{'a' => 1}, [{'foo' => 'bar'}, {'foo' => 'bar'}], {'a' => 1}]
+    output[1][0].should equal(output[1][1])
+    output[0].should equal(output[2])
+  end
+
+  it "should reference a fragment written twice" do
+    r = raw({'foo' => 'bar'}, 3)
+    output = round_trip([r, r], 3)
+    output[0].should == {'foo' => 'bar'}
+    output[0].should equal(output[1])
+  end
+
+  it "should embed AMF3 fragments in AMF0 streams" do
+    bytes = RocketAMF.serialize({'foo' => 'bar'}, 3)
+    RocketAMF.serialize(RocketAMF::Ext::Raw.new(bytes, 3), 0).should == "\x11".force_encoding('ASCII-8BIT') + bytes
+  end
+
+  it "should reject AMF0 fragments in AMF3 streams" do
+    lambda { RocketAMF.serialize([raw('foo', 0)], 3) }.should raise_error(ArgumentError)
+  end
+
+  it "should reject incomplete or padded fragments" do
+    bytes = RocketAMF.serialize(['foo', 'bar'], 3)
+    lambda { RocketAMF::Ext::Raw.new(bytes[0..-2], 3) }.should raise_error(RangeError)
+    lambda { RocketAMF::Ext::Raw.new(bytes + "\x01", 3) }.should raise_error(ArgumentError)
+  end
+
+  it "should reject externalizable objects it can't measure" do
+    lambda { RocketAMF::Ext::Raw.new(object_fixture('amf3-externalizable.bin'), 3) }.should raise_error(ArgumentError)
+  end
+end
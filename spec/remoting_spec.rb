@@ -95,6 +95,57 @@ describe RocketAMF::Envelope do
       expected = request_fixture('acknowledge-response.bin')
       res.serialize.should == expected
     end
+
+    it "should write the length of every header and message body" do
+      res = RocketAMF::Envelope.new :amf_version => 3
+      res.headers['Credentials'] = RocketAMF::Header.new('Credentials', false, {'userid' => 'user'})
+      res.messages << RocketAMF::Message.new('/1/onResult', '', ['hello', {:a => 1}])
+      res.messages << RocketAMF::Message.new('/2/onResult', '', 'world')
+      data = StringIO.new(res.serialize)
+
+      bodies = []
+      data.read(2) # Version
+      data.read(2).unpack('n')[0].times do
+        data.read(data.read(2).unpack('n')[0] + 1) # Name and must understand
+        bodies << data.read(data.read(4).unpack('N')[0])
+      end
+      data.read(2).unpack('n')[0].times do
+        2.times { data.read(data.read(2).unpack('n')[0]) } # Target and response URIs
+        bodies << data.read(data.read(4).unpack('N')[0])
+      end
+      data.eof?.should == true
+
+      RocketAMF.deserialize(bodies[0], 0).should == {'userid' => 'user'}
+      RocketAMF.deserialize(bodies[1][1..-1], 3).should == ['hello', {'a' => 1}]
+      RocketAMF.deserialize(bodies[2][1..-1], 3).should == 'world'
+    end
+
+    it "should write to an io as each body's length is filled in" do
+      res = RocketAMF::Envelope.new :amf_version => 3
+      res.headers['Credentials'] = RocketAMF::Header.new('Credentials', false, {'userid' => 'user'})
+      res.messages << RocketAMF::Message.new('/1/onResult', '', ['hello'] * 50)
+      res.messages << RocketAMF::Message.new('/2/onResult', '', 'world')
+
+      io = StringIO.new
+      res.serialize(nil, :io => io, :flush_size => 1024).should equal(io)
+      io.string.should == res.serialize
+    end
+
+    it "should stream bodies larger than the flush size with an unknown length" do
+      res = RocketAMF::Envelope.new :amf_version => 3
+      res.messages << RocketAMF::Message.new('/1/onResult', '', (1..50).map {|i| "hello #{i}"})
+      res.messages << RocketAMF::Message.new('/2/onResult', '', 'world')
+
+      io = StringIO.new
+      res.serialize(nil, :io => io, :flush_size => 64)
+      data = io.string.force_encoding("ASCII-8BIT")
+      data.should_not == res.serialize
+      data.bytesize.should == res.serialize.bytesize
+      data.index("\xFF\xFF\xFF\xFF".force_encoding("ASCII-8BIT")).should_not == nil
+
+      envelope = RocketAMF::Envelope.new.populate_from_stream(data)
+      envelope.messages.map {|m| m.data}.should == [(1..50).map {|i| "hello #{i}"}, 'world']
+    end
   end
 
   describe 'message handler' do
@@ -157,6 +208,55 @@ describe RocketAMF::Envelope do
         end
       }.should_not raise_error
     end
+
+    it "should acknowledge in the small form when the client uses it" do
+      req = create_envelope('commandMessage.bin')
+      ping = RocketAMF::Values::CommandMessageExt.new
+      ping.operation = RocketAMF::Values::CommandMessage::CLIENT_PING_OPERATION
+      req.messages[0].data = ping
+
+      res = RocketAMF::Envelope.new
+      res.each_method_call(req) {|method, args| true}
+      res.messages[0].data.class.should == RocketAMF::Values::AcknowledgeMessageExt
+
+      res = RocketAMF::Envelope.new
+      res.each_method_call(req, :small_messages => false) {|method, args| true}
+      res.messages[0].data.class.should == RocketAMF::Values::AcknowledgeMessage
+
+      res = RocketAMF::Envelope.new
+      res.each_method_call(create_envelope('remotingMessage.bin'), :small_messages => true) {|method, args| true}
+      res.messages[0].data.class.should == RocketAMF::Values::AcknowledgeMessageExt
+    end
+
+    it "should run batched calls concurrently and keep responses in order" do
+      req = RocketAMF::Envelope.new
+      4.times {|i| req.call("TestController.test#{i}", i)}
+
+      lock = Mutex.new
+      overlapped = ConditionVariable.new
+      running = max_running = 0
+      res = RocketAMF::Envelope.new
+      res.each_method_call req, :concurrency => 2 do |method, args|
+        lock.synchronize do
+          running += 1
+          max_running = running if running > max_running
+          overlapped.broadcast if running == 2
+
+          # The first call holds on until another is running alongside it,
+          # which only happens if they run concurrently
+          overlapped.wait(lock, 5) if args[0] == 0 && max_running < 2
+          running -= 1
+        end
+        raise 'Error in call' if args[0] == 1
+        method
+      end
+
+      max_running.should == 2
+      res.messages.map {|m| m.target_uri}.should == ['/1/onResult', '/2/onStatus', '/3/onResult', '/4/onResult']
+      res.messages[0].data.should == 'TestController.test0'
+      res.messages[1].data.should be_a(RocketAMF::Values::ErrorMessage)
+      res.messages[3].data.should == 'TestController.test3'
+    end
   end
 
   describe 'response parser' do
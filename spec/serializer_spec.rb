@@ -343,6 +343,23 @@ describe "when serializing" do
         output.should == expected
       end
 
+      it "should serialize classes mapped with members as sealed objects" do
+        RocketAMF::ClassMapper.define {|m| m.map :as => 'org.amf.ASClass', :ruby => 'RubyClass', :members => [:baz, :foo]}
+        expected = object_fixture('amf3-complex-array-collection.bin')
+
+        a = ["foo", "bar"]
+        a.is_array_collection = true
+        obj1 = RubyClass.new
+        obj1.foo = "bar"
+        obj2 = RubyClass.new
+        obj2.foo = "asdf"
+        b = [obj1, obj2]
+        b.is_array_collection = true
+
+        output = RocketAMF.serialize([a, b, b], 3)
+        output.should == expected
+      end
+
       it "should serialize a byte array" do
         expected = object_fixture("amf3-byte-array.bin")
         str = "\000\003これtest\100"
@@ -353,6 +370,50 @@ describe "when serializing" do
       end
     end
 
+    describe "vectors" do
+      it "should serialize Vector.<int>" do
+        input = RocketAMF::Values::Vector.new(:int, [4, -20, 12])
+        RocketAMF.serialize(input, 3).should == object_fixture('amf3-vector-int.bin')
+      end
+
+      it "should serialize Vector.<uint>" do
+        input = RocketAMF::Values::Vector.new(:uint, [4, 20, 12])
+        RocketAMF.serialize(input, 3).should == object_fixture('amf3-vector-uint.bin')
+      end
+
+      it "should serialize Vector.<Number>" do
+        input = RocketAMF::Values::Vector.new(:double, [4.3, -20.6])
+        RocketAMF.serialize(input, 3).should == object_fixture('amf3-vector-double.bin')
+      end
+
+      it "should serialize packed numeric vectors" do
+        RocketAMF.serialize(RocketAMF::Values::Vector.new(:int, [4, -20, 12].pack('l*')), 3).should == object_fixture('amf3-vector-int.bin')
+        RocketAMF.serialize(RocketAMF::Values::Vector.new(:double, [4.3, -20.6].pack('d*')), 3).should == object_fixture('amf3-vector-double.bin')
+      end
+
+      it "should raise on non-numeric elements in numeric vectors" do
+        lambda { RocketAMF.serialize(RocketAMF::Values::Vector.new(:int, [4, 'a']), 3) }.should raise_error(TypeError)
+        lambda { RocketAMF.serialize(RocketAMF::Values::Vector.new(:double, [4.3, nil]), 3) }.should raise_error(TypeError)
+      end
+
+      it "should serialize Vector.<Object>" do
+        input = RocketAMF::Values::Vector.new(:object, [{'foo' => 'bar'}, 'baz'], false, 'Object')
+        output = RocketAMF.serialize(input, 3)
+        RocketAMF.deserialize(output, 3).should == [{'foo' => 'bar'}, 'baz']
+      end
+
+      it "should keep references of duplicate vectors" do
+        vec = RocketAMF::Values::Vector.new(:double, [1.5])
+        output = RocketAMF.serialize([vec, vec], 3)
+        output[-2,2].should == "\x0f\x02".force_encoding("ASCII-8BIT") # Vector marker and object reference 1
+      end
+
+      it "should serialize vectors as arrays in AMF0" do
+        input = RocketAMF::Values::Vector.new(:int, [1, 2].pack('l*'))
+        RocketAMF.serialize(input, 0).should == RocketAMF.serialize([1, 2], 0)
+      end
+    end
+
     describe "and implementing the AMF Spec" do
       it "should keep references of duplicate strings" do
         class StringCarrier
@@ -492,6 +553,12 @@ describe "when serializing" do
         output.should == expected
       end
 
+      it "should write ASCII strings in other encodings as UTF-8" do
+        expected = RocketAMF.serialize(["abc", "abc"], 3)
+        RocketAMF.serialize(["abc".encode("ISO-8859-1"), "abc".encode("UTF-16LE")], 3).should == expected
+        RocketAMF.serialize(["abc".encode("US-ASCII"), :abc], 3).should == expected
+      end
+
       it "should handle inappropriate UTF-8 characters in byte arrays" do
         str = "\xff\xff\xff".force_encoding("ASCII-8BIT")
         str.freeze # For added amusement
@@ -500,4 +567,144 @@ describe "when serializing" do
       end
     end
   end
-end
\ No newline at end of file
+
+  describe "to an IO" do
+    def serializer options
+      RocketAMF::Serializer.new(RocketAMF::ClassMapper.new, options)
+    end
+
+    it "should write output to the IO in chunks" do
+      data = (1..200).map {|i| {"id" => i, "name" => "row #{i}"} }
+      io = StringIO.new
+      io.set_encoding("ASCII-8BIT") if io.respond_to?(:set_encoding)
+      writes = 0
+      io.singleton_class.send(:define_method, :write) {|str| writes += 1; super(str) }
+
+      serializer(:io => io, :flush_size => 256).serialize(3, data).should equal(io)
+      io.string.should == RocketAMF.serialize(data, 3)
+      (writes > 1).should == true
+    end
+
+    it "should flush remaining output at the end of serialization" do
+      io = StringIO.new
+      serializer(:io => io).serialize(0, "hello")
+      io.string.should == RocketAMF.serialize("hello", 0)
+    end
+
+    it "should raise once the output exceeds max_length" do
+      lambda {
+        serializer(:max_length => 100).serialize(0, ["a"*60, "b"*60])
+      }.should raise_error(RangeError)
+    end
+
+    it "should be reusable after exceeding max_length" do
+      ser = serializer(:max_length => 100)
+      lambda { ser.serialize(3, ["a"*60, "b"*60]) }.should raise_error(RangeError)
+      ser.serialize(3, ["hello"]).should == RocketAMF.serialize(["hello"], 3)
+    end
+
+    it "should drop partial output when serialization raises" do
+      bad = Object.new
+      def bad.encode_amf ser
+        ser.serialize(ser.version, "hello")
+        raise "failed"
+      end
+      ser = serializer({})
+      lambda { ser.serialize(3, ["s", bad]) }.should raise_error(RuntimeError)
+      ser.serialize(3, ["s"]).should == RocketAMF.serialize(["s"], 3)
+    end
+  end
+
+  describe "enumerators" do
+    def rows count
+      Enumerator.new(count) {|y| count.times {|i| y << {"id" => i, "name" => "row #{i}"} } }
+    end
+
+    it "should serialize sized enumerators like the arrays they yield" do
+      [0, 3].each do |version|
+        RocketAMF.serialize(rows(20), version).should == RocketAMF.serialize(rows(20).to_a, version)
+      end
+      RocketAMF.serialize({:a => 1, :b => 2}.each, 3).should == RocketAMF.serialize([[:a, 1], [:b, 2]], 3)
+    end
+
+    it "should backpatch the length of unsized enumerators in AMF0" do
+      unsized = Enumerator.new {|y| 3.times {|i| y << "é#{i}" } }
+      RocketAMF.serialize(unsized, 0).should == RocketAMF.serialize(["é0", "é1", "é2"], 0)
+    end
+
+    it "should hold off flushing to an IO until the length is backpatched" do
+      data = (1..200).map {|i| {"id" => i, "name" => "row #{i}"} }
+      unsized = Enumerator.new {|y| data.each {|row| y << row } }
+      io = StringIO.new
+      io.set_encoding("ASCII-8BIT") if io.respond_to?(:set_encoding)
+      RocketAMF::Serializer.new(RocketAMF::ClassMapper.new, :io => io, :flush_size => 256).serialize(0, unsized)
+      io.string.should == RocketAMF.serialize(data, 0)
+    end
+
+    it "should require a size in AMF3" do
+      lambda {
+        RocketAMF.serialize(Enumerator.new {|y| y << 1 }, 3)
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should raise if the enumerator yields a different number of elements than its size" do
+      [0, 3].each do |version|
+        lambda { RocketAMF.serialize(Enumerator.new(2) {|y| y << 1 }, version) }.should raise_error(RangeError)
+        lambda { RocketAMF.serialize(Enumerator.new(1) {|y| y << 1 << 2 }, version) }.should raise_error(RangeError)
+      end
+    end
+  end
+
+  describe "with deduplication" do
+    def serialize obj, version=3
+      RocketAMF::Serializer.new(RocketAMF::ClassMapper.new, :dedupe => true).serialize(version, obj)
+    end
+
+    it "should write equal hashes and arrays as references to the first one" do
+      serialize([[1, 'a'], [1, 'a']]).should == RocketAMF.serialize([[1, 'a']] * 2, 3)
+
+      rows = (1..3).map {|i| {'id' => i, 'address' => {'city' => 'Paris', 'zip' => [75001]}}}
+      output = serialize(rows)
+      (output.bytesize < RocketAMF.serialize(rows, 3).bytesize).should == true
+      decoded = RocketAMF.deserialize(output, 3)
+      decoded.should == rows
+      decoded[0]['address'].should equal(decoded[2]['address'])
+    end
+
+    it "should only compare plain values" do
+      typed = RocketAMF::Values::TypedHash.new('org.rocketAMF.Typed')
+      typed['a'] = 1
+      [
+        [{'a' => 1}, typed],
+        [{'t' => Time.at(0)}, {'t' => Time.at(0)}],
+        [[0.0], [-0.0]]
+      ].each do |obj|
+        serialize(obj).should == RocketAMF.serialize(obj, 3)
+      end
+    end
+
+    it "should be off by default and leave AMF0 alone" do
+      RocketAMF.serialize([[1], [1]], 3).should_not == serialize([[1], [1]])
+      serialize([[1], [1]], 0).should == RocketAMF.serialize([[1], [1]], 0)
+    end
+  end
+
+  describe "with sorted properties" do
+    def serialize obj, version
+      RocketAMF::Serializer.new(RocketAMF::ClassMapper.new, :sort_props => true).serialize(version, obj)
+    end
+
+    it "should produce identical output regardless of insertion order" do
+      [0, 3].each do |version|
+        a = serialize([{'b' => 1, 'a' => 2, :c => 3}, {'a' => 4, 'b' => 5, :c => 6}], version)
+        b = serialize([{:c => 3, 'a' => 2, 'b' => 1}, {'b' => 5, :c => 6, 'a' => 4}], version)
+        a.should == b
+      end
+    end
+
+    it "should write keys in bytewise order" do
+      output = serialize({'b' => 1, 'B' => 2, 'ab' => 3, 'a' => 4}, 3)
+      output.should == "\n\v\x01\x03B\x04\x02\x03a\x04\x04\x05ab\x04\x03\x03b\x04\x01\x01".force_encoding('ASCII-8BIT')
+    end
+  end
+end
@@ -0,0 +1,90 @@
+require "spec_helper.rb"
+
+describe "RocketAMF::Ext.stats" do
+  before :each do
+    RocketAMF::Ext.reset_stats
+    RocketAMF::Ext.stats_enabled = true
+  end
+
+  after :each do
+    RocketAMF::Ext.stats_enabled = false
+    RocketAMF::Ext.reset_stats
+  end
+
+  def histogram_total op
+    RocketAMF::Ext.stats[:operations][op][:histogram].values.inject(0) {|s, v| s + v}
+  end
+
+  it "should be disabled by default and collect nothing while disabled" do
+    RocketAMF::Ext.stats_enabled = false
+    RocketAMF::Ext.stats_enabled?.should == false
+    RocketAMF::Ext::Deserializer.new(RocketAMF::ClassMapper.new).deserialize(3, object_fixture('amf3-object-ref.bin'))
+    stats = RocketAMF::Ext.stats
+    stats[:deserializer][:objects].should == 0
+    stats[:operations][:deserialize][:count].should == 0
+  end
+
+  it "should count deserialized objects, references and bytes" do
+    data = object_fixture('amf3-object-ref.bin')
+    RocketAMF::Ext::Deserializer.new(RocketAMF::ClassMapper.new).deserialize(3, data)
+
+    stats = RocketAMF::Ext.stats[:deserializer]
+    stats[:bytes].should == data.bytesize
+    stats[:objects].should == 5
+    stats[:object_refs].should == 2
+    stats[:strings].should == 2
+    stats[:string_refs].should == 3
+    stats[:traits].should == 1
+    stats[:trait_refs].should == 1
+    stats[:mapper_calls].should == 4 # get_ruby_obj and populate_ruby_obj for both objects
+    RocketAMF::Ext.stats[:operations][:deserialize][:count].should == 1
+    histogram_total(:deserialize).should == 1
+  end
+
+  it "should count serializer reference table hits and misses" do
+    obj = {:a => 'str'}
+    output = RocketAMF::Ext::Serializer.new(RocketAMF::ClassMapper.new).serialize(3, [obj, obj, 'str', 'str'])
+
+    stats = RocketAMF::Ext.stats[:serializer]
+    stats[:bytes].should == output.bytesize
+    stats[:objects].should == 2
+    stats[:object_refs].should == 1
+    stats[:strings].should == 2 # 'a' and 'str'
+    stats[:string_refs].should == 2
+    stats[:traits].should == 1
+    RocketAMF::Ext.stats[:operations][:serialize][:count].should == 1
+  end
+
+  it "should only time the outermost serialize call" do
+    obj = RocketAMF::Values::Vector.new(:int, [1])
+    def obj.encode_amf ser
+      ser.serialize(3, [1, 2])
+    end
+    RocketAMF::Ext::Serializer.new(RocketAMF::ClassMapper.new).serialize(3, [obj])
+    RocketAMF::Ext.stats[:operations][:serialize][:count].should == 1
+  end
+
+  it "should time populate_from_stream" do
+    RocketAMF::Envelope.new.populate_from_stream(request_fixture('remotingMessage.bin'))
+    stats = RocketAMF::Ext.stats[:operations]
+    stats[:populate_from_stream][:count].should == 1
+    stats[:deserialize][:count].should == 1
+    histogram_total(:populate_from_stream).should == 1
+  end
+
+  it "should use power of two microsecond buckets" do
+    RocketAMF.deserialize(object_fixture('amf0-number.bin'), 0)
+    keys = RocketAMF::Ext.stats[:operations][:deserialize][:histogram].keys
+    keys.length.should == 1
+    (keys[0] & (keys[0] - 1)).should == 0
+  end
+
+  it "should reset all counters" do
+    RocketAMF.serialize({:a => 1}, 3)
+    RocketAMF::Ext.reset_stats
+    stats = RocketAMF::Ext.stats
+    stats[:serializer].values.uniq.should == [0]
+    stats[:operations][:serialize][:count].should == 0
+    stats[:operations][:serialize][:histogram].should == {}
+  end
+end
@@ -0,0 +1,131 @@
+require "spec_helper.rb"
+
+describe "RocketAMF::Ext.transcode" do
+  def round_trip src, from, to
+    # Transcoding keeps the source's property order
+    obj = RocketAMF.deserialize(src, from)
+    RocketAMF::Serializer.new(RocketAMF::ClassMapper.new, :sort_props => false).serialize(to, obj)
+  end
+
+  def transcode src, from, to
+    RocketAMF::Ext.transcode(src, :from => from, :to => to)
+  end
+
+  it "should match a round trip through ruby objects from AMF0 to AMF3" do
+    ['amf0-number.bin', 'amf0-boolean.bin', 'amf0-string.bin', 'amf0-null.bin', 'amf0-undefined.bin',
+     'amf0-hash.bin', 'amf0-ecma-ordinal-array.bin', 'amf0-strict-array.bin', 'amf0-time.bin',
+     'amf0-ref-test.bin', 'amf0-untyped-object.bin', 'amf0-xml-doc.bin', 'amf0-complex-encoded-string.bin'].each do |f|
+      src = object_fixture(f)
+      transcode(src, 0, 3).should == round_trip(src, 0, 3)
+    end
+  end
+
+  it "should match a round trip through ruby objects from AMF3 to AMF0" do
+    ['amf3-max.bin', 'amf3-large-max.bin', 'amf3-float.bin', 'amf3-string-ref.bin', 'amf3-date-ref.bin',
+     'amf3-object-ref.bin', 'amf3-array-ref.bin', 'amf3-associative-array.bin', 'amf3-mixed-array.bin',
+     'amf3-dynamic-object.bin', 'amf3-xml-ref.bin', 'amf3-array-collection.bin', 'amf3-vector-uint.bin'].each do |f|
+      src = object_fixture(f)
+      transcode(src, 3, 0).should == round_trip(src, 3, 0)
+    end
+  end
+
+  it "should keep the class name of typed objects" do
+    src = object_fixture('amf3-typed-object.bin')
+    output = RocketAMF.deserialize(transcode(src, 3, 0), 0)
+    output.should == RocketAMF.deserialize(src, 3)
+    RocketAMF.deserialize(transcode(transcode(src, 3, 0), 0, 3), 3).should == output
+  end
+
+  it "should translate shared references between formats" do
+    shared = {'foo' => 'bar'}
+    src = RocketAMF.serialize([shared, [shared, Time.at(0)], shared], 3)
+    output = RocketAMF.deserialize(transcode(src, 3, 0), 0)
+    output[0].should equal(output[1][0])
+    output[2].should equal(output[0])
+    RocketAMF.deserialize(transcode(transcode(src, 3, 0), 0, 3), 3).should == output
+  end
+
+  it "should embed byte arrays in AMF0 as AMF3" do
+    output = RocketAMF.deserialize(transcode(object_fixture('amf3-byte-array.bin'), 3, 0), 0)
+    output.should be_a(StringIO)
+    output.string.should == RocketAMF.deserialize(object_fixture('amf3-byte-array.bin'), 3).string
+  end
+
+  it "should raise once the output exceeds the max length" do
+    src = RocketAMF.serialize(['a' * 100, 'b' * 100], 3)
+    lambda { RocketAMF::Ext.transcode(src, :from => 3, :to => 0, :max_length => 150) }.should raise_error(RangeError)
+    RocketAMF::Ext.transcode(src, :from => 3, :to => 0, :max_length => 250).should == transcode(src, 3, 0)
+  end
+
+  it "should raise on trailing data" do
+    lambda { transcode(object_fixture('amf0-number.bin') + "\x05", 0, 3) }.should raise_error(ArgumentError)
+  end
+
+  it "should raise on dictionaries" do
+    lambda { transcode(object_fixture('amf3-dictionary.bin'), 3, 0) }.should raise_error(ArgumentError)
+  end
+end
+
+describe "RocketAMF::Ext.transcode to JSON" do
+  def json obj, options={}
+    RocketAMF::Ext.transcode(RocketAMF.serialize(obj, 3), {:from => 3, :to => :json}.merge(options))
+  end
+
+  it "should write values the way they deserialize" do
+    obj = {'list' => [1, 2.5, nil, true, "a\"b\n\xC3\xA9"], 'nested' => {'empty' => []}}
+    expected = "{\"list\":[1,2.5,null,true,\"a\\\"b\\n\xC3\xA9\"],\"nested\":{\"empty\":[]}}".force_encoding('ASCII-8BIT')
+    json(obj).should == expected
+    RocketAMF::Ext.transcode(RocketAMF.serialize(obj, 0), :to => :json).should == expected
+  end
+
+  it "should escape strings that aren't valid UTF-8 byte by byte" do
+    json("\xFF\x01".force_encoding('ASCII-8BIT')).should == '"\u00ff\u0001"'
+  end
+
+  it "should tag references unless asked to inline them" do
+    shared = {'a' => 1}
+    json([shared, shared]).should == '[{"a":1},{"$ref":1}]'
+    json([shared, shared], :refs => :inline).should == '[{"a":1},{"a":1}]'
+  end
+
+  it "should raise on cycles when inlining references" do
+    cycle = {}
+    cycle['self'] = cycle
+    lambda { json(cycle, :refs => :inline) }.should raise_error(ArgumentError)
+    json(cycle).should == '{"self":{"$ref":0}}'
+  end
+
+  it "should stop inlining references that blow up past the max length" do
+    # Each level references the one before twice, doubling the inlined output
+    nested = [1]
+    20.times { nested = [nested, nested] }
+    src = RocketAMF.serialize(nested, 3)
+    (src.bytesize < 200).should == true
+    lambda { json(nested, :refs => :inline, :max_length => 10_000) }.should raise_error(RangeError)
+    lambda { json(nested, :refs => :inline, :max_length => 10_000, :io => StringIO.new) }.should raise_error(RangeError)
+    json(nested, :max_length => 10_000).length.should == json(nested).length
+  end
+
+  it "should write dates as milliseconds or ISO 8601" do
+    json(Time.at(1.5)).should == '1500'
+    json(Time.at(1.5), :dates => :iso8601).should == '"1970-01-01T00:00:01.500Z"'
+  end
+
+  it "should write byte arrays as base64 or arrays" do
+    json(StringIO.new("abcd")).should == '"YWJjZA=="'
+    json(StringIO.new("abcd"), :byte_arrays => :array).should == '[97,98,99,100]'
+  end
+
+  it "should write class names under a configurable key" do
+    src = object_fixture('amf3-typed-object.bin')
+    RocketAMF::Ext.transcode(src, :from => 3, :to => :json).should == '{"_class":"org.amf.ASClass","baz":null,"foo":"bar"}'
+    RocketAMF::Ext.transcode(src, :from => 3, :to => :json, :class_key => '$type').should == '{"$type":"org.amf.ASClass","baz":null,"foo":"bar"}'
+    RocketAMF::Ext.transcode(src, :from => 3, :to => :json, :class_key => nil).should == '{"baz":null,"foo":"bar"}'
+  end
+
+  it "should write to a given io" do
+    io = StringIO.new(''.force_encoding('ASCII-8BIT'))
+    RocketAMF::Ext.transcode(RocketAMF.serialize([1, 'a'], 3), :from => 3, :to => :json, :io => io).should equal(io)
+    io.string.should == '[1,"a"]'
+  end
+end